@@ -414,6 +414,11 @@ namespace PeterDB {
         if (createCondition(getTableName(input), cond) != 0)
             error(__LINE__);
 
+        // A condition on a table scan is tested by the record scan itself
+        auto *scan = dynamic_cast<TableScan *>(input);
+        if (scan != NULL && scan->pushDownCondition(cond) == 0)
+            return scan;
+
         // Create Filter
         auto *filter = new Filter(input, cond);
 
@@ -456,6 +461,11 @@ namespace PeterDB {
             addTableNameToAttrs(tableName, attrNames);
         }
 
+        // Only the projected attributes are copied out of the records
+        auto *scan = dynamic_cast<TableScan *>(input);
+        if (scan != NULL && scan->pushDownProjection(attrNames) == 0)
+            return scan;
+
         auto *project = new Project(input, attrNames);
         return project;
     }
@@ -3,25 +3,33 @@
 
 #include <vector>
 #include <string>
+#include <unordered_map>
 
 #include "pfm.h"
-#include "rbfm.h" // for some type declarations only, e.g., RID and Attribute
+#include "rbfm.h" // RID, Attribute, and the Predicate/TupleBuilder key helpers
 
 # define IX_EOF (-1)  // end of the index scan
+# define IX_FILL_FACTOR 0.9                 // default share of a page filled by a bulk load
+# define IX_SORT_MEMORY (1024*PAGE_SIZE)    // entries a bulk load sorts in memory before spilling a run
+# define IX_NODE_CACHE_SHARE 4              // inner nodes pinned by all IXFileHandles together stay under 1/4 of the buffer pool
+# define IX_LEAF_FORMAT 2                   // layout of the leaves, kept on page 0 after the root; 0 (absent) is the slotted layout
 
 namespace PeterDB {
     #define NULL_NODE -1
 
     class IX_ScanIterator;
 
+    class IX_BulkLoader;
+
     class IXFileHandle;
 
 
     #define Slot_Size sizeof(Slot)
+    // Unsigned, so that offsets reach the end of the largest pages
     struct Slot {
-        short offset;
-        short len;
-        short rid_num;
+        unsigned short offset;
+        unsigned short len;
+        unsigned short rid_num;
     };
 
     struct keyEntry{
@@ -33,19 +41,25 @@ namespace PeterDB {
         int right = -1;
     };
 
+    // A leaf entry while a leaf is rebuilt: the full key and the RIDs under it
+    struct LeafEntry {
+        std::string key;
+        std::vector<RID> rids;
+    };
+
     class IndexManager {
 
     public:
         static IndexManager &instance();
 
-        // Create an index file.
-        RC createFile(const std::string &fileName);
+        // Create an index file, with pages of pageSize bytes.
+        RC createFile(const std::string &fileName, unsigned pageSize = PAGE_SIZE);
 
         // Delete an index file.
         RC destroyFile(const std::string &fileName);
 
-        // Open an index and return an ixFileHandle.
-        RC openFile(const std::string &fileName, IXFileHandle &ixFileHandle);
+        // Open an index and return an ixFileHandle, a mapped index is read only.
+        RC openFile(const std::string &fileName, IXFileHandle &ixFileHandle, bool mapped = false);
 
         // Close an ixFileHandle for an index.
         RC closeFile(IXFileHandle &ixFileHandle);
@@ -65,6 +79,12 @@ namespace PeterDB {
                 bool highKeyInclusive,
                 IX_ScanIterator &ix_ScanIterator);
 
+        // Initialize an IX_BulkLoader to build an empty index bottom-up, the tree is written on loader.close()
+        RC bulkLoad(IXFileHandle &ixFileHandle,
+                    const Attribute &attribute,
+                    IX_BulkLoader &loader,
+                    float fillFactor = IX_FILL_FACTOR);
+
         // Print the B+ tree in pre-order (in a JSON record format)
         RC printBTree(IXFileHandle &ixFileHandle, const Attribute &attribute, std::ostream &out) const;
 
@@ -93,14 +113,18 @@ namespace PeterDB {
 
         char* low;
         char* high;
-        char* page;
+        char* page;                                                         // buffer, or the leaf in place in a mapped file
+        char* buffer;
         bool lowInclusive;
         bool highInclusive;
+        Predicate highTest;                                                 // key <= high, or key < high
         int pageNum;
         int slotNum;
         int curCount;
         int ridNum;
         int curRIDNum;
+        int prefetchedTo;                                                   // Leaves below are read or on their way
+        int pageSize;
         IXFileHandle* fileHandle;
 
         Attribute attr;
@@ -110,11 +134,64 @@ namespace PeterDB {
 
         void moveToLeft();
 
+        void seekInLeaf();
+
+        // Restart as a scan of the entries equal to key, for keys in increasing order
+        RC seek(const void *key);
+
+        bool inLeaf();
+
         void moveToNext();
 
+        void skipEmpty();
+
+        RC loadPage(int pageNum);
+
+        void readAhead(int previous);
+
         bool inRange(char* key);
     };
 
+    // Bulk load: the entries are sorted with an external merge sort, then the leaves and the node levels
+    // above them are appended one page after another
+    class IX_BulkLoader {
+    public:
+        IX_BulkLoader();
+        ~IX_BulkLoader();
+
+        // Add an entry, entries may come in any order
+        RC insertEntry(const void *key, const RID &rid);
+
+        // Sort the entries and write the tree
+        RC close();
+
+        RC init(IXFileHandle &handle, const Attribute &attr, float fillFactor);
+
+    private:
+        IXFileHandle* fileHandle;
+        Attribute attr;
+        float fillFactor;
+        std::vector<char> entries;                                          // Keys each followed by the RID
+        std::vector<unsigned> offsets;
+        std::vector<std::string> runs;                                      // Sorted runs spilled to disk
+
+        std::string groupKey;                                               // Entries with the same key share a slot
+        std::vector<RID> groupRIDs;
+        char* leaf;
+        char* pending;                                                      // A full leaf waits until its next leaf is known
+        int leafPage;
+        std::vector<LeafEntry> leafEntries;                                 // Packed into leaf when it is full
+        int leafBytes;                                                      // Leaf::entrySize() of leafEntries
+        std::vector<std::pair<std::string, int>> level;                     // First key and page of every page in a level
+
+        RC spill();
+        RC addSorted(const char *key, const RID &rid);
+        RC flushGroup();
+        RC finishLeaf();
+        RC buildNodes();
+        void clear();
+    };
+
     class IXFileHandle {
     public:
 
@@ -129,7 +206,8 @@ namespace PeterDB {
         // Destructor
         ~IXFileHandle();
 
-        // Put the current counter values of associated PF FileHandles into variables
+        // Put the current counter values of associated PF FileHandles into variables,
+        // reads served by the pinned nodes are counted as reads too
         RC collectCounterValues(unsigned &readPageCount, unsigned &writePageCount, unsigned &appendPageCount);
 
         FileHandle fileHandle;
@@ -137,12 +215,25 @@ namespace PeterDB {
         int getRoot();
 
         RC readPage(PageNum pageNum, void *data);                           // Get a specific page
+        char* mapPage(PageNum pageNum);                                     // The page in place if the file is mapped, else nullptr
+        void prefetch(PageNum pageNum, unsigned count);                     // Start reading pages in the background
         RC writePage(PageNum pageNum, const void *data);                    // Write a specific page
         RC appendPage(const void *data);                                    // Append a specific page
         unsigned getNumberOfPages();                                        // Get the number of pages in the file
-        void setRoot(unsigned int num);
+        void setRoot(unsigned int num);                                     // Page 0 is rewritten with IX_LEAF_FORMAT
+        void releaseNodes();                                                // Unpin the cached pages, before the file closes
 
         char* rootPage;
+
+    private:
+        // Page 0 and the inner nodes stay pinned in the buffer pool once read, so a descent only reads
+        // its leaf. Writes go through the pool, through this handle or another one of the file, and
+        // show up in the pinned frames.
+        std::unordered_map<PageNum, char*> nodes;
+        unsigned nodeDrops;                                                 // Drop count of the file when the nodes were pinned
+        static unsigned pinnedNodes;                                        // Over every handle
+
+        void checkNodes();                                                  // Forget the nodes if the pool dropped their frames
     };
 
     // the structure of metadata for intermediate node
@@ -156,27 +247,27 @@ namespace PeterDB {
 
     class Tool{
     public:
-        static float compare(char* key1, char* key2, Attribute& attr);
+        static int compare(char* key1, char* key2, Attribute& attr);
 
-        static void writeSlot(char *data, short offset, short len, short rid_num, int i);
+        static void writeSlot(char *data, unsigned short offset, unsigned short len, unsigned short rid_num, int i, int pageSize);
 
-        static void appendSlot(char *data, int *info, short len);
+        static void appendSlot(char *data, int *info, unsigned short len, int pageSize);
 
         static void updateInfo(int *info, int slot_num, int data_offset, int info_offset);
 
-        static Slot getSlot(char *page, int i);
+        static Slot getSlot(char *page, int i, int pageSize);
 
         static void getKey(char *data, unsigned int pos, unsigned int len, char *key);
 
-        static void search(char *data, Attribute &attr, char *key, int& pos, int& left, int& len);
+        static void search(char *data, Attribute &attr, char *key, int& pos, int& left, int& len, int pageSize);
 
         static void moveBack(char *data, int offset, int distance, int length);
 
-        static void updateSlot(char *data, int *info, int dis, int i);
+        static void updateSlot(char *data, int *info, int dis, int i, int pageSize);
 
-        static void shiftEntry(char *data, int i, int pos, int len, int *info);
+        static void shiftEntry(char *data, int i, int pos, int len, int *info, int pageSize);
 
-        static void writeInfo(char *data, int *info);
+        static void writeInfo(char *data, int *info, int pageSize);
 
         static bool isNull(int i, char* data) {
             int bytePosition = i / 8;
@@ -192,10 +283,9 @@ namespace PeterDB {
             data[byteNum] |= mask;
         }
 
-        static void buildNullBytes(std::vector<Attribute> attrs, char *tuple, int offset, char *nullIndicator);
-
-        static void mergeTwoTuple(std::vector<Attribute> attr1, char *tuple1, int size1, std::vector<Attribute> attr2, char *tuple2,
+        static void mergeTwoTuple(const std::vector<Attribute> &attr1, char *tuple1, int size1, const std::vector<Attribute> &attr2, char *tuple2,
                       int size2, void *data);
+
     };
 
     enum {
@@ -206,50 +296,88 @@ namespace PeterDB {
     // intermediate node
     class Node {
     public:
-        static bool isNode(char* pageData);
+        static bool isNode(char* pageData, int pageSize);
 
         static void insertEntry(IXFileHandle& ixFileHandle, int pageNum, Attribute& attr, keyEntry& entry, RID& rid, keyEntry* child);
 
         static RC deleteEntry(IXFileHandle& ixFileHandle, int paPageNum, int pageNum, const Attribute &attr, keyEntry& entry, RID& rid, keyEntry* child);
 
-        static void getInfo(int* info, char* data);
+        static void getInfo(int* info, char* data, int pageSize);
 
-        static bool haveSpace(char *data, const char *key, Attribute& attr);
+        static bool haveSpace(char *data, const char *key, Attribute& attr, int pageSize);
 
-        static void appendKey(char* data, keyEntry& entry, Attribute& attr);
+        static void appendKey(char* data, keyEntry& entry, Attribute& attr, int pageSize);
 
-        static void createNode(char *data, int type, int parent);
+        static void createNode(char *data, int type, int parent, int pageSize);
 
-        static void split(char *data, char *page, char* middle);
+        static void split(char *data, char *page, char* middle, int pageSize);
 
         static void removeKey(IXFileHandle &ixFileHandle, int pageNum, keyEntry entry, const Attribute &attr);
 
         static void print(IXFileHandle &ixFileHandle, const Attribute &attribute, int root, int i, std::ostream &out);
 
-        static int searchPage(char *page, Attribute attribute, char *low);
+        // Child to follow for a key. An equal separator leads right, unless leftmost: a key filling a whole
+        // leaf is split over several leaves, the first of them left of the separator.
+        static int searchPage(char *page, Attribute attribute, char *low, int pageSize, bool leftmost = false);
 
-        static void insertKey(char *data, keyEntry entry, Attribute &attr);
+        static void insertKey(char *data, keyEntry entry, Attribute &attr, int pageSize);
+
+        static int childBefore(char *data, int i, int pageSize);
+
+        static bool hasChild(char *data, int child, int pageSize);
     };
-    // Leaf node
+    // Leaf node. Int and real leaves have no slots: the array of keys, the array of where the RIDs of
+    // each key end, then the RIDs. A varchar leaf starts with the prefix shared by all of its keys,
+    // each slot keeps the rest of a key followed by its RIDs.
     class Leaf {
     public:
-        static void insertEntry(char* leafData, const Attribute& attr, keyEntry& entry, RID& rid);
+        static void insertEntry(char* leafData, const Attribute& attr, keyEntry& entry, RID& rid, int pageSize);
 
-        static RC deleteEntry(char *leafData, const Attribute &attr, keyEntry &entry, RID &rid);
+        static RC deleteEntry(char *leafData, const Attribute &attr, keyEntry &entry, RID &rid, int pageSize);
 
-        static void getInfo(int* info, char* leafData);
+        static void getInfo(int* info, char* leafData, int pageSize);
 
-        static bool haveSpace(char *data, const Attribute &attr, const char *key);
+        static bool haveSpace(char *data, const Attribute &attr, const char *key, int pageSize);
 
-        static void createLeaf(char *page, int parent, int pre, int next);
+        static void createLeaf(char *page, int parent, int pre, int next, int pageSize);
 
-        static void split(char *data, char *newData);
+        // Split a full leaf into data and newData while the entry is added
+        static void split(char *data, char *newData, const Attribute &attr, keyEntry &entry, RID &rid, int pageSize);
 
-        static void print(char *data, const Attribute &attr, std::ostream &out);
+        static void print(char *data, const Attribute &attr, std::ostream &out, int pageSize);
 
         static bool equal(RID &rid, char *pos, int len);
 
-        static void appendToKey(char *data, int* info, const Attribute &attr, int i, RID &rid);
+        static void appendToKey(char *data, int* info, const Attribute &attr, int i, RID &rid, int pageSize);
+
+        static bool isDense(const Attribute &attr);
+
+        static int getCount(char *data, int pageSize);
+
+        // First entry not below key
+        static int search(char *data, const Attribute &attr, const char *key, int pageSize);
+
+        // Compare entry i with key without copying it out
+        static int compareKey(char *data, const Attribute &attr, int i, const char *key, int pageSize);
+
+        static void getKey(char *data, const Attribute &attr, int i, char *key, int pageSize);
+
+        static int getRIDNum(char *data, const Attribute &attr, int i, int pageSize);
+
+        static void getRID(char *data, const Attribute &attr, int i, int j, RID &rid, int pageSize);
+
+        static void decode(char *data, const Attribute &attr, std::vector<LeafEntry> &entries, int pageSize);
+
+        // Rewrite the entries of data with entries[begin, end), the page info is kept
+        static void pack(char *data, const Attribute &attr, const std::vector<LeafEntry> &entries, size_t begin,
+                         size_t end, int pageSize);
+
+        // Bytes an entry takes in a leaf, without the prefix
+        static int entrySize(const Attribute &attr, const LeafEntry &entry);
+
+        // Bytes of count entries from first to last whose entrySize() add up to bytes
+        static int packedSize(const Attribute &attr, const LeafEntry &first, const LeafEntry &last, int count,
+                              int bytes);
     };
 }// namespace PeterDB
 #endif // _ix_h_
@@ -1,10 +1,49 @@
 #ifndef _pfm_h_
 #define _pfm_h_
 
+// Page size of a file unless createFile asks for another one, records and keys never get larger
 #define PAGE_SIZE 4096
+// Largest page size a file can be created with, sizes are powers of two from PAGE_SIZE up
+#define PF_MAX_PAGE_SIZE (64*1024)
+// Open files with O_DIRECT by default, see PagedFileManager::setDirectIO
+#define PF_DIRECT_IO false
+// Default number of frames in the shared buffer pool
+#define BUFFER_POOL_FRAMES 1024
+// Pages a sequential scan keeps read ahead of itself
+#define PF_PREFETCH_PAGES 32
+// Threads reading prefetched pages into the buffer pool
+#define PF_PREFETCH_THREADS 2
+// Submit batches of page I/O through io_uring when the kernel allows it, pread/pwrite otherwise
+#define PF_IO_URING true
+// Most page transfers in flight in one io_uring submission
+#define PF_IO_BATCH 64
+// Each space map page covers the data pages after it, one byte per page: as many pages as it has bytes.
+// Free space is recorded in units of a 256th of a page, so one byte covers a whole page.
+#define SPACE_MAP_LEVELS 256
+// Write-ahead log shared by every file of the working directory, the database directory.
+// Each process locks a log of its own: the first free one of LOG_FILE_NAME, LOG_FILE_NAME.1, ...
+#define LOG_FILE_NAME "peterdb.log"
+#define LOG_MAX_FILES 16
+// Buffered log records are written out once they reach this size
+#define LOG_BUFFER_SIZE (16*PAGE_SIZE)
+// Changed bytes closer than this are logged as one run
+#define LOG_RUN_GAP 16
+// Past this size the next commit flushes every dirty page and empties the log
+#define LOG_CHECKPOINT_SIZE (1024*PAGE_SIZE)
+// Without sync commit, the log writer syncs the commits of this many microseconds at once
+#define LOG_GROUP_COMMIT_US 10000
 
 #include <string>
 #include <fstream>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <ctime>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <sys/types.h>
 
 namespace PeterDB {
 
@@ -12,6 +51,8 @@ namespace PeterDB {
     // Return code
     // 0 - normal
     typedef int RC;
+    typedef unsigned FileID;
+    typedef unsigned long long LSN;
 
     class FileHandle;
 
@@ -19,10 +60,14 @@ namespace PeterDB {
     public:
         static PagedFileManager &instance();                                // Access to the singleton instance
 
-        RC createFile(const std::string &fileName);                         // Create a new file
+        RC createFile(const std::string &fileName,
+                      unsigned pageSize = PAGE_SIZE);                       // Create a new file with pages of pageSize bytes
         RC destroyFile(const std::string &fileName);                        // Destroy a file
-        RC openFile(const std::string &fileName, FileHandle &fileHandle);   // Open a file
+        RC openFile(const std::string &fileName, FileHandle &fileHandle,
+                    bool mapped = false);                                   // Open a file, see FileHandle::openFile
         RC closeFile(FileHandle &fileHandle);                               // Close a file
+        void setDirectIO(bool directIO);                                    // Applies to the files opened afterwards
+        bool getDirectIO() const;
 
     protected:
         PagedFileManager();                                                 // Prevent construction
@@ -30,6 +75,96 @@ namespace PeterDB {
         PagedFileManager(const PagedFileManager &);                         // Prevent construction by copying
         PagedFileManager &operator=(const PagedFileManager &);              // Prevent assignment
 
+    private:
+        bool directIO;
+    };
+
+    // Page I/O of a FileHandle on a raw descriptor.
+    //  - pread/pwrite carry their own offset, handles of the same file never fight over a seek pointer
+    //  - With direct I/O the kernel page cache is skipped as well, the buffer pool is the only cache.
+    //    Buffers that are not PAGE_SIZE aligned go through an aligned bounce page.
+    //    File systems refusing O_DIRECT (e.g. tmpfs) silently get buffered I/O.
+    //  - The file can also be mapped read only, pages are then read in place from the kernel page cache
+    class PageIO {
+    public:
+        PageIO();
+        ~PageIO();
+
+        RC open(const std::string &fileName, bool direct);
+        RC close();
+        bool isOpen() const;
+        bool isDirect() const;
+        int getDescriptor() const;
+        void setPageSize(unsigned pageSize);                                // PAGE_SIZE until the header says otherwise
+        unsigned getPageSize() const;
+
+        RC readPage(PageNum pageNum, void *data);                           // Physical page, the header is page 0
+        RC writePage(PageNum pageNum, const void *data);
+        RC sync();
+        off_t getSize();
+        void adviseSequential();                                            // Read ahead aggressively until adviseRandom
+        void adviseRandom();
+
+        RC map();                                                           // Map the pages the file holds now
+        bool isMapped() const;
+        char* getMappedPage(PageNum pageNum);                               // Read only, nullptr past the mapping
+
+        static char* allocPages(size_t size);                               // PAGE_SIZE aligned, release with freePages
+        static void freePages(char* pages);
+
+    private:
+        int fd;
+        bool direct;
+        unsigned pageSize;
+        char* bounce;
+        char* mapping;
+        size_t mappedPages;
+
+        PageIO(const PageIO &);                                             // Prevent copying, the descriptor is owned
+        PageIO &operator=(const PageIO &);
+    };
+
+    struct PageRequest {
+        PageIO* io;
+        PageNum pageNum;            // physical page
+        char* data;
+        bool write;
+        RC rc;                      // set once the batch ran
+    };
+
+    // Runs batches of page reads and writes with a few io_uring_enter calls instead of a syscall per page.
+    // Without io_uring (old kernel, seccomp, PF_IO_URING off) every request falls back to PageIO.
+    // A ring has a single submitter, every thread batching I/O owns its own.
+    class IORing {
+    public:
+        IORing();
+        ~IORing();
+
+        bool isAvailable() const;
+        RC run(std::vector<PageRequest> &requests);                         // Every request done, -1 if any failed
+
+    private:
+        int ringFd;
+        unsigned entries;
+        char* sqRing;
+        size_t sqRingSize;
+        char* cqRing;
+        size_t cqRingSize;
+        void* sqes;
+        size_t sqesSize;
+        unsigned* sqTail;
+        unsigned* sqMask;
+        unsigned* sqArray;
+        unsigned* cqHead;
+        unsigned* cqTail;
+        unsigned* cqMask;
+        void* cqes;
+
+        IORing(const IORing &);                                             // Prevent copying, the ring is owned
+        IORing &operator=(const IORing &);
+
+        void runBatch(PageRequest *requests, unsigned count);
+        void shutdown();
     };
 
     enum infoVal {
@@ -37,18 +172,233 @@ namespace PeterDB {
         WRITE_NUM,
         APPEND_NUM,
         ACTIVE_PAGE_NUM,
+        PAGE_SIZE_NUM,              // 0 in files from before page sizes were recorded: PAGE_SIZE
         INFO_NUM
     };
 
+    // Header page (physical page 0), kept in memory and only written when dirty
     class infoPage {
     public:
         unsigned* info;
+        bool dirty;
 
         infoPage();
         ~infoPage();
 
-        void readInfoPage(std::FILE*);
-        void flushInfoPage(std::FILE*);
+        RC readInfoPage(PageIO &io);
+        RC flushInfoPage(PageIO &io);
+    };
+
+    struct Frame {
+        FileID fileID;
+        PageNum pageNum;
+        FileHandle* owner;          // handle used to write the page back when it is dirty
+        unsigned pinCount;
+        bool dirty;
+        bool reference;             // second chance bit of the CLOCK policy
+        bool valid;
+        LSN lsn;                    // last log record that changed the page, the log goes first on write back
+        bool loading;               // a prefetch is reading the page and holds a pin until it is settled
+    };
+
+    // On-disk identity of a file, used to detect files changed behind the pool's back
+    struct FileState {
+        FileID id;
+        unsigned openCount;
+        ino_t inode;
+        off_t size;
+        timespec modified;
+        bool known;
+        PageNum pageCount;          // data pages appended through any handle of the file
+        bool logged;                // the log holds changes that may not be durable in the file yet
+        unsigned drops;             // bumped when the pool drops the frames of the file, pinned ones included
+    };
+
+    // Background reads into buffer pool frames, for scans that know the pages they need next.
+    // Only the bytes of the frames are touched off the calling thread, the pool itself stays single threaded.
+    class Prefetcher {
+    public:
+        Prefetcher();
+        ~Prefetcher();
+
+        void submit(unsigned frame, PageIO &io, PageNum pageNum, char *data);
+        bool poll(unsigned frame, bool wait, bool &ok);                     // Collect the read of the frame if it is done
+
+    private:
+        struct Request {
+            unsigned frame;
+            PageIO* io;
+            PageNum pageNum;
+            char* data;
+        };
+
+        std::deque<Request> queue;
+        std::unordered_map<unsigned, bool> finished;                        // frame -> the read succeeded
+        bool stopping;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable completed;
+        std::vector<std::thread> workers;                                   // Started by the first request
+
+        void work();
+    };
+
+    // Process-wide page cache shared by every FileHandle (and thus every IXFileHandle).
+    //  - Pages are identified by (file, page number), so handles on the same file share frames
+    //  - A frame is sized for the page it holds, files may have different page sizes
+    //  - Writes only dirty the frame, the page reaches the disk on eviction or when a handle closes the file
+    //  - Victims are chosen with the CLOCK policy, pinned frames are never evicted
+    //  - Scans may prefetch the pages ahead of them, a page still being read is waited for when it is pinned
+    class BufferPool {
+    public:
+        static BufferPool &instance();                                      // Access to the singleton instance
+
+        RC setFrameCount(unsigned frameCount);                              // Resize the pool, fails if any page is pinned
+        unsigned getFrameCount() const;
+
+        // Pin a page and return its frame, load = false skips the disk read when the page will be overwritten.
+        // Return nullptr when every frame is pinned.
+        char* pinPage(FileHandle &fileHandle, PageNum pageNum, bool load, bool &hit);
+        RC unpinPage(FileHandle &fileHandle, PageNum pageNum, bool dirty, LSN lsn = 0);
+        RC prefetch(FileHandle &fileHandle, PageNum pageNum);               // Start reading a page in the background
+
+        RC flushFile(FileHandle &fileHandle);                               // Write back every dirty page of the file
+        RC checkpoint();                                                    // Make every logged change durable, then empty the log
+        void dropFile(const std::string &fileName);                         // Forget the pages of the file without writing
+        bool hasOpenFiles() const;
+
+        FileState* openFile(FileHandle &fileHandle);                        // Register an opened handle
+        void closeFile(FileHandle &fileHandle);                             // Unregister a handle, the file must be flushed
+
+        RC collectCounterValues(unsigned &hitCount, unsigned &missCount, unsigned &evictCount);
+
+    protected:
+        BufferPool();                                                       // Prevent construction
+        ~BufferPool();                                                      // Prevent unwanted destruction
+        BufferPool(const BufferPool &);                                     // Prevent construction by copying
+        BufferPool &operator=(const BufferPool &);                          // Prevent assignment
+
+    private:
+        std::vector<Frame> frames;
+        std::vector<char*> frameData;
+        std::vector<unsigned> frameSize;
+        unsigned clockHand;
+        std::unordered_map<unsigned long long, unsigned> pageTable;         // (file, page) -> frame
+        std::unordered_map<std::string, FileState> files;
+        FileID nextFileID;
+        unsigned hitCounter;
+        unsigned missCounter;
+        unsigned evictCounter;
+        unsigned prefetching;                                               // Frames pinned by unsettled prefetches
+        Prefetcher prefetcher;
+        IORing ring;
+
+        static unsigned long long getKey(FileID fileID, PageNum pageNum);
+        bool settle(unsigned pos, bool wait);
+        char* getFrameData(unsigned pos, unsigned size);                    // Reallocate a frame that is too small or too large
+        int getVictim();
+        RC writeBack(Frame &frame);
+        RC writeBack(std::vector<unsigned> &positions);                     // One log flush and one I/O batch
+        void dropFrames(FileState &state);
+        RC syncLoggedFiles();
+    };
+
+    enum LogRecordType {
+        LOG_PAGE = 1,               // runs of bytes changed in a page, with their old and new values
+        LOG_APPEND,                 // a page added at the end of a file, undone by cutting the file
+        LOG_COMMIT,                 // end of an atomic change
+        LOG_RESET                   // the file was created or destroyed, its older records no longer apply
+    };
+
+    // Write-ahead log shared by every file.
+    //  - Changes are grouped into atomic changes (a record insert, a B+ tree split, a catalog update),
+    //    changes made outside of one are never undone
+    //  - A page reaches its file only after the log records that changed it are durable
+    //  - Commits are made durable in groups: a log writer thread syncs every LOG_GROUP_COMMIT_US, so a crash
+    //    loses at most the commits of that window. With sync commit every committer waits instead, the ones
+    //    arriving during an fsync share the next one, and an outer LogGuard makes many changes durable with one.
+    //  - On the first open after a crash the log is redone from the start, then uncommitted changes are undone.
+    //    Logs of other processes are only replayed once their lock is free, i.e. the process died.
+    class LogManager {
+    public:
+        static LogManager &instance();                                      // Access to the singleton instance
+
+        void beginAtomic();                                                 // Calls may nest, only the outermost one counts
+        RC endAtomic();                                                     // Commit the change
+        void setSyncCommit(bool syncCommit);                                // Off by default, on waits for the log on every commit
+
+        // Log a change of physical page pageNum, before and after hold the bytes [offset, offset+length).
+        // Return the LSN of the record, 0 if nothing changed.
+        LSN logPage(FileHandle &fileHandle, PageNum pageNum, unsigned offset, unsigned length,
+                    const char *before, const char *after);
+        LSN logAppend(FileHandle &fileHandle, PageNum pageNum, const char *data);
+        RC logReset(const std::string &fileName);
+
+        RC flush(LSN lsn);                                                  // Make the log durable up to lsn
+        RC recover();                                                       // Replay the logs left behind, only while no file is open
+        const std::string &getFileName() const { return fileName; }         // Log locked by this process, empty before its first use
+        void truncate();                                                    // Drop the log, every logged change is durable in its file
+
+    protected:
+        LogManager();                                                       // Prevent construction
+        ~LogManager();                                                      // Prevent unwanted destruction
+        LogManager(const LogManager &);                                     // Prevent construction by copying
+        LogManager &operator=(const LogManager &);                          // Prevent assignment
+
+    private:
+        FILE* file;
+        std::string fileName;
+        std::string buffer;                                                 // Records after durableLSN
+        std::unordered_set<std::string> loggedFiles;                        // Files with records in the log, only they need a reset
+        LSN nextLSN;
+        LSN durableLSN;
+        unsigned long long logSize;                                         // Bytes logged since the last truncate
+        unsigned long long nextGroup;
+        unsigned long long currentGroup;                                    // 0 outside of an atomic change
+        unsigned depth;
+        bool changed;                                                       // The current atomic change logged something
+        bool syncCommit;
+        bool flushing;                                                      // A committer is writing the log for everyone
+        bool broken;                                                        // A sync failed, no commit can be durable anymore
+        bool stopping;
+        off_t logEnd;                                                       // Size of the log file, a failed write is cut back to it
+        std::mutex mutex;
+        std::condition_variable flushed;
+        std::condition_variable wakeWriter;
+        std::thread writer;                                                 // Started by the first commit that does not sync
+
+        LSN append(unsigned char type, unsigned long long group, const std::string &payload);
+        RC openLog();
+        RC writeLog(const std::string &bytes);
+        void noteFile(const std::string &fileName);
+        void writeLoop();
+    };
+
+    // Scope of an atomic change
+    class LogGuard {
+    public:
+        LogGuard();
+        ~LogGuard();
+    };
+
+    // Free space of every data page in units of pageSize / SPACE_MAP_LEVELS.
+    // A max-tree over the values finds the first page with enough room in O(log N).
+    class SpaceMap {
+    public:
+        SpaceMap();
+
+        void clear();
+        void resize(unsigned pageCount);
+        void set(PageNum pageNum, unsigned char value);
+        unsigned char get(PageNum pageNum) const;
+        int find(unsigned char value) const;                                // First page holding at least value, -1 if none
+
+        unsigned pageCount;
+        bool loaded;
+
+    private:
+        std::vector<unsigned char> tree;
+        unsigned leafCount;
     };
 
     class FileHandle {
@@ -57,6 +407,9 @@ namespace PeterDB {
         unsigned readPageCounter;
         unsigned writePageCounter;
         unsigned appendPageCounter;
+        // variables to keep the buffer pool hits and misses of this handle
+        unsigned hitPageCounter;
+        unsigned missPageCounter;
 
         FileHandle();                                                       // Default constructor
         ~FileHandle();                                                      // Destructor
@@ -65,21 +418,60 @@ namespace PeterDB {
         RC readPage(PageNum pageNum, void *data);                           // Get a specific page
         RC writePage(PageNum pageNum, const void *data);                    // Write a specific page
         RC appendPage(const void *data);                                    // Append a specific page
+        char* pinPage(PageNum pageNum);                                     // Borrow the buffered (or mapped) page, nullptr if unavailable
+        RC unpinPage(PageNum pageNum);                                      // Give back a page borrowed by pinPage
+        void prefetch(PageNum pageNum, unsigned count);                     // Start reading pages the caller needs next
+        char* getMappedPage(PageNum pageNum);                               // The page in a mapped file, nullptr if not mapped
         unsigned getNumberOfPages();                                        // Get the number of pages in the file
         RC collectCounterValues(unsigned &readPageCount, unsigned &writePageCount,
                                 unsigned &appendPageCount);                 // Put current counter values into variables
-        RC openFile(const std::string &fileName);
+        RC collectBufferCounterValues(unsigned &hitPageCount, unsigned &missPageCount);
+        // A mapped handle is read only: its pages come from a read-only mapping of the file without a copy
+        // through the buffer pool, and writes fail. The mapping is a snapshot, pages that other handles
+        // change show up once the pool writes them back.
+        RC openFile(const std::string &fileName, bool mapped = false);
         bool handlingFile();
+        bool isMapped() const;
+        unsigned getPageSize() const;                                       // Size of every page of the file
+        unsigned getDropCount() const;                                      // Changes when pins taken before are void
+        void adviseSequential(bool sequential);                             // Hint for scans reading the pages in order
+        // Temporary files skip the log until the handle closes, a crash leaves them in any state
+        void setLogged(bool logged);
+        bool isLogged() const;
 
         RC closeFile();
+        // Make every page and then the header durable, the header never describes pages missing from the disk
+        RC sync();
 
-        char* pageData;
-        FILE *file;
+        // Free space map of the data pages, kept in hidden pages not counted by getNumberOfPages.
+        // It is only a hint, callers still check the page itself.
+        RC setPageSpace(PageNum pageNum, unsigned freeSpace);               // Record the free bytes of a page
+        int findPageWithSpace(unsigned size, PageNum hint);                 // Page with at least size free bytes, -1 if none
+
+        // Bypass the buffer pool, the page number is physical (the header is page 0)
+        RC readFromDisk(PageNum pageNum, void *data);
+        RC writeToDisk(PageNum pageNum, const void *data);
+
+        char* pageData;                                                     // A page of the file's page size
+        PageIO io;
+        std::string fileName;
+        FileID fileID;
+        FileState* fileState;                                               // Shared by every handle of the file
 
         void updateRoot(int rootNum);
 
     private:
         PeterDB::infoPage infoPage;
+        PeterDB::SpaceMap spaceMap;
+
+        unsigned pageSize;
+        bool logged;
+
+        PageNum getPhysicalPage(PageNum pageNum) const;
+        PageNum getSpaceMapPage(PageNum pageNum) const;
+        RC loadSpaceMap();
+        RC flushPages();
+        PageNum getPageCountOnDisk();
     };
 } // namespace PeterDB
 
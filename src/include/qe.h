@@ -11,6 +11,12 @@
 namespace PeterDB {
 
 #define QE_EOF (-1)  // end of the index scan
+#define QE_HASH_MEMORY (256*PAGE_SIZE)  // largest partition a hash join builds in memory
+#define QE_MAX_REPARTITION 3            // a partition still too large after this many rounds is built anyway
+#define QE_BATCH_SIZE 1024              // tuples moved by one getNextBatch call
+#define QE_AGG_PARTITIONS 16            // spill files of a hash aggregation over its memory budget
+#define QE_SORT_PAGES 256               // memory of a sort: pages of one run, and runs merged at once
+#define QE_RID_BATCH 65536              // RIDs a BitmapIndexScan sorts by page at once
     typedef enum AggregateOp {
         MIN = 0, MAX, COUNT, SUM, AVG
     } AggregateOp;
@@ -38,94 +44,112 @@ namespace PeterDB {
         unsigned pos;
     };
 
+    class TupleBatch;
+
     class Iterator {
         // All the relational operators and access methods are iterators.
     public:
         virtual RC getNextTuple(void *data) = 0;
 
+        // Replace the content of the batch with the next tuples, QE_EOF when none is left.
+        // The batch must be initialized with the attributes of the iterator. The default reads
+        // getNextTuple, operators override it to work a batch at a time.
+        // A scan should use either getNextTuple or getNextBatch, operators may read ahead for one of them.
+        virtual RC getNextBatch(TupleBatch &batch);
+
         virtual RC getAttributes(std::vector<Attribute> &attrs) const = 0;
 
         virtual ~Iterator() = default;
     };
 
-    class Key {
+    // Up to a fixed number of tuples in the usual format (null bytes, then the attributes), stored back to back.
+    // The position of every attribute is decoded once when a tuple is added and kept column by column,
+    // so operators reach any attribute without walking the tuple again.
+    class TupleBatch {
     public:
-        char* data;
-        AttrType type;
-        unsigned len;
-        Key() = default;
-        Key(char* ptr, AttrType type){
-            this->type = type;
-            this->len = sizeof(int);
-            if(type==TypeVarChar){
-                memcpy(&this->len, ptr, sizeof(int));
-                this->len+=sizeof(int);
-            }
-            data = new char [len];
-            memcpy(data, ptr, len);
-        }
-
-        ~Key(){
-            //delete [] data;
-        }
-
-
-        bool operator < (const Key &k) const {
-            switch (type) {
-                case TypeInt:
-                {
-                    int int1 = *(int*)data;
-                    int int2 = *(int*)k.data;
-                    return int1<int2;
-                }
-                case TypeReal:
-                {
-                    float ft1 = *(float*)data;
-                    float ft2 = *(float*)k.data;
-                    return ft1<ft2;
-                }
-                case TypeVarChar:
-                {
-                    std::string s1(data+4);
-                    std::string s2(k.data+4);
-                    return s1<s2;
-                }
-            }
-        }
-
-        bool operator == (const Key &k) const {
-            switch (type) {
-                case TypeInt:
-                {
-                    int int1 = *(int*)data;
-                    int int2 = *(int*)k.data;
-                    return int1==int2;
-                }
-                case TypeReal:
-                {
-                    float ft1 = *(float*)data;
-                    float ft2 = *(float*)k.data;
-                    return ft1==ft2;
-                }
-                case TypeVarChar:
-                {
-                    std::string s1(data+4);
-                    std::string s2(k.data+4);
-                    return s1==s2;
-                }
-            }
-        }
+        static const unsigned NULL_POS = ~0u;                               // Position of a null attribute
+
+        TupleBatch();
+
+        void init(const std::vector<Attribute> &attrs, unsigned capacity = QE_BATCH_SIZE);
+        void clear();
+        unsigned size() const;
+        unsigned getCapacity() const;
+        bool full() const;
+        const std::vector<Attribute> &getAttributes() const;
+
+        // Room for one more tuple of at most PAGE_SIZE bytes, added by commit()
+        char* reserve();
+        void commit();
+        void append(const void *tuple);
+        void append(const TupleBatch &batch, unsigned i);                   // Copy a tuple of a batch with the same attributes
+
+        const char* getTuple(unsigned i) const;
+        unsigned getTupleSize(unsigned i) const;
+        bool isNull(unsigned i, unsigned attr) const;
+        const char* getAttribute(unsigned i, unsigned attr) const;          // nullptr if null
+        unsigned getAttributeSize(unsigned i, unsigned attr) const;         // 0 if null
+        unsigned getAttributeOffset(unsigned i, unsigned attr) const;       // Relative to the tuple, NULL_POS if null
 
-        void operator = (const Key &k){
-            this->len = k.len;
-            int tmp = sizeof(int);
-            if(k.type==TypeVarChar){
-                tmp+=k.len;
-            }
-            this->data = new char [tmp];
-            memcpy(this->data, k.data, tmp);
-            this->type = k.type;
-        }
+    private:
+        std::vector<Attribute> attrs;
+        unsigned capacity;
+        unsigned count;
+        unsigned nullSize;
+        std::vector<char> data;
+        std::vector<unsigned> offsets;                                      // Start of every tuple, then the end of the last
+        std::vector<unsigned> columns;                                      // Attribute positions, capacity per column
+    };
+
+    // Reads an iterator one tuple at a time through batches
+    class BatchReader {
+    public:
+        BatchReader();
+
+        void init(Iterator *input);
+        int next();                                                         // Row of the next tuple in batch, QE_EOF at the end
+        RC getNextTuple(void *data);                                        // Copy of the next tuple
+        void reset();                                                       // Drop what was read ahead, after the input restarts
+
+        TupleBatch batch;
+
+    private:
+        Iterator* input;
+        unsigned pos;
+        bool done;
+    };
+
+    // Build side of a hash join. Tuples are copied into one arena and found through an open-addressing
+    // table of their key hashes, a lookup allocates nothing.
+    class JoinHashTable {
+    public:
+        void init(AttrType keyType, size_t capacity);                       // Expected number of tuples
+        void insert(const char *tuple, unsigned size, unsigned keyPos, unsigned long long hash);
+        // Matching tuples one at a time: start with slot = start(hash), -1 after the last one
+        unsigned start(unsigned long long hash) const;
+        int next(const char *key, unsigned long long hash, unsigned &slot) const;
+        const char* getTuple(int i, unsigned &size) const;
+        size_t memory() const;                                              // Bytes of the tuples
+        bool empty() const;
+        void clear();
+
+        static unsigned long long hash(const char *key, unsigned keyLen, AttrType type, unsigned seed = 0);
+
+    private:
+        struct Entry {
+            unsigned long long hash;
+            unsigned offset;
+            unsigned size;
+            unsigned keyPos;                                                // Relative to the tuple
+        };
+        AttrType keyType = TypeInt;
+        std::vector<char> arena;
+        std::vector<Entry> entries;
+        std::vector<int> slots;                                             // Entry of each slot, -1 when empty
+        size_t mask = 0;
+
+        void grow();
+        bool sameKey(const char *key, const char *other) const;
     };
 
     class TableScan : public Iterator {
@@ -134,13 +158,18 @@ namespace PeterDB {
         RelationManager &rm;
         RM_ScanIterator iter;
         std::string tableName;
+        std::string relationName;                                           // tableName without the alias
         std::vector<Attribute> attrs;
         std::vector<std::string> attrNames;
+        std::vector<ScanCondition> conditions;                              // Pushed down into the record scan
         RID rid;
+
+        int findAttribute(const std::string &name) const;
     public:
         TableScan(RelationManager &rm, const std::string &tableName, const char *alias = NULL) : rm(rm) {
             //Set members
             this->tableName = tableName;
+            this->relationName = tableName;
 
             // Get Attributes from RM
             rm.getAttributes(tableName, attrs);
@@ -161,13 +190,28 @@ namespace PeterDB {
         // Start a new iterator given the new compOp and value
         void setIterator() {
             iter.close();
-            rm.scan(tableName, "", NO_OP, NULL, attrNames, iter);
+            rm.scan(relationName, conditions, attrNames, iter);
         };
 
+        // Let the record scan test "attr op constant" conditions and drop unwanted attributes, so rejected
+        // records are never copied out of their page. Both restart the scan, conditions add up.
+        // Return -1 and change nothing when the scan cannot take them.
+        RC pushDownCondition(const Condition &condition);
+        RC pushDownProjection(const std::vector<std::string> &attrNames);
+
         RC getNextTuple(void *data) override {
             return iter.getNextTuple(rid, data);
         };
 
+        // Tuples are read straight into the batch
+        RC getNextBatch(TupleBatch &batch) override {
+            batch.clear();
+            while(!batch.full() && iter.getNextTuple(rid, batch.reserve()) == 0) {
+                batch.commit();
+            }
+            return batch.size() == 0 ? QE_EOF : 0;
+        };
+
         RC getAttributes(std::vector<Attribute> &attributes) const override {
             attributes.clear();
             attributes = this->attrs;
@@ -228,6 +272,27 @@ namespace PeterDB {
             return rc;
         };
 
+        // Point lookups for keys in increasing order, the scan moves on along the leaves
+        RC seek(const void *key) {
+            return iter->seek(key);
+        };
+
+        RC getNextRID(RID &rid) {
+            return iter->getNextEntry(rid, key);
+        };
+
+        RC readTuple(const RID &rid, void *data) {
+            return rm.readTuple(tableName, rid, data);
+        };
+
+        RC getNextBatch(TupleBatch &batch) override {
+            batch.clear();
+            while(!batch.full() && iter->getNextEntry(rid, key) == 0) {
+                if(rm.readTuple(tableName, rid, batch.reserve()) == 0)batch.commit();
+            }
+            return batch.size() == 0 ? QE_EOF : 0;
+        };
+
         RC getAttributes(std::vector<Attribute> &attributes) const override {
             attributes.clear();
             attributes = this->attrs;
@@ -244,6 +309,42 @@ namespace PeterDB {
         };
     };
 
+    // Index range scan that reads the table in page order: the RIDs of the range are collected,
+    // QE_RID_BATCH at a time, sorted by page, and every page is read once for all of its tuples.
+    // The tuples come in page order, not in key order.
+    class BitmapIndexScan : public Iterator {
+    public:
+        BitmapIndexScan(RelationManager &rm, const std::string &tableName, const std::string &attrName,
+                        const char *alias = NULL);
+
+        ~BitmapIndexScan() override;
+
+        // Start a new iterator given the new key range
+        void setIterator(void *lowKey, void *highKey, bool lowKeyInclusive, bool highKeyInclusive);
+
+        RC getNextTuple(void *data) override;
+
+        RC getAttributes(std::vector<Attribute> &attributes) const override;
+
+    private:
+        RelationManager &rm;
+        RM_IndexScanIterator* iter;
+        std::string tableName;
+        std::string relationName;                                           // tableName without the alias
+        std::string attrName;
+        std::vector<Attribute> attrs;
+        char key[PAGE_SIZE];
+
+        std::vector<RID> rids;                                              // Sorted by page
+        size_t pos;                                                         // First RID not read yet
+        std::vector<RID> pageRIDs;                                          // RIDs of the page being returned
+        std::vector<char> tuples;
+        std::vector<unsigned> ends;
+        size_t next;                                                        // Next tuple of the page to return
+
+        RC collect();
+    };
+
     class Filter : public Iterator {
         // Filter operator
     public:
@@ -255,15 +356,21 @@ namespace PeterDB {
 
         RC getNextTuple(void *data) override;
 
+        RC getNextBatch(TupleBatch &batch) override;
+
         // For attribute in std::vector<Attribute>, name it as rel.attr
         RC getAttributes(std::vector<Attribute> &attrs) const override;
 
         Iterator* iter;
         Condition condition;
+        std::vector<Attribute> attrs;
+        int attrIndex;                                                      // Position of lhsAttr, -1 if missing
+        int rhsIndex;                                                       // Position of rhsAttr when bRhsIsAttr
+        Predicate predicate;
+        TupleBatch input;
+        BatchReader reader;                                                 // Serves getNextTuple
 
-        bool isMatch(char *data);
-
-        bool isCompareSatisfy(char *key);
+        bool isMatch(const TupleBatch &batch, unsigned i);
     };
 
     class Project : public Iterator {
@@ -275,12 +382,17 @@ namespace PeterDB {
 
         RC getNextTuple(void *data) override;
 
+        RC getNextBatch(TupleBatch &batch) override;
+
         // For attribute in std::vector<Attribute>, name it as rel.attr
         RC getAttributes(std::vector<Attribute> &attrs) const override;
 
         Iterator* iter;
         std::vector<std::string> attrNames;
         std::vector<Attribute> attrs;
+        std::vector<int> positions;                                         // Input attribute of each output one, -1 if missing
+        TupleBatch input;
+        BatchReader reader;                                                 // Serves getNextTuple
     };
 
     class BNLJoin : public Iterator {
@@ -304,14 +416,24 @@ namespace PeterDB {
         TableScan* rightIter;
         Condition condition;
         unsigned pageNum;
-        unsigned mapSize;
-        char* leftData;
-        char* rightData;
         std::vector<Attribute> leftAttrs;
         std::vector<Attribute> rightAttrs;
-
-        std::map<Key, std::vector<Record>> map;
-        std::vector<std::pair<Record, Record>> tupleBuffer;
+        int leftKey;
+        int rightKey;
+        BatchReader leftReader;
+        BatchReader rightReader;
+
+        JoinHashTable table;                                                // The current block of the left input
+        bool leftDone;
+        bool blockLoaded;
+        const char* rightTuple;                                             // Current row of rightReader
+        unsigned rightSize;
+        bool probing;                                                       // rightTuple may have more matches
+        unsigned rightKeyPos;
+        unsigned long long rightHash;
+        unsigned slot;
+
+        RC loadBlock();
     };
 
     class INLJoin : public Iterator {
@@ -332,11 +454,23 @@ namespace PeterDB {
         Iterator* leftIter;
         IndexScan* rightIter;
         Condition condition;
-        char* leftData;
-        char* rightData;
         std::vector<Attribute> leftAttrs;
         std::vector<Attribute> rightAttrs;
-        bool firstScan;
+        int leftKey;
+
+        TupleBatch block;                                                   // Outer tuples probed together
+        std::vector<unsigned> sortedRows;                                   // Rows with a key, in key order
+        std::vector<int> rowKey;                                            // Distinct key of each row, -1 if null
+        std::vector<unsigned> matchStart;                                   // First match of each key, then the end
+        std::vector<RID> matchRIDs;
+        std::vector<unsigned> fetchOrder;                                   // Matches in page order
+        std::vector<int> matchTuple;                                        // Right tuple of each match, -1 if unread
+        std::vector<char> rightArena;
+        std::vector<unsigned> rightOffsets;                                 // Start of each right tuple, then the end
+        unsigned row;
+        unsigned match;                                                     // Matches of the row already returned
+
+        RC loadBlock();
     };
 
     // 10 extra-credit points
@@ -355,6 +489,224 @@ namespace PeterDB {
 
         // For attribute in std::vector<Attribute>, name it as rel.attr
         RC getAttributes(std::vector<Attribute> &attrs) const override;
+
+        // A pair of spill files holding the tuples of both inputs with the same hash
+        struct Partition {
+            std::string left;
+            std::string right;
+            unsigned level;                                                 // Rounds of partitioning behind it
+        };
+
+        Iterator* leftIter;
+        Iterator* rightIter;
+        Condition condition;
+        unsigned numPartitions;
+        std::vector<Attribute> leftAttrs;
+        std::vector<Attribute> rightAttrs;
+        int leftKey;
+        int rightKey;
+
+        std::string prefix;
+        std::vector<std::string> files;                                     // Every spill file, removed with the join
+        std::vector<Partition> pending;
+        bool partitioned;
+
+        JoinHashTable table;                                                // Build side of the current partition
+        Iterator* probe;                                                    // Scan of the right side of the current partition
+        char* rightData;
+        bool probing;                                                       // rightData may have more matches
+        unsigned rightSize;
+        unsigned rightKeyPos;
+        unsigned long long rightHash;
+        unsigned slot;
+
+        RC partition(Iterator *left, Iterator *right, unsigned level);
+        RC spill(Iterator *input, const std::vector<Attribute> &attrs, int keyIndex, unsigned level,
+                 std::vector<std::string> &names);
+        RC loadPartition(const Partition &part);
+    };
+
+    // External merge sort on a list of attributes, nulls first (last when descending). Runs of numPages
+    // pages are sorted in memory and written to temporary files, then merged through a loser tree,
+    // numPages - 1 runs at a time. Input that fits in one run never touches the disk.
+    class Sort : public Iterator {
+    public:
+        Sort(Iterator *input,
+             const std::vector<std::string> &attrNames,             // Sort keys, most significant first
+             unsigned numPages = QE_SORT_PAGES,
+             bool descending = false);
+
+        ~Sort() override;
+
+        RC getNextTuple(void *data) override;
+
+        RC getAttributes(std::vector<Attribute> &attrs) const override;
+
+    private:
+        // A run being merged, with its current tuple
+        struct RunReader {
+            Iterator* scan;
+            std::vector<char> tuple;
+            unsigned size;
+            std::vector<unsigned> keyPos;
+            bool done;
+        };
+
+        Iterator* iter;
+        std::vector<Attribute> attrs;
+        std::vector<int> keys;                                              // Position of each sort attribute
+        unsigned numPages;
+        bool descending;
+        bool valid;                                                         // Every sort attribute was found
+        bool sorted;
+
+        std::vector<char> arena;                                            // Tuples of the run in memory
+        std::vector<unsigned> offsets;
+        std::vector<unsigned> sizes;
+        std::vector<unsigned> keyPos;                                       // keys.size() per tuple, relative to it
+        std::vector<unsigned> order;                                        // The run in sorted order
+        size_t next;
+
+        std::string prefix;
+        unsigned fileCount;
+        std::vector<std::string> runs;                                      // Run files not merged yet
+        std::vector<RunReader> readers;
+        std::vector<int> losers;                                            // Loser tree, the winner at 0
+
+        RC sort();
+        void sortRun();
+        RC writeRun();
+        RC mergeRuns(size_t count);
+        RC openMerge(const std::vector<std::string> &names);
+        void closeMerge();
+        void advance(int r);
+        void adjust(int r);
+        bool beats(int r1, int r2) const;
+        int compare(const char *tuple1, const unsigned *pos1, const char *tuple2, const unsigned *pos2) const;
+    };
+
+    // Both inputs are sorted on their join attribute and merged. EQ buffers the right tuples of one key.
+    // LT, LE, GT and GE (band joins) sort in the direction where the right tuples matching a left tuple
+    // are a prefix of the right input that only grows, and buffer that prefix.
+    // NE is not supported. A null key never joins.
+    class SortMergeJoin : public Iterator {
+    public:
+        SortMergeJoin(Iterator *leftIn,                 // Iterator of input R
+                      Iterator *rightIn,                // Iterator of input S
+                      const Condition &condition,       // Join condition, attribute against attribute
+                      unsigned numPages = QE_SORT_PAGES // Memory of each sort
+        );
+
+        ~SortMergeJoin() override;
+
+        RC getNextTuple(void *data) override;
+
+        // For attribute in std::vector<Attribute>, name it as rel.attr
+        RC getAttributes(std::vector<Attribute> &attrs) const override;
+
+        Condition condition;
+        std::vector<Attribute> leftAttrs;
+        std::vector<Attribute> rightAttrs;
+        int leftKey;
+        int rightKey;
+        Sort* leftSort;
+        Sort* rightSort;
+        Predicate match;                                                    // left key op right key
+        bool started;
+
+        std::vector<char> leftData;
+        unsigned leftSize;
+        unsigned leftKeyPos;
+        unsigned leftKeyLen;
+        bool hasLeft;
+        std::vector<char> rightData;
+        unsigned rightSize;
+        unsigned rightKeyPos;
+        bool hasRight;
+
+        std::vector<char> window;                                           // Right tuples matching the left one
+        std::vector<unsigned> windowOffsets;                                // Start of each, then the end
+        std::vector<char> windowKey;                                        // Key of the window of an EQ join
+        size_t pos;                                                         // Next tuple of the window to return
+
+        bool nextLeft();
+        bool nextRight();
+        void addToWindow();
+        void clearWindow();
+    };
+
+    // One aggregate computed by a HashAggregate, named "op(attr)" in the output
+    struct AggregateSpec {
+        Attribute attr;
+        AggregateOp op;
+    };
+
+    // Group-by aggregation in one pass over the input. Groups are found through an open-addressing table
+    // of their key hashes and keep typed accumulators: 64-bit integer sums and counts, double averages,
+    // MIN and MAX in the type of the attribute. Once the groups fill the memory budget, tuples of new groups
+    // are spilled by hash into partition files, aggregated one partition at a time afterwards.
+    // A null group value forms a group of its own. Without group attributes the input is one group and one
+    // tuple is returned even when the input is empty.
+    class HashAggregate : public Iterator {
+    public:
+        HashAggregate(Iterator *input,
+                      const std::vector<Attribute> &groupAttrs,
+                      const std::vector<AggregateSpec> &aggregates,
+                      size_t memory = QE_HASH_MEMORY);             // Bytes the groups may take before spilling
+
+        ~HashAggregate() override;
+
+        RC getNextTuple(void *data) override;
+
+        // The group attributes, then one attribute per aggregate: COUNT is an INT, AVG a REAL,
+        // the others take the type of their attribute
+        RC getAttributes(std::vector<Attribute> &attrs) const override;
+
+    private:
+        struct Accumulator {
+            long long count;                                                // Non-null values
+            union { long long i; double r; } sum;
+            union { int i; float r; } min, max;
+        };
+
+        struct Group {
+            unsigned long long hash;
+            unsigned offset;                                                // Key in the arena, a tuple of groupAttrs
+            unsigned size;
+        };
+
+        Iterator* iter;
+        std::vector<Attribute> inputAttrs;
+        std::vector<Attribute> groupAttrs;
+        std::vector<AggregateSpec> aggregates;
+        std::vector<int> groupIndex;                                        // Position of each group attribute in the input
+        std::vector<int> aggIndex;
+        size_t memory;
+        bool valid;                                                         // Every attribute was found
+
+        std::vector<char> arena;
+        std::vector<Group> groups;
+        std::vector<Accumulator> accumulators;                              // aggregates.size() per group
+        std::vector<int> slots;                                             // Group of each slot, -1 when empty
+        size_t mask;
+        std::vector<char> key;                                              // Key of the current input tuple
+
+        std::string prefix;
+        std::vector<std::string> files;                                     // Every spill file, removed with the operator
+        std::vector<std::pair<std::string, unsigned>> pending;              // Partitions left, with their level
+        std::vector<FileHandle*> spillHandles;                              // Partitions of the current pass
+        bool started;
+        size_t next;                                                        // Group to return next
+
+        RC aggregate(Iterator *input, unsigned level);
+        RC spill(const char *tuple, unsigned keySize, unsigned level);
+        void closeSpills();
+        void accumulate(Accumulator &acc, AttrType type, const char *value);
+        int find(unsigned size, unsigned long long hash) const;
+        int insertGroup(unsigned size, unsigned long long hash);
+        void grow();
+        void clear();
+        size_t used() const;
     };
 
     class Aggregate : public Iterator {
@@ -384,23 +736,7 @@ namespace PeterDB {
         // output attrName = "MAX(rel.attr)"
         RC getAttributes(std::vector<Attribute> &attrs) const override;
 
-        Iterator* iter;
-        Attribute aggAttr;
-        Attribute groupAttr;
-        std::vector<Attribute> attributes;
-        std::map<Key, std::pair<int, float>> groupMap;
-        int count = 0;
-        float num = 0;
-        AggregateOp op;
-        bool done;
-
-        RC getNext(void *data);
-
-        RC getNextWithGroup(void *data);
-
-        void initGroupBy();
-
-        std::string getAggName();
+        HashAggregate* hashAggregate;                                       // Computes the single aggregate
     };
 
 
@@ -3,10 +3,13 @@
 
 #include <vector>
 #include <map>
+#include <climits>
 #include "pfm.h"
 
-// More than 4096 the PAGE_SIZE
+// Field count of a tombstone, no record has that many fields
 #define DELETE_MARK 5000;
+// Offset in the slot of a deleted record, older files used DELETE_MARK: any offset past the page is deleted
+#define DELETED_SLOT UINT_MAX
 
 
 namespace PeterDB {
@@ -82,6 +85,106 @@ namespace PeterDB {
     //  }
     //  rbfmScanIterator.close();
     #define FLOAT_DIFF 0.0000001
+
+    // "value op constant" (or "value op value") compiled once: the test is picked for the type and the operator
+    // up front, so evaluating it neither switches on them nor allocates.
+    // EQ and NE tests take reals within FLOAT_DIFF as equal, VarChars compare their bytes and then their lengths.
+    class Predicate {
+    public:
+        typedef bool (*Test)(const char *value, const char *other);
+
+        Predicate();
+
+        void compile(AttrType type, CompOp op);                             // Compare two values
+        void compile(AttrType type, CompOp op, const void *constant);       // nullptr matches nothing, NO_OP everything
+
+        bool operator()(const void *value) const {
+            return test((const char*)value, constant.data());
+        }
+
+        bool operator()(const void *value, const void *other) const {
+            return test((const char*)value, (const char*)other);
+        }
+
+        // Negative, zero or positive in an exact total order, the one of sorts and index keys
+        static int compare(AttrType type, const void *value1, const void *value2);
+
+    private:
+        Test test;
+        std::string constant;
+    };
+
+    // One "attribute op value" test of a scan, a record is returned only when it passes every test
+    struct ScanCondition {
+        std::string attribute;
+        CompOp op;
+        std::string value;          // 4 bytes, or the length and then the characters of a VarChar
+    };
+
+    #define TUPLE_VIEW_FIELDS 32    // fields a TupleView keeps the offsets of without allocating
+
+    // A tuple in the format of insertRecord() with the offset of every field decoded once, so a field is
+    // reached in O(1). The view points into the tuple, it does not copy it.
+    class TupleView {
+    public:
+        TupleView();
+        TupleView(const std::vector<Attribute> &attrs, const void *tuple);
+
+        void reset(const std::vector<Attribute> &attrs, const void *tuple);
+
+        const char* getData() const { return tuple; }
+        unsigned getSize() const { return getOffset(count); }              // Bytes of the whole tuple
+        unsigned getFieldCount() const { return count; }
+
+        bool isNull(unsigned i) const {
+            return tuple[i / CHAR_BIT] & (0x80 >> (i % CHAR_BIT));
+        }
+
+        const char* getField(unsigned i) const {                           // nullptr if null
+            return isNull(i) ? nullptr : tuple + getOffset(i);
+        }
+
+        unsigned getFieldSize(unsigned i) const {                          // 0 if null
+            return getOffset(i + 1) - getOffset(i);
+        }
+
+        int getInt(unsigned i) const;
+        float getReal(unsigned i) const;
+
+    private:
+        const char* tuple;
+        unsigned count;
+        unsigned short offsets[TUPLE_VIEW_FIELDS + 1];                      // Start of every field, then the end
+        std::vector<unsigned short> wideOffsets;                            // Used instead for wider tuples
+
+        unsigned getOffset(unsigned i) const {
+            return count <= TUPLE_VIEW_FIELDS ? offsets[i] : wideOffsets[i];
+        }
+    };
+
+    // Writes a tuple in the format of insertRecord() field after field, null bits included
+    class TupleBuilder {
+    public:
+        TupleBuilder();
+
+        void start(void *data, unsigned fieldCount);
+
+        void addNull();
+        void addField(const void *value, unsigned size);
+        void addInt(int value);
+        void addReal(float value);
+        void addField(const TupleView &view, unsigned i);                   // A field of a view, null or not
+        void addFields(const TupleView &view);                              // Every field of a view in one copy
+        void addFields(const void *tuple, unsigned fieldCount, unsigned size);  // Same, the size already known
+
+        unsigned getSize() const { return offset; }                         // Bytes written so far
+
+    private:
+        char* data;
+        unsigned field;
+        unsigned offset;
+    };
+
     class RBFM_ScanIterator {
     public:
         RBFM_ScanIterator() = default;
@@ -99,27 +202,34 @@ namespace PeterDB {
                   const CompOp param,
                   const void *pVoid, const std::vector<std::string> &vector1);
 
+        void init(FileHandle &handle, const std::vector<Attribute> &descriptor,
+                  const std::vector<ScanCondition> &conditions, const std::vector<std::string> &attributeNames);
+
     private:
-        FileHandle* fileHandle;
+        // A condition resolved against the descriptor
+        struct ScanTest {
+            short id;                   // -1 when the attribute is unknown, nothing can match
+            Predicate predicate;
+        };
+
+        FileHandle* fileHandle = nullptr;
         std::vector<Attribute> descriptor;
-        std::string conditionAttribute;
-        CompOp commOp;
         std::vector<std::string> attributeNames;
         unsigned currentPageNum;
         unsigned short currentSlotNum;
-        unsigned attributeIndex;
-        AttrType attrType;
-        char* conditionVal;
-        unsigned attrLength;
-
-        RC moveToNext(unsigned pageNum, unsigned slotNum);
-        bool isMatch(char *record, char *attrValue);
-
-        void setAttrNull(void *src, ushort attrNum, bool isNull);
-
-        void setBit(char &src, bool value, unsigned int offset);
-
-        void getByteOffset(unsigned int pos, unsigned int &bytes, unsigned int &offset);
+        std::vector<ScanTest> conditions;
+        std::vector<short> projectedIDs;
+        // The page under the scan, pinned in the buffer pool (or copied into pageBuffer when no frame is free)
+        char* page = nullptr;
+        char* pageBuffer = nullptr;
+        bool pinned = false;
+        unsigned prefetchedTo = 0;                                          // Pages below are read or on their way
+
+        char* getPage(unsigned pageNum);
+        void releasePage();
+        bool isMatch(char *record);
+        bool isMatch(char *record, const ScanTest &test);
+        void projectRecord(char *record, char *data);
 
         RID readRID(char *recordData, int offset);
     };
@@ -128,11 +238,13 @@ namespace PeterDB {
     public:
         static RecordBasedFileManager &instance();                          // Access to the singleton instance
 
-        RC createFile(const std::string &fileName);                         // Create a new record-based file
+        RC createFile(const std::string &fileName,
+                      unsigned pageSize = PAGE_SIZE);                       // Create a new record-based file, see PagedFileManager
 
         RC destroyFile(const std::string &fileName);                        // Destroy a record-based file
 
-        RC openFile(const std::string &fileName, FileHandle &fileHandle);   // Open a record-based file
+        RC openFile(const std::string &fileName, FileHandle &fileHandle,
+                    bool mapped = false);                                   // Open a record-based file, read only if mapped
 
         RC closeFile(FileHandle &fileHandle);                               // Close a record-based file
 
@@ -140,7 +252,7 @@ namespace PeterDB {
 
         void writeRecord(const Record &record, FileHandle &fileHandle, unsigned availablePage, RID &rid, char* data);
         void fetchRecord(int offset, int recordSize, void* data, void* page);
-        unsigned int getFreeSpace(char* data);
+        unsigned int getFreeSpace(char* data, unsigned pageSize);
 
         //  Format of the data passed into the function is the following:
         //  [n byte-null-indicators for y fields] [actual value for the first field] [actual value for the second field] ...
@@ -157,13 +269,20 @@ namespace PeterDB {
         //  !!! The same format is used for updateRecord(), the returned data of readRecord(), and readAttribute().
         // For example, refer to the Q8 of Project 1 wiki page.
 
-        // Insert a record into a file
+        // Insert a record into a file. Whatever the page size, a record takes at most PAGE_SIZE bytes
+        // in the format above: readers, the query operators among them, hold a record in PAGE_SIZE bytes.
         RC insertRecord(FileHandle &fileHandle, const std::vector<Attribute> &recordDescriptor, const void *data,
                         RID &rid);
 
         // Read a record identified by the given rid.
         RC readRecord(FileHandle &fileHandle, const std::vector<Attribute> &recordDescriptor, const RID &rid, void *data);
 
+        // Read records by RID, each page once for a run of RIDs on it (sort the RIDs by page first).
+        // The records are appended to data one after another, the end of each one to ends; a record that
+        // cannot be read is left empty.
+        RC readRecords(FileHandle &fileHandle, const std::vector<Attribute> &recordDescriptor,
+                       const std::vector<RID> &rids, std::vector<char> &data, std::vector<unsigned> &ends);
+
         // Print the record that is passed to this utility method.
         // This method will be mainly used for debugging/testing.
         // The format is as follows:
@@ -196,11 +315,18 @@ namespace PeterDB {
                 const std::vector<std::string> &attributeNames, // a list of projected attributes
                 RBFM_ScanIterator &rbfm_ScanIterator);
 
-        void getInfo(char *data, unsigned int *info);
+        // Scan with a conjunction of conditions, tested on the page before a record is copied out
+        RC scan(FileHandle &fileHandle,
+                const std::vector<Attribute> &recordDescriptor,
+                const std::vector<ScanCondition> &conditions,
+                const std::vector<std::string> &attributeNames,
+                RBFM_ScanIterator &rbfm_ScanIterator);
+
+        void getInfo(char *data, unsigned int *info, unsigned pageSize);
 
         bool isTomb(char *data);
 
-        std::pair<unsigned , unsigned> getSlotInfo(unsigned slotNum, const char *data);
+        std::pair<unsigned , unsigned> getSlotInfo(unsigned slotNum, const char *data, unsigned pageSize);
 
         short getAttrID(const std::vector<Attribute> &recordDescriptor, const std::string &attributeName);
 
@@ -217,20 +343,20 @@ namespace PeterDB {
 
         void updateInfo(FileHandle& fileHandle, char *data, unsigned pageNum, unsigned* info);
 
-        int getDeletedSlot(char *data);
+        int getDeletedSlot(char *data, unsigned pageSize);
 
         RID getPointRID(char *data_offset);
 
         void insertTomb(char *data, unsigned int pageNum, unsigned slotNum);
 
-        void writeSlotInfo(unsigned slotNum, const char *data, std::pair<unsigned , unsigned > slot);
+        void writeSlotInfo(unsigned slotNum, const char *data, std::pair<unsigned , unsigned > slot, unsigned pageSize);
 
-        void shiftRecord(char *data, unsigned offset, long size, unsigned shiftOffset, unsigned len);
+        void shiftRecord(char *data, unsigned offset, long size, unsigned shiftOffset, unsigned len, unsigned pageSize);
 
         void writeUpdateInfo(FileHandle &fileHandle, unsigned *info, std::pair<unsigned , unsigned> slot, int size,
                         int oldSize, const RID &rid, char *pageData);
 
-        unsigned getSlotNum(char *pageData);
+        unsigned getSlotNum(char *pageData, unsigned pageSize);
 
     };
 
@@ -3,6 +3,8 @@
 
 #include <string>
 #include <vector>
+#include <list>
+#include <unordered_map>
 #include "src/include/ix.h"
 #include "src/include/rbfm.h"
 
@@ -105,12 +107,46 @@ namespace PeterDB {
 
         // "key" follows the same format as in IndexManager::insertEntry()
         RC getNextEntry(RID &rid, void *key);    // Get next matching entry
+        RC seek(const void *key);                // Restart on the entries of key, keys in increasing order
         RC close();                              // Terminate index scan
 
         IX_ScanIterator iter;
         IXFileHandle ixFileHandle;
     };
 
+    // Number of open handles the relation manager keeps per kind (table files, index files)
+    #define HANDLE_CACHE_SIZE 16
+
+    // LRU cache of open handles keyed by file name, so point operations do not reopen files on every call
+    template<typename Handle>
+    class HandleCache {
+    public:
+        explicit HandleCache(unsigned capacity);
+        ~HandleCache();
+
+        Handle* get(const std::string &fileName);                           // Open the file on a miss, nullptr if it fails
+        void invalidate(const std::string &fileName);                       // Close the handle, call before destroying the file
+        void clear();
+
+    private:
+        typedef std::list<std::pair<std::string, Handle*>> HandleList;
+
+        unsigned capacity;
+        HandleList handles;                                                 // Most recently used first
+        std::unordered_map<std::string, typename HandleList::iterator> index;
+
+        static RC openHandle(const std::string &fileName, Handle &handle);
+    };
+
+    // In-memory copy of one table's catalog entries, kept in sync with Tables, Columns and the index catalog
+    struct TableInfo {
+        int id;
+        std::string fileName;
+        std::vector<Attribute> attrs;                                       // Ordered by column-position
+        std::vector<std::string> indexes;                                   // Names of the indexed attributes
+        int nextPosition;                                                   // column-position of the next added attribute
+    };
+
     #define TABLES_TUPLE_SIZE 50*2+4*3+1
     #define COLUMNS_TUPLE_SIZE 50+4*5+1
     #define INDEX_TUPLE_SIZE 50*2+4*3+1
@@ -123,7 +159,9 @@ namespace PeterDB {
 
         RC deleteCatalog();
 
-        RC createTable(const std::string &tableName, const std::vector<Attribute> &attrs);
+        // The page size is kept in the header of the table file, see PagedFileManager::createFile
+        RC createTable(const std::string &tableName, const std::vector<Attribute> &attrs,
+                       unsigned pageSize = PAGE_SIZE);
 
         RC deleteTable(const std::string &tableName);
 
@@ -137,6 +175,10 @@ namespace PeterDB {
 
         RC readTuple(const std::string &tableName, const RID &rid, void *data);
 
+        // Read tuples by RID, see RecordBasedFileManager::readRecords()
+        RC readTuples(const std::string &tableName, const std::vector<RID> &rids, std::vector<char> &data,
+                      std::vector<unsigned> &ends);
+
         // Print a tuple that is passed to this utility method.
         // The format is the same as printRecord().
         RC printTuple(const std::vector<Attribute> &attrs, const void *data, std::ostream &out);
@@ -152,13 +194,20 @@ namespace PeterDB {
                 const std::vector<std::string> &attributeNames, // a list of projected attributes
                 RM_ScanIterator &rm_ScanIterator);
 
+        // Scan the tuples passing every condition, rejected records are never copied out of their page
+        RC scan(const std::string &tableName,
+                const std::vector<ScanCondition> &conditions,
+                const std::vector<std::string> &attributeNames,
+                RM_ScanIterator &rm_ScanIterator);
+
         // Extra credit work (10 points)
         RC addAttribute(const std::string &tableName, const Attribute &attr);
 
         RC dropAttribute(const std::string &tableName, const std::string &attributeName);
 
         // QE IX related
-        RC createIndex(const std::string &tableName, const std::string &attributeName);
+        RC createIndex(const std::string &tableName, const std::string &attributeName,
+                       unsigned pageSize = PAGE_SIZE);
 
         RC destroyIndex(const std::string &tableName, const std::string &attributeName);
 
@@ -197,6 +246,23 @@ namespace PeterDB {
         void insertIndex(const std::string &tableName, RID &rid);
 
         void deleteIndex(const std::string &tableName, RID &rid);
+
+        void dropNewIndex(const std::string &tableName, const std::string &attrName, const RID &rid);
+
+        RC loadCatalog();
+
+        TableInfo* getTableInfo(const std::string &tableName);              // nullptr if the table does not exist
+
+        RC findCatalogRecords(const std::string &fileName, const std::vector<Attribute> &descriptor,
+                              const std::string &conditionAttr, const void *value,
+                              const std::vector<std::string> &attrNames, std::vector<RID> &rids,
+                              std::vector<std::string> &records);
+
+        std::unordered_map<std::string, TableInfo> catalog;                 // Keyed by table name
+        bool catalogLoaded = false;
+
+        HandleCache<FileHandle> fileHandles;
+        HandleCache<IXFileHandle> ixFileHandles;
     };
 
 } // namespace PeterDB
@@ -4,35 +4,79 @@
 #include <cstring>
 #include <climits>
 #include <cmath>
+#include <algorithm>
 
 namespace PeterDB {
+    unsigned IXFileHandle::pinnedNodes = 0;
+
     IXFileHandle::IXFileHandle() {
         ixReadPageCounter = 0;
         ixWritePageCounter = 0;
         ixAppendPageCounter = 0;
+        nodeDrops = 0;
         rootPage = new char [PAGE_SIZE];
+        memset(rootPage, 0, PAGE_SIZE);
     }
     IXFileHandle::~IXFileHandle() {
+        releaseNodes();
         fileHandle.closeFile();
         delete [] rootPage;
     }
     RC IXFileHandle::collectCounterValues(unsigned &readPageCount, unsigned &writePageCount, unsigned &appendPageCount) {
-        return fileHandle.collectCounterValues(readPageCount, writePageCount, appendPageCount);
+        RC rc = fileHandle.collectCounterValues(readPageCount, writePageCount, appendPageCount);
+        readPageCount += ixReadPageCounter;
+        return rc;
     }
     int IXFileHandle::getRoot() {
         if(getNumberOfPages()==0)return -1;
         int root = 0;
+        checkNodes();
+        auto it = nodes.find(0);
+        if(it != nodes.end()){
+            memcpy(&root, it->second, sizeof(int));
+            ixReadPageCounter++;
+            return root;
+        }
         readPage(0, rootPage);
         memcpy(&root, rootPage, sizeof(int));
         return root;
     }
     void IXFileHandle::setRoot(unsigned num){
+        int format = IX_LEAF_FORMAT;
         memcpy(rootPage, &num, sizeof(int));
+        memcpy(rootPage + sizeof(int), &format, sizeof(int));
         writePage(0, rootPage);
     }
     RC IXFileHandle::readPage(PageNum pageNum, void *data) {
-        memset(data, 0, PAGE_SIZE);
-        return fileHandle.readPage(pageNum, data);
+        checkNodes();
+        auto it = nodes.find(pageNum);
+        if(it != nodes.end()){
+            memcpy(data, it->second, fileHandle.getPageSize());
+            ixReadPageCounter++;
+            return 0;
+        }
+        // Every handle shares the budget, so that the cached indexes of RM cannot pin the whole pool
+        bool cache = pinnedNodes < BufferPool::instance().getFrameCount() / IX_NODE_CACHE_SHARE;
+        char* frame = cache ? fileHandle.pinPage(pageNum) : nullptr;
+        if(frame == nullptr){
+            memset(data, 0, fileHandle.getPageSize());
+            return fileHandle.readPage(pageNum, data);
+        }
+        memcpy(data, frame, fileHandle.getPageSize());
+        if(pageNum == 0 || (Node::isNode(frame, fileHandle.getPageSize()) && getNumberOfPages() != 2)){
+            if(nodes.empty())nodeDrops = fileHandle.getDropCount();
+            nodes[pageNum] = frame;
+            pinnedNodes++;
+        } else {
+            fileHandle.unpinPage(pageNum);
+        }
+        return 0;
+    }
+    char* IXFileHandle::mapPage(PageNum pageNum) {
+        return fileHandle.getMappedPage(pageNum);
+    }
+    void IXFileHandle::prefetch(PageNum pageNum, unsigned count) {
+        fileHandle.prefetch(pageNum, count);
     }
     RC IXFileHandle::writePage(PageNum pageNum, const void *data) {
         return fileHandle.writePage(pageNum, data);
@@ -43,46 +87,86 @@ namespace PeterDB {
     unsigned IXFileHandle::getNumberOfPages() {
         return fileHandle.getNumberOfPages();
     }
+    void IXFileHandle::releaseNodes() {
+        checkNodes();
+        for(auto &node: nodes){
+            fileHandle.unpinPage(node.first);
+        }
+        pinnedNodes -= nodes.size();
+        nodes.clear();
+    }
+    // The frames of a destroyed or replaced file are dropped pinned or not, and may hold other pages by now
+    void IXFileHandle::checkNodes() {
+        if(nodes.empty() || fileHandle.getDropCount() == nodeDrops)return;
+        pinnedNodes -= nodes.size();
+        nodes.clear();
+    }
     IndexManager &IndexManager::instance() {
         static IndexManager _index_manager = IndexManager();
         return _index_manager;
     }
-    RC IndexManager::createFile(const std::string &fileName) {
+    RC IndexManager::createFile(const std::string &fileName, unsigned pageSize) {
         PagedFileManager& pfm = PagedFileManager::instance();
-        return pfm.createFile(fileName);
+        return pfm.createFile(fileName, pageSize);
     }
     RC IndexManager::destroyFile(const std::string &fileName) {
         PagedFileManager& pfm = PagedFileManager::instance();
         return pfm.destroyFile(fileName);
     }
-    RC IndexManager::openFile(const std::string &fileName, IXFileHandle &ixFileHandle) {
+    RC IndexManager::openFile(const std::string &fileName, IXFileHandle &ixFileHandle, bool mapped) {
         PagedFileManager& pfm = PagedFileManager::instance();
-        return pfm.openFile(fileName, ixFileHandle.fileHandle);
+        ixFileHandle.releaseNodes();
+        if(pfm.openFile(fileName, ixFileHandle.fileHandle, mapped) != 0)return -1;
+        // Page 0 is read and written whole, the root page follows the page size of the file
+        delete [] ixFileHandle.rootPage;
+        ixFileHandle.rootPage = new char [ixFileHandle.fileHandle.getPageSize()];
+        memset(ixFileHandle.rootPage, 0, ixFileHandle.fileHandle.getPageSize());
+        // Leaves written before the format was recorded cannot be read, the index has to be rebuilt
+        int format = IX_LEAF_FORMAT;
+        if(ixFileHandle.getNumberOfPages() != 0){
+            format = 0;
+            if(ixFileHandle.fileHandle.readPage(0, ixFileHandle.rootPage) == 0){
+                memcpy(&format, ixFileHandle.rootPage + sizeof(int), sizeof(int));
+            }
+        }
+        if(format != IX_LEAF_FORMAT){
+            std::cout << "Index " << fileName << " has leaf format " << format << ", not " << IX_LEAF_FORMAT << std::endl;
+            pfm.closeFile(ixFileHandle.fileHandle);
+            return -1;
+        }
+        return 0;
     }
     RC IndexManager::closeFile(IXFileHandle &ixFileHandle) {
         PagedFileManager& pfm = PagedFileManager::instance();
+        ixFileHandle.releaseNodes();
         return pfm.closeFile(ixFileHandle.fileHandle);
     }
 
     RC IndexManager::insertEntry(IXFileHandle &ixFileHandle, const Attribute &attribute, const void* key, const RID &rid) {
+        if(ixFileHandle.fileHandle.isMapped())return -1;
+        // Every node rewritten by a split commits together
+        LogGuard guard;
         auto root = ixFileHandle.getRoot();
         keyEntry entry;
         entry.key = (char*)key;
         if(root==-1){
             // Initialization
-            char* data = new char [PAGE_SIZE];
-            memset(data, 0, PAGE_SIZE);
+            int pageSize = ixFileHandle.fileHandle.getPageSize();
+            char* data = new char [pageSize];
+            memset(data, 0, pageSize);
             root = 1;
             memcpy(data, &root, sizeof(int));
             ixFileHandle.appendPage(data);
 
-            Leaf::createLeaf(data, NULL_NODE, NULL_NODE, NULL_NODE);
+            Leaf::createLeaf(data, NULL_NODE, NULL_NODE, NULL_NODE, pageSize);
             int* info = new int [TREE_NODE_SIZE];
-            Leaf::getInfo(info, data);
+            Leaf::getInfo(info, data, pageSize);
             info[NODE_TYPE] = ROOT;
-            Tool::writeInfo(data, info);
-            Leaf::insertEntry(data, attribute, entry, const_cast<RID &>(rid));
+            Tool::writeInfo(data, info, pageSize);
+            // Append the empty root and add the entry with a logged write, an append is never undone in place
             ixFileHandle.appendPage(data);
+            Leaf::insertEntry(data, attribute, entry, const_cast<RID &>(rid), pageSize);
+            ixFileHandle.writePage(1, data);
             ixFileHandle.setRoot(1);           // The root is initially page 1
             delete [] data;
             delete [] info;
@@ -97,6 +181,8 @@ namespace PeterDB {
     }
 
     RC IndexManager::deleteEntry(IXFileHandle &ixFileHandle, const Attribute &attribute, const void* key, const RID &rid) {
+        if(ixFileHandle.fileHandle.isMapped())return -1;
+        LogGuard guard;
         int root = ixFileHandle.getRoot();
         if (root == -1) {return -1;}
         keyEntry entry;
@@ -117,6 +203,11 @@ namespace PeterDB {
         return ix_ScanIterator.init(ixFileHandle, attribute, lowKey, highKey, lowKeyInclusive, highKeyInclusive);
     }
 
+    RC IndexManager::bulkLoad(IXFileHandle &ixFileHandle, const Attribute &attribute, IX_BulkLoader &loader,
+                              float fillFactor) {
+        return loader.init(ixFileHandle, attribute, fillFactor);
+    }
+
     // Construct the B+ tree in a recursive way, print in JSON format
     RC IndexManager::printBTree(IXFileHandle &ixFileHandle, const Attribute &attribute, std::ostream &out) const {
         int root = ixFileHandle.getRoot();
@@ -125,8 +216,20 @@ namespace PeterDB {
         return 0;
     }
 
-    IX_ScanIterator::IX_ScanIterator() {
+    static int keyLength(const Attribute &attr, const char *key) {
+        int len = 0;
+        if(attr.type != TypeVarChar)return sizeof(int);
+        memcpy(&len, key, sizeof(int));
+        return len + sizeof(int);
+    }
 
+    IX_ScanIterator::IX_ScanIterator() {
+        low = nullptr;
+        high = nullptr;
+        page = nullptr;
+        buffer = nullptr;
+        pageNum = -1;
+        fileHandle = nullptr;
     }
 
     IX_ScanIterator::~IX_ScanIterator() {
@@ -135,19 +238,19 @@ namespace PeterDB {
     RC IX_ScanIterator::getNextEntry(RID &rid, void *key) {
         if(pageNum==-1)return IX_EOF;
 
-        auto slot = Tool::getSlot(page, slotNum);
-        memcpy(key, page+slot.offset, slot.len);
+        Leaf::getKey(page, attr, slotNum, static_cast<char *>(key), pageSize);
         if(!inRange(static_cast<char *>(key))){
-            memset(key, 0, slot.len);
             return IX_EOF;
         }
-        memcpy(&rid, page+slot.offset+slot.len+sizeof(RID)*ridNum, sizeof(RID));
+        Leaf::getRID(page, attr, slotNum, ridNum, rid, pageSize);
         moveToNext();
         return 0;
     }
 
     RC IX_ScanIterator::close() {
-        delete [] page;
+        delete [] buffer;
+        buffer = nullptr;
+        page = nullptr;
         if(low != nullptr)delete [] low;
         if(high != nullptr)delete [] high;
         return 0;
@@ -155,7 +258,7 @@ namespace PeterDB {
 
     RC IX_ScanIterator::init(IXFileHandle &handle, const Attribute &attr, const void *low, const void *high,
                              bool lowInclusive, bool highInclusive) {
-        if (handle.fileHandle.file== nullptr) return -1;
+        if (!handle.fileHandle.handlingFile()) return -1;
         if (handle.getRoot()==-1)return -1;
         this->attr = attr;
         this->low = nullptr;
@@ -193,11 +296,17 @@ namespace PeterDB {
 
         this->lowInclusive = lowInclusive;
         this->highInclusive = highInclusive;
+        if(this->high != nullptr)highTest.compile(attr.type, highInclusive ? LE_OP : LT_OP, this->high);
         this->pageNum = handle.getRoot();
         this->slotNum = 0;
         this->ridNum = 0;
+        this->prefetchedTo = 0;
         this->fileHandle = &handle;
-        this->page = new char [PAGE_SIZE];
+        this->pageSize = handle.fileHandle.getPageSize();
+        this->buffer = new char [pageSize];
+        this->page = buffer;
+        // Leaves of a mapped file are read in place, let the kernel fetch them ahead
+        if(handle.fileHandle.isMapped())handle.fileHandle.adviseSequential(true);
 
         moveToLeft();
         return 0;
@@ -206,103 +315,392 @@ namespace PeterDB {
     void IX_ScanIterator::moveToLeft() {
         if (pageNum == -1) return;
 
-        fileHandle->readPage(pageNum, page);
-        if(Node::isNode(page) && fileHandle->getNumberOfPages()!=2){
+        loadPage(pageNum);
+        if(Node::isNode(page, pageSize) && fileHandle->getNumberOfPages()!=2){
             if (nullptr == this->low){
                 memcpy(&pageNum, page, sizeof(int));
             } else {
-                pageNum = Node::searchPage(page, attr, low);
+                pageNum = Node::searchPage(page, attr, low, pageSize, true);
             }
             moveToLeft();
         } else {
-            int* info = new int [TREE_NODE_SIZE];
-            Leaf::getInfo(info, page);
-            curCount = info[SLOT_NUM];
-            auto slot = Tool::getSlot(page, 0);
-            curRIDNum = slot.rid_num;
-            // when lowKey is nullptr, the slot number should be 0, which default value is 0 already
-            if (low == nullptr){
-                //skip if the current slot is empty
-                while(ridNum >= curRIDNum && pageNum!=-1) {
-                    slotNum++;
-                    while (slotNum >= curCount){
-                        Leaf::getInfo(info, page);
-                        pageNum = info[NEXT];
-                        if (pageNum == -1)break;
-                        fileHandle->readPage(pageNum, page);
-                        slotNum = 0;
-                        Leaf::getInfo(info, page);
-                        curCount = info[SLOT_NUM];
-                    }
-                    ridNum = 0;
-                    slot = Tool::getSlot(page, slotNum);
-                    curRIDNum = slot.rid_num;
-                }
-                delete [] info;
-                return;
-            }
-            char* oldKey = new char [PAGE_SIZE];
-            float diff = 0;
-            int id = 0, offset = 0, len = 0;
-            Tool::search(page, attr, low, offset, id, len);
-            Tool::getKey(page, offset, len, oldKey);
-            if(id==-1){
-                pageNum = -1;
-            }
-            diff = Tool::compare(low, oldKey, attr);
-            slotNum = id;
-            slot = Tool::getSlot(page, slotNum);
-            curRIDNum = slot.rid_num;
-            //when the lowkey is not inclusive, scan until the value satisfy
-            while (!lowInclusive && diff == 0){
-                moveToNext();
-                slot = Tool::getSlot(page, slotNum);
-                Tool::getKey(page, slot.offset, slot.len, oldKey);
-                diff = Tool::compare(low, oldKey, attr);
-            }
-            //the key does not exist in this leaf page
-            if (slotNum == curCount){
-                moveToNext();
+            seekInLeaf();
+        }
+    }
+
+    // Position the scan on the first entry of the leaf in page that is not below low
+    void IX_ScanIterator::seekInLeaf() {
+        curCount = Leaf::getCount(page, pageSize);
+        slotNum = 0;
+        ridNum = 0;
+        if(low != nullptr){
+            slotNum = Leaf::search(page, attr, low, pageSize);
+        }
+        curRIDNum = Leaf::getRIDNum(page, attr, slotNum, pageSize);
+        skipEmpty();
+        // When the low key is not inclusive, skip its entries, they may continue in the next leaves
+        while(!lowInclusive && low != nullptr && pageNum != -1 && Leaf::compareKey(page, attr, slotNum, low, pageSize) == 0){
+            ridNum = curRIDNum;
+            skipEmpty();
+        }
+    }
+
+    // Point scans for increasing keys: the leaf under the scan and the one after it are tried
+    // before going down from the root again
+    RC IX_ScanIterator::seek(const void *key) {
+        if(fileHandle == nullptr)return -1;
+        int len = keyLength(attr, (const char*)key);
+        if(low == nullptr)low = new char [PAGE_SIZE];
+        if(high == nullptr)high = new char [PAGE_SIZE];
+        memcpy(low, key, len);
+        memcpy(high, key, len);
+        lowInclusive = true;
+        highInclusive = true;
+        highTest.compile(attr.type, LE_OP, high);
+        slotNum = 0;
+        ridNum = 0;
+        bool found = false;
+        if(pageNum != -1 && !Node::isNode(page, pageSize)){
+            found = inLeaf();
+            int info[TREE_NODE_SIZE];
+            Leaf::getInfo(info, page, pageSize);
+            if(!found && info[NEXT] != -1){
+                pageNum = info[NEXT];
+                loadPage(pageNum);
+                found = inLeaf();
             }
-            delete [] oldKey;
-            delete [] info;
         }
+        if(found){
+            seekInLeaf();
+        } else {
+            pageNum = fileHandle->getRoot();
+            moveToLeft();
+        }
+        return 0;
+    }
+
+    // low is not above the last key of the leaf in page
+    bool IX_ScanIterator::inLeaf() {
+        int count = Leaf::getCount(page, pageSize);
+        if(count <= 0)return false;
+        return Leaf::compareKey(page, attr, count - 1, low, pageSize) >= 0;
     }
 
     void IX_ScanIterator::moveToNext() {
-        auto info = new int [TREE_NODE_SIZE];
         ridNum++;
-        Leaf::getInfo(info, page);
+        skipEmpty();
+    }
+
+    // Move past the entries without RIDs left and past the end of a leaf
+    void IX_ScanIterator::skipEmpty() {
+        int info[TREE_NODE_SIZE];
         while(ridNum >= curRIDNum && pageNum!=-1) {
             slotNum++;
             while (slotNum >= curCount){
-                Leaf::getInfo(info, page);
+                Leaf::getInfo(info, page, pageSize);
+                int previous = pageNum;
                 pageNum = info[NEXT];
                 if (pageNum == -1)break;
-                fileHandle->readPage(pageNum, page);
+                loadPage(pageNum);
+                readAhead(previous);
                 slotNum = 0;
-                Leaf::getInfo(info, page);
-                curCount = info[SLOT_NUM];
+                curCount = Leaf::getCount(page, pageSize);
             }
             ridNum = 0;
-            auto slot = Tool::getSlot(page, slotNum);
-            curRIDNum = slot.rid_num;
+            curRIDNum = Leaf::getRIDNum(page, attr, slotNum, pageSize);
+        }
+    }
+
+    // Pages of a mapped file are not copied, the scan only reads them
+    RC IX_ScanIterator::loadPage(int pageNum) {
+        char* mapped = fileHandle->mapPage(pageNum);
+        if(mapped != nullptr){
+            page = mapped;
+            return 0;
+        }
+        page = buffer;
+        return fileHandle->readPage(pageNum, page);
+    }
+
+    // Once the scan follows the leaf chain, the next leaf is read in the background. Leaves laid out
+    // in order (e.g. bulk loaded) follow each other in the file, a whole window is read ahead then.
+    void IX_ScanIterator::readAhead(int previous) {
+        int info[TREE_NODE_SIZE];
+        Leaf::getInfo(info, page, pageSize);
+        int next = info[NEXT];
+        int count = Leaf::getCount(page, pageSize);
+        // The range ends in this leaf
+        if(next == -1 || (high != nullptr && count > 0 && Leaf::compareKey(page, attr, count - 1, high, pageSize) > 0))return;
+        if(previous + 1 == pageNum && next == pageNum + 1){
+            if(next + PF_PREFETCH_PAGES / 2 < prefetchedTo)return;
+            int from = std::max(prefetchedTo, next);
+            prefetchedTo = next + PF_PREFETCH_PAGES;
+            fileHandle->prefetch(from, prefetchedTo - from);
+        } else {
+            fileHandle->prefetch(next, 1);
         }
-        delete [] info;
     }
 
     bool IX_ScanIterator::inRange(char* key) {
         if(high==nullptr)return true;
+        return highTest(key);
+    }
+
+
+    // Same order as Tool::compare, but exact for reals so that it can sort
+    static int compareKeys(const Attribute &attr, const char *key1, const char *key2) {
+        if(attr.type == TypeReal){
+            float val1 = 0, val2 = 0;
+            memcpy(&val1, key1, sizeof(float));
+            memcpy(&val2, key2, sizeof(float));
+            return val1 < val2 ? -1 : val1 > val2;
+        }
+        return Predicate::compare(attr.type, key1, key2);
+    }
+
+    IX_BulkLoader::IX_BulkLoader() {
+        fileHandle = nullptr;
+        fillFactor = IX_FILL_FACTOR;
+        leaf = nullptr;
+        pending = nullptr;
+        leafPage = 0;
+        leafBytes = 0;
+    }
+
+    IX_BulkLoader::~IX_BulkLoader() {
+        clear();
+    }
+
+    RC IX_BulkLoader::init(IXFileHandle &handle, const Attribute &attr, float fillFactor) {
+        if(!handle.fileHandle.handlingFile() || handle.fileHandle.isMapped())return -1;
+        if(handle.getNumberOfPages() != 0){
+            std::cout << "Bulk load needs an empty index" << std::endl;
+            return -1;
+        }
+        if(fillFactor <= 0 || fillFactor > 1)return -1;
+        clear();
+        this->fileHandle = &handle;
+        this->attr = attr;
+        this->fillFactor = fillFactor;
+        return 0;
+    }
 
-        float diff = Tool::compare(key, high, attr);
+    RC IX_BulkLoader::insertEntry(const void *key, const RID &rid) {
+        if(fileHandle == nullptr)return -1;
+        int len = keyLength(attr, (const char*)key);
+        offsets.push_back(entries.size());
+        entries.insert(entries.end(), (const char*)key, (const char*)key + len);
+        entries.insert(entries.end(), (const char*)&rid, (const char*)&rid + sizeof(RID));
+        if(entries.size() + offsets.size()*sizeof(unsigned) >= IX_SORT_MEMORY)return spill();
+        return 0;
+    }
 
-        return highInclusive ? diff<=0:diff<0;
+    // Sort the entries in memory and write them out as one run
+    RC IX_BulkLoader::spill() {
+        const char* base = entries.data();
+        const Attribute &attr = this->attr;
+        std::stable_sort(offsets.begin(), offsets.end(), [base, &attr](unsigned a, unsigned b) {
+            return compareKeys(attr, base + a, base + b) < 0;
+        });
+        std::string runName = fileHandle->fileHandle.fileName + ".run" + std::to_string(runs.size());
+        FILE* run = fopen(runName.c_str(), "wb");
+        if(run == nullptr)return -1;
+        runs.push_back(runName);
+        for(auto offset: offsets){
+            size_t size = keyLength(attr, base + offset) + sizeof(RID);
+            if(fwrite(base + offset, 1, size, run) != size){
+                fclose(run);
+                return -1;
+            }
+        }
+        if(fclose(run) != 0)return -1;
+        entries.clear();
+        offsets.clear();
+        return 0;
     }
 
+    RC IX_BulkLoader::close() {
+        if(fileHandle == nullptr)return -1;
+        RC rc = 0;
+        if(!runs.empty() && !offsets.empty())rc = spill();
+        if(rc == 0 && runs.empty()){
+            const char* base = entries.data();
+            const Attribute &attr = this->attr;
+            std::stable_sort(offsets.begin(), offsets.end(), [base, &attr](unsigned a, unsigned b) {
+                return compareKeys(attr, base + a, base + b) < 0;
+            });
+            for(size_t i = 0; i < offsets.size() && rc == 0; i++){
+                RID rid;
+                memcpy(&rid, base + offsets[i] + keyLength(attr, base + offsets[i]), sizeof(RID));
+                rc = addSorted(base + offsets[i], rid);
+            }
+        } else if(rc == 0){
+            // Merge the runs, on equal keys the earlier run goes first so the order of insertion is kept
+            std::vector<FILE*> files;
+            std::vector<std::vector<char>> heads(runs.size(), std::vector<char>(PAGE_SIZE + sizeof(RID)));
+            auto readHead = [this, &files, &heads](size_t i) {
+                char* head = heads[i].data();
+                if(fread(head, 1, sizeof(int), files[i]) != sizeof(int))return false;
+                size_t rest = keyLength(attr, head) - sizeof(int) + sizeof(RID);
+                return fread(head + sizeof(int), 1, rest, files[i]) == rest;
+            };
+            auto later = [this, &heads](size_t a, size_t b) {
+                int diff = compareKeys(attr, heads[a].data(), heads[b].data());
+                return diff != 0 ? diff > 0 : a > b;
+            };
+            std::vector<size_t> heap;
+            for(size_t i = 0; i < runs.size(); i++){
+                files.push_back(fopen(runs[i].c_str(), "rb"));
+                if(files[i] == nullptr)rc = -1;
+                else if(readHead(i))heap.push_back(i);
+            }
+            std::make_heap(heap.begin(), heap.end(), later);
+            while(rc == 0 && !heap.empty()){
+                std::pop_heap(heap.begin(), heap.end(), later);
+                size_t i = heap.back();
+                RID rid;
+                memcpy(&rid, heads[i].data() + keyLength(attr, heads[i].data()), sizeof(RID));
+                rc = addSorted(heads[i].data(), rid);
+                if(readHead(i))std::push_heap(heap.begin(), heap.end(), later);
+                else heap.pop_back();
+            }
+            for(auto file: files)if(file != nullptr)fclose(file);
+        }
+        if(rc == 0 && !groupRIDs.empty())rc = flushGroup();
+        // The leaf being filled always holds the last group
+        if(rc == 0 && leaf != nullptr)rc = finishLeaf();
+        if(rc == 0 && pending != nullptr){
+            // The last leaf has no next leaf, a single leaf is the root
+            int pageSize = fileHandle->fileHandle.getPageSize();
+            int* info = new int [TREE_NODE_SIZE];
+            Leaf::getInfo(info, pending, pageSize);
+            info[NEXT] = NULL_NODE;
+            if(level.size() == 1)info[NODE_TYPE] = ROOT;
+            Tool::writeInfo(pending, info, pageSize);
+            delete [] info;
+            rc = fileHandle->appendPage(pending);
+        }
+        if(rc == 0 && !level.empty())rc = buildNodes();
+        clear();
+        return rc;
+    }
+
+    // Entries arrive sorted, the ones with equal keys are gathered before they go into a leaf
+    RC IX_BulkLoader::addSorted(const char *key, const RID &rid) {
+        if(!groupRIDs.empty() && compareKeys(attr, groupKey.data(), key) != 0){
+            if(flushGroup() != 0)return -1;
+        }
+        if(groupRIDs.empty())groupKey.assign(key, keyLength(attr, key));
+        groupRIDs.push_back(rid);
+        return 0;
+    }
+
+    RC IX_BulkLoader::flushGroup() {
+        int pageSize = fileHandle->fileHandle.getPageSize();
+        int usable = pageSize - sizeof(int)*TREE_NODE_SIZE;
+        LeafEntry group;
+        group.key = groupKey;
+        group.rids.swap(groupRIDs);
+        int size = Leaf::entrySize(attr, group);
+        if(Leaf::packedSize(attr, group, group, 1, size) > usable){
+            std::cout << "Too many entries with the same key for one leaf" << std::endl;
+            return -1;
+        }
+        if(leaf == nullptr){
+            // Page 0 holds the root, the leaves follow it
+            leaf = new char [pageSize];
+            pending = new char [pageSize];
+            memset(leaf, 0, pageSize);
+            if(fileHandle->appendPage(leaf) != 0)return -1;
+            leafPage = 1;
+            Leaf::createLeaf(leaf, NULL_NODE, NULL_NODE, leafPage + 1, pageSize);
+        }
+        if(!leafEntries.empty()){
+            int packed = Leaf::packedSize(attr, leafEntries.front(), group, leafEntries.size() + 1, leafBytes + size);
+            if(packed > usable * fillFactor && finishLeaf() != 0)return -1;
+        }
+        leafEntries.push_back(group);
+        leafBytes += size;
+        return 0;
+    }
+
+    RC IX_BulkLoader::finishLeaf() {
+        int pageSize = fileHandle->fileHandle.getPageSize();
+        Leaf::pack(leaf, attr, leafEntries, 0, leafEntries.size(), pageSize);
+        if(!level.empty() && fileHandle->appendPage(pending) != 0)return -1;
+        level.emplace_back(leafEntries.front().key, leafPage);
+        leafEntries.clear();
+        leafBytes = 0;
+        std::swap(leaf, pending);
+        leafPage++;
+        Leaf::createLeaf(leaf, NULL_NODE, leafPage - 1, leafPage + 1, pageSize);
+        return 0;
+    }
 
-    void Node::getInfo(int *info, char *data) {
+    // Every pass groups the pages of a level under nodes, until a single node, the root, is left
+    RC IX_BulkLoader::buildNodes() {
+        int pageSize = fileHandle->fileHandle.getPageSize();
+        int usable = pageSize - sizeof(int)*TREE_NODE_SIZE;
+        char* node = new char [pageSize];
+        while(level.size() > 1){
+            std::vector<std::pair<std::string, int>> upper;
+            std::vector<size_t> firsts;                                     // First child of each node
+            int used = sizeof(int);
+            for(size_t i = 0; i < level.size(); i++){
+                int cost = level[i].first.size() + sizeof(int) + Slot_Size;
+                size_t children = firsts.empty() ? 0 : i - firsts.back();
+                // Keep at least two children in a node, the last one included
+                bool full = used + cost > usable * fillFactor && children >= 3;
+                if(firsts.empty() || full || used + cost > usable){
+                    firsts.push_back(i);
+                    used = sizeof(int);
+                } else {
+                    used += cost;
+                }
+            }
+            if(firsts.size() > 1 && firsts.back() == level.size() - 1)firsts.back()--;
+
+            int pageNum = fileHandle->getNumberOfPages();
+            for(size_t n = 0; n < firsts.size(); n++){
+                size_t end = n + 1 < firsts.size() ? firsts[n + 1] : level.size();
+                Node::createNode(node, firsts.size() == 1 ? ROOT : NODE, NULL_NODE, pageSize);
+                for(size_t i = firsts[n] + 1; i < end; i++){
+                    keyEntry entry(level[i - 1].second, &level[i].first[0], level[i].second);
+                    Node::appendKey(node, entry, attr, pageSize);
+                }
+                if(fileHandle->appendPage(node) != 0){
+                    delete [] node;
+                    return -1;
+                }
+                upper.emplace_back(level[firsts[n]].first, pageNum + n);
+            }
+            level.swap(upper);
+        }
+        delete [] node;
+        fileHandle->setRoot(level[0].second);
+        return 0;
+    }
+
+    void IX_BulkLoader::clear() {
+        for(auto &run: runs)remove(run.c_str());
+        runs.clear();
+        entries.clear();
+        offsets.clear();
+        groupKey.clear();
+        groupRIDs.clear();
+        leafEntries.clear();
+        leafBytes = 0;
+        level.clear();
+        delete [] leaf;
+        delete [] pending;
+        leaf = nullptr;
+        pending = nullptr;
+        fileHandle = nullptr;
+    }
+
+    void Node::getInfo(int *info, char *data, int pageSize) {
         memset(info, 0, sizeof(int)*TREE_NODE_SIZE);
-        auto base = data+PAGE_SIZE;
+        auto base = data+pageSize;
         int offset = sizeof(int);
         for(int i=0;i<TREE_NODE_SIZE;i++){
             memcpy(&info[i], base-offset, sizeof(int));
@@ -312,49 +710,52 @@ namespace PeterDB {
 
     void Node::insertEntry(IXFileHandle &ixFileHandle, int pageNum, Attribute &attr, keyEntry& entry, RID& rid,
                       keyEntry *child) {
-        char* data = new char [PAGE_SIZE];
+        int pageSize = ixFileHandle.fileHandle.getPageSize();
+        char* data = new char [pageSize];
         ixFileHandle.readPage(pageNum, data);
-        if(Node::isNode(data) && ixFileHandle.getNumberOfPages()!=2){
-            auto num = Node::searchPage(data, attr, entry.key);
+        if(Node::isNode(data, pageSize) && ixFileHandle.getNumberOfPages()!=2){
+            auto num = Node::searchPage(data, attr, entry.key, pageSize);
             insertEntry(ixFileHandle, num, attr, entry, rid, child);
             if(child->left!=-1){
-                if(Node::haveSpace(data, entry.key, attr)){
-                    Node::insertKey(data, *child, attr);
+                if(Node::haveSpace(data, entry.key, attr, pageSize)){
+                    Node::insertKey(data, *child, attr, pageSize);
                     child->left = -1;
                 }
                 else {
-                    char* newPage = new char [PAGE_SIZE];
+                    char* newPage = new char [pageSize];
                     int* info = new int [TREE_NODE_SIZE];
 
                     // Node will send the middleKey to upper layer
-                    Node::getInfo(info, data);
-                    Node::createNode(newPage, NODE, info[PARENT]);
+                    Node::getInfo(info, data, pageSize);
+                    Node::createNode(newPage, NODE, info[PARENT], pageSize);
                     char* middleKey = new char [PAGE_SIZE];
                     memset(middleKey, 0, PAGE_SIZE);
-                    Node::split(data, newPage, middleKey);
-                    getInfo(info, data);
+                    Node::split(data, newPage, middleKey, pageSize);
+                    getInfo(info, data, pageSize);
 
                     int newPageNum = ixFileHandle.getNumberOfPages();
                     info[NEXT] = newPageNum;
-                    Tool::writeInfo(data, info);
+                    Tool::writeInfo(data, info, pageSize);
                     ixFileHandle.appendPage(newPage);
 
-                    if(Tool::compare(child->key, middleKey, attr)<0){
-                        Node::insertKey(data, *child, attr);
+                    // A key equal to the middle one goes to the half holding the child that split
+                    float diff = Tool::compare(child->key, middleKey, attr);
+                    if(diff<0 || (diff==0 && Node::hasChild(data, child->left, pageSize))){
+                        Node::insertKey(data, *child, attr, pageSize);
                     } else {
-                        Node::insertKey(newPage, *child, attr);
+                        Node::insertKey(newPage, *child, attr, pageSize);
                         ixFileHandle.writePage(newPageNum, newPage);
                     }
 
                     int* newInfo = new int [TREE_NODE_SIZE];
-                    getInfo(newInfo, newPage);
-                    getInfo(info, data);
+                    getInfo(newInfo, newPage, pageSize);
+                    getInfo(info, data, pageSize);
 
                     if(info[NODE_TYPE] == ROOT){
                         int root_num = newPageNum+1;
 
-                        char* root = new char [PAGE_SIZE];
-                        Node::createNode(root, ROOT, NULL_NODE);
+                        char* root = new char [pageSize];
+                        Node::createNode(root, ROOT, NULL_NODE, pageSize);
                         keyEntry entry1;
                         entry1.left = pageNum;
                         entry1.right = newPageNum;
@@ -366,16 +767,16 @@ namespace PeterDB {
                         entry1.key = new char [keyLen];
                         memset(entry1.key, 0, keyLen);
                         memcpy(entry1.key, middleKey, keyLen);
-                        Node::appendKey(root, entry1, attr);
+                        Node::appendKey(root, entry1, attr, pageSize);
 
                         ixFileHandle.appendPage(root);
                         ixFileHandle.setRoot(root_num);
                         info[NODE_TYPE] = NODE;
                         info[PARENT] = root_num;
-                        Tool::writeInfo(data, info);
+                        Tool::writeInfo(data, info, pageSize);
 
                         newInfo[PARENT] = root_num;
-                        Tool::writeInfo(newPage, newInfo);
+                        Tool::writeInfo(newPage, newInfo, pageSize);
                         ixFileHandle.writePage(newPageNum, newPage);
                         delete [] entry1.key;
                         delete [] root;
@@ -393,70 +794,61 @@ namespace PeterDB {
             }
         }
         else {
-            if(Leaf::haveSpace(data, attr, entry.key)){
-                Leaf::insertEntry(data, attr, entry, rid);
+            if(Leaf::haveSpace(data, attr, entry.key, pageSize)){
+                Leaf::insertEntry(data, attr, entry, rid, pageSize);
                 child->left = -1;
             }
             else {
-                char* newPage = new char [PAGE_SIZE];
+                char* newPage = new char [pageSize];
                 int* info = new int [TREE_NODE_SIZE];
 
-                Leaf::getInfo(info, data);
-                Leaf::createLeaf(newPage, info[PARENT], pageNum, info[NEXT]);
-                Leaf::split(data, newPage);
-                Leaf::getInfo(info, data);
+                Leaf::getInfo(info, data, pageSize);
+                Leaf::createLeaf(newPage, info[PARENT], pageNum, info[NEXT], pageSize);
+                Leaf::split(data, newPage, attr, entry, rid, pageSize);
+                Leaf::getInfo(info, data, pageSize);
                 int newPageNum = ixFileHandle.getNumberOfPages();
 
-                auto slot = Tool::getSlot(newPage, 0);
-                char* newKey = new char [slot.len];
-                memset(newKey, 0, slot.len);
-                memcpy(newKey, newPage+slot.offset, slot.len);
-
-                if(Tool::compare(entry.key, newKey, attr)<0){
-                    Leaf::insertEntry(data, attr, entry, rid);
-                } else {
-                    Leaf::insertEntry(newPage, attr, entry, rid);
-                }
+                char* newKey = new char [PAGE_SIZE];
+                Leaf::getKey(newPage, attr, 0, newKey, pageSize);
+                int newKeyLen = keyLength(attr, newKey);
 
                 int* newInfo = new int [TREE_NODE_SIZE];
-                getInfo(newInfo, newPage);
-                getInfo(info, data);
+                getInfo(newInfo, newPage, pageSize);
+                getInfo(info, data, pageSize);
 
                 if(info[NODE_TYPE] == ROOT){
-                    char* root = new char [PAGE_SIZE];
-                    Node::createNode(root, ROOT, NULL_NODE);
+                    char* root = new char [pageSize];
+                    Node::createNode(root, ROOT, NULL_NODE, pageSize);
                     keyEntry entry1;
                     entry1.left = pageNum;
                     entry1.right = newPageNum+1;
-                    auto newSlot = Tool::getSlot(newPage, 0);
-                    entry1.key = new char [newSlot.len];
-                    memset(entry1.key, 0, newSlot.len);
-                    memcpy(entry1.key, newPage+newSlot.offset, newSlot.len);
-                    Node::appendKey(root, entry1, attr);
+                    entry1.key = new char [newKeyLen];
+                    memcpy(entry1.key, newKey, newKeyLen);
+                    Node::appendKey(root, entry1, attr, pageSize);
 
                     ixFileHandle.appendPage(root);
                     ixFileHandle.setRoot(newPageNum);
                     // Change Parent pointer
                     info[NODE_TYPE] = LEAF;
                     info[PARENT] = newPageNum;
-                    Tool::writeInfo(data, info);
+                    Tool::writeInfo(data, info, pageSize);
 
                     newInfo[PARENT] = newPageNum;
-                    Tool::writeInfo(newPage, newInfo);
+                    Tool::writeInfo(newPage, newInfo, pageSize);
 
                     newPageNum++;
                     delete [] entry1.key;
                     delete [] root;
                 }
-                getInfo(info, data);
+                getInfo(info, data, pageSize);
 
                 child->left = pageNum;
                 memset(child->key, 0, PAGE_SIZE);
-                memcpy(child->key, newKey, slot.len);
+                memcpy(child->key, newKey, newKeyLen);
                 child->right = newPageNum;
 
                 info[NEXT] = newPageNum;
-                Tool::writeInfo(data, info);
+                Tool::writeInfo(data, info, pageSize);
                 ixFileHandle.appendPage(newPage);
 
                 delete [] newPage;
@@ -471,19 +863,27 @@ namespace PeterDB {
 
     RC Node::deleteEntry(IXFileHandle &ixFileHandle, int paPageNum, int pageNum, const Attribute &attr, keyEntry &entry,
                            RID& rid, keyEntry *child) {
-        char* data = new char [PAGE_SIZE];
+        int pageSize = ixFileHandle.fileHandle.getPageSize();
+        char* data = new char [pageSize];
         ixFileHandle.readPage(pageNum, data);
-        if(Node::isNode(data) && ixFileHandle.getNumberOfPages() !=2){
-            auto num = Node::searchPage(data, attr, entry.key);
+        if(Node::isNode(data, pageSize) && ixFileHandle.getNumberOfPages() !=2){
+            auto num = Node::searchPage(data, attr, entry.key, pageSize, true);
             delete [] data;
             return deleteEntry(ixFileHandle, pageNum, num, attr, entry, rid,  child);
         }
         else {
-            auto rc = Leaf::deleteEntry(data, attr, entry, rid);
-            if(rc!=0){
-                std::cout << " " << pageNum << std::endl;
-                delete [] data;
-                return rc;
+            // The leftmost leaf that can hold the key was reached, its RIDs may continue in the next leaves
+            while(Leaf::deleteEntry(data, attr, entry, rid, pageSize) != 0){
+                int info[TREE_NODE_SIZE];
+                Leaf::getInfo(info, data, pageSize);
+                int count = Leaf::getCount(data, pageSize);
+                if(info[NEXT] == -1 || (count > 0 && Leaf::compareKey(data, attr, count - 1, entry.key, pageSize) > 0)){
+                    std::cout << "Entry not found in the index" << std::endl;
+                    delete [] data;
+                    return -1;
+                }
+                pageNum = info[NEXT];
+                ixFileHandle.readPage(pageNum, data);
             }
             ixFileHandle.writePage(pageNum, data);
         }
@@ -491,19 +891,20 @@ namespace PeterDB {
         return 0;
     }
 
-    bool Node::isNode(char *pageData) {
+    bool Node::isNode(char *pageData, int pageSize) {
         int* info = new int [TREE_NODE_SIZE];
-        getInfo(info, pageData);
+        getInfo(info, pageData, pageSize);
         auto type = info[NODE_TYPE];
         delete [] info;
         return type != LEAF;
     }
 
     void Node::print(IXFileHandle &ixFileHandle, const Attribute &attribute, int root, int depth, std::ostream &out) {
-        char* data = new char [PAGE_SIZE];
+        int pageSize = ixFileHandle.fileHandle.getPageSize();
+        char* data = new char [pageSize];
         ixFileHandle.readPage(root, data);
-        if(!isNode(data) || ixFileHandle.getNumberOfPages()==2){
-            Leaf::print(data, attribute, out);
+        if(!isNode(data, pageSize) || ixFileHandle.getNumberOfPages()==2){
+            Leaf::print(data, attribute, out, pageSize);
             delete [] data;
             return;
         }
@@ -512,7 +913,7 @@ namespace PeterDB {
 
         std::queue<int> children;
         int* info = new int [TREE_NODE_SIZE];
-        getInfo(info, data);
+        getInfo(info, data, pageSize);
         int child = 0;
         int count = info[SLOT_NUM];
         char* key = new char [PAGE_SIZE];
@@ -522,7 +923,7 @@ namespace PeterDB {
         //keys
 
         for (int i = 0; i < count; i++){
-            auto slot = Tool::getSlot(data, i);
+            auto slot = Tool::getSlot(data, i, pageSize);
             memset(key, 0, PAGE_SIZE);
             memcpy(key, data + slot.offset, slot.len);
             memcpy(&child, data + slot.offset - sizeof(int), sizeof(int));
@@ -572,21 +973,21 @@ namespace PeterDB {
         out<<"]}" << std::endl;
     }
 
-    void Node::createNode(char *data, int type, int parent) {
-        memset(data, 0, PAGE_SIZE);
+    void Node::createNode(char *data, int type, int parent, int pageSize) {
+        memset(data, 0, pageSize);
         int* info = new int [TREE_NODE_SIZE];
         memset(info, 0, sizeof(int)*TREE_NODE_SIZE);
         info[INFO_OFFSET] = sizeof(int)*TREE_NODE_SIZE;
         info[PARENT] = parent;
         info[NODE_TYPE] = type;
-        Tool::writeInfo(data, info);
+        Tool::writeInfo(data, info, pageSize);
         delete [] info;
     }
 
-    bool Node::haveSpace(char *data, const char *key, Attribute& attr) {
+    bool Node::haveSpace(char *data, const char *key, Attribute& attr, int pageSize) {
         int* info = new int [TREE_NODE_SIZE];
-        getInfo(info, data);
-        auto empty = PAGE_SIZE - info[DATA_OFFSET] - info[INFO_OFFSET];
+        getInfo(info, data, pageSize);
+        auto empty = pageSize - info[DATA_OFFSET] - info[INFO_OFFSET];
         int space = 0;
         switch (attr.type) {
             case TypeInt:
@@ -604,9 +1005,9 @@ namespace PeterDB {
         return empty>=space;
     }
 
-    void Node::appendKey(char* data, keyEntry &entry, Attribute &attr) {
+    void Node::appendKey(char* data, keyEntry &entry, Attribute &attr, int pageSize) {
         int* info = new int [TREE_NODE_SIZE];
-        getInfo(info, data);
+        getInfo(info, data, pageSize);
         if(entry.left==-1||entry.right==-1){
             std::cout<<std::endl;
         }
@@ -627,53 +1028,53 @@ namespace PeterDB {
         }
         memcpy(pos, entry.key, len);
         memcpy(pos+len, &entry.right, sizeof(int));
-        Tool::appendSlot(data, info, len);
+        Tool::appendSlot(data, info, len, pageSize);
 
         info[DATA_OFFSET] += len+sizeof(int);
-        Tool::writeInfo(data, info);
+        Tool::writeInfo(data, info, pageSize);
         delete [] info;
     }
 
-    void Node::split(char *data, char *newData, char *middle) {
+    void Node::split(char *data, char *newData, char *middle, int pageSize) {
         int* info = new int [TREE_NODE_SIZE];
-        getInfo(info, data);
+        getInfo(info, data, pageSize);
         auto count = info[SLOT_NUM];
         int d = count/2;
-        auto slot = Tool::getSlot(data, d);
+        auto slot = Tool::getSlot(data, d, pageSize);
 
         int len = slot.offset+slot.len;
         auto dataLen = info[DATA_OFFSET]-len;
         auto infoLen = Slot_Size*(count-d-1);
 
         auto data_pivot = data+len;
-        auto info_pivot = data+PAGE_SIZE-info[INFO_OFFSET];
+        auto info_pivot = data+pageSize-info[INFO_OFFSET];
 
         memcpy(middle, data+slot.offset, slot.len);
 
         // Transfer data
         memcpy(newData, data_pivot, dataLen);
-        memcpy(newData+PAGE_SIZE-sizeof(int)*TREE_NODE_SIZE-infoLen, info_pivot, infoLen);
+        memcpy(newData+pageSize-sizeof(int)*TREE_NODE_SIZE-infoLen, info_pivot, infoLen);
         // Update info
         memset(data+slot.offset, 0, info[DATA_OFFSET] - slot.offset);
         memset(info_pivot, 0, infoLen+Slot_Size);
         Tool::updateInfo(info, d, slot.offset, sizeof(int)*TREE_NODE_SIZE + Slot_Size*d);
-        Tool::writeInfo(data, info);
+        Tool::writeInfo(data, info, pageSize);
 
         int* newInfo = new int [TREE_NODE_SIZE];
-        getInfo(newInfo, newData);
+        getInfo(newInfo, newData, pageSize);
         Tool::updateInfo(newInfo, count-d-1, dataLen, infoLen+sizeof(int)*TREE_NODE_SIZE);
-        Tool::writeInfo(newData, newInfo);
-        Tool::updateSlot(newData, newInfo, -len, 0);
+        Tool::writeInfo(newData, newInfo, pageSize);
+        Tool::updateSlot(newData, newInfo, -len, 0, pageSize);
 
         delete [] info;
         delete [] newInfo;
     }
 
-    int Node::searchPage(char *page, Attribute attribute, char *key) {
+    int Node::searchPage(char *page, Attribute attribute, char *key, int pageSize, bool leftmost) {
         int pos = 0, len = 0, i = 0;
-        Tool::search(page, attribute, key, pos, i, len);
+        Tool::search(page, attribute, key, pos, i, len, pageSize);
         float diff = Tool::compare(key, page+pos, attribute);
-        if(diff==0){
+        if(diff==0 && !leftmost){
             pos+=len+sizeof(int);
         }
         int num = 0;
@@ -681,12 +1082,36 @@ namespace PeterDB {
         return num;
     }
 
-    void Node::insertKey(char *data, keyEntry entry, Attribute &attr) {
+    // Child pointer in front of key i, the last pointer for i == count
+    int Node::childBefore(char *data, int i, int pageSize) {
+        int info[TREE_NODE_SIZE];
+        getInfo(info, data, pageSize);
+        int pos = i < info[SLOT_NUM] ? Tool::getSlot(data, i, pageSize).offset : info[DATA_OFFSET];
+        int num = 0;
+        memcpy(&num, data+pos-sizeof(int), sizeof(int));
+        return num;
+    }
+
+    bool Node::hasChild(char *data, int child, int pageSize) {
+        int info[TREE_NODE_SIZE];
+        getInfo(info, data, pageSize);
+        for(int i = 0; i <= info[SLOT_NUM]; i++){
+            if(childBefore(data, i, pageSize) == child)return true;
+        }
+        return false;
+    }
+
+    void Node::insertKey(char *data, keyEntry entry, Attribute &attr, int pageSize) {
         int* info = new int [TREE_NODE_SIZE];
-        getInfo(info, data);
+        getInfo(info, data, pageSize);
         int pos = 0, len = 0, i = 0;
-        Tool::search(data, attr, entry.key, pos, i, len);
+        Tool::search(data, attr, entry.key, pos, i, len, pageSize);
         if(i==-1)i=info[SLOT_NUM];
+        // Past equal separators (a key split over several leaves), up to the pointer of the child that split
+        while(i < info[SLOT_NUM] && Tool::compare(data+pos, entry.key, attr) == 0 && childBefore(data, i, pageSize) != entry.left){
+            i++;
+            pos = i < info[SLOT_NUM] ? Tool::getSlot(data, i, pageSize).offset : info[DATA_OFFSET];
+        }
         int attrLen = 4;
         if(attr.type==TypeVarChar){
             memcpy(&attrLen, entry.key, sizeof(int));
@@ -703,20 +1128,20 @@ namespace PeterDB {
         memcpy(data+pos+attrLen, &entry.right, sizeof(int));
 
         int num = info[SLOT_NUM]-i;
-        auto info_pos = data+PAGE_SIZE-info[INFO_OFFSET];
+        auto info_pos = data+pageSize-info[INFO_OFFSET];
         memmove(info_pos-Slot_Size, info_pos, Slot_Size*num);
-        Tool::writeSlot(data, pos, attrLen, 1, i);
+        Tool::writeSlot(data, pos, attrLen, 1, i, pageSize);
 
         Tool::updateInfo(info, info[SLOT_NUM]+1, info[DATA_OFFSET]+dis, info[INFO_OFFSET]+Slot_Size);
-        Tool::writeInfo(data, info);
-        Tool::updateSlot(data, info, dis, i + 1);
+        Tool::writeInfo(data, info, pageSize);
+        Tool::updateSlot(data, info, dis, i + 1, pageSize);
 
         delete [] info;
     }
 
-    void Leaf::getInfo(int *info, char *leafData) {
+    void Leaf::getInfo(int *info, char *leafData, int pageSize) {
         memset(info, 0, sizeof(int)*TREE_NODE_SIZE);
-        auto base = leafData+PAGE_SIZE;
+        auto base = leafData+pageSize;
         int offset = sizeof(int);
         for(int i=0;i<TREE_NODE_SIZE;i++){
             memcpy(&info[i], base-offset, sizeof(int));
@@ -724,8 +1149,8 @@ namespace PeterDB {
         }
     }
 
-    void Leaf::createLeaf(char *page, int parent, int pre, int next) {
-        memset(page, 0, PAGE_SIZE);
+    void Leaf::createLeaf(char *page, int parent, int pre, int next, int pageSize) {
+        memset(page, 0, pageSize);
         int* info = new int [TREE_NODE_SIZE];
         memset(info, 0, sizeof(int)*TREE_NODE_SIZE);
         info[INFO_OFFSET] = sizeof(int)*TREE_NODE_SIZE;
@@ -733,166 +1158,201 @@ namespace PeterDB {
         info[PRE] = pre;
         info[NODE_TYPE] = LEAF;
         info[NEXT] = next;
-        Tool::writeInfo(page, info);
+        Tool::writeInfo(page, info, pageSize);
         delete [] info;
     }
 
-    void Leaf::split(char *data, char *newData) {
-        int* info = new int [TREE_NODE_SIZE];
-        getInfo(info, data);
-        auto count = info[SLOT_NUM];
-        int d = count/2;
-        auto slot = Tool::getSlot(data, d-1);
+    // Bytes shared at the start of two strings
+    static int commonPrefix(const char *str1, int len1, const char *str2, int len2) {
+        int len = std::min(len1, len2), i = 0;
+        while(i < len && str1[i] == str2[i])i++;
+        return i;
+    }
 
-        int len = slot.offset+slot.len+sizeof(RID)*slot.rid_num;
-        auto dataLen = info[DATA_OFFSET]- len;
-        auto infoLen = Slot_Size*(count-d);
+    static int commonPrefix(const std::string &key1, const std::string &key2) {
+        return commonPrefix(key1.data() + sizeof(int), key1.size() - sizeof(int),
+                            key2.data() + sizeof(int), key2.size() - sizeof(int));
+    }
 
-        auto data_pivot = data+len;
-        auto info_pivot = data+PAGE_SIZE-info[INFO_OFFSET];
-        // Transfer data
-        memcpy(newData, data_pivot, dataLen);
-        memcpy(newData+PAGE_SIZE-sizeof(int)*TREE_NODE_SIZE-infoLen, info_pivot, infoLen);
-        // Update info
-        Tool::updateInfo(info, d, len, sizeof(int)*TREE_NODE_SIZE + Slot_Size*d);
-        Tool::writeInfo(data, info);
-        memset(data_pivot, 0, dataLen);
-        memset(info_pivot, 0, infoLen);
+    static int prefixLength(const char *data) {
+        int len = 0;
+        memcpy(&len, data, sizeof(int));
+        return len;
+    }
 
-        int* newInfo = new int [TREE_NODE_SIZE];
-        getInfo(newInfo, newData);
-        Tool::updateInfo(newInfo, count-d, dataLen, infoLen+sizeof(int)*TREE_NODE_SIZE);
+    // A dense leaf holds count keys, then the end of the RIDs of each key, then the RIDs
+    static unsigned short denseEnd(const char *data, int count, int i) {
+        unsigned short end = 0;
+        if(i >= 0)memcpy(&end, data + sizeof(int)*count + sizeof(short)*i, sizeof(short));
+        return end;
+    }
 
-        Tool::writeInfo(newData, newInfo);
-        Tool::updateSlot(newData, newInfo, -len, 0);
-        delete [] info;
-        delete [] newInfo;
+    static void setDenseEnd(char *data, int count, int i, unsigned short end) {
+        memcpy(data + sizeof(int)*count + sizeof(short)*i, &end, sizeof(short));
     }
 
-    void Leaf::print(char *data, const Attribute &attr, std::ostream &out) {
-        out<<"{\"keys\": [";
-        int* info = new int [TREE_NODE_SIZE];
-        getInfo(info, data);
-        int count = info[SLOT_NUM];
-        int strLength = 0;
-        char* key = new char [PAGE_SIZE];
-        char* stringKey = new char [PAGE_SIZE];
+    static char* denseRIDs(char *data, int count) {
+        return data + (sizeof(int) + sizeof(short))*count;
+    }
 
-        int intKey = 0;
-        float floatKey = 0;
+    // Add an entry to entries sorted by key
+    static void addEntry(const Attribute &attr, std::vector<LeafEntry> &entries, const char *key, const RID &rid) {
+        auto it = std::lower_bound(entries.begin(), entries.end(), key, [&attr](const LeafEntry &entry, const char *key) {
+            return Predicate::compare(attr.type, entry.key.data(), key) < 0;
+        });
+        if(it == entries.end() || Predicate::compare(attr.type, it->key.data(), key) != 0){
+            it = entries.insert(it, LeafEntry());
+            it->key.assign(key, keyLength(attr, key));
+        }
+        it->rids.push_back(rid);
+    }
 
+    void Leaf::split(char *data, char *newData, const Attribute &attr, keyEntry &entry, RID &rid, int pageSize) {
+        int usable = pageSize - sizeof(int)*TREE_NODE_SIZE;
+        std::vector<LeafEntry> entries;
+        decode(data, attr, entries, pageSize);
+        addEntry(attr, entries, entry.key, rid);
+        // Equal keys stay in one leaf, unless a single key fills it
+        if(entries.size() == 1){
+            entries.push_back(entries[0]);
+            size_t half = entries[0].rids.size() / 2;
+            entries[0].rids.resize(half);
+            entries[1].rids.erase(entries[1].rids.begin(), entries[1].rids.begin() + half);
+        }
+        // The most even cut that leaves both halves fitting in a page
+        size_t n = entries.size(), cut = n / 2;
+        std::vector<int> bytes(n + 1, 0);
+        for(size_t i = 0; i < n; i++)bytes[i + 1] = bytes[i] + entrySize(attr, entries[i]);
+        int best = INT_MAX;
+        for(size_t d = 1; d < n; d++){
+            int left = packedSize(attr, entries[0], entries[d - 1], d, bytes[d]);
+            int right = packedSize(attr, entries[d], entries[n - 1], n - d, bytes[n] - bytes[d]);
+            if(left > usable || right > usable)continue;
+            if(std::abs(left - right) < best){
+                best = std::abs(left - right);
+                cut = d;
+            }
+        }
+        pack(data, attr, entries, 0, cut, pageSize);
+        pack(newData, attr, entries, cut, n, pageSize);
+    }
 
-        for (int i = 0; i < count; i++){
-            auto slot = Tool::getSlot(data, i);
-            if(slot.rid_num==0)continue;
-            if(i!=0)out<<",";
-            memset(key, 0, PAGE_SIZE);
-            memcpy(key, data + slot.offset, slot.len);
+    void Leaf::print(char *data, const Attribute &attr, std::ostream &out, int pageSize) {
+        out<<"{\"keys\": [";
+        std::vector<LeafEntry> entries;
+        decode(data, attr, entries, pageSize);
+        int intKey = 0;
+        float floatKey = 0;
+        bool first = true;
 
+        for (auto &entry: entries){
+            if(entry.rids.empty())continue;
+            if(!first)out<<",";
+            first = false;
 
             out<< "\"";
             switch(attr.type){
                 case TypeVarChar:
-                    memcpy(&strLength, key, sizeof(int));
-                    memcpy(stringKey, key + sizeof(int), strLength);
-                    stringKey[strLength] = '\0';
-                    out<<( reinterpret_cast< char const* >(stringKey));
+                    out<<entry.key.substr(sizeof(int));
                     break;
                 case TypeInt:
-                    memcpy(&intKey, key, sizeof(int));
+                    memcpy(&intKey, entry.key.data(), sizeof(int));
                     out<<intKey;
                     break;
                 case TypeReal:
-                    memcpy(&floatKey, key, sizeof(int));
+                    memcpy(&floatKey, entry.key.data(), sizeof(int));
                     out<<floatKey;
                     break;
             }
-            RID rid;
             out<<":[";
-            for (int j = 0; j < slot.rid_num; ++j) {
-                memcpy(&rid, data+slot.offset+slot.len+Slot_Size*j, sizeof(RID));
-                out<<"("<<rid.pageNum<<","<<rid.slotNum<<")";
-                if(j!=slot.rid_num-1)out<<",";
+            for (size_t j = 0; j < entry.rids.size(); ++j) {
+                out<<"("<<entry.rids[j].pageNum<<","<<entry.rids[j].slotNum<<")";
+                if(j!=entry.rids.size()-1)out<<",";
             }
             out<<"]\"";
         }
-        delete [] key;
-        delete [] stringKey;
-        delete [] info;
         out<<"]}";
     }
 
-    bool Leaf::haveSpace(char *data, const Attribute &attr, const char *key) {
-        int* info = new int [TREE_NODE_SIZE];
-        getInfo(info, data);
-        auto empty = PAGE_SIZE - info[DATA_OFFSET] - info[INFO_OFFSET];
-        int space = 0;
-        switch (attr.type) {
-            case TypeInt:
-            case TypeReal:
-                space+=sizeof(int);
-                break;
-            case TypeVarChar:
-                int len = 0;
-                memcpy(&len, key, sizeof(int));
-                space+=len+sizeof(int);
-                break;
-        }
-        space += Slot_Size + sizeof(RID);   // + the size of an index
-        delete [] info;
+    bool Leaf::haveSpace(char *data, const Attribute &attr, const char *key, int pageSize) {
+        int info[TREE_NODE_SIZE];
+        getInfo(info, data, pageSize);
+        auto empty = pageSize - info[DATA_OFFSET] - info[INFO_OFFSET];
+        if(isDense(attr))return empty >= (int)(sizeof(int) + sizeof(short) + sizeof(RID));
+        if(info[SLOT_NUM] == 0)return true;
+        int len = keyLength(attr, key) - sizeof(int);
+        int prefix = prefixLength(data);
+        int shared = commonPrefix(data + sizeof(int), prefix, key + sizeof(int), len);
+        // A key outside the prefix makes every stored key longer
+        int space = len - shared + Slot_Size + sizeof(RID) + (prefix - shared)*info[SLOT_NUM];
         return empty>=space;
     }
 
-    void Leaf::insertEntry(char *leafData, const Attribute &attr, keyEntry &entry, RID &rid) {
-        int* info = new int [TREE_NODE_SIZE];
-        getInfo(info, leafData);
+    void Leaf::insertEntry(char *leafData, const Attribute &attr, keyEntry &entry, RID &rid, int pageSize) {
+        int info[TREE_NODE_SIZE];
+        getInfo(info, leafData, pageSize);
+        int count = info[SLOT_NUM];
 
-        int offset = 0;
-        int len = sizeof (int);
-        int left = 0;
-        int slot_len = 0;
-        if(attr.type==TypeVarChar){
-            memcpy(&len, entry.key, sizeof(int));
-            len+=sizeof(int);
-        }
-        int keyLen;
-        Tool::search(leafData, const_cast<Attribute &>(attr), entry.key, offset, left, keyLen);
-        slot_len = len;
-        // Insert an entry in the middle
-        if(offset!=info[DATA_OFFSET]) {
-            char* oldKey = new char [keyLen];
-            memset(oldKey,0, keyLen);
-            memcpy(oldKey, leafData+offset, keyLen);
-            float diff = Tool::compare(entry.key, oldKey, const_cast<Attribute &>(attr));
-            if(diff==0)Leaf::appendToKey(leafData, info, attr, left, rid);
-            else {
-                Tool::moveBack(leafData, offset, len + sizeof(RID), info[DATA_OFFSET] - offset);
-                int num = info[SLOT_NUM]-left;
-                auto info_pos = leafData+PAGE_SIZE-info[INFO_OFFSET];
-                memmove(info_pos-Slot_Size, info_pos, Slot_Size*num);
-                // Write data and slot
-                auto data_pos = leafData+offset;
-                memcpy(data_pos, entry.key, len);
-                memcpy(data_pos+len, &rid, sizeof(RID));
-                Tool::writeSlot(leafData, offset, len, 1, left);
-                // Update info and slot
-                Tool::updateInfo(info, info[SLOT_NUM]+1, info[DATA_OFFSET]+len+sizeof(RID), info[INFO_OFFSET]+Slot_Size);
-                Tool::writeInfo(leafData, info);
-                Tool::updateSlot(leafData, info, len + sizeof(RID), left + 1);
+        if(isDense(attr)){
+            int i = search(leafData, attr, entry.key, pageSize);
+            int total = denseEnd(leafData, count, count - 1);
+            if(i == count || compareKey(leafData, attr, i, entry.key, pageSize) != 0){
+                // Every array moves for the new key and its end, the last one first
+                int pos = denseEnd(leafData, count, i - 1);
+                char* rids = denseRIDs(leafData, count);
+                char* newRIDs = denseRIDs(leafData, count + 1);
+                memmove(newRIDs + sizeof(RID)*pos, rids + sizeof(RID)*pos, sizeof(RID)*(total - pos));
+                memmove(newRIDs, rids, sizeof(RID)*pos);
+                char* ends = leafData + sizeof(int)*count;
+                char* newEnds = leafData + sizeof(int)*(count + 1);
+                memmove(newEnds + sizeof(short)*(i + 1), ends + sizeof(short)*i, sizeof(short)*(count - i));
+                memmove(newEnds, ends, sizeof(short)*i);
+                memmove(leafData + sizeof(int)*(i + 1), leafData + sizeof(int)*i, sizeof(int)*(count - i));
+                memcpy(leafData + sizeof(int)*i, entry.key, sizeof(int));
+                count++;
+                setDenseEnd(leafData, count, i, pos);
             }
-            delete [] oldKey;
-            delete [] info;
+            // After the RIDs of an equal key, so that they stay in the order of insertion
+            int pos = denseEnd(leafData, count, i);
+            char* rids = denseRIDs(leafData, count);
+            memmove(rids + sizeof(RID)*(pos + 1), rids + sizeof(RID)*pos, sizeof(RID)*(total - pos));
+            memcpy(rids + sizeof(RID)*pos, &rid, sizeof(RID));
+            for(int j = i; j < count; j++)setDenseEnd(leafData, count, j, denseEnd(leafData, count, j) + 1);
+            Tool::updateInfo(info, count, (sizeof(int) + sizeof(short))*count + sizeof(RID)*(total + 1),
+                             info[INFO_OFFSET]);
+            Tool::writeInfo(leafData, info, pageSize);
             return;
         }
 
-        auto pos = leafData + offset;
-        memcpy(pos, entry.key, len);
-        memcpy(pos+len, &rid, sizeof(RID));
-        Tool::appendSlot(leafData, info, slot_len);
-
-        info[DATA_OFFSET] += len+sizeof(RID);
-        Tool::writeInfo(leafData, info);
-        delete [] info;
+        int len = keyLength(attr, entry.key);
+        int prefix = prefixLength(leafData);
+        if(count == 0 || commonPrefix(leafData + sizeof(int), prefix, entry.key + sizeof(int), len - sizeof(int)) < prefix){
+            // The first key sets the prefix, a key outside of it makes it shorter: the leaf is rebuilt
+            std::vector<LeafEntry> entries;
+            decode(leafData, attr, entries, pageSize);
+            addEntry(attr, entries, entry.key, rid);
+            pack(leafData, attr, entries, 0, entries.size(), pageSize);
+            return;
+        }
+        int i = search(leafData, attr, entry.key, pageSize);
+        if(i < count && compareKey(leafData, attr, i, entry.key, pageSize) == 0){
+            appendToKey(leafData, info, attr, i, rid, pageSize);
+            return;
+        }
+        // Insert an entry in the middle, or append it
+        int suffix = len - sizeof(int) - prefix;
+        int offset = i < count ? Tool::getSlot(leafData, i, pageSize).offset : info[DATA_OFFSET];
+        Tool::moveBack(leafData, offset, suffix + sizeof(RID), info[DATA_OFFSET] - offset);
+        auto info_pos = leafData+pageSize-info[INFO_OFFSET];
+        memmove(info_pos-Slot_Size, info_pos, Slot_Size*(count - i));
+        // Write data and slot
+        memcpy(leafData + offset, entry.key + sizeof(int) + prefix, suffix);
+        memcpy(leafData + offset + suffix, &rid, sizeof(RID));
+        Tool::writeSlot(leafData, offset, suffix, 1, i, pageSize);
+        // Update info and slot
+        Tool::updateInfo(info, count+1, info[DATA_OFFSET]+suffix+sizeof(RID), info[INFO_OFFSET]+Slot_Size);
+        Tool::writeInfo(leafData, info, pageSize);
+        Tool::updateSlot(leafData, info, suffix + sizeof(RID), i + 1, pageSize);
     }
 
     bool Leaf::equal(RID &rid, char *pos, int len) {
@@ -902,94 +1362,199 @@ namespace PeterDB {
         return true;
     }
 
-    RC Leaf::deleteEntry(char *leafData, const Attribute &attr, keyEntry &entry, RID &rid) {
-        int pos = 0, len = 0, i = 0;
-        Tool::search(leafData, const_cast<Attribute &>(attr), entry.key, pos, i, len);
-        float diff = Tool::compare(entry.key, leafData+pos, const_cast<Attribute &>(attr));
-        unsigned num = *(unsigned *)entry.key;
-        if(diff!=0){
-            std::cout<< "Key not found in this page ";
+    RC Leaf::deleteEntry(char *leafData, const Attribute &attr, keyEntry &entry, RID &rid, int pageSize) {
+        int info[TREE_NODE_SIZE];
+        getInfo(info, leafData, pageSize);
+        int count = info[SLOT_NUM];
+        int i = search(leafData, attr, entry.key, pageSize);
+        if(i == count || compareKey(leafData, attr, i, entry.key, pageSize) != 0){
+            return -1;
+        }
+        if(isDense(attr)){
+            // A key left without RIDs keeps its place, as a slot does
+            char* rids = denseRIDs(leafData, count);
+            int total = denseEnd(leafData, count, count - 1);
+            for(int j = denseEnd(leafData, count, i - 1); j < denseEnd(leafData, count, i); j++){
+                if(!equal(rid, rids + sizeof(RID)*j, 0))continue;
+                memmove(rids + sizeof(RID)*j, rids + sizeof(RID)*(j + 1), sizeof(RID)*(total - j - 1));
+                for(int k = i; k < count; k++)setDenseEnd(leafData, count, k, denseEnd(leafData, count, k) - 1);
+                info[DATA_OFFSET] -= sizeof(RID);
+                Tool::writeInfo(leafData, info, pageSize);
+                return 0;
+            }
             return -1;
         }
-        auto slot = Tool::getSlot(leafData, i);
-        auto off = pos+len-sizeof(RID);
-        RID r;
+        auto slot = Tool::getSlot(leafData, i, pageSize);
+        auto off = slot.offset+slot.len-sizeof(RID);
         bool found = false;
         for(int j = 0;j<slot.rid_num&&!found;j++){
             off+=sizeof (RID);
             found = equal(rid, leafData+off, 0);
         }
         if(!found){
-            std::cout<< "RID not found" << std::endl;
             return -1;
         }
-        int* info = new int [TREE_NODE_SIZE];
-        getInfo(info, leafData);
-
-        Tool::shiftEntry(leafData, i, off, sizeof(RID), info);
-        Tool::writeSlot(leafData, slot.offset, slot.len, slot.rid_num-1, i);
-        delete [] info;
+        Tool::shiftEntry(leafData, i, off, sizeof(RID), info, pageSize);
+        Tool::writeSlot(leafData, slot.offset, slot.len, slot.rid_num-1, i, pageSize);
         return 0;
     }
 
-    void Leaf::appendToKey(char *data, int* info, const Attribute &attr, int i, RID &rid) {
-        auto slot = Tool::getSlot(data, i);
+    void Leaf::appendToKey(char *data, int* info, const Attribute &attr, int i, RID &rid, int pageSize) {
+        auto slot = Tool::getSlot(data, i, pageSize);
         auto pos = slot.offset+slot.len+sizeof(RID)*slot.rid_num;
         Tool::moveBack(data, pos, sizeof(RID), info[DATA_OFFSET]-pos);
         memcpy(data+pos, &rid, sizeof(RID));
         info[DATA_OFFSET] += sizeof(RID);
-        Tool::writeInfo(data, info);
-        Tool::writeSlot(data, slot.offset, slot.len, slot.rid_num+1, i);
-        Tool::updateSlot(data, info, sizeof(RID), i+1);
+        Tool::writeInfo(data, info, pageSize);
+        Tool::writeSlot(data, slot.offset, slot.len, slot.rid_num+1, i, pageSize);
+        Tool::updateSlot(data, info, sizeof(RID), i+1, pageSize);
     }
 
-    void Tool::moveBack(char* data, int offset, int distance, int length){
-        memmove(data+offset+distance, data+offset, length);
+    bool Leaf::isDense(const Attribute &attr) {
+        return attr.type != TypeVarChar;
     }
 
-    float Tool::compare(char *key1, char *key2, Attribute &attr) {
-        switch (attr.type) {
-            case TypeInt:
-            {
-                int intVal1 = *(int*)key1;
-                int intVal2 = *(int*)key2;
-                return intVal1-intVal2;
-            }
-            case TypeReal:
-            {
-                float floatVal1 = *(float*)key1;
-                float floatVal2 = *(float*)key2;
-                if(fabs(floatVal1-floatVal2)<FLOAT_DIFF)return 0;
-                else return floatVal1-floatVal2;
-            }
-            case TypeVarChar:
-            {
-                int len1 = 0;
-                int len2 = 0;
+    int Leaf::getCount(char *data, int pageSize) {
+        int info[TREE_NODE_SIZE];
+        getInfo(info, data, pageSize);
+        return info[SLOT_NUM];
+    }
+
+    // Binary search on the keys as they are stored
+    int Leaf::search(char *data, const Attribute &attr, const char *key, int pageSize) {
+        int l = 0, r = getCount(data, pageSize);
+        while(l < r){
+            int mid = l + (r - l)/2;
+            if(compareKey(data, attr, mid, key, pageSize) < 0)l = mid + 1;
+            else r = mid;
+        }
+        return l;
+    }
+
+    int Leaf::compareKey(char *data, const Attribute &attr, int i, const char *key, int pageSize) {
+        if(isDense(attr))return Predicate::compare(attr.type, data + sizeof(int)*i, key);
+        int prefix = prefixLength(data);
+        auto slot = Tool::getSlot(data, i, pageSize);
+        int len = keyLength(attr, key) - sizeof(int);
+        const char* bytes = key + sizeof(int);
+        int cmp = memcmp(data + sizeof(int), bytes, std::min(prefix, len));
+        if(cmp != 0)return cmp;
+        if(len < prefix)return 1;
+        cmp = memcmp(data + slot.offset, bytes + prefix, std::min((int)slot.len, len - prefix));
+        if(cmp != 0)return cmp;
+        int total = prefix + slot.len;
+        return total < len ? -1 : total > len;
+    }
 
-                memcpy(&len1, key1, sizeof(int));
-                memcpy(&len2, key2, sizeof(int));
+    void Leaf::getKey(char *data, const Attribute &attr, int i, char *key, int pageSize) {
+        if(isDense(attr)){
+            memcpy(key, data + sizeof(int)*i, sizeof(int));
+            return;
+        }
+        int prefix = prefixLength(data);
+        auto slot = Tool::getSlot(data, i, pageSize);
+        int len = prefix + slot.len;
+        memcpy(key, &len, sizeof(int));
+        memcpy(key + sizeof(int), data + sizeof(int), prefix);
+        memcpy(key + sizeof(int) + prefix, data + slot.offset, slot.len);
+    }
 
-                char* val1 = new char [len1+1];
-                memset(val1, 0, len1+1);
-                char* val2 = new char [len2+1];
-                memset(val2, 0, len2+1);
+    // 0 past the last entry
+    int Leaf::getRIDNum(char *data, const Attribute &attr, int i, int pageSize) {
+        int count = getCount(data, pageSize);
+        if(i < 0 || i >= count)return 0;
+        if(isDense(attr))return denseEnd(data, count, i) - denseEnd(data, count, i - 1);
+        return Tool::getSlot(data, i, pageSize).rid_num;
+    }
 
-                memcpy(val1, key1+sizeof(int), len1);
-                memcpy(val2, key2+sizeof(int), len2);
+    void Leaf::getRID(char *data, const Attribute &attr, int i, int j, RID &rid, int pageSize) {
+        if(isDense(attr)){
+            int count = getCount(data, pageSize);
+            memcpy(&rid, denseRIDs(data, count) + sizeof(RID)*(denseEnd(data, count, i - 1) + j), sizeof(RID));
+            return;
+        }
+        auto slot = Tool::getSlot(data, i, pageSize);
+        memcpy(&rid, data + slot.offset + slot.len + sizeof(RID)*j, sizeof(RID));
+    }
 
-                auto res = strcmp(val1, val2);
-                delete [] val1;
-                delete [] val2;
-                return res;
+    void Leaf::decode(char *data, const Attribute &attr, std::vector<LeafEntry> &entries, int pageSize) {
+        int count = getCount(data, pageSize);
+        char* key = new char [PAGE_SIZE];
+        RID rid;
+        for(int i = 0; i < count; i++){
+            getKey(data, attr, i, key, pageSize);
+            entries.emplace_back();
+            entries.back().key.assign(key, keyLength(attr, key));
+            int num = getRIDNum(data, attr, i, pageSize);
+            for(int j = 0; j < num; j++){
+                getRID(data, attr, i, j, rid, pageSize);
+                entries.back().rids.push_back(rid);
             }
         }
-        return 0;
+        delete [] key;
+    }
+
+    void Leaf::pack(char *data, const Attribute &attr, const std::vector<LeafEntry> &entries, size_t begin,
+                    size_t end, int pageSize) {
+        int info[TREE_NODE_SIZE];
+        getInfo(info, data, pageSize);
+        memset(data, 0, pageSize - sizeof(int)*TREE_NODE_SIZE);
+        int count = 0;
+        if(isDense(attr)){
+            count = end - begin;
+            char* rids = denseRIDs(data, count);
+            int total = 0;
+            for(size_t i = begin; i < end; i++){
+                auto &entry = entries[i];
+                memcpy(data + sizeof(int)*(i - begin), entry.key.data(), sizeof(int));
+                memcpy(rids + sizeof(RID)*total, entry.rids.data(), sizeof(RID)*entry.rids.size());
+                total += entry.rids.size();
+                setDenseEnd(data, count, i - begin, total);
+            }
+            Tool::updateInfo(info, count, (sizeof(int) + sizeof(short))*count + sizeof(RID)*total,
+                             sizeof(int)*TREE_NODE_SIZE);
+            Tool::writeInfo(data, info, pageSize);
+            return;
+        }
+        // Entries are sorted, so the first and the last key share the prefix of all of them
+        int prefix = begin < end ? commonPrefix(entries[begin].key, entries[end - 1].key) : 0;
+        memcpy(data, &prefix, sizeof(int));
+        if(begin < end)memcpy(data + sizeof(int), entries[begin].key.data() + sizeof(int), prefix);
+        int offset = sizeof(int) + prefix;
+        for(size_t i = begin; i < end; i++, count++){
+            auto &entry = entries[i];
+            int len = entry.key.size() - sizeof(int) - prefix;
+            memcpy(data + offset, entry.key.data() + sizeof(int) + prefix, len);
+            memcpy(data + offset + len, entry.rids.data(), sizeof(RID)*entry.rids.size());
+            Tool::writeSlot(data, offset, len, entry.rids.size(), count, pageSize);
+            offset += len + sizeof(RID)*entry.rids.size();
+        }
+        Tool::updateInfo(info, count, offset, sizeof(int)*TREE_NODE_SIZE + Slot_Size*count);
+        Tool::writeInfo(data, info, pageSize);
+    }
+
+    int Leaf::entrySize(const Attribute &attr, const LeafEntry &entry) {
+        if(isDense(attr))return sizeof(int) + sizeof(short) + sizeof(RID)*entry.rids.size();
+        return entry.key.size() - sizeof(int) + Slot_Size + sizeof(RID)*entry.rids.size();
+    }
+
+    int Leaf::packedSize(const Attribute &attr, const LeafEntry &first, const LeafEntry &last, int count, int bytes) {
+        if(isDense(attr))return bytes;
+        int prefix = commonPrefix(first.key, last.key);
+        return bytes + sizeof(int) + prefix - prefix*count;
+    }
+
+    void Tool::moveBack(char* data, int offset, int distance, int length){
+        memmove(data+offset+distance, data+offset, length);
+    }
+
+    int Tool::compare(char *key1, char *key2, Attribute &attr) {
+        return Predicate::compare(attr.type, key1, key2);
     }
 
-    void Tool::appendSlot(char *data, int *info, short len) {
-        Slot slot = {static_cast<short>(info[DATA_OFFSET]), len, 1};
-        memcpy(data+PAGE_SIZE-info[INFO_OFFSET]-Slot_Size, &slot, Slot_Size);
+    void Tool::appendSlot(char *data, int *info, unsigned short len, int pageSize) {
+        Slot slot = {static_cast<unsigned short>(info[DATA_OFFSET]), len, 1};
+        memcpy(data+pageSize-info[INFO_OFFSET]-Slot_Size, &slot, Slot_Size);
         info[INFO_OFFSET] += Slot_Size;
         info[SLOT_NUM]++;
     }
@@ -1001,17 +1566,16 @@ namespace PeterDB {
     }
 
     // binary search to find the left border of the key
-    void Tool::search(char *data, Attribute &attr, char *key, int& pos, int& left, int& len) {
+    void Tool::search(char *data, Attribute &attr, char *key, int& pos, int& left, int& len, int pageSize) {
         int* info = new int [TREE_NODE_SIZE];
-        Node::getInfo(info, data);
+        Node::getInfo(info, data, pageSize);
 
         int l = 0, r = info[SLOT_NUM]-1, mid;
-        char* middle = new char [PAGE_SIZE];
         while(l<=r){
             mid = l+(r-l)/2;
-            auto slot = getSlot(data, mid);
-            getKey(data, slot.offset, slot.len, middle);
-            auto diff = compare(middle, key, attr);
+            auto slot = getSlot(data, mid, pageSize);
+            // The keys are compared in the page
+            auto diff = compare(data + slot.offset, key, attr);
             if(diff<0)l = mid+1;
             else r = mid-1;
         }
@@ -1019,19 +1583,17 @@ namespace PeterDB {
             pos = info[DATA_OFFSET];
             left = -1;
             delete [] info;
-            delete [] middle;
             return;
         }
-        auto slot = getSlot(data, l);
+        auto slot = getSlot(data, l, pageSize);
         pos = slot.offset;
         left = l;
         len = slot.len;
-        delete [] middle;
         delete [] info;
     }
 
-    Slot Tool::getSlot(char *page, int i){
-        auto base = page+PAGE_SIZE-sizeof(int)*TREE_NODE_SIZE;
+    Slot Tool::getSlot(char *page, int i, int pageSize){
+        auto base = page+pageSize-sizeof(int)*TREE_NODE_SIZE;
         auto addr = base - Slot_Size*(i+1);
 
         Slot slot;
@@ -1045,33 +1607,34 @@ namespace PeterDB {
         memcpy(key, data+pos, len);
     }
 
-    void Tool::writeSlot(char *data, short offset, short len, short rid_num, int i) {
+    void Tool::writeSlot(char *data, unsigned short offset, unsigned short len, unsigned short rid_num, int i,
+                         int pageSize) {
         Slot slot = {offset, len, rid_num};
-        auto addr = data+PAGE_SIZE-sizeof(int)*TREE_NODE_SIZE-Slot_Size*(i+1);
+        auto addr = data+pageSize-sizeof(int)*TREE_NODE_SIZE-Slot_Size*(i+1);
         memset(addr, 0, Slot_Size);
         memcpy(addr, &slot, Slot_Size);
     }
 
-    void Tool::updateSlot(char *data, int *info, int dis, int i) {
+    void Tool::updateSlot(char *data, int *info, int dis, int i, int pageSize) {
         for(;i<info[SLOT_NUM];i++){
-            auto slot = getSlot(data, i);
+            auto slot = getSlot(data, i, pageSize);
             slot.offset += dis;
-            writeSlot(data, slot.offset, slot.len, slot.rid_num, i);
+            writeSlot(data, slot.offset, slot.len, slot.rid_num, i, pageSize);
         }
     }
     // To compact the page. Used for deletion
-    void Tool::shiftEntry(char *data, int i, int pos, int len, int *info) {
+    void Tool::shiftEntry(char *data, int i, int pos, int len, int *info, int pageSize) {
         memset(data+pos, 0, len);
         memmove(data+pos, data+pos+len, info[DATA_OFFSET]-pos-len);
 
-        updateSlot(data, info, -len,  i+1);
+        updateSlot(data, info, -len,  i+1, pageSize);
         info[DATA_OFFSET] -= len;
         memset(data+info[DATA_OFFSET], 0, len);
-        writeInfo(data, info);
+        writeInfo(data, info, pageSize);
     }
 
-    void Tool::writeInfo(char* data, int* info){
-        auto base = data+PAGE_SIZE;
+    void Tool::writeInfo(char* data, int* info, int pageSize){
+        auto base = data+pageSize;
         int offset = sizeof(int);
         for(int i=0;i<TREE_NODE_SIZE;i++){
             memcpy(base-offset, &info[i], sizeof(int));
@@ -1079,53 +1642,15 @@ namespace PeterDB {
         }
     }
 
-    void Tool::buildNullBytes(std::vector<Attribute> attrs, char* tuple, int offset, char* nullIndicator){
-        for(int i = 0; i < attrs.size(); i++) {
-            uint8_t nullIndicatorBuffer = 0;
-            int byteOffset = (offset + i) / CHAR_BIT;
-            int bitOffset = (offset + i) % CHAR_BIT;
-            memcpy(&nullIndicatorBuffer, nullIndicator + byteOffset, sizeof(uint8_t));
-
-            if(Tool::isNull(i, tuple)) {
-                nullIndicatorBuffer = nullIndicatorBuffer >> (CHAR_BIT - bitOffset - 1);
-                nullIndicatorBuffer = nullIndicatorBuffer | 1;
-                nullIndicatorBuffer = nullIndicatorBuffer << (CHAR_BIT - bitOffset - 1);
-                memcpy(nullIndicator + byteOffset, &nullIndicatorBuffer, sizeof(uint8_t));
-            }
-            else {
-                nullIndicatorBuffer = nullIndicatorBuffer >> (CHAR_BIT - bitOffset);
-                nullIndicatorBuffer = nullIndicatorBuffer << (CHAR_BIT - bitOffset);
-                memcpy(nullIndicator + byteOffset, &nullIndicatorBuffer, sizeof(uint8_t));
-            }
-        }
-    }
-
-    void Tool::mergeTwoTuple(std::vector<Attribute> attr1, char *tuple1, int size1, std::vector<Attribute> attr2,
+    void Tool::mergeTwoTuple(const std::vector<Attribute> &attr1, char *tuple1, int size1, const std::vector<Attribute> &attr2,
                                 char *tuple2, int size2, void *data) {
-        int leftNullIndicatorSize = ceil(attr1.size() / 8.0);
-        int rightNullIndicatorSize = ceil(attr2.size() / 8.0);
-        int totalNullIndicatorSize = ceil((attr1.size() + attr2.size()) / 8.0);
-
-        char* nullIndicator = new char [totalNullIndicatorSize];
-        memset(nullIndicator, 0, totalNullIndicatorSize);
-
-        buildNullBytes(attr1, tuple1, 0, nullIndicator);
-        buildNullBytes(attr2, tuple2, attr1.size(), nullIndicator);
-
-        unsigned mergedTupleSize = totalNullIndicatorSize + size1 + size2-leftNullIndicatorSize-rightNullIndicatorSize;
-
-        unsigned offset = 0;
-        memset(data, 0, mergedTupleSize);
-
-        memcpy((char*)data + offset, nullIndicator, totalNullIndicatorSize);
-        offset += totalNullIndicatorSize;
-
-        memcpy((char*)data + offset, tuple1 + leftNullIndicatorSize, size1-leftNullIndicatorSize);
-        offset += size1-leftNullIndicatorSize;
-
-        memcpy((char*)data + offset, tuple2 + rightNullIndicatorSize, size2-rightNullIndicatorSize);
+        TupleBuilder builder;
+        builder.start(data, attr1.size() + attr2.size());
+        builder.addFields(tuple1, attr1.size(), size1);
+        builder.addFields(tuple2, attr2.size(), size2);
     }
 
+
     keyEntry::keyEntry(int left, char *key, int right) {
         this->left = left;
         this->key = key;
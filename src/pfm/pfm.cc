@@ -1,7 +1,19 @@
 #include <iostream>
 #include "src/include/pfm.h"
 #include <cstring>
+#include <algorithm>
+#include <map>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "errno.h"
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 namespace PeterDB {
     // Meyers' Singleton
@@ -10,8 +22,9 @@ namespace PeterDB {
         return _pf_manager;
     }
 
-    // default: Generated constructor which will do nothing
-    PagedFileManager::PagedFileManager() = default;
+    PagedFileManager::PagedFileManager() {
+        directIO = PF_DIRECT_IO;
+    }
 
     // destructor: will be invoked when the object is deleted
     PagedFileManager::~PagedFileManager() = default;
@@ -21,19 +34,30 @@ namespace PeterDB {
     // operator overloading: Prevent assignment
     PagedFileManager &PagedFileManager::operator=(const PagedFileManager &) = default;
 
-    RC PagedFileManager::createFile(const std::string &fileName) {
+    RC PagedFileManager::createFile(const std::string &fileName, unsigned pageSize) {
+        if(pageSize < PAGE_SIZE || pageSize > PF_MAX_PAGE_SIZE || (pageSize & (pageSize-1)) != 0){
+            std::cout << "Unsupported page size " << pageSize << std::endl;
+            return -1;
+        }
         FILE* file = fopen(fileName.c_str(), "r");
         if(!file){
+            // Records of an older file with the same name must not be replayed into this one
+            if(LogManager::instance().logReset(fileName) != 0)return -1;
             file = fopen(fileName.c_str(), "wb");
+            PageIO io;
             if(file){
+                fclose(file);
+            }
+            if(file && io.open(fileName, false) == 0){
                 //std::cout << "Create " << fileName << std::endl;
                 infoPage infoPage;
-                infoPage.flushInfoPage(file);
-                fclose(file);
-                return 0;
+                infoPage.info[PAGE_SIZE_NUM] = pageSize;
+                io.setPageSize(pageSize);
+                RC rc = infoPage.flushInfoPage(io);
+                io.close();
+                return rc;
             } else {
                 std::cout << "Error when creating the file" << std::endl;
-                fclose(file);
                 return -1;
             }
         }
@@ -51,13 +75,15 @@ namespace PeterDB {
             if(remove(fileName.c_str())!=0){
                 std::cout << "The deletion failed: " << fileName << std::endl;
             }
+            BufferPool::instance().dropFile(fileName);
+            LogManager::instance().logReset(fileName);
         }
         file.close();
         return 0;
     }
 
-    RC PagedFileManager::openFile(const std::string &fileName, FileHandle &fileHandle) {
-        return fileHandle.openFile(fileName);
+    RC PagedFileManager::openFile(const std::string &fileName, FileHandle &fileHandle, bool mapped) {
+        return fileHandle.openFile(fileName, mapped);
     }
 
     RC PagedFileManager::closeFile(FileHandle &fileHandle) {
@@ -66,15 +92,353 @@ namespace PeterDB {
         return fileHandle.closeFile();
     }
 
+    void PagedFileManager::setDirectIO(bool directIO) {
+        this->directIO = directIO;
+    }
+
+    bool PagedFileManager::getDirectIO() const {
+        return directIO;
+    }
+
+    PageIO::PageIO() {
+        fd = -1;
+        direct = false;
+        pageSize = PAGE_SIZE;
+        bounce = nullptr;
+        mapping = nullptr;
+        mappedPages = 0;
+    }
+
+    PageIO::~PageIO() {
+        close();
+        freePages(bounce);
+    }
+
+    PageIO::PageIO(const PageIO &) {
+        fd = -1;
+        direct = false;
+        pageSize = PAGE_SIZE;
+        bounce = nullptr;
+        mapping = nullptr;
+        mappedPages = 0;
+    }
+
+    PageIO &PageIO::operator=(const PageIO &) {
+        return *this;
+    }
+
+    RC PageIO::open(const std::string &fileName, bool direct) {
+        if(fd >= 0)return -1;
+        this->direct = false;
+#ifdef O_DIRECT
+        if(direct){
+            fd = ::open(fileName.c_str(), O_RDWR | O_DIRECT);
+            // EINVAL: the file system does not support direct I/O, fall back to the page cache
+            if(fd >= 0)this->direct = true;
+            else if(errno != EINVAL)return -1;
+        }
+#endif
+        if(fd < 0)fd = ::open(fileName.c_str(), O_RDWR);
+        if(fd < 0)return -1;
+        return 0;
+    }
+
+    RC PageIO::close() {
+        if(mapping != nullptr)munmap(mapping, mappedPages*pageSize);
+        mapping = nullptr;
+        mappedPages = 0;
+        if(fd < 0)return 0;
+        RC rc = ::close(fd) == 0 ? 0 : -1;
+        fd = -1;
+        direct = false;
+        pageSize = PAGE_SIZE;
+        freePages(bounce);
+        bounce = nullptr;
+        return rc;
+    }
+
+    bool PageIO::isOpen() const {
+        return fd >= 0;
+    }
+
+    bool PageIO::isDirect() const {
+        return direct;
+    }
+
+    int PageIO::getDescriptor() const {
+        return fd;
+    }
+
+    // The bounce page follows the page size, it is allocated on the first unaligned transfer
+    void PageIO::setPageSize(unsigned pageSize) {
+        if(pageSize == this->pageSize)return;
+        this->pageSize = pageSize;
+        freePages(bounce);
+        bounce = nullptr;
+    }
+
+    unsigned PageIO::getPageSize() const {
+        return pageSize;
+    }
+
+    // Retry short transfers and signals, a page is only read or written as a whole
+    RC PageIO::readPage(PageNum pageNum, void *data) {
+        char* target = (char*)data;
+        if(direct && (uintptr_t)data % PAGE_SIZE != 0){
+            if(bounce == nullptr)bounce = allocPages(pageSize);
+            if(bounce == nullptr)return -1;
+            target = bounce;
+        }
+        off_t offset = (off_t)pageNum*pageSize;
+        size_t done = 0;
+        while(done < pageSize){
+            ssize_t n = pread(fd, target+done, pageSize-done, offset+done);
+            if(n < 0 && errno == EINTR)continue;
+            if(n <= 0)return -1;
+            done += n;
+        }
+        if(target != data)memcpy(data, target, pageSize);
+        return 0;
+    }
+
+    RC PageIO::writePage(PageNum pageNum, const void *data) {
+        const char* source = (const char*)data;
+        if(direct && (uintptr_t)data % PAGE_SIZE != 0){
+            if(bounce == nullptr)bounce = allocPages(pageSize);
+            if(bounce == nullptr)return -1;
+            memcpy(bounce, data, pageSize);
+            source = bounce;
+        }
+        off_t offset = (off_t)pageNum*pageSize;
+        size_t done = 0;
+        while(done < pageSize){
+            ssize_t n = pwrite(fd, source+done, pageSize-done, offset+done);
+            if(n < 0 && errno == EINTR)continue;
+            if(n <= 0)return -1;
+            done += n;
+        }
+        return 0;
+    }
+
+    RC PageIO::sync() {
+        if(fd < 0 || fsync(fd) != 0)return -1;
+        return 0;
+    }
+
+    off_t PageIO::getSize() {
+        struct stat st{};
+        if(fd < 0 || fstat(fd, &st) != 0)return 0;
+        return st.st_size;
+    }
+
+    void PageIO::adviseSequential() {
+#ifdef POSIX_FADV_SEQUENTIAL
+        if(fd >= 0)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        if(mapping != nullptr){
+            madvise(mapping, mappedPages*pageSize, MADV_SEQUENTIAL);
+            madvise(mapping, mappedPages*pageSize, MADV_WILLNEED);
+        }
+    }
+
+    void PageIO::adviseRandom() {
+#ifdef POSIX_FADV_RANDOM
+        if(fd >= 0)posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+        if(mapping != nullptr)madvise(mapping, mappedPages*pageSize, MADV_RANDOM);
+    }
+
+    RC PageIO::map() {
+        if(fd < 0 || mapping != nullptr)return -1;
+        size_t pages = getSize() / pageSize;
+        if(pages == 0)return -1;
+        void* address = mmap(nullptr, pages*pageSize, PROT_READ, MAP_SHARED, fd, 0);
+        if(address == MAP_FAILED)return -1;
+        mapping = (char*)address;
+        mappedPages = pages;
+        return 0;
+    }
+
+    bool PageIO::isMapped() const {
+        return mapping != nullptr;
+    }
+
+    char* PageIO::getMappedPage(PageNum pageNum) {
+        if(mapping == nullptr || pageNum >= mappedPages)return nullptr;
+        return mapping + (size_t)pageNum*pageSize;
+    }
+
+    char* PageIO::allocPages(size_t size) {
+        void* pages = nullptr;
+        if(posix_memalign(&pages, PAGE_SIZE, size) != 0)return nullptr;
+        return (char*)pages;
+    }
+
+    void PageIO::freePages(char* pages) {
+        free(pages);
+    }
+
+    IORing::IORing() {
+        ringFd = -1;
+        entries = 0;
+        sqRing = nullptr;
+        sqRingSize = 0;
+        cqRing = nullptr;
+        cqRingSize = 0;
+        sqes = nullptr;
+        sqesSize = 0;
+#ifdef __NR_io_uring_setup
+        if(!PF_IO_URING)return;
+        io_uring_params params{};
+        int fd = (int)syscall(__NR_io_uring_setup, PF_IO_BATCH, &params);
+        if(fd < 0)return;
+        sqRingSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+        bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if(single)sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        void* sq = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        void* cq = single ? sq : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      fd, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries*sizeof(io_uring_sqe);
+        void* entriesMap = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if(sq == MAP_FAILED || cq == MAP_FAILED || entriesMap == MAP_FAILED){
+            if(sq != MAP_FAILED)munmap(sq, sqRingSize);
+            if(!single && cq != MAP_FAILED)munmap(cq, cqRingSize);
+            if(entriesMap != MAP_FAILED)munmap(entriesMap, sqesSize);
+            ::close(fd);
+            return;
+        }
+        ringFd = fd;
+        entries = params.sq_entries;
+        sqRing = (char*)sq;
+        cqRing = (char*)cq;
+        sqes = entriesMap;
+        sqTail = (unsigned*)(sqRing + params.sq_off.tail);
+        sqMask = (unsigned*)(sqRing + params.sq_off.ring_mask);
+        sqArray = (unsigned*)(sqRing + params.sq_off.array);
+        cqHead = (unsigned*)(cqRing + params.cq_off.head);
+        cqTail = (unsigned*)(cqRing + params.cq_off.tail);
+        cqMask = (unsigned*)(cqRing + params.cq_off.ring_mask);
+        cqes = cqRing + params.cq_off.cqes;
+#endif
+    }
+
+    IORing::~IORing() {
+        shutdown();
+    }
+
+    void IORing::shutdown() {
+        if(ringFd < 0)return;
+        munmap(sqes, sqesSize);
+        if(cqRing != sqRing)munmap(cqRing, cqRingSize);
+        munmap(sqRing, sqRingSize);
+        ::close(ringFd);
+        ringFd = -1;
+    }
+
+    IORing::IORing(const IORing &) : IORing() {}
+
+    IORing &IORing::operator=(const IORing &) {
+        return *this;
+    }
+
+    bool IORing::isAvailable() const {
+        return ringFd >= 0;
+    }
+
+    RC IORing::run(std::vector<PageRequest> &requests) {
+        for(unsigned start = 0; start < requests.size(); start += PF_IO_BATCH){
+            unsigned count = std::min<size_t>(PF_IO_BATCH, requests.size() - start);
+            runBatch(&requests[start], count);
+        }
+        RC rc = 0;
+        for(auto& request: requests){
+            if(request.rc != 0)rc = -1;
+        }
+        return rc;
+    }
+
+    // Requests the ring cannot take or that come back short are redone one by one through PageIO
+    void IORing::runBatch(PageRequest *requests, unsigned count) {
+        for(unsigned i = 0; i < count; i++){
+            requests[i].rc = 1;
+        }
+#ifdef __NR_io_uring_setup
+        std::vector<iovec> vectors(count);
+        unsigned tail = *sqTail, queued = 0;
+        for(unsigned i = 0; ringFd >= 0 && i < count && queued < entries; i++){
+            PageRequest& request = requests[i];
+            // Direct I/O needs an aligned buffer, PageIO has the bounce page for the others
+            if(request.io->isDirect() && (uintptr_t)request.data % PAGE_SIZE != 0)continue;
+            vectors[i].iov_base = request.data;
+            vectors[i].iov_len = request.io->getPageSize();
+            unsigned index = tail & *sqMask;
+            auto* entry = (io_uring_sqe*)sqes + index;
+            memset(entry, 0, sizeof(io_uring_sqe));
+            entry->opcode = request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+            entry->fd = request.io->getDescriptor();
+            entry->addr = (unsigned long long)&vectors[i];
+            entry->len = 1;
+            entry->off = (unsigned long long)request.pageNum*request.io->getPageSize();
+            entry->user_data = i;
+            sqArray[index] = index;
+            tail++;
+            queued++;
+        }
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+        unsigned submitted = 0, completed = 0;
+        while(completed < queued){
+            int n = (int)syscall(__NR_io_uring_enter, ringFd, queued - submitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if(n < 0){
+                if(errno == EINTR)continue;
+                if(submitted < queued){
+                    // Take back what the kernel has not taken, then only wait for what is in flight
+                    __atomic_store_n(sqTail, tail - (queued - submitted), __ATOMIC_RELEASE);
+                    queued = submitted;
+                    continue;
+                }
+                // Even waiting fails: completions can no longer be matched, stop using the ring
+                shutdown();
+                break;
+            }
+            submitted += n;
+            unsigned head = *cqHead;
+            unsigned cqTailNow = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            for(; head != cqTailNow; head++){
+                auto* done = (io_uring_cqe*)cqes + (head & *cqMask);
+                PageRequest& request = requests[done->user_data];
+                request.rc = done->res == (int)request.io->getPageSize() ? 0 : 1;
+                completed++;
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        }
+#endif
+        for(unsigned i = 0; i < count; i++){
+            PageRequest& request = requests[i];
+            if(request.rc == 0)continue;
+            request.rc = request.write ? request.io->writePage(request.pageNum, request.data)
+                                       : request.io->readPage(request.pageNum, request.data);
+        }
+    }
+
     FileHandle::FileHandle() {
         readPageCounter = 0;
         writePageCounter = 0;
         appendPageCounter = 0;
-        file = nullptr;
+        hitPageCounter = 0;
+        missPageCounter = 0;
+        fileID = 0;
+        fileState = nullptr;
+        pageSize = PAGE_SIZE;
+        logged = true;
         pageData = new char [PAGE_SIZE];
+        // Construct the pool first so that it outlives every handle, static ones included
+        BufferPool::instance();
     }
 
     FileHandle::~FileHandle() {
+        // Dirty frames may point to this handle, write them back before it goes away
+        closeFile();
         delete [] pageData;
     };
 
@@ -84,79 +448,351 @@ namespace PeterDB {
 
     // void pointer(void *data) which can be assigned to the point of any type
     RC FileHandle::readPage(PageNum pageNum, void *data) {
-        if(pageNum < infoPage.info[ACTIVE_PAGE_NUM]) {
-            // Offset the information page
-            fseek(file, (pageNum+1)*PAGE_SIZE, SEEK_SET);
-            fread(data, PAGE_SIZE, 1, file);
+        if(pageNum < getNumberOfPages()) {
+            BufferPool& pool = BufferPool::instance();
+            bool hit = false;
+            PageNum physicalPage = getPhysicalPage(pageNum);
+            char* mapped = io.getMappedPage(physicalPage);
+            if(mapped != nullptr){
+                memcpy(data, mapped, pageSize);
+                infoPage.info[READ_NUM]++;
+                return 0;
+            }
+            char* frame = pool.pinPage(*this, physicalPage, true, hit);
+            if(frame == nullptr){
+                // Every frame is pinned, fall back to the disk
+                if(readFromDisk(physicalPage, data) != 0)return -1;
+            } else {
+                memcpy(data, frame, pageSize);
+                pool.unpinPage(*this, physicalPage, false);
+            }
+            hit ? hitPageCounter++ : missPageCounter++;
             infoPage.info[READ_NUM]++;
+            infoPage.dirty = true;
             return 0;
         }
         return -1;
     }
 
     RC FileHandle::writePage(PageNum pageNum, const void *data) {
-        if(pageNum < infoPage.info[ACTIVE_PAGE_NUM]){
-            fseek(file, (pageNum+1)*PAGE_SIZE, SEEK_SET);
-            fwrite(data, PAGE_SIZE, 1, file);
+        if(io.isMapped())return -1;
+        if(pageNum < getNumberOfPages()){
+            BufferPool& pool = BufferPool::instance();
+            bool hit = false;
+            PageNum physicalPage = getPhysicalPage(pageNum);
+            LogManager& log = LogManager::instance();
+            // The old content goes to the log with the new one
+            char* frame = pool.pinPage(*this, physicalPage, true, hit);
+            if(frame == nullptr){
+                char* old = new char [pageSize];
+                RC rc = readFromDisk(physicalPage, old);
+                LSN lsn = rc == 0 ? log.logPage(*this, physicalPage, 0, pageSize, old, (const char*)data) : 0;
+                delete [] old;
+                if(rc != 0 || log.flush(lsn) != 0 || writeToDisk(physicalPage, data) != 0)return -1;
+            } else {
+                LSN lsn = log.logPage(*this, physicalPage, 0, pageSize, frame, (const char*)data);
+                memcpy(frame, data, pageSize);
+                pool.unpinPage(*this, physicalPage, true, lsn);
+            }
             infoPage.info[WRITE_NUM]++;
-            infoPage.flushInfoPage(file);
+            infoPage.dirty = true;
             return 0;
         }
         return -1;
     }
 
+    // The frame stays valid until unpinPage, writes through any handle of the file show up in it
+    char* FileHandle::pinPage(PageNum pageNum) {
+        if(pageNum >= getNumberOfPages())return nullptr;
+        char* mapped = getMappedPage(pageNum);
+        if(mapped != nullptr)return mapped;
+        bool hit = false;
+        char* frame = BufferPool::instance().pinPage(*this, getPhysicalPage(pageNum), true, hit);
+        if(frame == nullptr)return nullptr;
+        hit ? hitPageCounter++ : missPageCounter++;
+        infoPage.info[READ_NUM]++;
+        infoPage.dirty = true;
+        return frame;
+    }
+
+    // Nothing to give back, the mapping lives as long as the handle
+    char* FileHandle::getMappedPage(PageNum pageNum) {
+        if(pageNum >= getNumberOfPages())return nullptr;
+        char* mapped = io.getMappedPage(getPhysicalPage(pageNum));
+        if(mapped != nullptr)infoPage.info[READ_NUM]++;
+        return mapped;
+    }
+
+    // Mapped files rely on the kernel's readahead instead
+    void FileHandle::prefetch(PageNum pageNum, unsigned count) {
+        if(!handlingFile() || io.isMapped())return;
+        BufferPool& pool = BufferPool::instance();
+        unsigned pageCount = getNumberOfPages();
+        for(PageNum i = pageNum; i < pageNum + count && i < pageCount; i++){
+            if(pool.prefetch(*this, getPhysicalPage(i)) != 0)break;
+        }
+    }
+
+    RC FileHandle::unpinPage(PageNum pageNum) {
+        // Pages appended after the file was mapped come from the pool
+        if(io.getMappedPage(getPhysicalPage(pageNum)) != nullptr)return 0;
+        return BufferPool::instance().unpinPage(*this, getPhysicalPage(pageNum), false);
+    }
+
     RC FileHandle::appendPage(const void *data) {
-        fseek(file, 0, SEEK_END);
-        fwrite(data, PAGE_SIZE, 1, file);
+        if(io.isMapped())return -1;
+        PageNum pageNum = getNumberOfPages();
+        // The first page of a group brings the space map page of the group, where every page starts as full
+        if(pageNum % pageSize == 0){
+            char* spacePage = new char [pageSize];
+            memset(spacePage, 0, pageSize);
+            RC rc = writeToDisk(getSpaceMapPage(pageNum), spacePage);
+            delete [] spacePage;
+            if(rc != 0)return -1;
+        }
+        // Appends go straight to the disk so the file always covers every active page.
+        // They do not wait for the log: a page whose record is lost belongs to a change that never committed,
+        // and callers only fill new pages through logged writes or link them through logged writes.
+        PageNum physicalPage = getPhysicalPage(pageNum);
+        LogManager::instance().logAppend(*this, physicalPage, (const char*)data);
+        if(writeToDisk(physicalPage, data) != 0)return -1;
         infoPage.info[ACTIVE_PAGE_NUM]++;
         infoPage.info[APPEND_NUM]++;
-        infoPage.flushInfoPage(file);
+        infoPage.dirty = true;
+        fileState->pageCount = infoPage.info[ACTIVE_PAGE_NUM];
+        if(spaceMap.loaded)spaceMap.resize(infoPage.info[ACTIVE_PAGE_NUM]);
+
+        // A new page is usually written again right away, keep a clean copy
+        BufferPool& pool = BufferPool::instance();
+        bool hit = false;
+        char* frame = pool.pinPage(*this, physicalPage, false, hit);
+        if(frame != nullptr){
+            memcpy(frame, data, pageSize);
+            pool.unpinPage(*this, physicalPage, false);
+        }
+        return 0;
+    }
+
+    RC FileHandle::readFromDisk(PageNum pageNum, void *data) {
+        return io.readPage(pageNum, data);
+    }
+
+    RC FileHandle::writeToDisk(PageNum pageNum, const void *data) {
+        return io.writePage(pageNum, data);
+    }
+
+    /*
+     * Layout: [header] [space map 0] [data 0 .. pageSize-1] [space map 1] [data ...] ...
+     */
+    PageNum FileHandle::getPhysicalPage(PageNum pageNum) const {
+        return getSpaceMapPage(pageNum) + 1 + pageNum % pageSize;
+    }
+
+    PageNum FileHandle::getSpaceMapPage(PageNum pageNum) const {
+        return 1 + pageNum / pageSize * (pageSize + 1);
+    }
+
+    RC FileHandle::loadSpaceMap() {
+        unsigned pageCount = getNumberOfPages();
+        spaceMap.clear();
+        spaceMap.resize(pageCount);
+        BufferPool& pool = BufferPool::instance();
+        char* data = new char [pageSize];
+        for(PageNum start = 0; start < pageCount; start += pageSize){
+            PageNum physicalPage = getSpaceMapPage(start);
+            bool hit = false;
+            char* frame = pool.pinPage(*this, physicalPage, true, hit);
+            if(frame == nullptr){
+                if(readFromDisk(physicalPage, data) != 0){
+                    delete [] data;
+                    return -1;
+                }
+            } else {
+                memcpy(data, frame, pageSize);
+                pool.unpinPage(*this, physicalPage, false);
+            }
+            for(PageNum i = start; i < pageCount && i < start+pageSize; i++){
+                spaceMap.set(i, data[i % pageSize]);
+            }
+        }
+        delete [] data;
+        spaceMap.loaded = true;
         return 0;
     }
 
+    RC FileHandle::setPageSpace(PageNum pageNum, unsigned freeSpace) {
+        if(io.isMapped() || pageNum >= getNumberOfPages())return -1;
+        if(!spaceMap.loaded && loadSpaceMap() != 0)return -1;
+        unsigned char value = std::min(freeSpace / (pageSize / SPACE_MAP_LEVELS), SPACE_MAP_LEVELS - 1u);
+        if(pageNum >= spaceMap.pageCount)spaceMap.resize(infoPage.info[ACTIVE_PAGE_NUM]);
+        if(spaceMap.get(pageNum) == value)return 0;
+        spaceMap.set(pageNum, value);
+
+        // Only touch the byte of this page, other handles of the file share the frame
+        BufferPool& pool = BufferPool::instance();
+        bool hit = false;
+        PageNum physicalPage = getSpaceMapPage(pageNum);
+        LogManager& log = LogManager::instance();
+        unsigned offset = pageNum % pageSize;
+        char* frame = pool.pinPage(*this, physicalPage, true, hit);
+        if(frame != nullptr){
+            LSN lsn = log.logPage(*this, physicalPage, offset, 1, frame+offset, (const char*)&value);
+            frame[offset] = (char)value;
+            pool.unpinPage(*this, physicalPage, true, lsn);
+            return 0;
+        }
+        // Every frame is pinned, rewrite the page on the disk
+        char* data = new char [pageSize];
+        RC rc = -1;
+        if(io.readPage(physicalPage, data) == 0 &&
+           log.flush(log.logPage(*this, physicalPage, offset, 1, data+offset, (const char*)&value)) == 0){
+            data[offset] = (char)value;
+            rc = io.writePage(physicalPage, data);
+        }
+        delete [] data;
+        return rc;
+    }
+
+    int FileHandle::findPageWithSpace(unsigned size, PageNum hint) {
+        unsigned unit = pageSize / SPACE_MAP_LEVELS;
+        unsigned need = (size + unit - 1) / unit;
+        if(need == 0)need = 1;
+        if(need > SPACE_MAP_LEVELS - 1)return -1;
+        if(!spaceMap.loaded && loadSpaceMap() != 0)return -1;
+        if(hint < spaceMap.pageCount && spaceMap.get(hint) >= need)return hint;
+        return spaceMap.find(need);
+    }
+
+    // Catch up with pages appended through other handles of the same file
     unsigned FileHandle::getNumberOfPages() {
-        infoPage.flushInfoPage(file);
+        if(fileState != nullptr && fileState->pageCount > infoPage.info[ACTIVE_PAGE_NUM]){
+            infoPage.info[ACTIVE_PAGE_NUM] = fileState->pageCount;
+            infoPage.dirty = true;
+        }
         return infoPage.info[ACTIVE_PAGE_NUM];
     }
 
     RC FileHandle::collectCounterValues(unsigned &readPageCount, unsigned &writePageCount, unsigned &appendPageCount) {
-        infoPage.flushInfoPage(file);
         readPageCount = infoPage.info[READ_NUM];
         writePageCount = infoPage.info[WRITE_NUM];
         appendPageCount = infoPage.info[APPEND_NUM];
         return 0;
     }
 
-    RC FileHandle::openFile(const std::string& fileName) {
+    RC FileHandle::collectBufferCounterValues(unsigned &hitPageCount, unsigned &missPageCount) {
+        hitPageCount = hitPageCounter;
+        missPageCount = missPageCounter;
+        return 0;
+    }
+
+    RC FileHandle::openFile(const std::string& fileName, bool mapped) {
         if(handlingFile()){
             std::cout << "This FileHandle is handling another file." << std::endl;
             return -1;
         }
-        file = fopen(fileName.c_str(), "r+b");
+        // A log left by a crash is replayed before any file is read
+        LogManager::instance().recover();
+        io.open(fileName, !mapped && PagedFileManager::instance().getDirectIO());
         if(!handlingFile()){
 //            std::cout << "Error cannot open the file " << fileName << " " << errno << std::endl;
             return -1;
         } else {
 //            infoPage = new class infoPage();
-            infoPage.readInfoPage(file);
+            if(infoPage.readInfoPage(io) != 0){
+                io.close();
+                return -1;
+            }
+            pageSize = infoPage.info[PAGE_SIZE_NUM] == 0 ? PAGE_SIZE : infoPage.info[PAGE_SIZE_NUM];
+            io.setPageSize(pageSize);
+            delete [] pageData;
+            pageData = new char [pageSize];
+            // Appended pages reach the disk before the header and recovery may cut them off, trust the file
+            PageNum pageCount = getPageCountOnDisk();
+            if(pageCount != infoPage.info[ACTIVE_PAGE_NUM]){
+                infoPage.info[ACTIVE_PAGE_NUM] = pageCount;
+                infoPage.dirty = true;
+            }
+            spaceMap.clear();
+            this->fileName = fileName;
+            fileState = BufferPool::instance().openFile(*this);
+            fileID = fileState->id;
+            if(fileState->pageCount < infoPage.info[ACTIVE_PAGE_NUM])fileState->pageCount = infoPage.info[ACTIVE_PAGE_NUM];
+            // The mapping starts from what the other handles of the file have written so far
+            if(mapped && (flushPages() != 0 || io.map() != 0)){
+                closeFile();
+                return -1;
+            }
         }
         return 0;
     }
 
     RC FileHandle::closeFile(){
-        if(file != NULL){
-            infoPage.flushInfoPage(file);
-            fclose(file);
-            file = nullptr;
+        if(handlingFile()){
+            BufferPool& pool = BufferPool::instance();
+            flushPages();
+            getNumberOfPages();
+            // A mapped handle leaves the header alone, its reads are not persisted
+            if(infoPage.dirty && !io.isMapped())infoPage.flushInfoPage(io);
+            pool.closeFile(*this);
+            io.close();
+            fileState = nullptr;
+            spaceMap.clear();
+            pageSize = PAGE_SIZE;
+            logged = true;
         }
         return 0;
     }
 
+    RC FileHandle::sync() {
+        if(!handlingFile())return -1;
+        if(flushPages() != 0)return -1;
+        if(io.sync() != 0)return -1;
+        if(!infoPage.dirty || io.isMapped())return 0;
+        if(infoPage.flushInfoPage(io) != 0 || io.sync() != 0)return -1;
+        return 0;
+    }
+
+    // Data pages first, so that a header on the disk never counts pages that are not there
+    RC FileHandle::flushPages() {
+        return BufferPool::instance().flushFile(*this);
+    }
+
+    // Number of data pages the file can hold, skipping the header and the space map pages
+    PageNum FileHandle::getPageCountOnDisk() {
+        off_t size = io.getSize();
+        if(size <= pageSize)return 0;
+        PageNum physicalPages = size / pageSize - 1;
+        PageNum groups = (physicalPages + pageSize) / (pageSize + 1);
+        return physicalPages - groups;
+    }
+
     bool FileHandle::handlingFile() {
-        if(file != nullptr){
-            return true;
-        }
-        return false;
+        return io.isOpen();
+    }
+
+    bool FileHandle::isMapped() const {
+        return io.isMapped();
+    }
+
+    unsigned FileHandle::getPageSize() const {
+        return pageSize;
+    }
+
+    unsigned FileHandle::getDropCount() const {
+        return fileState == nullptr ? 0 : fileState->drops;
+    }
+
+    void FileHandle::adviseSequential(bool sequential) {
+        if(sequential)io.adviseSequential();
+        else io.adviseRandom();
+    }
+
+    void FileHandle::setLogged(bool logged) {
+        this->logged = logged;
+    }
+
+    bool FileHandle::isLogged() const {
+        return logged;
     }
 
     infoPage::infoPage() {
@@ -164,13 +800,15 @@ namespace PeterDB {
         for (int i = 0; i < INFO_NUM; ++i) {
             info[i] = 0;
         }
+        dirty = false;
     }
 
-    void infoPage::readInfoPage(FILE* file) {
-        char* data = new char [sizeof(unsigned)*INFO_NUM];
-        memset(data, 0, sizeof(unsigned)*INFO_NUM);
-        fseek(file, 0, SEEK_SET);
-        fread(data, sizeof(unsigned)*INFO_NUM, 1, file);
+    RC infoPage::readInfoPage(PageIO &io) {
+        char* data = new char [PAGE_SIZE];
+        if(io.readPage(0, data) != 0){
+            delete [] data;
+            return -1;
+        }
         auto* value = (unsigned*)data;
         short offset = 0;
         info[READ_NUM] = *(unsigned *)(data+offset);
@@ -180,16 +818,929 @@ namespace PeterDB {
         info[APPEND_NUM] = *(unsigned *)(data+offset);
         offset+=sizeof (unsigned);
         info[ACTIVE_PAGE_NUM] = *(unsigned *)(data+offset);
+        offset+=sizeof (unsigned);
+        info[PAGE_SIZE_NUM] = *(unsigned *)(data+offset);
         delete [] value;
+        dirty = false;
+        return 0;
     }
 
-    void infoPage::flushInfoPage(FILE *file) {
-        fseek(file, 0, SEEK_SET);
-        fwrite(info, PAGE_SIZE, 1, file);
+    RC infoPage::flushInfoPage(PageIO &io) {
+        char* data = new char [io.getPageSize()];
+        memset(data, 0, io.getPageSize());
+        memcpy(data, info, sizeof(unsigned)*INFO_NUM);
+        RC rc = io.writePage(0, data);
+        delete [] data;
+        if(rc != 0)return -1;
+        dirty = false;
+        return 0;
     }
 
     infoPage::~infoPage() {
         delete [] info;
     };
+
+    SpaceMap::SpaceMap() {
+        clear();
+    }
+
+    void SpaceMap::clear() {
+        tree.assign(2, 0);
+        leafCount = 1;
+        pageCount = 0;
+        loaded = false;
+    }
+
+    void SpaceMap::resize(unsigned pageCount) {
+        if(pageCount > leafCount){
+            unsigned newLeafCount = leafCount;
+            while(newLeafCount < pageCount)newLeafCount *= 2;
+            std::vector<unsigned char> newTree(2*newLeafCount, 0);
+            std::copy(tree.begin()+leafCount, tree.begin()+leafCount+this->pageCount, newTree.begin()+newLeafCount);
+            for(unsigned i = newLeafCount-1; i > 0; i--){
+                newTree[i] = std::max(newTree[2*i], newTree[2*i+1]);
+            }
+            tree.swap(newTree);
+            leafCount = newLeafCount;
+        }
+        if(pageCount > this->pageCount)this->pageCount = pageCount;
+    }
+
+    void SpaceMap::set(PageNum pageNum, unsigned char value) {
+        unsigned pos = leafCount + pageNum;
+        tree[pos] = value;
+        for(pos /= 2; pos > 0; pos /= 2){
+            tree[pos] = std::max(tree[2*pos], tree[2*pos+1]);
+        }
+    }
+
+    unsigned char SpaceMap::get(PageNum pageNum) const {
+        return tree[leafCount + pageNum];
+    }
+
+    int SpaceMap::find(unsigned char value) const {
+        if(tree[1] < value)return -1;
+        unsigned pos = 1;
+        while(pos < leafCount){
+            pos = tree[2*pos] >= value ? 2*pos : 2*pos+1;
+        }
+        return pos - leafCount;
+    }
+
+    BufferPool &BufferPool::instance() {
+        static BufferPool _buffer_pool = BufferPool();
+        return _buffer_pool;
+    }
+
+    Prefetcher::Prefetcher() {
+        stopping = false;
+    }
+
+    // Requests still queued are read first, their frames are gone only after the pool waited for them
+    Prefetcher::~Prefetcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(auto& worker: workers){
+            worker.join();
+        }
+    }
+
+    void Prefetcher::submit(unsigned frame, PageIO &io, PageNum pageNum, char *data) {
+        std::lock_guard<std::mutex> lock(mutex);
+        while(workers.size() < PF_PREFETCH_THREADS){
+            workers.emplace_back(&Prefetcher::work, this);
+        }
+        queue.push_back(Request{frame, &io, pageNum, data});
+        wake.notify_one();
+    }
+
+    bool Prefetcher::poll(unsigned frame, bool wait, bool &ok) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = finished.find(frame);
+        while(wait && it == finished.end()){
+            completed.wait(lock);
+            it = finished.find(frame);
+        }
+        if(it == finished.end())return false;
+        ok = it->second;
+        finished.erase(it);
+        return true;
+    }
+
+    // Every worker takes what is queued, up to a batch, and reads it through its own ring
+    void Prefetcher::work() {
+        IORing ring;
+        std::vector<unsigned> batchFrames;
+        std::vector<PageRequest> batch;
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true){
+            wake.wait(lock, [this]{ return stopping || !queue.empty(); });
+            if(queue.empty())return;
+            batchFrames.clear();
+            batch.clear();
+            while(!queue.empty() && batch.size() < PF_IO_BATCH){
+                Request& request = queue.front();
+                batchFrames.push_back(request.frame);
+                batch.push_back(PageRequest{request.io, request.pageNum, request.data, false, 0});
+                queue.pop_front();
+            }
+            lock.unlock();
+            ring.run(batch);
+            lock.lock();
+            for(unsigned i = 0; i < batch.size(); i++){
+                finished[batchFrames[i]] = batch[i].rc == 0;
+            }
+            completed.notify_all();
+        }
+    }
+
+    BufferPool::BufferPool() {
+        clockHand = 0;
+        nextFileID = 0;
+        hitCounter = 0;
+        missCounter = 0;
+        evictCounter = 0;
+        prefetching = 0;
+        setFrameCount(BUFFER_POOL_FRAMES);
+        // Dirty pages are written back through the log, construct it first so that it outlives the pool
+        LogManager::instance();
+    }
+
+    // Every handle flushes its file when it is closed, nothing is dirty by now
+    BufferPool::~BufferPool() {
+        for(auto& frame: frames){
+            if(frame.valid && frame.loading)settle(&frame - &frames[0], true);
+        }
+        for(auto data: frameData){
+            PageIO::freePages(data);
+        }
+    }
+
+    BufferPool::BufferPool(const BufferPool &) : BufferPool() {}
+
+    BufferPool &BufferPool::operator=(const BufferPool &) {
+        return *this;
+    }
+
+    RC BufferPool::setFrameCount(unsigned frameCount) {
+        if(frameCount == 0)return -1;
+        for(auto& frame: frames){
+            if(frame.valid && frame.loading)settle(&frame - &frames[0], true);
+        }
+        for(auto& frame: frames){
+            if(frame.valid && frame.pinCount > 0)return -1;
+        }
+        std::vector<unsigned> positions;
+        for(auto& frame: frames){
+            if(frame.valid && frame.dirty)positions.push_back(&frame - &frames[0]);
+        }
+        if(writeBack(positions) != 0)return -1;
+        for(auto data: frameData){
+            PageIO::freePages(data);
+        }
+        frameData.assign(frameCount, nullptr);
+        frameSize.assign(frameCount, 0);
+        frames.assign(frameCount, Frame{0, 0, nullptr, 0, false, false, false, 0, false});
+        pageTable.clear();
+        clockHand = 0;
+        return 0;
+    }
+
+    unsigned BufferPool::getFrameCount() const {
+        return frames.size();
+    }
+
+    unsigned long long BufferPool::getKey(FileID fileID, PageNum pageNum) {
+        return ((unsigned long long)fileID << 32) | pageNum;
+    }
+
+    char* BufferPool::pinPage(FileHandle &fileHandle, PageNum pageNum, bool load, bool &hit) {
+        auto key = getKey(fileHandle.fileID, pageNum);
+        auto it = pageTable.find(key);
+        if(it != pageTable.end() && frames[it->second].loading){
+            // A failed prefetch leaves the page to be read again below
+            settle(it->second, true);
+            it = pageTable.find(key);
+        }
+        if(it != pageTable.end()){
+            Frame& frame = frames[it->second];
+            frame.pinCount++;
+            frame.reference = true;
+            hit = true;
+            if(load)hitCounter++;
+            return frameData[it->second];
+        }
+        hit = false;
+        if(load)missCounter++;
+        int victim = getVictim();
+        if(victim == -1)return nullptr;
+
+        char* data = getFrameData(victim, fileHandle.getPageSize());
+        if(data == nullptr || (load && fileHandle.readFromDisk(pageNum, data) != 0)){
+            return nullptr;
+        }
+        frames[victim] = Frame{fileHandle.fileID, pageNum, &fileHandle, 1, false, true, true, 0, false};
+        pageTable[key] = victim;
+        return data;
+    }
+
+    RC BufferPool::unpinPage(FileHandle &fileHandle, PageNum pageNum, bool dirty, LSN lsn) {
+        auto it = pageTable.find(getKey(fileHandle.fileID, pageNum));
+        if(it == pageTable.end())return -1;
+        Frame& frame = frames[it->second];
+        if(frame.pinCount == 0)return -1;
+        frame.pinCount--;
+        if(dirty){
+            frame.dirty = true;
+            frame.owner = &fileHandle;
+        }
+        if(lsn > frame.lsn)frame.lsn = lsn;
+        return 0;
+    }
+
+    // The frame stays pinned by the prefetch until the page is asked for or the frame comes up as a victim
+    RC BufferPool::prefetch(FileHandle &fileHandle, PageNum pageNum) {
+        auto key = getKey(fileHandle.fileID, pageNum);
+        if(pageTable.count(key) != 0)return 0;
+        // Keep most of the pool for the pages in use
+        if(prefetching >= frames.size() / 4)return -1;
+        int victim = getVictim();
+        if(victim == -1)return -1;
+        char* data = getFrameData(victim, fileHandle.getPageSize());
+        if(data == nullptr)return -1;
+        frames[victim] = Frame{fileHandle.fileID, pageNum, &fileHandle, 1, false, false, true, 0, true};
+        pageTable[key] = victim;
+        prefetching++;
+        prefetcher.submit(victim, fileHandle.io, pageNum, data);
+        return 0;
+    }
+
+    // Give back the pin of a finished prefetch, wait = false only collects reads that are done
+    bool BufferPool::settle(unsigned pos, bool wait) {
+        Frame& frame = frames[pos];
+        bool ok = false;
+        if(!frame.loading)return true;
+        if(!prefetcher.poll(pos, wait, ok))return false;
+        frame.loading = false;
+        frame.pinCount--;
+        prefetching--;
+        if(!ok){
+            pageTable.erase(getKey(frame.fileID, frame.pageNum));
+            frame.valid = false;
+        }
+        return true;
+    }
+
+    // Frames are allocated on first use, aligned so that direct I/O reads and writes them in place
+    char* BufferPool::getFrameData(unsigned pos, unsigned size) {
+        if(frameSize[pos] == size)return frameData[pos];
+        char* data = PageIO::allocPages(size);
+        if(data == nullptr)return nullptr;
+        PageIO::freePages(frameData[pos]);
+        frameData[pos] = data;
+        frameSize[pos] = size;
+        return data;
+    }
+
+    // CLOCK: sweep the frames, clearing reference bits until an unpinned, unreferenced frame shows up
+    int BufferPool::getVictim() {
+        unsigned frameCount = frames.size();
+        for(unsigned i = 0; i < 2*frameCount; i++){
+            unsigned pos = clockHand;
+            clockHand = (clockHand+1) % frameCount;
+            Frame& frame = frames[pos];
+            if(frame.valid && frame.loading)settle(pos, false);
+            if(!frame.valid)return pos;
+            if(frame.pinCount > 0)continue;
+            if(frame.reference){
+                frame.reference = false;
+                continue;
+            }
+            if(frame.dirty && writeBack(frame) != 0)continue;
+            pageTable.erase(getKey(frame.fileID, frame.pageNum));
+            frame.valid = false;
+            evictCounter++;
+            return pos;
+        }
+        return -1;
+    }
+
+    RC BufferPool::writeBack(Frame &frame) {
+        char* data = frameData[&frame - &frames[0]];
+        // Write-ahead: the records describing the page are durable before the page is
+        if(LogManager::instance().flush(frame.lsn) != 0)return -1;
+        if(frame.owner->writeToDisk(frame.pageNum, data) != 0)return -1;
+        frame.dirty = false;
+        return 0;
+    }
+
+    // Dirty pages in file order, the log is flushed once for all of them
+    RC BufferPool::writeBack(std::vector<unsigned> &positions) {
+        if(positions.empty())return 0;
+        std::sort(positions.begin(), positions.end(), [this](unsigned a, unsigned b) {
+            if(frames[a].owner != frames[b].owner)return frames[a].owner < frames[b].owner;
+            return frames[a].pageNum < frames[b].pageNum;
+        });
+        LSN lsn = 0;
+        std::vector<PageRequest> requests;
+        for(auto pos: positions){
+            Frame& frame = frames[pos];
+            lsn = std::max(lsn, frame.lsn);
+            requests.push_back(PageRequest{&frame.owner->io, frame.pageNum, frameData[pos], true, 0});
+        }
+        if(LogManager::instance().flush(lsn) != 0)return -1;
+        RC rc = ring.run(requests);
+        for(unsigned i = 0; i < positions.size(); i++){
+            if(requests[i].rc == 0)frames[positions[i]].dirty = false;
+        }
+        return rc;
+    }
+
+    RC BufferPool::flushFile(FileHandle &fileHandle) {
+        std::vector<unsigned> positions;
+        for(auto& frame: frames){
+            if(frame.valid && frame.dirty && frame.fileID == fileHandle.fileID){
+                // Route through the closing handle, the owner may be the same file opened elsewhere
+                frame.owner = &fileHandle;
+                positions.push_back(&frame - &frames[0]);
+            }
+        }
+        return writeBack(positions);
+    }
+
+    // Pins are dropped too, holders of long-lived pins check FileHandle::getDropCount
+    void BufferPool::dropFrames(FileState &state) {
+        state.drops++;
+        for(auto& frame: frames){
+            if(frame.valid && frame.fileID == state.id){
+                settle(&frame - &frames[0], true);
+                pageTable.erase(getKey(frame.fileID, frame.pageNum));
+                frame.valid = false;
+                frame.dirty = false;
+                frame.pinCount = 0;
+            }
+        }
+    }
+
+    bool BufferPool::hasOpenFiles() const {
+        for(auto& entry: files){
+            if(entry.second.openCount > 0)return true;
+        }
+        return false;
+    }
+
+    void BufferPool::dropFile(const std::string &fileName) {
+        auto it = files.find(fileName);
+        if(it == files.end())return;
+        dropFrames(it->second);
+        it->second.known = false;
+        it->second.pageCount = 0;
+        it->second.logged = false;
+    }
+
+    FileState* BufferPool::openFile(FileHandle &fileHandle) {
+        auto it = files.find(fileHandle.fileName);
+        if(it == files.end()){
+            FileState state{};
+            state.id = ++nextFileID;
+            it = files.insert({fileHandle.fileName, state}).first;
+        }
+        FileState& state = it->second;
+        if(state.openCount == 0){
+            // The file may have been replaced or modified while nobody had it open
+            struct stat st{};
+            fstat(fileHandle.io.getDescriptor(), &st);
+            if(!state.known || st.st_ino != state.inode || st.st_size != state.size ||
+               st.st_mtim.tv_sec != state.modified.tv_sec || st.st_mtim.tv_nsec != state.modified.tv_nsec){
+                dropFrames(state);
+            }
+            state.pageCount = 0;
+        }
+        state.openCount++;
+        return &state;
+    }
+
+    void BufferPool::closeFile(FileHandle &fileHandle) {
+        // Reads still going through the handle's descriptor finish before it closes
+        for(auto& frame: frames){
+            if(frame.valid && frame.loading && frame.owner == &fileHandle)settle(&frame - &frames[0], true);
+        }
+        auto it = files.find(fileHandle.fileName);
+        if(it == files.end())return;
+        FileState& state = it->second;
+        if(state.openCount > 0)state.openCount--;
+        if(state.openCount == 0){
+            // The last handle made every page durable, the log no longer needs to hold them
+            if(state.logged && fileHandle.io.sync() == 0){
+                state.logged = false;
+                bool logged = false;
+                for(auto& entry: files){
+                    logged |= entry.second.logged;
+                }
+                if(!logged)LogManager::instance().truncate();
+            }
+            struct stat st{};
+            fstat(fileHandle.io.getDescriptor(), &st);
+            state.inode = st.st_ino;
+            state.size = st.st_size;
+            state.modified = st.st_mtim;
+            state.known = true;
+        }
+    }
+
+    RC BufferPool::checkpoint() {
+        std::vector<unsigned> positions;
+        for(auto& frame: frames){
+            if(frame.valid && frame.dirty)positions.push_back(&frame - &frames[0]);
+        }
+        if(writeBack(positions) != 0 || syncLoggedFiles() != 0)return -1;
+        LogManager::instance().truncate();
+        return 0;
+    }
+
+    // Pages are written without user space buffering, any descriptor of the file syncs it
+    RC BufferPool::syncLoggedFiles() {
+        for(auto& entry: files){
+            if(!entry.second.logged)continue;
+            int fd = open(entry.first.c_str(), O_RDONLY);
+            // A file removed behind our back has nothing left to sync
+            if(fd >= 0 && fsync(fd) != 0){
+                close(fd);
+                return -1;
+            }
+            if(fd >= 0)close(fd);
+            entry.second.logged = false;
+        }
+        return 0;
+    }
+
+    RC BufferPool::collectCounterValues(unsigned &hitCount, unsigned &missCount, unsigned &evictCount) {
+        hitCount = hitCounter;
+        missCount = missCounter;
+        evictCount = evictCounter;
+        return 0;
+    }
+
+    // Record: size, checksum of the rest, type, atomic change, then a payload starting with the file name
+    #define LOG_HEADER_SIZE (2*sizeof(unsigned)+1+sizeof(unsigned long long))
+
+    // FNV-1a over 8-byte words, the header and the payload are hashed one after the other
+    static unsigned long long logChecksum(const char* data, size_t size, unsigned long long hash = 14695981039346656037ull) {
+        size_t i = 0;
+        for(; i + sizeof(unsigned long long) <= size; i += sizeof(unsigned long long)){
+            unsigned long long word;
+            memcpy(&word, data+i, sizeof(word));
+            hash = (hash ^ word) * 1099511628211ull;
+        }
+        for(; i < size; i++){
+            hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    static const unsigned LOG_WORD = sizeof(unsigned long long);
+
+    static bool sameWord(const char *a, const char *b) {
+        unsigned long long x, y;
+        memcpy(&x, a, LOG_WORD);
+        memcpy(&y, b, LOG_WORD);
+        return x == y;
+    }
+
+    static void putName(std::string &payload, const std::string &fileName) {
+        unsigned short size = fileName.size();
+        payload.append((const char*)&size, sizeof(size));
+        payload.append(fileName);
+    }
+
+    LogManager &LogManager::instance() {
+        static LogManager _log_manager = LogManager();
+        return _log_manager;
+    }
+
+    LogManager::LogManager() {
+        file = nullptr;
+        nextLSN = 0;
+        durableLSN = 0;
+        logSize = 0;
+        nextGroup = 0;
+        currentGroup = 0;
+        depth = 0;
+        changed = false;
+        syncCommit = false;
+        flushing = false;
+        broken = false;
+        stopping = false;
+        logEnd = 0;
+    }
+
+    LogManager::~LogManager() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeWriter.notify_all();
+        if(writer.joinable())writer.join();
+        if(file == nullptr)return;
+        flush(nextLSN);
+        fclose(file);
+    }
+
+    // The mutex cannot be copied, a copy starts with an empty log state
+    LogManager::LogManager(const LogManager &) : LogManager() {}
+
+    LogManager &LogManager::operator=(const LogManager &) {
+        return *this;
+    }
+
+    void LogManager::beginAtomic() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(depth++ == 0)currentGroup = ++nextGroup;
+    }
+
+    RC LogManager::endAtomic() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if(depth == 0)return -1;
+        if(--depth > 0)return 0;
+        unsigned long long group = currentGroup;
+        currentGroup = 0;
+        // Nothing was logged since the change began, there is nothing to commit
+        if(!changed)return 0;
+        changed = false;
+        lock.unlock();
+
+        LSN lsn = append(LOG_COMMIT, group, "");
+        if(syncCommit){
+            if(flush(lsn) != 0)return -1;
+        }else{
+            lock.lock();
+            if(!writer.joinable())writer = std::thread(&LogManager::writeLoop, this);
+            lock.unlock();
+        }
+        if(logSize > LOG_CHECKPOINT_SIZE)return BufferPool::instance().checkpoint();
+        return 0;
+    }
+
+    void LogManager::setSyncCommit(bool syncCommit) {
+        this->syncCommit = syncCommit;
+    }
+
+    LSN LogManager::logPage(FileHandle &fileHandle, PageNum pageNum, unsigned offset, unsigned length,
+                            const char *before, const char *after) {
+        if(!fileHandle.isLogged())return 0;
+        std::string runs;
+        unsigned short runCount = 0;
+        unsigned i = 0;
+        while(i < length){
+            // Unchanged bytes are skipped a word at a time
+            while(i + LOG_WORD <= length && sameWord(before+i, after+i))i += LOG_WORD;
+            while(i < length && before[i] == after[i])i++;
+            if(i == length)break;
+            // Close runs are merged, a run header costs more than a few unchanged bytes
+            unsigned end = i+1;
+            for(unsigned j = end; j < length && j < end + LOG_RUN_GAP; j += LOG_WORD){
+                if(j + LOG_WORD > length){
+                    for(unsigned k = j; k < length; k++)if(before[k] != after[k])end = k+1;
+                }else if(!sameWord(before+j, after+j))end = j + LOG_WORD;
+            }
+            unsigned runOffset = offset + i, runLength = end - i;
+            runs.append((const char*)&runOffset, sizeof(runOffset));
+            runs.append((const char*)&runLength, sizeof(runLength));
+            runs.append(before+i, runLength);
+            runs.append(after+i, runLength);
+            runCount++;
+            i = end;
+        }
+        if(runCount == 0)return 0;
+
+        std::string payload;
+        putName(payload, fileHandle.fileName);
+        payload.append((const char*)&pageNum, sizeof(PageNum));
+        unsigned pageSize = fileHandle.getPageSize();
+        payload.append((const char*)&pageSize, sizeof(unsigned));
+        payload.append((const char*)&runCount, sizeof(runCount));
+        payload.append(runs);
+        if(fileHandle.fileState != nullptr)fileHandle.fileState->logged = true;
+        noteFile(fileHandle.fileName);
+        return append(LOG_PAGE, currentGroup, payload);
+    }
+
+    LSN LogManager::logAppend(FileHandle &fileHandle, PageNum pageNum, const char *data) {
+        if(!fileHandle.isLogged())return 0;
+        std::string payload;
+        putName(payload, fileHandle.fileName);
+        payload.append((const char*)&pageNum, sizeof(PageNum));
+        unsigned pageSize = fileHandle.getPageSize();
+        payload.append((const char*)&pageSize, sizeof(unsigned));
+        payload.append(data, pageSize);
+        if(fileHandle.fileState != nullptr)fileHandle.fileState->logged = true;
+        noteFile(fileHandle.fileName);
+        return append(LOG_APPEND, currentGroup, payload);
+    }
+
+    void LogManager::noteFile(const std::string &fileName) {
+        std::lock_guard<std::mutex> lock(mutex);
+        loggedFiles.insert(fileName);
+    }
+
+    // Only records of the file could be replayed into a new one of the same name
+    RC LogManager::logReset(const std::string &fileName) {
+        recover();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(loggedFiles.erase(fileName) == 0)return 0;
+        }
+        std::string payload;
+        putName(payload, fileName);
+        return flush(append(LOG_RESET, 0, payload));
+    }
+
+    LSN LogManager::append(unsigned char type, unsigned long long group, const std::string &payload) {
+        unsigned size = LOG_HEADER_SIZE + payload.size();
+        char header[LOG_HEADER_SIZE];
+        memcpy(header, &size, sizeof(unsigned));
+        header[2*sizeof(unsigned)] = (char)type;
+        memcpy(header+2*sizeof(unsigned)+1, &group, sizeof(group));
+        unsigned checksum = logChecksum(payload.data(), payload.size(),
+                                        logChecksum(header+2*sizeof(unsigned), LOG_HEADER_SIZE-2*sizeof(unsigned)));
+        memcpy(header+sizeof(unsigned), &checksum, sizeof(unsigned));
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if(group != 0 && type != LOG_COMMIT)changed = true;
+        buffer.append(header, LOG_HEADER_SIZE);
+        buffer.append(payload);
+        nextLSN += size;
+        logSize += size;
+        LSN lsn = nextLSN;
+        // A full buffer is only handed to the OS, the next commit or page write-back syncs it
+        if(buffer.size() >= LOG_BUFFER_SIZE){
+            while(flushing)flushed.wait(lock);
+            if(buffer.size() >= LOG_BUFFER_SIZE && !broken && openLog() == 0 && writeLog(buffer) == 0)buffer.clear();
+        }
+        return lsn;
+    }
+
+    // Group commit: the first committer to arrive writes and syncs every buffered record,
+    // the ones arriving meanwhile wait for it and usually find their records already durable
+    RC LogManager::flush(LSN lsn) {
+        std::unique_lock<std::mutex> lock(mutex);
+        lsn = std::min(lsn, nextLSN);
+        while(durableLSN < lsn){
+            if(flushing){
+                flushed.wait(lock);
+                continue;
+            }
+            if(broken || openLog() != 0)return -1;
+            flushing = true;
+            std::string batch;
+            batch.swap(buffer);
+            buffer.reserve(LOG_BUFFER_SIZE);
+            LSN target = nextLSN;
+            lock.unlock();
+            bool failed = writeLog(batch) != 0;
+            if(!failed && fdatasync(fileno(file)) != 0){
+                // The kernel may have dropped the pages it could not write, nothing in the log can be trusted
+                std::cout << "Error when syncing the log" << std::endl;
+                broken = true;
+                failed = true;
+            }
+            lock.lock();
+            flushing = false;
+            if(!failed)durableLSN = target;
+            else buffer.insert(0, batch);
+            flushed.notify_all();
+            if(failed)return -1;
+        }
+        return 0;
+    }
+
+    // Without sync commit, commits return at once and this thread makes them durable within LOG_GROUP_COMMIT_US
+    void LogManager::writeLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(!stopping){
+            wakeWriter.wait_for(lock, std::chrono::microseconds(LOG_GROUP_COMMIT_US));
+            if(durableLSN >= nextLSN)continue;
+            LSN lsn = nextLSN;
+            lock.unlock();
+            flush(lsn);
+            lock.lock();
+        }
+    }
+
+    void LogManager::truncate() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(flushing)flushed.wait(lock);
+        if(depth > 0)return;
+        buffer.clear();
+        loggedFiles.clear();
+        durableLSN = nextLSN;
+        logSize = 0;
+        if(file != nullptr){
+            if(ftruncate(fileno(file), 0) != 0)std::cout << "Error when truncating the log" << std::endl;
+            logEnd = 0;
+        }
+    }
+
+    // Records are written without user space buffering. A failed write is cut off again so that
+    // the records, still buffered, are not logged twice or torn when the write is retried.
+    RC LogManager::writeLog(const std::string &bytes) {
+        int fd = fileno(file);
+        size_t written = 0;
+        while(written < bytes.size()){
+            ssize_t n = ::write(fd, bytes.data()+written, bytes.size()-written);
+            if(n < 0 && errno == EINTR)continue;
+            if(n <= 0)break;
+            written += n;
+        }
+        if(written == bytes.size()){
+            logEnd += written;
+            return 0;
+        }
+        if(written > 0 && ftruncate(fd, logEnd) != 0){
+            std::cout << "Error when cutting off a failed log write" << std::endl;
+            broken = true;
+        }
+        return -1;
+    }
+
+    static std::string getLogName(unsigned i) {
+        return i == 0 ? LOG_FILE_NAME : std::string(LOG_FILE_NAME) + "." + std::to_string(i);
+    }
+
+    // The lock lives as long as the log stays open, i.e. until the process ends
+    RC LogManager::openLog() {
+        if(file != nullptr)return 0;
+        for(unsigned i = 0; i < LOG_MAX_FILES && file == nullptr; i++){
+            std::string name = getLogName(i);
+            FILE* log = fopen(name.c_str(), "a+b");
+            if(log == nullptr)break;
+            if(flock(fileno(log), LOCK_EX | LOCK_NB) == 0){
+                file = log;
+                fileName = name;
+            } else fclose(log);
+        }
+        if(file == nullptr){
+            std::cout << "Error when opening the log" << std::endl;
+            return -1;
+        }
+        logEnd = lseek(fileno(file), 0, SEEK_END);
+        return 0;
+    }
+
+    struct LogRecord {
+        unsigned char type;
+        unsigned long long group;
+        std::string fileName;
+        PageNum pageNum;
+        unsigned pageSize;
+        const char* body;           // Runs of a page record, page of an append
+    };
+
+    static FILE* getRecoveryFile(std::map<std::string, FILE*> &files, const std::string &fileName) {
+        auto it = files.find(fileName);
+        if(it == files.end())it = files.insert({fileName, fopen(fileName.c_str(), "r+b")}).first;
+        return it->second;
+    }
+
+    // Apply the new (redo) or the old (undo) bytes of every run in a page record
+    static void applyRuns(FILE* file, const LogRecord &record, bool redo) {
+        char* page = new char [record.pageSize];
+        memset(page, 0, record.pageSize);
+        fseek(file, (long)record.pageNum*record.pageSize, SEEK_SET);
+        fread(page, 1, record.pageSize, file);
+        const char* ptr = record.body;
+        unsigned short runCount;
+        memcpy(&runCount, ptr, sizeof(runCount));
+        ptr += sizeof(runCount);
+        for(unsigned short i = 0; i < runCount; i++){
+            unsigned offset, length;
+            memcpy(&offset, ptr, sizeof(offset));
+            memcpy(&length, ptr+sizeof(offset), sizeof(length));
+            ptr += sizeof(offset)+sizeof(length);
+            memcpy(page+offset, redo ? ptr+length : ptr, length);
+            ptr += 2*length;
+        }
+        fseek(file, (long)record.pageNum*record.pageSize, SEEK_SET);
+        fwrite(page, record.pageSize, 1, file);
+        delete [] page;
+    }
+
+    // Replay a log locked by the caller, then empty it
+    static RC replayLog(int fd) {
+        off_t size = lseek(fd, 0, SEEK_END);
+        if(size <= 0)return 0;
+        std::string log(size, 0);
+        if(pread(fd, &log[0], size, 0) != size)return -1;
+
+        // A torn or corrupted record ends the log
+        std::vector<LogRecord> records;
+        std::unordered_map<unsigned long long, bool> committed;
+        std::unordered_map<std::string, size_t> lastReset;
+        size_t pos = 0;
+        while(pos + LOG_HEADER_SIZE <= (size_t)size){
+            unsigned recordSize, checksum;
+            memcpy(&recordSize, &log[pos], sizeof(unsigned));
+            memcpy(&checksum, &log[pos+sizeof(unsigned)], sizeof(unsigned));
+            if(recordSize < LOG_HEADER_SIZE || pos + recordSize > (size_t)size)break;
+            unsigned expected = logChecksum(&log[pos+LOG_HEADER_SIZE], recordSize-LOG_HEADER_SIZE,
+                                            logChecksum(&log[pos+2*sizeof(unsigned)], LOG_HEADER_SIZE-2*sizeof(unsigned)));
+            if(expected != checksum)break;
+            LogRecord record{};
+            record.type = log[pos+2*sizeof(unsigned)];
+            memcpy(&record.group, &log[pos+2*sizeof(unsigned)+1], sizeof(record.group));
+            const char* ptr = &log[pos+LOG_HEADER_SIZE];
+            if(record.type == LOG_COMMIT){
+                committed[record.group] = true;
+            } else {
+                unsigned short nameSize;
+                memcpy(&nameSize, ptr, sizeof(nameSize));
+                record.fileName = std::string(ptr+sizeof(nameSize), nameSize);
+                ptr += sizeof(nameSize)+nameSize;
+                if(record.type == LOG_RESET){
+                    lastReset[record.fileName] = records.size();
+                } else {
+                    memcpy(&record.pageNum, ptr, sizeof(PageNum));
+                    memcpy(&record.pageSize, ptr+sizeof(PageNum), sizeof(unsigned));
+                    record.body = ptr+sizeof(PageNum)+sizeof(unsigned);
+                }
+                records.push_back(record);
+            }
+            pos += recordSize;
+        }
+
+        // Redo everything, then undo the changes that never committed, newest first
+        std::map<std::string, FILE*> files;
+        for(size_t i = 0; i < records.size(); i++){
+            LogRecord& record = records[i];
+            if(record.type == LOG_RESET)continue;
+            auto reset = lastReset.find(record.fileName);
+            if(reset != lastReset.end() && reset->second > i)continue;
+            FILE* dataFile = getRecoveryFile(files, record.fileName);
+            if(dataFile == nullptr)continue;
+            if(record.type == LOG_PAGE){
+                applyRuns(dataFile, record, true);
+            } else {
+                fseek(dataFile, (long)record.pageNum*record.pageSize, SEEK_SET);
+                fwrite(record.body, record.pageSize, 1, dataFile);
+            }
+        }
+        for(size_t i = records.size(); i-- > 0;){
+            LogRecord& record = records[i];
+            if(record.type == LOG_RESET || record.group == 0 || committed.count(record.group))continue;
+            auto reset = lastReset.find(record.fileName);
+            if(reset != lastReset.end() && reset->second > i)continue;
+            FILE* dataFile = getRecoveryFile(files, record.fileName);
+            if(dataFile == nullptr)continue;
+            if(record.type == LOG_PAGE){
+                applyRuns(dataFile, record, false);
+            } else {
+                fflush(dataFile);
+                if(ftruncate(fileno(dataFile), (off_t)record.pageNum*record.pageSize) != 0){
+                    std::cout << "Error when undoing an append to " << record.fileName << std::endl;
+                }
+            }
+        }
+        for(auto& entry: files){
+            if(entry.second == nullptr)continue;
+            fflush(entry.second);
+            fsync(fileno(entry.second));
+            fclose(entry.second);
+        }
+        return ftruncate(fd, 0);
+    }
+
+    // Open files hold state the replay would not see. Once the last one closes the log is empty,
+    // unless this process crashed on the same files before, or another one did.
+    RC LogManager::recover() {
+        if(BufferPool::instance().hasOpenFiles())return 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        if(openLog() != 0)return -1;
+        // A free lock means its process is gone, a live one keeps its log
+        for(unsigned i = 0; i < LOG_MAX_FILES; i++){
+            std::string name = getLogName(i);
+            if(name == fileName)continue;
+            int fd = open(name.c_str(), O_RDWR);
+            if(fd < 0)continue;
+            if(flock(fd, LOCK_EX | LOCK_NB) == 0 && replayLog(fd) != 0){
+                std::cout << "Error when replaying the log " << name << std::endl;
+            }
+            close(fd);
+        }
+        if(replayLog(fileno(file)) != 0)return -1;
+        loggedFiles.clear();
+        logEnd = 0;
+        return 0;
+    }
+
+    LogGuard::LogGuard() {
+        LogManager::instance().beginAtomic();
+    }
+
+    LogGuard::~LogGuard() {
+        LogManager::instance().endAtomic();
+    }
 } // namespace PeterDB
 
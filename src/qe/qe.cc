@@ -6,140 +6,340 @@
 #include <algorithm>
 
 namespace PeterDB {
-    Filter::Filter(Iterator *input, const Condition &condition) {
-        this->iter = input;
-        this->condition = condition;
+    static int getAttributeIndex(const std::vector<Attribute> &attrs, const std::string &name) {
+        for(int i = 0; i < attrs.size(); i++){
+            if(attrs[i].name == name)return i;
+        }
+        return -1;
     }
 
-    Filter::~Filter() {
+    RC Iterator::getNextBatch(TupleBatch &batch) {
+        batch.clear();
+        while(!batch.full() && getNextTuple(batch.reserve()) == 0){
+            batch.commit();
+        }
+        return batch.size() == 0 ? QE_EOF : 0;
+    }
+
+    const unsigned TupleBatch::NULL_POS;
 
+    TupleBatch::TupleBatch() {
+        this->capacity = 0;
+        this->count = 0;
+        this->nullSize = 0;
     }
 
-    RC Filter::getNextTuple(void *data) {
-        while(iter->getNextTuple(data)!=-1){
-            if(isMatch((char*)data))return 0;
-        }
-        return QE_EOF;
+    void TupleBatch::init(const std::vector<Attribute> &attrs, unsigned capacity) {
+        this->attrs = attrs;
+        this->capacity = std::max(capacity, 1u);
+        this->nullSize = std::ceil(static_cast<double>(attrs.size()) / CHAR_BIT);
+        this->columns.assign(attrs.size() * this->capacity, NULL_POS);
+        this->offsets.assign(this->capacity + 1, 0);
+        this->count = 0;
     }
 
-    RC Filter::getAttributes(std::vector<Attribute> &attrs) const {
-        return iter->getAttributes(attrs);
+    void TupleBatch::clear() {
+        count = 0;
     }
 
-    bool Filter::isMatch(char *data) {
-        std::vector<Attribute> attrs;
-        iter->getAttributes(attrs);
+    unsigned TupleBatch::size() const {
+        return count;
+    }
 
-        int pivot = std::ceil( static_cast<double>(attrs.size()) /CHAR_BIT);
-        char* nullBytes = new char [pivot];
-        memset(nullBytes, 0, pivot);
-        memcpy(nullBytes, data, pivot);
-        // Found such condition attribute in data or not
+    unsigned TupleBatch::getCapacity() const {
+        return capacity;
+    }
 
-        if(condition.bRhsIsAttr == false){
-            for(int i = 0 ; i < attrs.size(); i++){
-                if(Tool::isNull(i, nullBytes))
-                    continue;
-                if(attrs[i].name == condition.lhsAttr) {
-                    break;
-                }
-                if(attrs[i].type == TypeVarChar){
-                    int strLength;
-                    memcpy(&strLength, data + pivot, sizeof(int));
-                    pivot += (sizeof(int) + strLength);
-                }
-                else{
-                    pivot += sizeof(int);
-                }
-            }
-            // save the key
-            char* key = new char [PAGE_SIZE];
-            memset(key, 0, PAGE_SIZE);
-            if(condition.rhsValue.type == TypeVarChar){
-                int strLength;
-                memcpy(&strLength, data + pivot, sizeof(int));
-                memcpy(key, data + pivot, strLength + sizeof(int));
+    bool TupleBatch::full() const {
+        return count >= capacity;
+    }
+
+    const std::vector<Attribute> &TupleBatch::getAttributes() const {
+        return attrs;
+    }
+
+    char* TupleBatch::reserve() {
+        size_t needed = offsets[count] + PAGE_SIZE;
+        if(data.size() < needed)data.resize(std::max(needed, data.size() * 2));
+        return &data[offsets[count]];
+    }
+
+    // Decode the attribute positions of the reserved tuple
+    void TupleBatch::commit() {
+        unsigned start = offsets[count];
+        char* tuple = &data[start];
+        unsigned pos = nullSize;
+        for(unsigned i = 0; i < attrs.size(); i++){
+            if(Tool::isNull(i, tuple)){
+                columns[i * capacity + count] = NULL_POS;
+                continue;
             }
-            else{
-                memcpy(key, data + pivot, sizeof(int));
+            columns[i * capacity + count] = start + pos;
+            int len = sizeof(int);
+            if(attrs[i].type == TypeVarChar){
+                memcpy(&len, tuple + pos, sizeof(int));
+                len += sizeof(int);
             }
-            bool satisfy = isCompareSatisfy(key);
-            int k;
-            memcpy(&k, key, sizeof(int));
-            delete [] key;
-            delete [] nullBytes;
-            return satisfy;
+            pos += len;
         }
+        offsets[++count] = start + pos;
+    }
 
-        return false;
+    void TupleBatch::append(const void *tuple) {
+        memcpy(reserve(), tuple, TupleView(attrs, tuple).getSize());
+        commit();
     }
 
-    bool Filter::isCompareSatisfy(char *key) {
-        if (condition.op == NO_OP) return true;
-
-        switch (condition.rhsValue.type) {
-            case TypeInt:
-            {
-                int val = *(int*)key;
-                int cond = *(int*)this->condition.rhsValue.data;
-                switch (this->condition.op) {
-                    case EQ_OP: return val == cond;
-                    case LT_OP: return val < cond;
-                    case LE_OP: return val <= cond;
-                    case GT_OP: return val > cond;
-                    case GE_OP: return val >= cond;
-                    case NE_OP: return val != cond;
-                    default: return false;
-                }
+    // The positions are moved along with the bytes, nothing is decoded again
+    void TupleBatch::append(const TupleBatch &batch, unsigned i) {
+        unsigned start = offsets[count];
+        unsigned size = batch.getTupleSize(i);
+        memcpy(reserve(), batch.getTuple(i), size);
+        for(unsigned j = 0; j < attrs.size(); j++){
+            unsigned pos = batch.columns[j * batch.capacity + i];
+            columns[j * capacity + count] = pos == NULL_POS ? NULL_POS : pos - batch.offsets[i] + start;
+        }
+        offsets[++count] = start + size;
+    }
+
+    const char* TupleBatch::getTuple(unsigned i) const {
+        return &data[offsets[i]];
+    }
+
+    unsigned TupleBatch::getTupleSize(unsigned i) const {
+        return offsets[i + 1] - offsets[i];
+    }
+
+    bool TupleBatch::isNull(unsigned i, unsigned attr) const {
+        return columns[attr * capacity + i] == NULL_POS;
+    }
+
+    const char* TupleBatch::getAttribute(unsigned i, unsigned attr) const {
+        unsigned pos = columns[attr * capacity + i];
+        return pos == NULL_POS ? nullptr : &data[pos];
+    }
+
+    unsigned TupleBatch::getAttributeSize(unsigned i, unsigned attr) const {
+        unsigned pos = columns[attr * capacity + i];
+        if(pos == NULL_POS)return 0;
+        if(attrs[attr].type != TypeVarChar)return sizeof(int);
+        int len;
+        memcpy(&len, &data[pos], sizeof(int));
+        return len + sizeof(int);
+    }
+
+    unsigned TupleBatch::getAttributeOffset(unsigned i, unsigned attr) const {
+        unsigned pos = columns[attr * capacity + i];
+        return pos == NULL_POS ? NULL_POS : pos - offsets[i];
+    }
+
+    int TableScan::findAttribute(const std::string &name) const {
+        for(int i = 0; i < attrs.size(); i++){
+            if(tableName + "." + attrs[i].name == name)return i;
+        }
+        return -1;
+    }
+
+    RC TableScan::pushDownCondition(const Condition &condition) {
+        if(condition.op == NO_OP)return 0;
+        if(condition.bRhsIsAttr || condition.rhsValue.data == nullptr)return -1;
+        int index = findAttribute(condition.lhsAttr);
+        if(index == -1 || attrs[index].type != condition.rhsValue.type)return -1;
+
+        unsigned size = sizeof(int);
+        if(attrs[index].type == TypeVarChar){
+            memcpy(&size, condition.rhsValue.data, sizeof(int));
+            size += sizeof(int);
+        }
+        conditions.push_back({attrs[index].name, condition.op, std::string((char*)condition.rhsValue.data, size)});
+        setIterator();
+        return 0;
+    }
+
+    RC TableScan::pushDownProjection(const std::vector<std::string> &attrNames) {
+        std::vector<Attribute> projected;
+        std::vector<std::string> names;
+        for(auto &name: attrNames){
+            int index = findAttribute(name);
+            if(index == -1)return -1;
+            projected.push_back(attrs[index]);
+            names.push_back(attrs[index].name);
+        }
+        this->attrs = projected;
+        this->attrNames = names;
+        setIterator();
+        return 0;
+    }
+
+    BatchReader::BatchReader() {
+        this->input = nullptr;
+        this->pos = 0;
+    }
+
+    void BatchReader::init(Iterator *input) {
+        std::vector<Attribute> attrs;
+        this->input = input;
+        input->getAttributes(attrs);
+        batch.init(attrs);
+        reset();
+    }
+
+    int BatchReader::next() {
+        while(pos >= batch.size()){
+            if(input->getNextBatch(batch) == QE_EOF){
+                batch.clear();
+                pos = 0;
+                return QE_EOF;
             }
-            case TypeReal:
-            {
-                float val = *(float *)key;
-                float cond = *(float *)this->condition.rhsValue.data;
-                switch (this->condition.op) {
-                    case EQ_OP: return fabs(val-cond)<FLOAT_DIFF;
-                    case LT_OP: return val < cond;
-                    case LE_OP: return val <= cond;
-                    case GT_OP: return val > cond;
-                    case GE_OP: return val >= cond;
-                    case NE_OP: return (val-cond)>FLOAT_DIFF;
-                    default: return false;
-                }
+            pos = 0;
+        }
+        return pos++;
+    }
+
+    RC BatchReader::getNextTuple(void *data) {
+        int i = next();
+        if(i == QE_EOF)return QE_EOF;
+        memcpy(data, batch.getTuple(i), batch.getTupleSize(i));
+        return 0;
+    }
+
+    void BatchReader::reset() {
+        batch.clear();
+        pos = 0;
+    }
+
+    BitmapIndexScan::BitmapIndexScan(RelationManager &rm, const std::string &tableName, const std::string &attrName,
+                                     const char *alias) : rm(rm) {
+        this->tableName = alias ? alias : tableName;
+        this->relationName = tableName;
+        this->attrName = attrName;
+        rm.getAttributes(tableName, attrs);
+        this->iter = new RM_IndexScanIterator();
+        rm.indexScan(tableName, attrName, NULL, NULL, true, true, *this->iter);
+        this->pos = 0;
+        this->next = 0;
+    }
+
+    BitmapIndexScan::~BitmapIndexScan() {
+        iter->close();
+        delete iter;
+    }
+
+    void BitmapIndexScan::setIterator(void *lowKey, void *highKey, bool lowKeyInclusive, bool highKeyInclusive) {
+        iter->close();
+        delete iter;
+        iter = new RM_IndexScanIterator();
+        rm.indexScan(relationName, attrName, lowKey, highKey, lowKeyInclusive, highKeyInclusive, *this->iter);
+        rids.clear();
+        pos = 0;
+        ends.clear();
+        next = 0;
+    }
+
+    RC BitmapIndexScan::getNextTuple(void *data) {
+        while(true){
+            if(next < ends.size()){
+                unsigned start = next == 0 ? 0 : ends[next - 1];
+                unsigned end = ends[next++];
+                // Deleted since it was indexed
+                if(start == end)continue;
+                memcpy(data, &tuples[start], end - start);
+                return 0;
             }
-            case TypeVarChar:
-            {
-                unsigned keyLen = *(unsigned* )key;
-                unsigned condLen = *(unsigned *)this->condition.rhsValue.data;
-                char* keycmp = new char [keyLen+1];
-                char* condcmp = new char [condLen+1];
-                memcpy(keycmp, key+sizeof(int), keyLen);
-                memcpy(condcmp, (char*)this->condition.rhsValue.data+sizeof(int), condLen);
-                keycmp[keyLen] = '\0';
-                condcmp[condLen] = '\0';
-
-
-                auto res = strcmp(keycmp, condcmp);
-                delete [] keycmp;
-                delete [] condcmp;
-                switch (this->condition.op) {
-                    case EQ_OP: return res==0;
-                    case LT_OP: return res<0;
-                    case LE_OP: return res<=0;
-                    case GT_OP: return res>0;
-                    case GE_OP: return res>=0;
-                    case NE_OP: return res!=0;
-                }
+            if(pos == rids.size() && collect() == QE_EOF)return QE_EOF;
+            size_t last = pos;
+            while(last < rids.size() && rids[last].pageNum == rids[pos].pageNum)last++;
+            pageRIDs.assign(rids.begin() + pos, rids.begin() + last);
+            pos = last;
+            next = 0;
+            if(rm.readTuples(relationName, pageRIDs, tuples, ends) != 0)ends.clear();
+        }
+    }
+
+    RC BitmapIndexScan::getAttributes(std::vector<Attribute> &attributes) const {
+        attributes = this->attrs;
+        // For attribute in std::vector<Attribute>, name it as rel.attr
+        for (Attribute &attribute : attributes) {
+            attribute.name = tableName + "." + attribute.name;
+        }
+        return 0;
+    }
+
+    // The next RIDs of the range, in page order
+    RC BitmapIndexScan::collect() {
+        rids.clear();
+        pos = 0;
+        RID rid;
+        while(rids.size() < QE_RID_BATCH && iter->getNextEntry(rid, key) == 0)rids.push_back(rid);
+        if(rids.empty())return QE_EOF;
+        std::sort(rids.begin(), rids.end(), [](const RID &r1, const RID &r2) {
+            return r1.pageNum < r2.pageNum || (r1.pageNum == r2.pageNum && r1.slotNum < r2.slotNum);
+        });
+        return 0;
+    }
+
+    Filter::Filter(Iterator *input, const Condition &condition) {
+        this->iter = input;
+        this->condition = condition;
+        this->iter->getAttributes(this->attrs);
+        this->attrIndex = getAttributeIndex(attrs, condition.lhsAttr);
+        this->rhsIndex = -1;
+        if(condition.bRhsIsAttr){
+            this->rhsIndex = getAttributeIndex(attrs, condition.rhsAttr);
+            if(attrIndex != -1)predicate.compile(attrs[attrIndex].type, condition.op);
+        } else {
+            predicate.compile(condition.rhsValue.type, condition.op, condition.rhsValue.data);
+        }
+        this->input.init(attrs);
+        this->reader.init(this);
+    }
+
+    Filter::~Filter() {
+
+    }
+
+    RC Filter::getNextTuple(void *data) {
+        return reader.getNextTuple(data);
+    }
+
+    // Keep the matching tuples of whole input batches, an input batch never overflows the output
+    RC Filter::getNextBatch(TupleBatch &batch) {
+        batch.clear();
+        if(input.getCapacity() != batch.getCapacity())input.init(attrs, batch.getCapacity());
+        while(batch.size() == 0){
+            if(iter->getNextBatch(input) == QE_EOF)return QE_EOF;
+            for(unsigned i = 0; i < input.size(); i++){
+                if(isMatch(input, i))batch.append(input, i);
             }
-            default:
-                std::cout<<"Error with the attribute type"<< std::endl;
-                return false;
         }
+        return 0;
+    }
+
+    RC Filter::getAttributes(std::vector<Attribute> &attrs) const {
+        return iter->getAttributes(attrs);
+    }
+
+    // A null attribute never satisfies the condition
+    bool Filter::isMatch(const TupleBatch &batch, unsigned i) {
+        if(attrIndex == -1)return false;
+        const char* value = batch.getAttribute(i, attrIndex);
+        if(value == nullptr)return false;
+        if(!condition.bRhsIsAttr)return predicate(value);
+        if(rhsIndex == -1)return false;
+        const char* other = batch.getAttribute(i, rhsIndex);
+        return other != nullptr && predicate(value, other);
     }
 
     Project::Project(Iterator *input, const std::vector<std::string> &attrNames) {
         iter = input;
         this->attrNames = attrNames;
         iter->getAttributes(attrs);
+        for(auto &name: attrNames){
+            int index = getAttributeIndex(attrs, name);
+            if(index != -1)positions.push_back(index);
+        }
+        this->input.init(attrs);
+        this->reader.init(this);
     }
 
     Project::~Project() {
@@ -147,61 +347,24 @@ namespace PeterDB {
     }
 
     RC Project::getNextTuple(void *data) {
-        char* tuple = new char [PAGE_SIZE];
-        memset(tuple, 0, PAGE_SIZE);
-        if(iter->getNextTuple(tuple)==-1){
-            delete [] tuple;
-            return -1;
-        }
-        ProjectAttr* proAttrs = new ProjectAttr [attrNames.size()];
-        int pivot = std::ceil( static_cast<double>(attrs.size()) /CHAR_BIT);
-        char* nullBytes = new char [pivot];
-        memset(nullBytes, 0, pivot);
-        memcpy(nullBytes, tuple, pivot);
-
-        int namePivot = std::ceil( static_cast<double>(attrNames.size()) /CHAR_BIT);
-        char* nameNullBytes = new char [namePivot];
-        memset(nameNullBytes, 0, namePivot);
-        memcpy(nameNullBytes, tuple, namePivot);
-        // Find not-null attribute and its position in a record
-        for (int i = 0; i < attrs.size(); ++i) {
-            auto it = std::find(attrNames.begin(), attrNames.end(), attrs[i].name);
-            int dis = std::distance(attrNames.begin(), it);
-            if(Tool::isNull(i, nullBytes)){
-                if(it!=attrNames.end()){
-                    Tool::setNull(dis, nameNullBytes);
-                }
-                continue;
-            }
-            if(it!=attrNames.end()){
-                proAttrs[dis] = {attrs[i], (unsigned)pivot};
-            }
+        return reader.getNextTuple(data);
+    }
 
-            int len = sizeof(int);
-            if(attrs[i].type == TypeVarChar){
-                memcpy(&len, tuple + pivot, sizeof(int));
-                len += sizeof(int);
+    // Build every output tuple from the attribute positions of the input batch
+    RC Project::getNextBatch(TupleBatch &batch) {
+        batch.clear();
+        if(input.getCapacity() != batch.getCapacity())input.init(attrs, batch.getCapacity());
+        if(iter->getNextBatch(input) == QE_EOF)return QE_EOF;
+        TupleBuilder builder;
+        for(unsigned i = 0; i < input.size(); i++){
+            builder.start(batch.reserve(), positions.size());
+            for(auto position : positions){
+                const char* value = input.getAttribute(i, position);
+                if(value == nullptr)builder.addNull();
+                else builder.addField(value, input.getAttributeSize(i, position));
             }
-            pivot += len;
+            batch.commit();
         }
-
-        // Build the returned data using the information previously found.
-        for(int i=0;i<attrNames.size();i++){
-            auto item = proAttrs[i];
-            int len = sizeof(int);
-            if(item.attr.type==TypeVarChar){
-                memcpy(&len, tuple+item.pos, sizeof(int));
-                len+=sizeof(int);
-            }
-            memcpy((char*)data+namePivot, tuple+item.pos, len);
-            namePivot += len;
-        }
-        // Copy the null indicator to the data
-        memcpy(data, nameNullBytes, std::ceil( static_cast<double>(attrNames.size()) /CHAR_BIT));
-        delete [] proAttrs;
-        delete [] tuple;
-        delete [] nullBytes;
-        delete [] nameNullBytes;
         return 0;
     }
 
@@ -220,104 +383,198 @@ namespace PeterDB {
         return 0;
     }
 
+    void JoinHashTable::init(AttrType keyType, size_t capacity) {
+        this->keyType = keyType;
+        clear();
+        size_t size = 16;
+        while(size < capacity * 2)size *= 2;
+        slots.assign(size, -1);
+        mask = size - 1;
+        entries.reserve(capacity);
+    }
+
+    void JoinHashTable::insert(const char *tuple, unsigned size, unsigned keyPos, unsigned long long hash) {
+        if((entries.size() + 1) * 2 > slots.size())grow();
+        entries.push_back({hash, (unsigned)arena.size(), size, keyPos});
+        arena.insert(arena.end(), tuple, tuple + size);
+        size_t slot = hash & mask;
+        while(slots[slot] != -1)slot = (slot + 1) & mask;
+        slots[slot] = entries.size() - 1;
+    }
+
+    unsigned JoinHashTable::start(unsigned long long hash) const {
+        return hash & mask;
+    }
+
+    int JoinHashTable::next(const char *key, unsigned long long hash, unsigned &slot) const {
+        if(slots.empty())return -1;
+        while(slots[slot] != -1){
+            int i = slots[slot];
+            slot = (slot + 1) & mask;
+            const Entry &entry = entries[i];
+            if(entry.hash == hash && sameKey(&arena[entry.offset + entry.keyPos], key))
+                return i;
+        }
+        return -1;
+    }
+
+    // Exact equality, the one hash() agrees with: reals within FLOAT_DIFF of each other do not join
+    bool JoinHashTable::sameKey(const char *key, const char *other) const {
+        if(keyType == TypeReal){
+            float value, otherValue;
+            memcpy(&value, key, sizeof(float));
+            memcpy(&otherValue, other, sizeof(float));
+            return value == otherValue;
+        }
+        unsigned size = sizeof(int);
+        if(keyType == TypeVarChar){
+            memcpy(&size, key, sizeof(unsigned));
+            size += sizeof(unsigned);
+        }
+        return memcmp(key, other, size) == 0;
+    }
+
+    const char* JoinHashTable::getTuple(int i, unsigned &size) const {
+        size = entries[i].size;
+        return &arena[entries[i].offset];
+    }
+
+    size_t JoinHashTable::memory() const {
+        return arena.size();
+    }
+
+    bool JoinHashTable::empty() const {
+        return entries.empty();
+    }
+
+    // The slots and the arena keep their memory for the next block
+    void JoinHashTable::clear() {
+        arena.clear();
+        entries.clear();
+        std::fill(slots.begin(), slots.end(), -1);
+    }
+
+    void JoinHashTable::grow() {
+        size_t size = std::max<size_t>(slots.size() * 2, 16);
+        slots.assign(size, -1);
+        mask = size - 1;
+        for(size_t i = 0; i < entries.size(); i++){
+            size_t slot = entries[i].hash & mask;
+            while(slots[slot] != -1)slot = (slot + 1) & mask;
+            slots[slot] = i;
+        }
+    }
+
+    // FNV-1a, mixed with the seed so that every round of partitioning splits differently
+    unsigned long long JoinHashTable::hash(const char *key, unsigned keyLen, AttrType type, unsigned seed) {
+        float zero = 0;
+        // 0.0 and -0.0 are equal but differ in their bytes
+        if(type == TypeReal && *(const float*)key == 0)key = (const char*)&zero;
+        unsigned long long hash = 14695981039346656037ull;
+        for(unsigned i = 0; i < keyLen; i++){
+            hash = (hash ^ (unsigned char)key[i]) * 1099511628211ull;
+        }
+        hash += (seed + 1) * 0x9e3779b97f4a7c15ull;
+        hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+        hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+        return hash ^ (hash >> 31);
+    }
+
+    // Tuples of a block that fit in memory, judged from the smallest tuple the attributes allow
+    static size_t estimateTuples(const std::vector<Attribute> &attrs, size_t bytes) {
+        size_t minSize = std::ceil(static_cast<double>(attrs.size()) / CHAR_BIT) + attrs.size() * sizeof(int);
+        return bytes / std::max<size_t>(minSize, 1) + 1;
+    }
+
     BNLJoin::BNLJoin(Iterator *leftIn, TableScan *rightIn, const Condition &condition, const unsigned int numPages) {
         this->leftIter = leftIn;
         this->rightIter = rightIn;
         this->condition = condition;
-        this->pageNum = numPages;
-        this->mapSize = 0;
+        this->pageNum = std::max(numPages, 1u);
 
         this->leftIter->getAttributes(this->leftAttrs);
         this->rightIter->getAttributes(this->rightAttrs);
-
-        this->leftData = new char [PAGE_SIZE];
-        this->rightData = new char [PAGE_SIZE];
+        this->leftKey = getAttributeIndex(leftAttrs, condition.lhsAttr);
+        this->rightKey = getAttributeIndex(rightAttrs, condition.rhsAttr);
+        this->leftReader.init(leftIn);
+        this->rightReader.init(rightIn);
+
+        this->leftDone = false;
+        this->blockLoaded = false;
+        this->probing = false;
+        this->slot = 0;
+        if(leftKey != -1){
+            table.init(leftAttrs[leftKey].type, estimateTuples(leftAttrs, (size_t)pageNum * PAGE_SIZE));
+        }
     }
 
     BNLJoin::~BNLJoin() {
-        delete [] this->leftData;
-        delete [] this->rightData;
+
     }
 
-    // Use tupleBuffer to store the pairs of records
-    // a map as the block buffer to find the matching pairs
-    RC BNLJoin::getNextTuple(void *data) {
-        RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
-        while(true) {
-            if(!tupleBuffer.empty()) {
-                auto pair = tupleBuffer.back();
-                char* tuple1 = new char [pair.first.getSize()];
-                char* tuple2 = new char [pair.second.getSize()];
-                memset(tuple1, 0, pair.first.getSize());
-                memset(tuple2, 0, pair.second.getSize());
-                pair.first.getData(leftAttrs, tuple1);
-                pair.second.getData(rightAttrs, tuple2);
-                Tool::mergeTwoTuple(leftAttrs, tuple1, pair.first.getSize(), rightAttrs, tuple2, pair.second.getSize(), data);
-                tupleBuffer.pop_back();
-                return 0;
+    // Fill the table with the next numPages pages worth of left tuples
+    RC BNLJoin::loadBlock() {
+        AttrType type = leftAttrs[leftKey].type;
+        const TupleBatch &batch = leftReader.batch;
+        while(table.memory() < (size_t)pageNum * PAGE_SIZE){
+            int i = leftReader.next();
+            if(i == QE_EOF){
+                leftDone = true;
+                break;
             }
+            // A null key never joins
+            if(batch.isNull(i, leftKey))continue;
+            unsigned len = batch.getAttributeSize(i, leftKey);
+            table.insert(batch.getTuple(i), batch.getTupleSize(i), batch.getAttributeOffset(i, leftKey),
+                         JoinHashTable::hash(batch.getAttribute(i, leftKey), len, type));
+        }
+        return 0;
+    }
 
-            while(mapSize < pageNum * PAGE_SIZE) {
-                if(leftIter->getNextTuple(leftData) != QE_EOF) {
-                    RID rid{0, 0};
-                    Record record(leftAttrs, leftData, rid);
-
-                    char* attrData = new char [PAGE_SIZE];
-                    memset(attrData, 0, PAGE_SIZE);
-                    record.getAttribute(condition.lhsAttr, leftAttrs, attrData);
-                    char nullIndicator = attrData[0];
-                    if(nullIndicator!=-128) {
-                        Attribute targetAttr;
-                        for(auto attr:leftAttrs){
-                            if(attr.name==condition.lhsAttr){
-                                targetAttr=attr;
-                                break;
-                            }
-                        }
-                        Key* key = new Key(attrData+1, targetAttr.type);
-                        map[*key].push_back(record);
-                        mapSize += record.getSize();
-                    }
-                    delete[] attrData;
-                }
-                else if(mapSize == 0) {
-                    return QE_EOF;
-                }
-                else {
-                    break;
+    // Each block of the left input is hashed once, then the whole right input probes it
+    RC BNLJoin::getNextTuple(void *data) {
+        if(leftKey == -1 || rightKey == -1)return QE_EOF;
+        while(true) {
+            if(probing) {
+                int i = table.next(rightTuple + rightKeyPos, rightHash, slot);
+                if(i != -1) {
+                    unsigned size;
+                    const char* left = table.getTuple(i, size);
+                    Tool::mergeTwoTuple(leftAttrs, (char*)left, size, rightAttrs, (char*)rightTuple, rightSize, data);
+                    return 0;
                 }
+                probing = false;
             }
 
-            while(rightIter->getNextTuple(rightData) != QE_EOF) {
-                RID rid{0,0};
-                Record rightRecord(rightAttrs, rightData, rid);
-
-                char* attrData = new char [PAGE_SIZE];
-                memset(attrData, 0, PAGE_SIZE);
-                rightRecord.getAttribute(condition.rhsAttr, rightAttrs, attrData);
-                char nullIndicator = attrData[0];
-                if(nullIndicator!=-128) {
-                    Attribute targetAttr;
-                    for(auto attr:leftAttrs){
-                        if(attr.name==condition.lhsAttr){
-                            targetAttr=attr;
-                            break;
-                        }
-                    }
-                    Key key(attrData+1, targetAttr.type);
-                    if(map.find(key) != map.end()) {
-                        for(int i=0;i<map[key].size();i++){
-                            auto pair = new std::pair<Record, Record>(map[key][i], rightRecord);
-                            tupleBuffer.push_back(*pair);
-                        }
+            if(blockLoaded) {
+                int i = rightReader.next();
+                if(i != QE_EOF) {
+                    const TupleBatch &batch = rightReader.batch;
+                    if(!batch.isNull(i, rightKey)) {
+                        rightTuple = batch.getTuple(i);
+                        rightSize = batch.getTupleSize(i);
+                        rightKeyPos = batch.getAttributeOffset(i, rightKey);
+                        unsigned rightKeyLen = batch.getAttributeSize(i, rightKey);
+                        rightHash = JoinHashTable::hash(rightTuple + rightKeyPos, rightKeyLen, leftAttrs[leftKey].type);
+                        slot = table.start(rightHash);
+                        probing = true;
                     }
+                    continue;
                 }
-                delete [] attrData;
+                table.clear();
+                blockLoaded = false;
+                if(leftDone)return QE_EOF;
+                this->rightIter->setIterator();
+                this->rightReader.reset();
             }
 
-            this->map.clear();
-            this->mapSize = 0;
-            this->rightIter->setIterator();
+            if(leftDone)return QE_EOF;
+            loadBlock();
+            if(table.empty()) {
+                if(leftDone)return QE_EOF;
+                continue;
+            }
+            blockLoaded = true;
         }
     }
 
@@ -337,52 +594,104 @@ namespace PeterDB {
         this->leftIter = leftIn;
         this->rightIter = rightIn;
         this->condition = condition;
-        this->firstScan = true;
 
         this->leftIter->getAttributes(this->leftAttrs);
         this->rightIter->getAttributes(this->rightAttrs);
-        // Avoid duplicate allocation and deallocation
-        this->leftData = new char [PAGE_SIZE];
-        this->rightData = new char [PAGE_SIZE];
+        this->leftKey = getAttributeIndex(leftAttrs, condition.lhsAttr);
+        this->block.init(leftAttrs);
+        this->row = 0;
+        this->match = 0;
     }
 
     INLJoin::~INLJoin() {
-        delete [] this->leftData;
-        delete [] this->rightData;
+
     }
 
     RC INLJoin::getNextTuple(void *data) {
-        memset(rightData, 0, PAGE_SIZE);
-        if(!this->firstScan && rightIter->getNextTuple(rightData) != QE_EOF) {
-            RID rid;
-            Record left(leftAttrs, leftData, rid);
-            Record right(rightAttrs, rightData, rid);
-            Tool::mergeTwoTuple(leftAttrs, leftData, left.getSize(), rightAttrs, rightData, right.getSize(), data);
-            return 0;
-        }
-
-        memset(this->leftData, 0, PAGE_SIZE);
-        do{
-            if(leftIter->getNextTuple(leftData) == QE_EOF) {
-                return QE_EOF;
+        if(leftKey == -1)return QE_EOF;
+        while(true){
+            if(row < block.size() && rowKey[row] != -1){
+                unsigned m = matchStart[rowKey[row]] + match;
+                if(m < matchStart[rowKey[row] + 1]){
+                    match++;
+                    int t = matchTuple[m];
+                    if(t == -1)continue;
+                    Tool::mergeTwoTuple(leftAttrs, (char*)block.getTuple(row), block.getTupleSize(row), rightAttrs,
+                                        &rightArena[rightOffsets[t]], rightOffsets[t + 1] - rightOffsets[t], data);
+                    return 0;
+                }
             }
+            if(row < block.size()){
+                row++;
+                match = 0;
+                continue;
+            }
+            if(loadBlock() != 0)return QE_EOF;
+        }
+    }
 
-            RID rid;
-            char* leftAttrData = new char [PAGE_SIZE];
-            memset(leftAttrData, 0, PAGE_SIZE);
-            Record left(leftAttrs, leftData, rid);
-            left.getAttribute(condition.lhsAttr, leftAttrs, leftAttrData);
-
-            rightIter->setIterator(leftAttrData + 1, leftAttrData + 1, true, true);
-            delete[] leftAttrData;
-        }while(rightIter->getNextTuple(rightData) == QE_EOF);
+    // Probe the index for a block of outer tuples at once: the distinct keys in increasing order, so the
+    // index scan mostly moves along the leaves, then every matching tuple fetched once in page order
+    RC INLJoin::loadBlock() {
+        if(leftIter->getNextBatch(block) == QE_EOF)return QE_EOF;
+        row = 0;
+        match = 0;
+        AttrType type = leftAttrs[leftKey].type;
+        // A null key never joins
+        rowKey.assign(block.size(), -1);
+        sortedRows.clear();
+        for(unsigned i = 0; i < block.size(); i++){
+            if(!block.isNull(i, leftKey))sortedRows.push_back(i);
+        }
+        std::sort(sortedRows.begin(), sortedRows.end(), [&](unsigned a, unsigned b) {
+            return Predicate::compare(type, block.getAttribute(a, leftKey), block.getAttribute(b, leftKey)) < 0;
+        });
 
+        matchStart.clear();
+        matchRIDs.clear();
+        const char* last = nullptr;
         RID rid;
-        Record left(leftAttrs, leftData, rid);
-        Record right(rightAttrs, rightData, rid);
-        Tool::mergeTwoTuple(leftAttrs, leftData, left.getSize(), rightAttrs, rightData, right.getSize(), data);
-        this->firstScan = false;
-
+        for(auto i : sortedRows){
+            const char* key = block.getAttribute(i, leftKey);
+            if(last == nullptr || Predicate::compare(type, last, key) != 0){
+                matchStart.push_back(matchRIDs.size());
+                if(rightIter->seek(key) == 0){
+                    while(rightIter->getNextRID(rid) == 0)matchRIDs.push_back(rid);
+                }
+                last = key;
+            }
+            rowKey[i] = matchStart.size() - 1;
+        }
+        matchStart.push_back(matchRIDs.size());
+
+        fetchOrder.resize(matchRIDs.size());
+        for(unsigned m = 0; m < fetchOrder.size(); m++)fetchOrder[m] = m;
+        std::sort(fetchOrder.begin(), fetchOrder.end(), [this](unsigned a, unsigned b) {
+            const RID &r1 = matchRIDs[a], &r2 = matchRIDs[b];
+            return r1.pageNum < r2.pageNum || (r1.pageNum == r2.pageNum && r1.slotNum < r2.slotNum);
+        });
+        matchTuple.assign(matchRIDs.size(), -1);
+        rightArena.clear();
+        rightOffsets.assign(1, 0);
+        for(size_t k = 0; k < fetchOrder.size(); k++){
+            const RID &current = matchRIDs[fetchOrder[k]];
+            if(k > 0){
+                const RID &previous = matchRIDs[fetchOrder[k - 1]];
+                if(previous.pageNum == current.pageNum && previous.slotNum == current.slotNum){
+                    matchTuple[fetchOrder[k]] = matchTuple[fetchOrder[k - 1]];
+                    continue;
+                }
+            }
+            size_t start = rightArena.size();
+            rightArena.resize(start + PAGE_SIZE);
+            if(rightIter->readTuple(current, &rightArena[start]) != 0){
+                rightArena.resize(start);
+                continue;
+            }
+            rightArena.resize(start + TupleView(rightAttrs, &rightArena[start]).getSize());
+            rightOffsets.push_back(rightArena.size());
+            matchTuple[fetchOrder[k]] = rightOffsets.size() - 2;
+        }
         return 0;
     }
 
@@ -398,317 +707,769 @@ namespace PeterDB {
         return 0;
     }
 
+    // Spill files are rebuilt by every run of an operator, their writes skip the log
+    static RC createSpillFile(const std::string &fileName, FileHandle &fileHandle) {
+        RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
+        rbfm.destroyFile(fileName);
+        if(rbfm.createFile(fileName) != 0 || rbfm.openFile(fileName, fileHandle) != 0)return -1;
+        fileHandle.setLogged(false);
+        return 0;
+    }
+
+    // Reads back the tuples of a spill file
+    class SpillScan : public Iterator {
+    public:
+        SpillScan(const std::string &fileName, const std::vector<Attribute> &attrs) : attrs(attrs) {
+            RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
+            std::vector<std::string> attrNames;
+            for(auto &attr: attrs)attrNames.push_back(attr.name);
+            opened = rbfm.openFile(fileName, fileHandle) == 0;
+            if(opened)rbfm.scan(fileHandle, attrs, "", NO_OP, NULL, attrNames, iter);
+        }
+
+        ~SpillScan() override {
+            if(opened)iter.close();
+        }
+
+        RC getNextTuple(void *data) override {
+            if(!opened)return QE_EOF;
+            RID rid;
+            return iter.getNextRecord(rid, data) == RBFM_EOF ? QE_EOF : 0;
+        }
+
+        RC getAttributes(std::vector<Attribute> &attributes) const override {
+            attributes = attrs;
+            return 0;
+        }
+
+    private:
+        std::vector<Attribute> attrs;
+        FileHandle fileHandle;
+        RBFM_ScanIterator iter;
+        bool opened;
+    };
+
     GHJoin::GHJoin(Iterator *leftIn, Iterator *rightIn, const Condition &condition, const unsigned int numPartitions) {
+        static unsigned joinCount = 0;
+        this->leftIter = leftIn;
+        this->rightIter = rightIn;
+        this->condition = condition;
+        this->numPartitions = std::max(numPartitions, 1u);
+        this->leftIter->getAttributes(this->leftAttrs);
+        this->rightIter->getAttributes(this->rightAttrs);
+        this->leftKey = getAttributeIndex(leftAttrs, condition.lhsAttr);
+        this->rightKey = getAttributeIndex(rightAttrs, condition.rhsAttr);
 
+        this->prefix = "ghjoin" + std::to_string(joinCount++) + "_";
+        this->partitioned = false;
+        this->probe = nullptr;
+        this->rightData = new char [PAGE_SIZE];
+        this->probing = false;
+        this->slot = 0;
+        if(leftKey != -1){
+            table.init(leftAttrs[leftKey].type, estimateTuples(leftAttrs, QE_HASH_MEMORY));
+        }
     }
 
     GHJoin::~GHJoin() {
+        delete probe;
+        RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
+        for(auto &file: files)rbfm.destroyFile(file);
+        delete [] rightData;
+    }
 
+    // Split both inputs by the hash of their join key, one pair of spill files per partition
+    RC GHJoin::partition(Iterator *left, Iterator *right, unsigned level) {
+        std::vector<std::string> leftNames, rightNames;
+        if(spill(left, leftAttrs, leftKey, level, leftNames) != 0)return -1;
+        if(spill(right, rightAttrs, rightKey, level, rightNames) != 0)return -1;
+        for(unsigned i = 0; i < numPartitions; i++){
+            pending.push_back({leftNames[i], rightNames[i], level});
+        }
+        return 0;
+    }
+
+    RC GHJoin::spill(Iterator *input, const std::vector<Attribute> &attrs, int keyIndex, unsigned level,
+                     std::vector<std::string> &names) {
+        RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
+        std::vector<FileHandle*> handles;
+        RC rc = 0;
+        for(unsigned i = 0; i < numPartitions && rc == 0; i++){
+            std::string name = prefix + std::to_string(files.size());
+            handles.push_back(new FileHandle());
+            files.push_back(name);
+            names.push_back(name);
+            rc = createSpillFile(name, *handles.back());
+        }
+        BatchReader reader;
+        reader.init(input);
+        const TupleBatch &batch = reader.batch;
+        AttrType type = attrs[keyIndex].type;
+        RID rid;
+        int i;
+        while(rc == 0 && (i = reader.next()) != QE_EOF){
+            // A null key never joins
+            if(batch.isNull(i, keyIndex))continue;
+            unsigned long long hash = JoinHashTable::hash(batch.getAttribute(i, keyIndex),
+                                                          batch.getAttributeSize(i, keyIndex), type, level + 1);
+            rc = rbfm.insertRecord(*handles[hash % numPartitions], attrs, batch.getTuple(i), rid);
+        }
+        for(auto handle: handles){
+            rbfm.closeFile(*handle);
+            delete handle;
+        }
+        return rc;
+    }
+
+    // Build the hash table from the left side of a partition and start probing it with the right side.
+    // A left side over the memory budget is partitioned again instead.
+    RC GHJoin::loadPartition(const Partition &part) {
+        RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
+        FileHandle handle;
+        unsigned leftPages = 0, rightPages = 0;
+        if(rbfm.openFile(part.left, handle) != 0)return -1;
+        leftPages = handle.getNumberOfPages();
+        rbfm.closeFile(handle);
+        if(rbfm.openFile(part.right, handle) != 0)return -1;
+        rightPages = handle.getNumberOfPages();
+        rbfm.closeFile(handle);
+        if(leftPages == 0 || rightPages == 0)return 0;
+
+        if((unsigned long long)leftPages * PAGE_SIZE > QE_HASH_MEMORY && part.level < QE_MAX_REPARTITION){
+            SpillScan left(part.left, leftAttrs), right(part.right, rightAttrs);
+            return partition(&left, &right, part.level + 1);
+        }
+
+        SpillScan left(part.left, leftAttrs);
+        BatchReader reader;
+        reader.init(&left);
+        const TupleBatch &batch = reader.batch;
+        AttrType type = leftAttrs[leftKey].type;
+        int i;
+        while((i = reader.next()) != QE_EOF){
+            if(batch.isNull(i, leftKey))continue;
+            unsigned len = batch.getAttributeSize(i, leftKey);
+            table.insert(batch.getTuple(i), batch.getTupleSize(i), batch.getAttributeOffset(i, leftKey),
+                         JoinHashTable::hash(batch.getAttribute(i, leftKey), len, type));
+        }
+        probe = new SpillScan(part.right, rightAttrs);
+        return 0;
     }
 
     RC GHJoin::getNextTuple(void *data) {
-        return -1;
+        if(leftKey == -1 || rightKey == -1)return QE_EOF;
+        if(!partitioned){
+            partitioned = true;
+            if(partition(leftIter, rightIter, 0) != 0)return QE_EOF;
+        }
+        while(true){
+            if(probing){
+                int i = table.next(rightData + rightKeyPos, rightHash, slot);
+                if(i != -1){
+                    unsigned size;
+                    const char* left = table.getTuple(i, size);
+                    Tool::mergeTwoTuple(leftAttrs, (char*)left, size, rightAttrs, rightData, rightSize, data);
+                    return 0;
+                }
+                probing = false;
+            }
+            if(probe != nullptr){
+                if(probe->getNextTuple(rightData) != QE_EOF){
+                    TupleView right(rightAttrs, rightData);
+                    if(!right.isNull(rightKey)){
+                        rightSize = right.getSize();
+                        rightKeyPos = right.getField(rightKey) - rightData;
+                        rightHash = JoinHashTable::hash(rightData + rightKeyPos, right.getFieldSize(rightKey),
+                                                        leftAttrs[leftKey].type);
+                        slot = table.start(rightHash);
+                        probing = true;
+                    }
+                    continue;
+                }
+                delete probe;
+                probe = nullptr;
+                table.clear();
+            }
+            if(pending.empty())return QE_EOF;
+            Partition part = pending.back();
+            pending.pop_back();
+            if(loadPartition(part) != 0)return QE_EOF;
+        }
     }
 
     RC GHJoin::getAttributes(std::vector<Attribute> &attrs) const {
-        return -1;
+        attrs.clear();
+        attrs = leftAttrs;
+        attrs.insert(attrs.end(), rightAttrs.begin(), rightAttrs.end());
+        return 0;
     }
 
-    Aggregate::Aggregate(Iterator *input, const Attribute &aggAttr, AggregateOp op) {
+    Sort::Sort(Iterator *input, const std::vector<std::string> &attrNames, unsigned numPages, bool descending) {
+        static unsigned sortCount = 0;
         this->iter = input;
-        this->aggAttr = aggAttr;
-        this->op = op;
-        this->done = false;
-        this->count = 0;
-        this->num = (op==MIN? std::numeric_limits<float>::max() : 0);
-        this->groupAttr.length = -1;
+        this->numPages = std::max(numPages, 3u);
+        this->descending = descending;
+        this->iter->getAttributes(attrs);
+        this->valid = !attrNames.empty();
+        for(auto &name: attrNames){
+            keys.push_back(getAttributeIndex(attrs, name));
+            if(keys.back() == -1)valid = false;
+        }
+        this->sorted = false;
+        this->next = 0;
+        this->prefix = "sort" + std::to_string(sortCount++) + "_";
+        this->fileCount = 0;
     }
 
-    Aggregate::Aggregate(Iterator *input, const Attribute &aggAttr, const Attribute &groupAttr, AggregateOp op) {
-        this->iter = input;
-        this->aggAttr = aggAttr;
-        this->op = op;
-        this->done = false;
-        this->count = 0;
-        this->num = (op==MIN? std::numeric_limits<float>::max() : 0);
-        this->groupAttr = groupAttr;
-        this->getAttributes(attributes);
-        this->initGroupBy();
+    Sort::~Sort() {
+        closeMerge();
+        RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
+        for(auto &run: runs)rbfm.destroyFile(run);
     }
 
-    Aggregate::~Aggregate() {}
+    RC Sort::getNextTuple(void *data) {
+        if(!valid)return QE_EOF;
+        if(!sorted){
+            sorted = true;
+            if(sort() != 0)return QE_EOF;
+        }
+        if(readers.empty()){
+            if(next == order.size())return QE_EOF;
+            unsigned i = order[next++];
+            memcpy(data, &arena[offsets[i]], sizes[i]);
+            return 0;
+        }
+        int winner = losers[0];
+        if(readers[winner].done)return QE_EOF;
+        memcpy(data, readers[winner].tuple.data(), readers[winner].size);
+        advance(winner);
+        adjust(winner);
+        return 0;
+    }
 
-    RC Aggregate::getNextTuple(void *data) {
-        if(this->groupAttr.length==-1){
-            return this->getNext(data);
-        } else {
-            return this->getNextWithGroup(data);
+    RC Sort::getAttributes(std::vector<Attribute> &attrs) const {
+        attrs = this->attrs;
+        return 0;
+    }
+
+    // Cut the input into sorted runs, then merge them until one merge can serve the output
+    RC Sort::sort() {
+        BatchReader reader;
+        reader.init(iter);
+        const TupleBatch &batch = reader.batch;
+        size_t budget = (size_t)numPages * PAGE_SIZE;
+        int i;
+        while((i = reader.next()) != QE_EOF){
+            unsigned size = batch.getTupleSize(i);
+            if(!offsets.empty() && arena.size() + size > budget && writeRun() != 0)return -1;
+            offsets.push_back(arena.size());
+            sizes.push_back(size);
+            arena.insert(arena.end(), batch.getTuple(i), batch.getTuple(i) + size);
+            for(auto key: keys)keyPos.push_back(batch.getAttributeOffset(i, key));
+        }
+
+        if(runs.empty()){
+            sortRun();
+            return 0;
         }
+
+        if(!offsets.empty() && writeRun() != 0)return -1;
+        size_t fanIn = numPages - 1;
+        while(runs.size() > fanIn){
+            if(mergeRuns(fanIn) != 0)return -1;
+        }
+        return openMerge(runs);
     }
 
-    RC Aggregate::getNextWithGroup(void* data) {
-        static auto iter = groupMap.begin();
-        char* val = new char [PAGE_SIZE];
-        while(iter!=groupMap.end()){
-            memset(val, 0, PAGE_SIZE);
-            int len = sizeof(int);
-            if(groupAttr.type==TypeVarChar){
-                memcpy(&len, iter->first.data, sizeof(int));
-                len+=sizeof(int);
-            }
-            memcpy(val+1, iter->first.data, len);
+    // Only the order of the tuples is sorted, the tuples stay where they are
+    void Sort::sortRun() {
+        order.resize(offsets.size());
+        for(unsigned j = 0; j < order.size(); j++)order[j] = j;
+        std::stable_sort(order.begin(), order.end(), [this](unsigned a, unsigned b) {
+            return compare(&arena[offsets[a]], &keyPos[a * keys.size()],
+                           &arena[offsets[b]], &keyPos[b * keys.size()]) < 0;
+        });
+    }
 
-            switch (op) {
-                case SUM:
-                case MIN:
-                case MAX:
-                {
+    // Sort the tuples in memory and write them to a new run file
+    RC Sort::writeRun() {
+        sortRun();
+        RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
+        std::string name = prefix + std::to_string(fileCount++);
+        FileHandle handle;
+        runs.push_back(name);
+        if(createSpillFile(name, handle) != 0)return -1;
+        RID rid;
+        RC rc = 0;
+        for(size_t j = 0; j < order.size() && rc == 0; j++){
+            rc = rbfm.insertRecord(handle, attrs, &arena[offsets[order[j]]], rid);
+        }
+        rbfm.closeFile(handle);
+        arena.clear();
+        offsets.clear();
+        sizes.clear();
+        keyPos.clear();
+        order.clear();
+        return rc;
+    }
+    // Merge the first count runs into a new one at the end
+    RC Sort::mergeRuns(size_t count) {
+        std::vector<std::string> names(runs.begin(), runs.begin() + count);
+        runs.erase(runs.begin(), runs.begin() + count);
+        RC rc = openMerge(names);
+        RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
+        std::string name = prefix + std::to_string(fileCount++);
+        FileHandle handle;
+        if(rc == 0){
+            runs.push_back(name);
+            rc = createSpillFile(name, handle);
+        }
+        RID rid;
+        while(rc == 0 && !readers[losers[0]].done){
+            int winner = losers[0];
+            rc = rbfm.insertRecord(handle, attrs, readers[winner].tuple.data(), rid);
+            advance(winner);
+            adjust(winner);
+        }
+        rbfm.closeFile(handle);
+        closeMerge();
+        for(auto &merged: names)rbfm.destroyFile(merged);
+        return rc;
+    }
 
-                    char* aggVal = new char [sizeof(int)+1];
-                    memset(aggVal, 0, sizeof(int)+1);
-                    if(aggAttr.type==TypeInt){
-                        int intNum = iter->second.second;
-                        memcpy(aggVal+1, &intNum, sizeof(int));
-                    }
-                    else memcpy(aggVal+1, &iter->second.second, sizeof(int));
-                    Tool::mergeTwoTuple({groupAttr}, val, len+1, {aggAttr}, aggVal, sizeof(int)+1, data);
-                    delete [] val;
-                    delete [] aggVal;
-                    iter++;
-                    return 0;
-                }
-                case COUNT:
-                {
-                    char* aggVal = new char [sizeof(int)+1];
-                    memset(aggVal, 0, sizeof(int)+1);
-                    memcpy(aggVal+1, &iter->second.first, sizeof(int));
-                    Tool::mergeTwoTuple({groupAttr}, val, len+1, {aggAttr}, aggVal, sizeof(int)+1, data);
-                    delete [] val;
-                    delete [] aggVal;
-                    iter++;
-                    return 0;
-                }
-                case AVG:
-                {
-                    if(iter->second.first==0){
-                        char* aggVal = new char [sizeof(int)+1];
-                        memset(aggVal, 0, sizeof(int)+1);
-                        memcpy(aggVal+1, &iter->second.second, sizeof(int));
-                        Tool::mergeTwoTuple({groupAttr}, val, len+1, {aggAttr}, aggVal, sizeof(int)+1, data);
-                        delete [] aggVal;
-                        delete [] val;
-                        iter++;
-                        return 0;
-                    }
-                    float avg = iter->second.second / iter->second.first;
-                    char* temp = new char [sizeof(float) + 1];
-                    memset(temp, 0, sizeof(float) + 1);
-                    memcpy(temp+1, &avg, sizeof(float));
-                    Tool:: mergeTwoTuple({groupAttr}, val, len+1, {aggAttr}, (char*)temp, sizeof(float)+1, data);
-                    delete[] temp;
-                    delete[] val;
-                    iter++;
-                    return 0;
-                }
-            }
+    RC Sort::openMerge(const std::vector<std::string> &names) {
+        closeMerge();
+        readers.resize(names.size());
+        for(size_t r = 0; r < names.size(); r++){
+            readers[r].scan = new SpillScan(names[r], attrs);
+            readers[r].tuple.resize(PAGE_SIZE);
+            readers[r].keyPos.resize(keys.size());
+            advance(r);
         }
-        delete [] val;
-        return -1;
+        // Every leaf is played in turn against a virtual leaf that beats them all
+        int k = readers.size();
+        losers.assign(k, k);
+        for(int r = k - 1; r >= 0; r--)adjust(r);
+        return 0;
     }
 
-    RC Aggregate::getNext(void* data){
-        if (this->done) return QE_EOF;
+    void Sort::closeMerge() {
+        for(auto &reader: readers)delete reader.scan;
+        readers.clear();
+        losers.clear();
+    }
 
-        char* tuple = new char [PAGE_SIZE];
-        char* key = new char [PAGE_SIZE];
-        float floatNum = 0;
-        int intNum = 0;
-        std::vector<Attribute> attrs;
-        iter->getAttributes(attrs);
-        memset(tuple, 0, PAGE_SIZE);
+    // Read the next tuple of a run
+    void Sort::advance(int r) {
+        RunReader &reader = readers[r];
+        reader.done = reader.scan->getNextTuple(reader.tuple.data()) == QE_EOF;
+        if(reader.done)return;
+        TupleView view(attrs, reader.tuple.data());
+        reader.size = view.getSize();
+        for(size_t k = 0; k < keys.size(); k++){
+            const char* field = view.getField(keys[k]);
+            reader.keyPos[k] = field == nullptr ? TupleBatch::NULL_POS : field - reader.tuple.data();
+        }
+    }
 
-        while(iter->getNextTuple(tuple) != QE_EOF){
-            this->count++;
-            RID rid;
-            Record record(attrs, tuple, rid);
-            memset(key, 0, PAGE_SIZE);
-            record.getAttribute(this->aggAttr.name, attrs, key);
-            char nullIndicator = key[0];
-            if(nullIndicator==-128)continue;
-            memcpy(&intNum, key+1, sizeof(int));
-            memcpy(&floatNum, key+1, sizeof(float));
-
-            switch (this->op) {
-                case MIN:
-                    if(this->aggAttr.type==TypeInt)this->num = std::min(this->num, (float)intNum);
-                    else this->num = std::min(this->num, floatNum);
-                    break;
-                case MAX:
-                    if(this->aggAttr.type==TypeInt)this->num = std::max(this->num, (float)intNum);
-                    else this->num = std::max(this->num, floatNum);
-                    break;
-                case AVG:
-                case SUM:
-                    if(this->aggAttr.type==TypeInt)this->num += intNum;
-                    else this->num += floatNum;
-                    break;
-            }
+    // Replay the matches from a leaf up to the root, every node keeps the loser
+    void Sort::adjust(int r) {
+        int winner = r;
+        for(size_t node = (r + readers.size()) / 2; node > 0; node /= 2){
+            if(beats(losers[node], winner))std::swap(losers[node], winner);
         }
+        losers[0] = winner;
+    }
+
+    // An exhausted run loses to everything, equal tuples come out in the order of their runs
+    bool Sort::beats(int r1, int r2) const {
+        int k = readers.size();
+        if(r1 == k)return true;
+        if(r2 == k)return false;
+        if(readers[r1].done)return false;
+        if(readers[r2].done)return true;
+        int c = compare(readers[r1].tuple.data(), readers[r1].keyPos.data(),
+                        readers[r2].tuple.data(), readers[r2].keyPos.data());
+        return c < 0 || (c == 0 && r1 < r2);
+    }
 
-        char nullIndicator = 0;
-        if(this->count==0){
-            nullIndicator = -128;
+    int Sort::compare(const char *tuple1, const unsigned *pos1, const char *tuple2, const unsigned *pos2) const {
+        for(size_t k = 0; k < keys.size(); k++){
+            bool null1 = pos1[k] == TupleBatch::NULL_POS, null2 = pos2[k] == TupleBatch::NULL_POS;
+            int c;
+            if(null1 || null2)c = (int)null2 - (int)null1;                  // A null comes first
+            else c = Predicate::compare(attrs[keys[k]].type, tuple1 + pos1[k], tuple2 + pos2[k]);
+            if(c != 0)return descending ? -c : c;
         }
-        memcpy(data, &nullIndicator, sizeof(char));
+        return 0;
+    }
 
-        switch(op){
-            // Use this.num to store all intermediate result
-            case MAX:
-            case MIN:
-            case SUM:
-                if(this->aggAttr.type==TypeInt) {
-                    int res = this->num;
-                    memcpy((char*)data + sizeof(char), &res, sizeof(int));
+    SortMergeJoin::SortMergeJoin(Iterator *leftIn, Iterator *rightIn, const Condition &condition, unsigned numPages) {
+        this->condition = condition;
+        leftIn->getAttributes(this->leftAttrs);
+        rightIn->getAttributes(this->rightAttrs);
+        this->leftKey = getAttributeIndex(leftAttrs, condition.lhsAttr);
+        this->rightKey = condition.bRhsIsAttr ? getAttributeIndex(rightAttrs, condition.rhsAttr) : -1;
+        // Matches of LT and LE are a prefix of the right input when both are in descending order
+        bool descending = condition.op == LT_OP || condition.op == LE_OP;
+        this->leftSort = new Sort(leftIn, {condition.lhsAttr}, numPages, descending);
+        this->rightSort = new Sort(rightIn, {condition.rhsAttr}, numPages, descending);
+        if(leftKey != -1)match.compile(leftAttrs[leftKey].type, condition.op);
+        this->started = false;
+        this->hasLeft = false;
+        this->hasRight = false;
+        this->leftData.resize(PAGE_SIZE);
+        this->rightData.resize(PAGE_SIZE);
+        this->pos = 0;
+        clearWindow();
+    }
+
+    SortMergeJoin::~SortMergeJoin() {
+        delete leftSort;
+        delete rightSort;
+    }
+
+    RC SortMergeJoin::getNextTuple(void *data) {
+        if(leftKey == -1 || rightKey == -1 || condition.op == NE_OP || condition.op == NO_OP)return QE_EOF;
+        AttrType type = leftAttrs[leftKey].type;
+        if(!started){
+            started = true;
+            hasRight = nextRight();
+        }
+        while(true){
+            if(hasLeft && pos + 1 < windowOffsets.size()){
+                unsigned start = windowOffsets[pos], end = windowOffsets[pos + 1];
+                Tool::mergeTwoTuple(leftAttrs, leftData.data(), leftSize, rightAttrs, &window[start], end - start, data);
+                pos++;
+                return 0;
+            }
+            hasLeft = nextLeft();
+            if(!hasLeft)return QE_EOF;
+            pos = 0;
+            const char* key = leftData.data() + leftKeyPos;
+            if(condition.op != EQ_OP){
+                while(hasRight && match(key, rightData.data() + rightKeyPos)){
+                    addToWindow();
+                    hasRight = nextRight();
                 }
-                else memcpy((char*)data + sizeof(char), &this->num, sizeof(float));
-                break;
-            case COUNT:
-            {
-                float res = this->count;
-                memcpy((char*)data + sizeof(char), &res, sizeof(float));
-                break;
+                continue;
             }
-            case AVG:
-            {
-                float avg = (this->count == 0 ? 0 : this->num / this->count);
-                memcpy((char*)data + sizeof(char), &avg, sizeof(float));
-                break;
+            // Left tuples with the same key share the window
+            if(!windowKey.empty() && Predicate::compare(type, key, windowKey.data()) == 0)continue;
+            clearWindow();
+            windowKey.assign(key, key + leftKeyLen);
+            while(hasRight && Predicate::compare(type, rightData.data() + rightKeyPos, key) < 0)hasRight = nextRight();
+            while(hasRight && Predicate::compare(type, rightData.data() + rightKeyPos, key) == 0){
+                addToWindow();
+                hasRight = nextRight();
             }
         }
+    }
 
-        this->done = true;
-        delete [] tuple;
-        delete [] key;
+    RC SortMergeJoin::getAttributes(std::vector<Attribute> &attrs) const {
+        attrs = leftAttrs;
+        attrs.insert(attrs.end(), rightAttrs.begin(), rightAttrs.end());
         return 0;
     }
 
-    RC Aggregate::getAttributes(std::vector<Attribute> &attrs) const {
-        attrs.clear();
-        if(groupAttr.length!=-1){
-            attrs.push_back(groupAttr);
+    // The next left tuple with a key
+    bool SortMergeJoin::nextLeft() {
+        while(leftSort->getNextTuple(leftData.data()) != QE_EOF){
+            TupleView view(leftAttrs, leftData.data());
+            if(view.isNull(leftKey))continue;
+            leftSize = view.getSize();
+            leftKeyPos = view.getField(leftKey) - leftData.data();
+            leftKeyLen = view.getFieldSize(leftKey);
+            return true;
         }
-        std::string name;
-        switch(this->op){
-            case MIN:
-                name = "MIN";
-                break;
-            case MAX:
-                name = "MAX";
-                break;
-            case COUNT:
-                name = "COUNT";
-                break;
-            case SUM:
-                name = "SUM";
-                break;
-            case AVG:
-                name = "AVG";
-                break;
+        return false;
+    }
+
+    bool SortMergeJoin::nextRight() {
+        while(rightSort->getNextTuple(rightData.data()) != QE_EOF){
+            TupleView view(rightAttrs, rightData.data());
+            if(view.isNull(rightKey))continue;
+            rightSize = view.getSize();
+            rightKeyPos = view.getField(rightKey) - rightData.data();
+            return true;
+        }
+        return false;
+    }
+
+    void SortMergeJoin::addToWindow() {
+        window.insert(window.end(), rightData.begin(), rightData.begin() + rightSize);
+        windowOffsets.push_back(window.size());
+    }
+
+    void SortMergeJoin::clearWindow() {
+        window.clear();
+        windowOffsets.assign(1, 0);
+        windowKey.clear();
+    }
+
+    static std::string getAggregateName(const AggregateSpec &spec) {
+        static const char* names[] = {"MIN", "MAX", "COUNT", "SUM", "AVG"};
+        return std::string(names[spec.op]) + "(" + spec.attr.name + ")";
+    }
+
+    HashAggregate::HashAggregate(Iterator *input, const std::vector<Attribute> &groupAttrs,
+                                 const std::vector<AggregateSpec> &aggregates, size_t memory) {
+        static unsigned aggregateCount = 0;
+        this->iter = input;
+        this->groupAttrs = groupAttrs;
+        this->aggregates = aggregates;
+        this->memory = memory;
+        this->iter->getAttributes(inputAttrs);
+        // The values are read with the types of the input
+        this->valid = true;
+        for(auto &attr: this->groupAttrs){
+            groupIndex.push_back(getAttributeIndex(inputAttrs, attr.name));
+            if(groupIndex.back() == -1)valid = false;
+            else attr.type = inputAttrs[groupIndex.back()].type;
         }
-        std::string attrName = name + "(" + this->aggAttr.name + ")";
-        Attribute attr;
-        attr.name = attrName;
-        attr.type = this->aggAttr.type;
-        if(this->op==AVG){
-            attr.type = TypeReal;
+        for(auto &spec: this->aggregates){
+            aggIndex.push_back(getAttributeIndex(inputAttrs, spec.attr.name));
+            if(aggIndex.back() == -1)valid = false;
+            else spec.attr.type = inputAttrs[aggIndex.back()].type;
         }
-        attr.length = this->aggAttr.length;
-        attrs.push_back(attr);
-        return 0;
+        this->key.resize(PAGE_SIZE);
+        this->prefix = "hashagg" + std::to_string(aggregateCount++) + "_";
+        this->started = false;
+        clear();
     }
 
-    void Aggregate::initGroupBy() {
-        char* attrData = new char [PAGE_SIZE];
-        char* tuple = new char [PAGE_SIZE];
-        char* val = new char [PAGE_SIZE];
-        memset(tuple, 0, PAGE_SIZE);
-        while(iter->getNextTuple(tuple) != QE_EOF) {
-            memset(attrData, 0, PAGE_SIZE);
-            RID rid;
-            Record nextRecord(attributes, tuple, rid);
-            nextRecord.getAttribute(groupAttr.name, attributes, attrData);
-            char nullIndicator = attrData[0];
-            if (nullIndicator == -128)continue;
-            Key* key = new Key(attrData + 1, groupAttr.type);
-
-            if (groupMap.find(*key) == groupMap.end()) {
-                float num = (op==MIN? std::numeric_limits<float>::max() : 0);
-                groupMap.insert({*key, {0, num}});
+    HashAggregate::~HashAggregate() {
+        closeSpills();
+        RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
+        for(auto &file: files)rbfm.destroyFile(file);
+    }
+
+    RC HashAggregate::getNextTuple(void *data) {
+        if(!valid)return QE_EOF;
+        if(!started){
+            started = true;
+            if(aggregate(iter, 0) != 0)return QE_EOF;
+            if(groupAttrs.empty() && groups.empty())insertGroup(0, 0);
+        }
+        while(next == groups.size()){
+            if(pending.empty())return QE_EOF;
+            auto part = pending.back();
+            pending.pop_back();
+            clear();
+            SpillScan scan(part.first, inputAttrs);
+            if(aggregate(&scan, part.second) != 0)return QE_EOF;
+        }
+
+        const Group &group = groups[next];
+        const Accumulator* acc = &accumulators[next * aggregates.size()];
+        TupleBuilder builder;
+        builder.start(data, groupAttrs.size() + aggregates.size());
+        builder.addFields(arena.data() + group.offset, groupAttrs.size(), group.size);
+        for(unsigned j = 0; j < aggregates.size(); j++){
+            AttrType type = aggregates[j].attr.type;
+            if(aggregates[j].op == COUNT){
+                builder.addInt(acc[j].count);
+                continue;
             }
-            int id = 0;
-            for(;id<attributes.size();id++){
-                if(attributes[id].name==groupAttr.name)break;
+            // Nothing to aggregate, or nothing but VarChars
+            if(acc[j].count == 0 || type == TypeVarChar){
+                builder.addNull();
+                continue;
             }
-            int intNum = 0;
-            float floatNum = 0;
-            memset(val, 0, PAGE_SIZE);
-            std::string attrName = getAggName();
-            nextRecord.getAttribute(attrName, attributes, val);
-            memcpy(&intNum, val+1, sizeof(int));
-            memcpy(&floatNum, val+1, sizeof(int));
-            nullIndicator = val[0];
-            switch(op) {
+            switch(aggregates[j].op){
                 case MIN:
-                    if(nullIndicator!=-128){
-                        if(aggAttr.type==TypeInt)groupMap[*key].second = std::min(groupMap[*key].second, (float)intNum);
-                        else groupMap[*key].second = std::min(groupMap[*key].second, floatNum);
-                    }
+                    if(type == TypeInt)builder.addInt(acc[j].min.i);
+                    else builder.addReal(acc[j].min.r);
                     break;
                 case MAX:
-                    if(nullIndicator!=-128){
-                        if(aggAttr.type==TypeInt)groupMap[*key].second = std::max(groupMap[*key].second, (float)intNum);
-                        else groupMap[*key].second = std::max(groupMap[*key].second, floatNum);
-                    }
-                    break;
-                case COUNT:
-                    if(nullIndicator!=-128){
-                        groupMap[*key].first++;
-                    }
+                    if(type == TypeInt)builder.addInt(acc[j].max.i);
+                    else builder.addReal(acc[j].max.r);
                     break;
                 case SUM:
+                    if(type == TypeInt)builder.addInt(acc[j].sum.i);
+                    else builder.addReal(acc[j].sum.r);
+                    break;
                 case AVG:
-                    if(nullIndicator!=-128){
-                        if(aggAttr.type==TypeInt)groupMap[*key].second+=intNum;
-                        else groupMap[*key].second+=floatNum;
-                        groupMap[*key].first++;
-                    }
+                    if(type == TypeInt)builder.addReal((double)acc[j].sum.i / acc[j].count);
+                    else builder.addReal(acc[j].sum.r / acc[j].count);
+                    break;
+                default:
                     break;
             }
         }
-        delete [] attrData;
-        delete [] tuple;
-        delete [] val;
+        next++;
+        return 0;
     }
 
-    std::string Aggregate::getAggName() {
-        std::string name;
-        switch(this->op){
-            case MIN:
-                name = "MIN";
-                break;
-            case MAX:
-                name = "MAX";
-                break;
-            case COUNT:
-                name = "COUNT";
-                break;
-            case SUM:
-                name = "SUM";
-                break;
-            case AVG:
-                name = "AVG";
-                break;
+    RC HashAggregate::getAttributes(std::vector<Attribute> &attrs) const {
+        attrs = groupAttrs;
+        for(auto &spec: aggregates){
+            Attribute attr = spec.attr;
+            attr.name = getAggregateName(spec);
+            if(spec.op == COUNT || spec.op == AVG){
+                attr.type = spec.op == COUNT ? TypeInt : TypeReal;
+                attr.length = sizeof(int);
+            }
+            attrs.push_back(attr);
+        }
+        return 0;
+    }
+
+    // Fold an input into the groups in memory. Past the memory budget, tuples of groups not in memory yet
+    // are spilled, unless the input is a partition already split QE_MAX_REPARTITION times.
+    RC HashAggregate::aggregate(Iterator *input, unsigned level) {
+        BatchReader reader;
+        reader.init(input);
+        const TupleBatch &batch = reader.batch;
+        TupleBuilder builder;
+        RC rc = 0;
+        int i;
+        while(rc == 0 && (i = reader.next()) != QE_EOF){
+            builder.start(key.data(), groupAttrs.size());
+            for(unsigned j = 0; j < groupIndex.size(); j++){
+                const char* value = batch.getAttribute(i, groupIndex[j]);
+                if(value == nullptr){
+                    builder.addNull();
+                    continue;
+                }
+                if(groupAttrs[j].type == TypeReal){
+                    float real;
+                    memcpy(&real, value, sizeof(float));
+                    // -0.0 is in the group of 0.0
+                    builder.addReal(real == 0 ? 0 : real);
+                    continue;
+                }
+                builder.addField(value, batch.getAttributeSize(i, groupIndex[j]));
+            }
+            unsigned size = builder.getSize();
+            unsigned long long hash = JoinHashTable::hash(key.data(), size, TypeInt);
+            int g = find(size, hash);
+            if(g == -1){
+                if(level < QE_MAX_REPARTITION && !groups.empty() && used() > memory){
+                    rc = spill(batch.getTuple(i), size, level);
+                    continue;
+                }
+                g = insertGroup(size, hash);
+            }
+            Accumulator* acc = &accumulators[g * aggregates.size()];
+            for(unsigned j = 0; j < aggIndex.size(); j++){
+                const char* value = batch.getAttribute(i, aggIndex[j]);
+                if(value != nullptr)accumulate(acc[j], aggregates[j].attr.type, value);
+            }
+        }
+        closeSpills();
+        return rc;
+    }
+
+    // The partitions of a pass are created with its first spilled tuple
+    RC HashAggregate::spill(const char *tuple, unsigned keySize, unsigned level) {
+        RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
+        if(spillHandles.empty()){
+            for(unsigned i = 0; i < QE_AGG_PARTITIONS; i++){
+                std::string name = prefix + std::to_string(files.size());
+                spillHandles.push_back(new FileHandle());
+                files.push_back(name);
+                if(createSpillFile(name, *spillHandles.back()) != 0)return -1;
+                pending.push_back({name, level + 1});
+            }
+        }
+        unsigned long long hash = JoinHashTable::hash(key.data(), keySize, TypeInt, level + 1);
+        RID rid;
+        return rbfm.insertRecord(*spillHandles[hash % QE_AGG_PARTITIONS], inputAttrs, tuple, rid);
+    }
+
+    void HashAggregate::closeSpills() {
+        RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
+        for(auto handle: spillHandles){
+            rbfm.closeFile(*handle);
+            delete handle;
+        }
+        spillHandles.clear();
+    }
+
+    // MIN, MAX and SUM are all kept, whichever is asked for
+    void HashAggregate::accumulate(Accumulator &acc, AttrType type, const char *value) {
+        bool first = acc.count++ == 0;
+        if(type == TypeInt){
+            int v;
+            memcpy(&v, value, sizeof(int));
+            acc.sum.i += v;
+            if(first || v < acc.min.i)acc.min.i = v;
+            if(first || v > acc.max.i)acc.max.i = v;
+        } else if(type == TypeReal){
+            float v;
+            memcpy(&v, value, sizeof(float));
+            acc.sum.r += v;
+            if(first || v < acc.min.r)acc.min.r = v;
+            if(first || v > acc.max.r)acc.max.r = v;
         }
-        return name+"("+aggAttr.name+")";
+    }
+
+    // Group keyed by the tuple in key, -1 if there is none
+    int HashAggregate::find(unsigned size, unsigned long long hash) const {
+        size_t slot = hash & mask;
+        while(slots[slot] != -1){
+            const Group &group = groups[slots[slot]];
+            if(group.hash == hash && group.size == size && memcmp(arena.data() + group.offset, key.data(), size) == 0)
+                return slots[slot];
+            slot = (slot + 1) & mask;
+        }
+        return -1;
+    }
+
+    int HashAggregate::insertGroup(unsigned size, unsigned long long hash) {
+        if((groups.size() + 1) * 2 > slots.size())grow();
+        groups.push_back({hash, (unsigned)arena.size(), size});
+        arena.insert(arena.end(), key.data(), key.data() + size);
+        accumulators.resize(accumulators.size() + aggregates.size(), Accumulator());
+        size_t slot = hash & mask;
+        while(slots[slot] != -1)slot = (slot + 1) & mask;
+        slots[slot] = groups.size() - 1;
+        return groups.size() - 1;
+    }
+
+    void HashAggregate::grow() {
+        size_t size = slots.size() * 2;
+        slots.assign(size, -1);
+        mask = size - 1;
+        for(size_t i = 0; i < groups.size(); i++){
+            size_t slot = groups[i].hash & mask;
+            while(slots[slot] != -1)slot = (slot + 1) & mask;
+            slots[slot] = i;
+        }
+    }
+
+    void HashAggregate::clear() {
+        arena.clear();
+        groups.clear();
+        accumulators.clear();
+        slots.assign(16, -1);
+        mask = 15;
+        next = 0;
+    }
+
+    size_t HashAggregate::used() const {
+        return arena.size() + groups.size() * sizeof(Group) + accumulators.size() * sizeof(Accumulator)
+               + slots.size() * sizeof(int);
+    }
+
+    Aggregate::Aggregate(Iterator *input, const Attribute &aggAttr, AggregateOp op) {
+        this->hashAggregate = new HashAggregate(input, {}, {{aggAttr, op}});
+    }
+
+    Aggregate::Aggregate(Iterator *input, const Attribute &aggAttr, const Attribute &groupAttr, AggregateOp op) {
+        this->hashAggregate = new HashAggregate(input, {groupAttr}, {{aggAttr, op}});
+    }
+
+    Aggregate::~Aggregate() {
+        delete hashAggregate;
+    }
+
+    RC Aggregate::getNextTuple(void *data) {
+        return hashAggregate->getNextTuple(data);
+    }
+
+    RC Aggregate::getAttributes(std::vector<Attribute> &attrs) const {
+        return hashAggregate->getAttributes(attrs);
     }
 } // namespace PeterDB
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <cstring>
 #include <climits>
+#include <algorithm>
 #include "src/include/rbfm.h"
 
 namespace PeterDB {
@@ -18,9 +19,9 @@ namespace PeterDB {
 
     RecordBasedFileManager &RecordBasedFileManager::operator=(const RecordBasedFileManager &) = default;
 
-    RC RecordBasedFileManager::createFile(const std::string &fileName) {
+    RC RecordBasedFileManager::createFile(const std::string &fileName, unsigned pageSize) {
         PagedFileManager& pfm = PagedFileManager::instance();
-        return pfm.createFile(fileName);
+        return pfm.createFile(fileName, pageSize);
     }
 
     RC RecordBasedFileManager::destroyFile(const std::string &fileName) {
@@ -28,9 +29,9 @@ namespace PeterDB {
         return pfm.destroyFile(fileName);
     }
 
-    RC RecordBasedFileManager::openFile(const std::string &fileName, FileHandle& fileHandle) {
+    RC RecordBasedFileManager::openFile(const std::string &fileName, FileHandle& fileHandle, bool mapped) {
         PagedFileManager& pfm = PagedFileManager::instance();
-        return pfm.openFile(fileName, fileHandle);
+        return pfm.openFile(fileName, fileHandle, mapped);
     }
 
     RC RecordBasedFileManager::closeFile(FileHandle &fileHandle) {
@@ -39,15 +40,17 @@ namespace PeterDB {
     }
 
     RC RecordBasedFileManager::appendNewPage(FileHandle &fileHandle) {
-        char* page = new char [PAGE_SIZE];
-        memset(page,0,PAGE_SIZE);
+        unsigned pageSize = fileHandle.getPageSize();
+        char* page = new char [pageSize];
+        memset(page,0,pageSize);
         const unsigned info[3] = {sizeof (unsigned)*PAGE_INFO_NUM, 0, 0};
-        memcpy((void *) (page + PAGE_SIZE - sizeof(unsigned) * PAGE_INFO_NUM), info, sizeof(unsigned) * PAGE_INFO_NUM);
+        memcpy((void *) (page + pageSize - sizeof(unsigned) * PAGE_INFO_NUM), info, sizeof(unsigned) * PAGE_INFO_NUM);
 
-        fileHandle.appendPage(page);
+        RC rc = fileHandle.appendPage(page);
+        if(rc == 0)fileHandle.setPageSpace(fileHandle.getNumberOfPages()-1, getFreeSpace(page, pageSize));
 
         delete[] page;
-        return 0;
+        return rc;
     }
 
     /*
@@ -60,6 +63,9 @@ namespace PeterDB {
     // Extrem case: the old record is smalller than the size of a tombstone
     RC RecordBasedFileManager::insertRecord(FileHandle &fileHandle, const std::vector<Attribute> &recordDescriptor,
                                             const void *data, RID &rid) {
+        if(fileHandle.isMapped())return -1;
+        if(TupleView(recordDescriptor, data).getSize() > PAGE_SIZE)return -1;
+        LogGuard guard;
         if(fileHandle.getNumberOfPages() == 0) {
             appendNewPage(fileHandle);
         }
@@ -71,11 +77,11 @@ namespace PeterDB {
          *  - update the slot information at the back of this page
          */
 
-        memset(fileHandle.pageData, 0, PAGE_SIZE);
+        memset(fileHandle.pageData, 0, fileHandle.getPageSize());
         unsigned lastPageNum = fileHandle.getNumberOfPages()-1;
         unsigned pageNum = getNextAvailablePageNum(record.size + SLOT_SIZE + sizeof(RID), fileHandle, lastPageNum);
         fileHandle.readPage(pageNum, (void *) fileHandle.pageData);
-        unsigned slotID = getSlotNum(fileHandle.pageData);
+        unsigned slotID = getSlotNum(fileHandle.pageData, fileHandle.getPageSize());
         rid.pageNum = pageNum;
         rid.slotNum = slotID;
         writeRecord(record, fileHandle, pageNum, rid, fileHandle.pageData);
@@ -83,25 +89,26 @@ namespace PeterDB {
         return 0;
     }
 
-    unsigned RecordBasedFileManager::getSlotNum(char* pageData){
+    unsigned RecordBasedFileManager::getSlotNum(char* pageData, unsigned pageSize){
         auto* info = new unsigned [PAGE_INFO_NUM];
         memset(info, 0, sizeof(unsigned)*PAGE_INFO_NUM);
-        getInfo(pageData, info);
-        auto slotID = getDeletedSlot(pageData);
+        getInfo(pageData, info, pageSize);
+        auto slotID = getDeletedSlot(pageData, pageSize);
         if(slotID<0){
             slotID = info[SLOT_NUM];
             info[SLOT_NUM]++;
             info[INFO_OFFSET] += SLOT_SIZE;
         }
-        memcpy((void*)(pageData + PAGE_SIZE - sizeof(unsigned) * PAGE_INFO_NUM), info, sizeof(unsigned) * PAGE_INFO_NUM);
+        memcpy((void*)(pageData + pageSize - sizeof(unsigned) * PAGE_INFO_NUM), info, sizeof(unsigned) * PAGE_INFO_NUM);
         delete [] info;
         return slotID;
     }
 
     void RecordBasedFileManager::writeRecord(const Record& record, FileHandle &handle, unsigned num, RID &rid, char* data) {
+        unsigned pageSize = handle.getPageSize();
         auto* info = new unsigned [PAGE_INFO_NUM];
         memset(info, 0, sizeof(unsigned)*PAGE_INFO_NUM);
-        getInfo(data, info);
+        getInfo(data, info, pageSize);
         // Write the record to page
         memcpy(data+info[DATA_OFFSET], record.data, record.size);
         memcpy(data+info[DATA_OFFSET]+ record.size, &rid, sizeof(RID));
@@ -109,29 +116,30 @@ namespace PeterDB {
         std::pair<unsigned ,unsigned> newSlot;
         newSlot = {info[DATA_OFFSET], record.size+sizeof(RID)};
 
-        writeSlotInfo(rid.slotNum, data, newSlot);
+        writeSlotInfo(rid.slotNum, data, newSlot, pageSize);
         // Update information
         info[DATA_OFFSET] += record.size+sizeof(RID);
         // Write back
-        memcpy((void*)(data + PAGE_SIZE - sizeof(unsigned) * PAGE_INFO_NUM), info, sizeof(unsigned) * PAGE_INFO_NUM);
+        memcpy((void*)(data + pageSize - sizeof(unsigned) * PAGE_INFO_NUM), info, sizeof(unsigned) * PAGE_INFO_NUM);
         // Write to disk
         handle.writePage(num, data);
+        handle.setPageSpace(num, getFreeSpace(data, pageSize));
 
         delete [] info;
     }
 
-    void RecordBasedFileManager::getInfo(char* data, unsigned *info){
-        memcpy(info, data + PAGE_SIZE - sizeof(unsigned)*PAGE_INFO_NUM, sizeof(unsigned)*PAGE_INFO_NUM);
+    void RecordBasedFileManager::getInfo(char* data, unsigned *info, unsigned pageSize){
+        memcpy(info, data + pageSize - sizeof(unsigned)*PAGE_INFO_NUM, sizeof(unsigned)*PAGE_INFO_NUM);
     }
 
-    int RecordBasedFileManager::getDeletedSlot(char* data){
+    int RecordBasedFileManager::getDeletedSlot(char* data, unsigned pageSize){
         auto* info = new unsigned [PAGE_INFO_NUM];
         memset(info, 0, sizeof(unsigned)*PAGE_INFO_NUM);
-        getInfo(data, info);
+        getInfo(data, info, pageSize);
         auto slotNum = (info[INFO_OFFSET]-sizeof(short)*PAGE_INFO_NUM)/SLOT_SIZE;
         for(unsigned i=0;i<slotNum;i++){
-            auto slot = getSlotInfo(i, data);
-            if(slot.first==5000) {
+            auto slot = getSlotInfo(i, data, pageSize);
+            if(slot.first >= pageSize) {
                 delete [] info;
                 return i;
             }
@@ -143,10 +151,10 @@ namespace PeterDB {
     // Should also return the flag information and stick to the format as before
     RC RecordBasedFileManager::readRecord(FileHandle &fileHandle, const std::vector<Attribute> &recordDescriptor,
                                           const RID &rid, void *data) {
-        memset(fileHandle.pageData, 0, PAGE_SIZE);
+        memset(fileHandle.pageData, 0, fileHandle.getPageSize());
         if(fileHandle.readPage(rid.pageNum, fileHandle.pageData)==0){
-            auto slot = getSlotInfo(rid.slotNum, fileHandle.pageData);
-            if(slot.first==5000)return -1;
+            auto slot = getSlotInfo(rid.slotNum, fileHandle.pageData, fileHandle.getPageSize());
+            if(slot.first >= fileHandle.getPageSize())return -1;
 
             auto data_offset = fileHandle.pageData+slot.first;
             if(isTomb(data_offset)){
@@ -159,23 +167,71 @@ namespace PeterDB {
         return -1;
     }
 
+    // Records on the same page as the one before them are read from the page already at hand
+    RC RecordBasedFileManager::readRecords(FileHandle &fileHandle, const std::vector<Attribute> &recordDescriptor,
+                                           const std::vector<RID> &rids, std::vector<char> &data,
+                                           std::vector<unsigned> &ends) {
+        data.clear();
+        ends.clear();
+        char* page = nullptr;
+        bool pinned = false;
+        unsigned pageNum = 0;
+        unsigned pageSize = fileHandle.getPageSize();
+        std::vector<char> pageBuffer;
+        for(auto &rid: rids){
+            if(page == nullptr || rid.pageNum != pageNum){
+                if(pinned)fileHandle.unpinPage(pageNum);
+                pageNum = rid.pageNum;
+                page = fileHandle.pinPage(pageNum);
+                pinned = page != nullptr;
+                if(!pinned){
+                    pageBuffer.resize(pageSize);
+                    page = pageBuffer.data();
+                    if(fileHandle.readPage(pageNum, page) != 0){
+                        page = nullptr;
+                        ends.push_back(data.size());
+                        continue;
+                    }
+                }
+            }
+            size_t start = data.size();
+            data.resize(start + pageSize);
+            auto slot = getSlotInfo(rid.slotNum, page, pageSize);
+            if(slot.first >= pageSize){
+                data.resize(start);
+            } else if(isTomb(page + slot.first)){
+                if(readRecord(fileHandle, recordDescriptor, getPointRID(page + slot.first), &data[start]) != 0)
+                    data.resize(start);
+                else data.resize(start + TupleView(recordDescriptor, &data[start]).getSize());
+            } else {
+                short fieldNum = *(short*)(page + slot.first);
+                fetchRecord(slot.first, slot.second, &data[start], page);
+                data.resize(start + slot.second - FIELD_NUM_SIZE - INDEX_SIZE * fieldNum - sizeof(RID));
+            }
+            ends.push_back(data.size());
+        }
+        if(pinned)fileHandle.unpinPage(pageNum);
+        return 0;
+    }
+
     /*
      * Get the slot from disk
      * Slot:
      *  first: offset from the beginning
      *  second: The record size
      * Deleted:
-     *  first = 5000
+     *  first = DELETED_SLOT
      *  second = 0
     */
-    std::pair<unsigned, unsigned> RecordBasedFileManager::getSlotInfo(unsigned slotNum, const char* data) {
-        void* slotPtr = (void *) (data + PAGE_SIZE - sizeof(unsigned) * PAGE_INFO_NUM - (slotNum + 1) * SLOT_SIZE);
+    std::pair<unsigned, unsigned> RecordBasedFileManager::getSlotInfo(unsigned slotNum, const char* data, unsigned pageSize) {
+        void* slotPtr = (void *) (data + pageSize - sizeof(unsigned) * PAGE_INFO_NUM - (slotNum + 1) * SLOT_SIZE);
         return reinterpret_cast<std::pair<unsigned ,unsigned>*>(slotPtr)[0];
     }
 
-    void RecordBasedFileManager::writeSlotInfo(unsigned slotNum, const char* data, std::pair<unsigned, unsigned> slot){
+    void RecordBasedFileManager::writeSlotInfo(unsigned slotNum, const char* data, std::pair<unsigned, unsigned> slot,
+                                               unsigned pageSize){
         auto info_offset = sizeof(unsigned)*PAGE_INFO_NUM + slotNum*SLOT_SIZE;
-        memcpy((void *) (data + PAGE_SIZE - info_offset - SLOT_SIZE), &slot, SLOT_SIZE);
+        memcpy((void *) (data + pageSize - info_offset - SLOT_SIZE), &slot, SLOT_SIZE);
     }
 
     void RecordBasedFileManager::fetchRecord(int offset, int recordSize, void *data, void *page) {
@@ -242,12 +298,15 @@ namespace PeterDB {
      */
     RC RecordBasedFileManager::deleteRecord(FileHandle &fileHandle, const std::vector<Attribute> &recordDescriptor,
                                             const RID &rid) {
-        memset(fileHandle.pageData, 0, PAGE_SIZE);
+        if(fileHandle.isMapped())return -1;
+        LogGuard guard;
+        unsigned pageSize = fileHandle.getPageSize();
+        memset(fileHandle.pageData, 0, pageSize);
         fileHandle.readPage(rid.pageNum, fileHandle.pageData);
-        auto slot = getSlotInfo(rid.slotNum, fileHandle.pageData);
+        auto slot = getSlotInfo(rid.slotNum, fileHandle.pageData, pageSize);
         auto* info = new unsigned [PAGE_INFO_NUM];
         memset(info, 0, sizeof(unsigned)*PAGE_INFO_NUM);
-        getInfo(fileHandle.pageData, info);
+        getInfo(fileHandle.pageData, info, pageSize);
         auto data_offset = fileHandle.pageData+slot.first;
 
         if(isTomb(data_offset)){
@@ -256,14 +315,14 @@ namespace PeterDB {
             deleteRecord(fileHandle, recordDescriptor, getPointRID(data_offset));
         }
         // Read updated page data
-        memset(fileHandle.pageData, 0, PAGE_SIZE);
+        memset(fileHandle.pageData, 0, fileHandle.getPageSize());
         fileHandle.readPage(rid.pageNum, fileHandle.pageData);
         // shift record data to reuse empty space
         memset(fileHandle.pageData+slot.first, 0, slot.second);
-        shiftRecord(fileHandle.pageData, slot.first, 0, slot.second, info[DATA_OFFSET]-slot.first-slot.second);
+        shiftRecord(fileHandle.pageData, slot.first, 0, slot.second, info[DATA_OFFSET]-slot.first-slot.second, pageSize);
         info[DATA_OFFSET] -= slot.second;
-        slot.first = DELETE_MARK;
-        auto slotPos = fileHandle.pageData + PAGE_SIZE - sizeof(unsigned )*PAGE_INFO_NUM-(rid.slotNum+1)*SLOT_SIZE;
+        slot.first = DELETED_SLOT;
+        auto slotPos = fileHandle.pageData + pageSize - sizeof(unsigned )*PAGE_INFO_NUM-(rid.slotNum+1)*SLOT_SIZE;
         memcpy(slotPos, &slot, SLOT_SIZE);
         updateInfo(fileHandle, fileHandle.pageData, rid.pageNum, info);
         fileHandle.writePage(rid.pageNum, fileHandle.pageData);
@@ -277,15 +336,20 @@ namespace PeterDB {
      */
     RC RecordBasedFileManager::updateRecord(FileHandle &fileHandle, const std::vector<Attribute> &recordDescriptor,
                                             const void *data, const RID &rid) {
+        if(fileHandle.isMapped())return -1;
+        if(TupleView(recordDescriptor, data).getSize() > PAGE_SIZE)return -1;
+        // Moving the record and leaving the tombstone behind is one atomic change
+        LogGuard guard;
         RID cpy = {rid.pageNum, rid.slotNum};
         Record record(recordDescriptor, data, cpy);
 
-        memset(fileHandle.pageData, 0, PAGE_SIZE);
+        unsigned pageSize = fileHandle.getPageSize();
+        memset(fileHandle.pageData, 0, pageSize);
         fileHandle.readPage(rid.pageNum, fileHandle.pageData);
-        auto slot = getSlotInfo(rid.slotNum, fileHandle.pageData);
+        auto slot = getSlotInfo(rid.slotNum, fileHandle.pageData, pageSize);
         auto* info = new unsigned [PAGE_INFO_NUM];
         memset(info, 0, sizeof(unsigned)*PAGE_INFO_NUM);
-        getInfo(fileHandle.pageData, info);
+        getInfo(fileHandle.pageData, info, pageSize);
 
         auto data_offset = fileHandle.pageData+slot.first;
         if(isTomb(data_offset)){
@@ -301,13 +365,14 @@ namespace PeterDB {
 
         if(record.size<=oldRecord.size){
             memcpy(data_offset, record.data, record.size);
-            shiftRecord(fileHandle.pageData, slot.first, record.size+sizeof(RID), slot.second, info[DATA_OFFSET]-slot.first-slot.second);
+            shiftRecord(fileHandle.pageData, slot.first, record.size+sizeof(RID), slot.second, info[DATA_OFFSET]-slot.first-slot.second,
+                        pageSize);
             writeUpdateInfo(fileHandle, info, slot, record.size, oldRecord.size, rid, fileHandle.pageData);
             delete [] info;
             return 0;
         }
         // Record is the last record, and there is enough space in the middle
-        if(slot.first+slot.second==info[DATA_OFFSET] && getFreeSpace(fileHandle.pageData)>=(record.size-oldRecord.size)){
+        if(slot.first+slot.second==info[DATA_OFFSET] && getFreeSpace(fileHandle.pageData, pageSize)>=(record.size-oldRecord.size)){
             memcpy(data_offset, record.data, record.size);
             writeUpdateInfo(fileHandle, info, slot, record.size, oldRecord.size, rid, fileHandle.pageData);
             delete [] info;
@@ -317,16 +382,16 @@ namespace PeterDB {
         // insertRecord(fileHandle, recordDescriptor, data, cpy);
         unsigned lastPageNum = fileHandle.getNumberOfPages()-1;
         cpy.pageNum = getNextAvailablePageNum(record.size + SLOT_SIZE + sizeof(RID), fileHandle, lastPageNum);
-        memset(fileHandle.pageData, 0, PAGE_SIZE);
+        memset(fileHandle.pageData, 0, fileHandle.getPageSize());
         fileHandle.readPage(cpy.pageNum, fileHandle.pageData);
-        cpy.slotNum = getSlotNum(fileHandle.pageData);
+        cpy.slotNum = getSlotNum(fileHandle.pageData, pageSize);
 
         writeRecord(record, fileHandle, cpy.pageNum, cpy, fileHandle.pageData);
-        memset(fileHandle.pageData, 0, PAGE_SIZE);
+        memset(fileHandle.pageData, 0, fileHandle.getPageSize());
         fileHandle.readPage(rid.pageNum, fileHandle.pageData);
-        getInfo(fileHandle.pageData, info);
+        getInfo(fileHandle.pageData, info, pageSize);
         insertTomb(data_offset, cpy.pageNum, cpy.slotNum);
-        shiftRecord(fileHandle.pageData, slot.first, TOMB_SIZE, slot.second, info[DATA_OFFSET]-slot.first-slot.second);
+        shiftRecord(fileHandle.pageData, slot.first, TOMB_SIZE, slot.second, info[DATA_OFFSET]-slot.first-slot.second, pageSize);
         writeUpdateInfo(fileHandle, info, slot, TOMB_SIZE, oldRecord.size+sizeof(RID), rid, fileHandle.pageData);
 
         delete [] info;
@@ -336,24 +401,25 @@ namespace PeterDB {
     void RecordBasedFileManager::writeUpdateInfo(FileHandle &fileHandle, unsigned* info, std::pair<unsigned, unsigned> slot,
                                                  int size, int oldSize, const RID &rid, char* pageData){
         slot.second -= oldSize-size;
-        writeSlotInfo(rid.slotNum, pageData, slot);
+        writeSlotInfo(rid.slotNum, pageData, slot, fileHandle.getPageSize());
         info[DATA_OFFSET] += size-oldSize;
         updateInfo(fileHandle, pageData, rid.pageNum, info);
         fileHandle.writePage(rid.pageNum, pageData);
     }
 
-    void RecordBasedFileManager::shiftRecord(char* data, unsigned offset, long size, unsigned shiftOffset, unsigned len){
+    void RecordBasedFileManager::shiftRecord(char* data, unsigned offset, long size, unsigned shiftOffset, unsigned len,
+                                             unsigned pageSize){
         auto data_offset = data+offset;
         memmove(data_offset+size, data_offset+shiftOffset, len);
         auto info = new unsigned [PAGE_INFO_NUM];
         memset(info, 0, sizeof(unsigned)*PAGE_INFO_NUM);
-        getInfo(data, info);
+        getInfo(data, info, pageSize);
         for(unsigned i=0;i<info[SLOT_NUM];i++){
-            auto slot = getSlotInfo(i, data);
-            if(slot.first==5000)continue;
+            auto slot = getSlotInfo(i, data, pageSize);
+            if(slot.first >= pageSize)continue;
             if(slot.first>offset){
                 slot.first -= shiftOffset-size;
-                writeSlotInfo(i, data, slot);
+                writeSlotInfo(i, data, slot, pageSize);
             }
         }
         delete [] info;
@@ -381,9 +447,9 @@ namespace PeterDB {
     RC RecordBasedFileManager::readAttribute(FileHandle &fileHandle, const std::vector<Attribute> &recordDescriptor,
                                              const RID &rid, const std::string &attributeName, void *data) {
         auto id = getAttrID(recordDescriptor, attributeName);
-        memset(fileHandle.pageData, 0, PAGE_SIZE);
+        memset(fileHandle.pageData, 0, fileHandle.getPageSize());
         fileHandle.readPage(rid.pageNum, fileHandle.pageData);
-        auto slot = getSlotInfo(rid.slotNum, fileHandle.pageData);
+        auto slot = getSlotInfo(rid.slotNum, fileHandle.pageData, fileHandle.getPageSize());
         char* recordData = new char [slot.second];
         memset(recordData, 0, slot.second);
         memcpy(recordData, fileHandle.pageData+slot.first, slot.second);
@@ -438,31 +504,47 @@ namespace PeterDB {
         return 0;
     }
 
+    RC RecordBasedFileManager::scan(FileHandle &fileHandle, const std::vector<Attribute> &recordDescriptor,
+                                    const std::vector<ScanCondition> &conditions,
+                                    const std::vector<std::string> &attributeNames,
+                                    RBFM_ScanIterator &rbfm_ScanIterator) {
+        rbfm_ScanIterator.init(fileHandle, recordDescriptor, conditions, attributeNames);
+        return 0;
+    }
+
+    // Ask the free space map, starting from the given page, and only append when no page has room
     unsigned RecordBasedFileManager::getNextAvailablePageNum(unsigned insertSize, FileHandle &fileHandle, unsigned int startingNum) {
-        for (int i = 0; i < fileHandle.getNumberOfPages(); ++i) {
-            memset(fileHandle.pageData, 0, PAGE_SIZE);
-            fileHandle.readPage((startingNum + i) % fileHandle.getNumberOfPages(), fileHandle.pageData);
-            if(insertSize<getFreeSpace(fileHandle.pageData)){
-                return (startingNum+i)%fileHandle.getNumberOfPages();
+        int pageNum = fileHandle.findPageWithSpace(insertSize+1, startingNum);
+        while(pageNum >= 0){
+            memset(fileHandle.pageData, 0, fileHandle.getPageSize());
+            fileHandle.readPage(pageNum, fileHandle.pageData);
+            unsigned freeSpace = getFreeSpace(fileHandle.pageData, fileHandle.getPageSize());
+            if(insertSize<freeSpace){
+                return pageNum;
             }
+            // The map is out of date (e.g. written through another handle), correct it and look again
+            if(fileHandle.setPageSpace(pageNum, freeSpace) != 0)break;
+            pageNum = fileHandle.findPageWithSpace(insertSize+1, startingNum);
         }
         appendNewPage(fileHandle);
         return fileHandle.getNumberOfPages()-1;
     }
 
-    unsigned RecordBasedFileManager::getFreeSpace(char* data) {
+    unsigned RecordBasedFileManager::getFreeSpace(char* data, unsigned pageSize) {
         auto* info = new unsigned [PAGE_INFO_NUM];
         memset(info, 0, sizeof(unsigned)*PAGE_INFO_NUM);
-        getInfo(data, info);
+        getInfo(data, info, pageSize);
         unsigned data_offset = info[DATA_OFFSET];
         unsigned info_offset = info[INFO_OFFSET];
         delete [] info;
-        return PAGE_SIZE-data_offset-info_offset;
+        return pageSize-data_offset-info_offset;
     }
 
     void RecordBasedFileManager::updateInfo(FileHandle& fileHandle, char* data, unsigned pageNum, unsigned* info){
-        memcpy((void*)(data + PAGE_SIZE - sizeof(unsigned) * PAGE_INFO_NUM), info, sizeof(unsigned) * PAGE_INFO_NUM);
+        unsigned pageSize = fileHandle.getPageSize();
+        memcpy((void*)(data + pageSize - sizeof(unsigned) * PAGE_INFO_NUM), info, sizeof(unsigned) * PAGE_INFO_NUM);
         fileHandle.writePage(pageNum, data);
+        fileHandle.setPageSpace(pageNum, getFreeSpace(data, pageSize));
     }
 
     bool RecordBasedFileManager::isTomb(char* data){
@@ -585,131 +667,52 @@ namespace PeterDB {
         this->slotNum = slotNum;
     }
 
-     void RBFM_ScanIterator::setAttrNull(void *src, ushort attrNum, bool isNull) {
-        unsigned bytes = 0;
-        unsigned pos = 0;
-        getByteOffset(attrNum, bytes, pos);
-        setBit(*((char *) src + bytes), isNull, pos);
-    }
-
-    void RBFM_ScanIterator::setBit(char &src, bool value, unsigned offset) {
-        if (value) {
-            src |= 1u << offset;
-        } else {
-            src &= ~(1u << offset);
+    // Walk the slot directory of the pinned page in place, the next page is only fetched once this one is done
+    RC RBFM_ScanIterator::getNextRecord(RID &rid, void *data) {
+        RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
+        unsigned pageCount = fileHandle->getNumberOfPages();
+        unsigned pageSize = fileHandle->getPageSize();
+        unsigned info[PAGE_INFO_NUM];
+        while(currentPageNum < pageCount){
+            if(getPage(currentPageNum) == nullptr)break;
+            rbfm.getInfo(page, info, pageSize);
+            for(; currentSlotNum < info[SLOT_NUM]; currentSlotNum++){
+                auto slot = rbfm.getSlotInfo(currentSlotNum, page, pageSize);
+                if(slot.first >= pageSize || slot.second<=10)continue;
+                char* recordData = page + slot.first;
+                if(rbfm.isTomb(recordData) || !isMatch(recordData))continue;
+
+                projectRecord(recordData, (char*)data);
+                rid = readRID(recordData, slot.second);
+                currentSlotNum++;
+                return 0;
+            }
+            releasePage();
+            currentPageNum++;
+            currentSlotNum = 0;
         }
+        releasePage();
+        return RBFM_EOF;
     }
 
-    void RBFM_ScanIterator::getByteOffset(unsigned pos, unsigned &bytes, unsigned &offset) {
-        bytes = pos / 8;
-
-        offset = 7 - pos % 8;
-    }
-
-    RC RBFM_ScanIterator::getNextRecord(RID &rid, void *data) {
-        if(currentPageNum>=fileHandle->getNumberOfPages()){
-            return RBFM_EOF;
-        }
-        bool found = false;
+    void RBFM_ScanIterator::projectRecord(char* record, char* data) {
         RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
-        char* attrValue;
-        if(attrType==TypeVarChar){
-            attrValue = new char [attrLength+sizeof(int)+1];
-        }else {
-            attrValue = new char [attrLength+1];
-        }
-
-        while(!found){
-            // Initialize data
-            memset(fileHandle->pageData, 0, PAGE_SIZE);
-            fileHandle->readPage(currentPageNum, fileHandle->pageData);
-            unsigned* info = new unsigned [PAGE_INFO_NUM];
-            memset(info, 0, sizeof(unsigned)*PAGE_INFO_NUM);
-            rbfm.getInfo(fileHandle->pageData, info);
-            // Judge if the current record match
-            auto slot = rbfm.getSlotInfo(currentSlotNum, fileHandle->pageData);
-            if(slot.first==5000 || slot.second<=10){
-                if(moveToNext(fileHandle->getNumberOfPages(), info[SLOT_NUM])==-1){
-                    delete [] attrValue;
-                    delete [] info;
-                    return RBFM_EOF;
-                }
-                delete [] info;
-                continue;
-            }
-            char* recordData = fileHandle->pageData + slot.first;
-            if(rbfm.isTomb(recordData)){
-                if(moveToNext(fileHandle->getNumberOfPages(), info[SLOT_NUM])==-1){
-                    delete [] attrValue;
-                    delete [] info;
-                    return RBFM_EOF;
-                }
-                delete [] info;
-                continue;
-            }
-            memset(attrValue, 0, attrLength+1);
-            rid.pageNum = currentPageNum;
-            rid.slotNum = currentSlotNum;
-            rbfm.readAttribute(*fileHandle, descriptor, rid, conditionAttribute, attrValue);
-            char nullId = attrValue[0];
-            if(nullId==-128&&commOp!=NO_OP){
-                if(moveToNext(fileHandle->getNumberOfPages(), info[SLOT_NUM])==-1){
-                    delete [] attrValue;
-                    delete [] info;
-                    return RBFM_EOF;
-                }
-                delete [] info;
+        char* flag = record + FIELD_NUM_SIZE;
+        TupleBuilder builder;
+        builder.start(data, projectedIDs.size());
+        for (auto id : projectedIDs) {
+            if(rbfm.isNull(flag, id)){
+                builder.addNull();
                 continue;
             }
-            if(isMatch(recordData, attrValue+1)){
-                char* res = (char*)data;
-                found = true;
-                char* recordBody = new char[slot.second];
-                memset(recordBody, 0, slot.second);
-                rbfm.fetchRecord(slot.first, slot.second, recordBody, fileHandle->pageData);
-                Record record(descriptor, recordBody, rid);
-                // Include a null indicator to the returned data
-                short int flag_size = std::ceil( static_cast<double>(attributeNames.size()) /CHAR_BIT);
-                memset(res, 0, flag_size);
-                res+=flag_size;
-                // write to the void* data
-                for (int i = 0; i < attributeNames.size(); ++i) {
-                    auto id = rbfm.getAttrID(descriptor, attributeNames[i]);
-                    if(record.isNull(id)){
-                        setAttrNull(data, i, true);
-                        continue;
-                    }
-                    int offset = rbfm.getAttrPos(descriptor, recordData, id);
-                    auto attrPos = recordData+offset;
-                    int attrSize = 4;
-                    if(descriptor[id].type==TypeVarChar){
-                        memcpy(&attrSize, attrPos, sizeof(int));
-                        memcpy(res, &attrSize, sizeof(int));
-                        attrPos += sizeof(int);
-                        res += sizeof(int);
-                    }
-                    memcpy(res, attrPos, attrSize);
-                    res += attrSize;
-                }
-                rid = readRID(recordData, slot.second);
-                moveToNext(fileHandle->getNumberOfPages(), info[SLOT_NUM]);
-                delete [] recordBody;
-                delete [] info;
-                break;
-            }
-            // Move to the nexxt record
-            // If moved to the last one, break the loop return -1
-            if(moveToNext(fileHandle->getNumberOfPages(), info[SLOT_NUM])==-1) {
-                delete [] info;
-                break;
+            auto attrPos = record + rbfm.getAttrPos(descriptor, record, id);
+            int attrSize = 4;
+            if(descriptor[id].type==TypeVarChar){
+                memcpy(&attrSize, attrPos, sizeof(int));
+                attrSize += sizeof(int);
             }
-            delete [] info;
-        }
-        delete [] attrValue;
-        if(found){
-            return 0;
+            builder.addField(attrPos, attrSize);
         }
-        return -1;
     }
 
     RID RBFM_ScanIterator::readRID(char* recordData, int offset){
@@ -719,147 +722,333 @@ namespace PeterDB {
         return rid;
     }
 
-    RC RBFM_ScanIterator::moveToNext(unsigned pageNum, unsigned slotNum){
-        currentSlotNum++;
-        if(currentSlotNum>=slotNum){
-            currentSlotNum = 0;
-            currentPageNum++;
-            if(currentPageNum>=pageNum){
-                return RBFM_EOF;
-            }
+    char* RBFM_ScanIterator::getPage(unsigned pageNum) {
+        if(page != nullptr)return page;
+        page = fileHandle->pinPage(pageNum);
+        pinned = page != nullptr;
+        // Past its first page the scan is sequential, keep the next pages on their way
+        if(pageNum > 0 && pageNum + PF_PREFETCH_PAGES / 2 >= prefetchedTo){
+            unsigned from = std::max(prefetchedTo, pageNum + 1);
+            prefetchedTo = pageNum + 1 + PF_PREFETCH_PAGES;
+            fileHandle->prefetch(from, prefetchedTo - from);
         }
-        return 0;
+        if(!pinned){
+            // Every frame is taken, fall back to a private copy
+            if(pageBuffer == nullptr)pageBuffer = new char [fileHandle->getPageSize()];
+            if(fileHandle->readPage(pageNum, pageBuffer) != 0)return nullptr;
+            page = pageBuffer;
+        }
+        return page;
+    }
+
+    void RBFM_ScanIterator::releasePage() {
+        if(pinned)fileHandle->unpinPage(currentPageNum);
+        page = nullptr;
+        pinned = false;
     }
 
     RC RBFM_ScanIterator::close() {
         if(this->fileHandle != nullptr){
+            releasePage();
             this->fileHandle->closeFile();
         }
         this->currentSlotNum = 0;
         this->currentPageNum = 0;
-        delete [] conditionVal;
+        this->conditions.clear();
+        delete [] pageBuffer;
+        pageBuffer = nullptr;
         return 0;
     }
 
     void RBFM_ScanIterator::init(FileHandle &filehandle, const std::vector<Attribute> &descriptor, const std::string &condition,
                             const CompOp compOp, const void *value, const std::vector<std::string> &attributeNames) {
+        std::vector<ScanCondition> conditions;
+        if(compOp != NO_OP){
+            ScanCondition scanCondition{condition, compOp, ""};
+            RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
+            short id = rbfm.getAttrID(descriptor, condition);
+            if(value != nullptr && id != -1){
+                unsigned size = sizeof(int);
+                if(descriptor[id].type == TypeVarChar){
+                    memcpy(&size, value, sizeof(unsigned));
+                    size += sizeof(unsigned);
+                }
+                scanCondition.value.assign((const char*)value, size);
+            }
+            conditions.push_back(scanCondition);
+        }
+        init(filehandle, descriptor, conditions, attributeNames);
+    }
+
+    void RBFM_ScanIterator::init(FileHandle &filehandle, const std::vector<Attribute> &descriptor,
+                                 const std::vector<ScanCondition> &conditions, const std::vector<std::string> &attributeNames) {
         this->fileHandle = &filehandle;
         this->descriptor = descriptor;
-        this->commOp = compOp;
         this->attributeNames = attributeNames;
-        this->conditionAttribute = condition;
 
         this->currentPageNum = 0;
         this->currentSlotNum = 0;
-        this->attrLength = 0;
-        this->attrType = TypeInt;
-        this->attributeIndex = 0;
-
-        for (int i = 0; i < descriptor.size(); ++i) {
-            if(!descriptor.at(i).name.compare(condition)){
-                this->attributeIndex = i;
-                this->attrType = descriptor.at(i).type;
-                this->attrLength = descriptor.at(i).length;
-                break;
-            }
+        this->page = nullptr;
+        this->pinned = false;
+        this->prefetchedTo = 0;
+        // Pages are read in file order, let the kernel read ahead
+        filehandle.adviseSequential(true);
+
+        RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
+        this->projectedIDs.clear();
+        for(auto& name: attributeNames){
+            this->projectedIDs.push_back(rbfm.getAttrID(descriptor, name));
         }
-        if (value){
-            switch (this->attrType) {
-                case TypeInt:
-                case TypeReal:
-                    this->conditionVal = new char [sizeof(float)];
-                    memset(this->conditionVal, 0, sizeof(float));
-                    memcpy(this->conditionVal, value, sizeof(float));
-                    break;
-                case TypeVarChar:
-                    unsigned size;
-                    memcpy(&size, value, sizeof(unsigned));
-                    this->conditionVal = new char [size+sizeof(unsigned)+1];
-                    memset(this->conditionVal, 0, size+sizeof(unsigned )+1);
-                    memcpy(this->conditionVal, value, size+sizeof(unsigned ));
-                    break;
-                default:
-                    std::cout<< "error: No type match"<< std::endl;
+
+        this->conditions.clear();
+        for(auto& condition: conditions){
+            if(condition.op == NO_OP)continue;
+            ScanTest test;
+            test.id = rbfm.getAttrID(descriptor, condition.attribute);
+            if(test.id != -1){
+                // A value too short for its type can match nothing
+                bool valid = condition.value.size() >= sizeof(int);
+                test.predicate.compile(descriptor[test.id].type, condition.op, valid ? condition.value.data() : nullptr);
             }
-        } else {
-            this->conditionVal = nullptr;
+            this->conditions.push_back(test);
         }
     }
 
-    bool RBFM_ScanIterator::isMatch(char* record, char* attrValue) {
-        if(commOp == NO_OP)return true;
-        if(!conditionVal)return false;
+    bool RBFM_ScanIterator::isMatch(char* record) {
+        for(auto& test: conditions){
+            if(!isMatch(record, test))return false;
+        }
+        return true;
+    }
+
+    // Test the condition attribute straight from the record bytes
+    bool RBFM_ScanIterator::isMatch(char* record, const ScanTest &test) {
+        if(test.id == -1)return false;
 
         RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
-        if(rbfm.isTomb(record)){
-            return false;
+        if(rbfm.isNull(record + FIELD_NUM_SIZE, test.id))return false;
+        return test.predicate(record + rbfm.getAttrPos(descriptor, record, test.id));
+    }
+
+    template<CompOp op> static bool holds(int cmp) {
+        switch (op) {
+            case EQ_OP: return cmp == 0;
+            case LT_OP: return cmp < 0;
+            case LE_OP: return cmp <= 0;
+            case GT_OP: return cmp > 0;
+            case GE_OP: return cmp >= 0;
+            case NE_OP: return cmp != 0;
+            default: return true;
         }
+    }
 
-        switch (attrType) {
-            case TypeInt:
-            {
-                int condition = *(int*)conditionVal;
-                int val = *(int*)attrValue;
-                switch (commOp) {
-                    case EQ_OP: return val == condition;
-                    case LT_OP: return val < condition;
-                    case LE_OP: return val <= condition;
-                    case GT_OP: return val > condition;
-                    case GE_OP: return val >= condition;
-                    case NE_OP: return val != condition;
-                    default: return false;
-                }
+    template<CompOp op> static bool testInt(const char *value, const char *other) {
+        int val1, val2;
+        memcpy(&val1, value, sizeof(int));
+        memcpy(&val2, other, sizeof(int));
+        switch (op) {
+            case EQ_OP: return val1 == val2;
+            case LT_OP: return val1 < val2;
+            case LE_OP: return val1 <= val2;
+            case GT_OP: return val1 > val2;
+            case GE_OP: return val1 >= val2;
+            case NE_OP: return val1 != val2;
+            default: return true;
+        }
+    }
+
+    template<CompOp op> static bool testReal(const char *value, const char *other) {
+        float val1, val2;
+        memcpy(&val1, value, sizeof(float));
+        memcpy(&val2, other, sizeof(float));
+        switch (op) {
+            case EQ_OP: return fabs(val1 - val2) < FLOAT_DIFF;
+            case LT_OP: return val1 < val2;
+            case LE_OP: return val1 <= val2;
+            case GT_OP: return val1 > val2;
+            case GE_OP: return val1 >= val2;
+            case NE_OP: return fabs(val1 - val2) >= FLOAT_DIFF;
+            default: return true;
+        }
+    }
+
+    static int compareVarChar(const char *value1, const char *value2) {
+        int len1, len2;
+        memcpy(&len1, value1, sizeof(int));
+        memcpy(&len2, value2, sizeof(int));
+        int cmp = memcmp(value1 + sizeof(int), value2 + sizeof(int), std::min(len1, len2));
+        if(cmp != 0)return cmp;
+        return len1 < len2 ? -1 : len1 > len2;
+    }
+
+    template<CompOp op> static bool testVarChar(const char *value, const char *other) {
+        return holds<op>(compareVarChar(value, other));
+    }
+
+    static bool testAll(const char *, const char *) {
+        return true;
+    }
+
+    static bool testNone(const char *, const char *) {
+        return false;
+    }
+
+    template<CompOp op> static Predicate::Test pickTest(AttrType type) {
+        switch (type) {
+            case TypeInt: return testInt<op>;
+            case TypeReal: return testReal<op>;
+            case TypeVarChar: return testVarChar<op>;
+            default:
+                std::cout<<"Error with the attribute type"<< std::endl;
+                return testNone;
+        }
+    }
+
+    Predicate::Predicate() {
+        this->test = testAll;
+    }
+
+    void Predicate::compile(AttrType type, CompOp op) {
+        switch (op) {
+            case EQ_OP: test = pickTest<EQ_OP>(type); break;
+            case LT_OP: test = pickTest<LT_OP>(type); break;
+            case LE_OP: test = pickTest<LE_OP>(type); break;
+            case GT_OP: test = pickTest<GT_OP>(type); break;
+            case GE_OP: test = pickTest<GE_OP>(type); break;
+            case NE_OP: test = pickTest<NE_OP>(type); break;
+            default: test = testAll;
+        }
+    }
+
+    void Predicate::compile(AttrType type, CompOp op, const void *constant) {
+        compile(type, op);
+        this->constant.clear();
+        if(op == NO_OP)return;
+        if(constant == nullptr){
+            test = testNone;
+            return;
+        }
+        unsigned size = sizeof(int);
+        if(type == TypeVarChar){
+            memcpy(&size, constant, sizeof(int));
+            size += sizeof(int);
+        }
+        this->constant.assign((const char*)constant, size);
+    }
+
+    int Predicate::compare(AttrType type, const void *value1, const void *value2) {
+        switch (type) {
+            case TypeInt: {
+                int val1, val2;
+                memcpy(&val1, value1, sizeof(int));
+                memcpy(&val2, value2, sizeof(int));
+                return val1 < val2 ? -1 : val1 > val2;
             }
-            case TypeReal:
-            {
-                float condition = *(float *)conditionVal;
-                float val = *(float *)attrValue;
-                switch (commOp) {
-                    case EQ_OP: return fabs(val-condition)<FLOAT_DIFF;
-                    case LT_OP: return val < condition;
-                    case LE_OP: return val <= condition;
-                    case GT_OP: return val > condition;
-                    case GE_OP: return val >= condition;
-                    case NE_OP: return (val-condition)>FLOAT_DIFF;
-                    default: return false;
-                }
+            case TypeReal: {
+                float val1, val2;
+                memcpy(&val1, value1, sizeof(float));
+                memcpy(&val2, value2, sizeof(float));
+                if(val1 < val2)return -1;
+                if(val1 > val2)return 1;
+                // NaNs come after every number, a total order is what sorts and B+ trees need
+                bool nan1 = val1 != val1, nan2 = val2 != val2;
+                return nan1 == nan2 ? 0 : (nan1 ? 1 : -1);
             }
             case TypeVarChar:
-            {
-                bool res = false;
+                return compareVarChar((const char*)value1, (const char*)value2);
+        }
+        return 0;
+    }
 
-                switch (commOp) {
-                    case EQ_OP: {
-                        res = strcmp(attrValue+4, conditionVal+4)==0;
-                        break;
-                    }
-                    case LT_OP: {
-                        res = strcmp(attrValue+4, conditionVal+4)<0;
-                        break;
-                    }
-                    case LE_OP: {
-                        res = strcmp(attrValue+4, conditionVal+4)<=0;
-                        break;
-                    }
-                    case GT_OP: {
-                        res = strcmp(attrValue+4, conditionVal+4)>0;
-                        break;
-                    }
-                    case GE_OP: {
-                        res = strcmp(attrValue+4, conditionVal+4)>=0;
-                        break;
-                    }
-                    case NE_OP: {
-                        res = strcmp(attrValue+4, conditionVal+4)!=0;
-                        break;
-                    }
-                }
-                return res;
+    TupleView::TupleView() : tuple(nullptr), count(0) {
+        offsets[0] = 0;
+    }
+
+    TupleView::TupleView(const std::vector<Attribute> &attrs, const void *tuple) {
+        reset(attrs, tuple);
+    }
+
+    void TupleView::reset(const std::vector<Attribute> &attrs, const void *tuple) {
+        this->tuple = (const char*)tuple;
+        count = attrs.size();
+        unsigned short* pos = offsets;
+        if(count > TUPLE_VIEW_FIELDS){
+            wideOffsets.resize(count + 1);
+            pos = wideOffsets.data();
+        }
+        unsigned offset = (count + CHAR_BIT - 1) / CHAR_BIT;
+        for(unsigned i = 0; i < count; i++){
+            pos[i] = offset;
+            if(isNull(i))continue;
+            if(attrs[i].type == TypeVarChar){
+                int len;
+                memcpy(&len, this->tuple + offset, sizeof(int));
+                offset += len;
             }
-            default:
-                std::cout<<"Error with the attribute type"<< std::endl;
-                return false;
+            offset += sizeof(int);
+        }
+        pos[count] = offset;
+    }
+
+    int TupleView::getInt(unsigned i) const {
+        int value;
+        memcpy(&value, tuple + getOffset(i), sizeof(int));
+        return value;
+    }
+
+    float TupleView::getReal(unsigned i) const {
+        float value;
+        memcpy(&value, tuple + getOffset(i), sizeof(float));
+        return value;
+    }
+
+    TupleBuilder::TupleBuilder() : data(nullptr), field(0), offset(0) {}
+
+    void TupleBuilder::start(void *data, unsigned fieldCount) {
+        this->data = (char*)data;
+        field = 0;
+        offset = (fieldCount + CHAR_BIT - 1) / CHAR_BIT;
+        memset(data, 0, offset);
+    }
+
+    void TupleBuilder::addNull() {
+        data[field / CHAR_BIT] |= (char)(0x80 >> (field % CHAR_BIT));
+        field++;
+    }
+
+    void TupleBuilder::addField(const void *value, unsigned size) {
+        memcpy(data + offset, value, size);
+        offset += size;
+        field++;
+    }
+
+    void TupleBuilder::addInt(int value) {
+        addField(&value, sizeof(int));
+    }
+
+    void TupleBuilder::addReal(float value) {
+        addField(&value, sizeof(float));
+    }
+
+    void TupleBuilder::addField(const TupleView &view, unsigned i) {
+        if(view.isNull(i))addNull();
+        else addField(view.getField(i), view.getFieldSize(i));
+    }
+
+    void TupleBuilder::addFields(const TupleView &view) {
+        addFields(view.getData(), view.getFieldCount(), view.getSize());
+    }
+
+    void TupleBuilder::addFields(const void *tuple, unsigned count, unsigned size) {
+        auto bytes = (const char*)tuple;
+        for(unsigned i = 0; i < count; i++){
+            if(bytes[i / CHAR_BIT] & (0x80 >> (i % CHAR_BIT)))
+                data[(field + i) / CHAR_BIT] |= (char)(0x80 >> ((field + i) % CHAR_BIT));
         }
+        unsigned start = (count + CHAR_BIT - 1) / CHAR_BIT;
+        memcpy(data + offset, bytes + start, size - start);
+        offset += size - start;
+        field += count;
     }
 
     RBFM_ScanIterator::~RBFM_ScanIterator() {}
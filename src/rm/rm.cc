@@ -1,6 +1,7 @@
 #include "src/include/rm.h"
 #include <cstring>
 #include <iostream>
+#include <algorithm>
 
 namespace PeterDB {
     RelationManager &RelationManager::instance() {
@@ -8,7 +9,10 @@ namespace PeterDB {
         return _relation_manager;
     }
 
-    RelationManager::RelationManager() = default;
+    // Cached handles are closed in the destructor, construct the pool first so that it outlives them
+    RelationManager::RelationManager() : fileHandles(HANDLE_CACHE_SIZE), ixFileHandles(HANDLE_CACHE_SIZE) {
+        BufferPool::instance();
+    }
 
     RelationManager::~RelationManager() = default;
 
@@ -16,8 +20,73 @@ namespace PeterDB {
 
     RelationManager &RelationManager::operator=(const RelationManager &) = default;
 
+    template<>
+    RC HandleCache<FileHandle>::openHandle(const std::string &fileName, FileHandle &handle) {
+        return RecordBasedFileManager::instance().openFile(fileName, handle);
+    }
+
+    template<>
+    RC HandleCache<IXFileHandle>::openHandle(const std::string &fileName, IXFileHandle &handle) {
+        return IndexManager::instance().openFile(fileName, handle);
+    }
+
+    template<typename Handle>
+    HandleCache<Handle>::HandleCache(unsigned capacity) {
+        this->capacity = capacity;
+    }
+
+    template<typename Handle>
+    HandleCache<Handle>::~HandleCache() {
+        clear();
+    }
+
+    template<typename Handle>
+    Handle* HandleCache<Handle>::get(const std::string &fileName) {
+        auto it = index.find(fileName);
+        if(it != index.end()){
+            handles.splice(handles.begin(), handles, it->second);
+            return it->second->second;
+        }
+        auto* handle = new Handle();
+        if(openHandle(fileName, *handle) != 0){
+            delete handle;
+            return nullptr;
+        }
+        if(handles.size() >= capacity){
+            // The handle closes its file when destroyed
+            delete handles.back().second;
+            index.erase(handles.back().first);
+            handles.pop_back();
+        }
+        handles.push_front({fileName, handle});
+        index[fileName] = handles.begin();
+        return handle;
+    }
+
+    template<typename Handle>
+    void HandleCache<Handle>::invalidate(const std::string &fileName) {
+        auto it = index.find(fileName);
+        if(it == index.end())return;
+        delete it->second->second;
+        handles.erase(it->second);
+        index.erase(it);
+    }
+
+    template<typename Handle>
+    void HandleCache<Handle>::clear() {
+        for(auto& entry: handles){
+            delete entry.second;
+        }
+        handles.clear();
+        index.clear();
+    }
+
     RC RelationManager::createCatalog() {
         RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
+        fileHandles.clear();
+        ixFileHandles.clear();
+        catalog.clear();
+        catalogLoaded = false;
         rbfm.createFile("Tables");
         rbfm.createFile("Columns");
         rbfm.createFile("Variables");
@@ -87,27 +156,52 @@ namespace PeterDB {
 
         delete [] countData;
         delete [] tuple;
+
+        catalog["Tables"] = {1, "Tables", Tables_Descriptor, {}, 4};
+        catalog["Columns"] = {2, "Columns", Columns_Descriptor, {}, 6};
+        catalogLoaded = true;
         return 0;
     }
 
     RC RelationManager::deleteCatalog() {
         RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
+        fileHandles.clear();
+        ixFileHandles.clear();
+        // The tables go with the catalog, otherwise their leftover files block recreating them
+        if(catalogLoaded || loadCatalog() == 0){
+            for(auto& entry: catalog){
+                if(entry.first == "Tables" || entry.first == "Columns")continue;
+                for(auto& attrName: entry.second.indexes){
+                    rbfm.destroyFile(getIndexName(entry.first, attrName));
+                }
+                rbfm.destroyFile(entry.second.fileName);
+                rbfm.destroyFile(getIndexTableName(entry.first));
+            }
+        }
+        catalog.clear();
+        catalogLoaded = false;
         rbfm.destroyFile("Tables");
         rbfm.destroyFile("Columns");
         rbfm.destroyFile("Variables");
         return 0;
     }
 
-    RC RelationManager::createTable(const std::string &tableName, const std::vector<Attribute> &attrs) {
+    RC RelationManager::createTable(const std::string &tableName, const std::vector<Attribute> &attrs,
+                                    unsigned pageSize) {
+        LogGuard guard;
         RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
-        FileHandle tablesHandle;
-        FileHandle columnHandle;
         RID rid;
         std::string indexName = getIndexTableName(tableName);
-        if(rbfm.openFile("Tables", tablesHandle)!=0 || rbfm.openFile("Columns", columnHandle))return -1;
-        if(rbfm.createFile(tableName)!=0||rbfm.createFile(indexName)!=0){
-            rbfm.closeFile(tablesHandle);
-            rbfm.closeFile(columnHandle);
+        FileHandle* tablesHandle = fileHandles.get("Tables");
+        FileHandle* columnHandle = fileHandles.get("Columns");
+        if(tablesHandle == nullptr || columnHandle == nullptr)return -1;
+        if(getTableInfo(tableName) != nullptr){
+            std::cout<< "Table " << tableName <<" already exists" << std::endl;
+            return -1;
+        }
+        fileHandles.invalidate(tableName);
+        fileHandles.invalidate(indexName);
+        if(rbfm.createFile(tableName, pageSize)!=0||rbfm.createFile(indexName)!=0){
             std::cout<< "Create file " << tableName <<" Failed" << std::endl;
             return -1;
         }
@@ -116,7 +210,7 @@ namespace PeterDB {
         memset(tuple, 0, TABLES_TUPLE_SIZE);
         int tableID = getTableCount() + 1;
         buildTablesTuple(tableID, tableName, tableName, tuple);
-        rbfm.insertRecord(tablesHandle, Tables_Descriptor, tuple, rid);
+        rbfm.insertRecord(*tablesHandle, Tables_Descriptor, tuple, rid);
 
         // Insert Columns data
         delete [] tuple;
@@ -125,152 +219,146 @@ namespace PeterDB {
         for(int i = 0 ; i < attrs.size() ; i++) {
             memset(tuple, 0, COLUMNS_TUPLE_SIZE);
             buildColumnsTuple(tableID, attrs[i], i+1, tuple);
-            rbfm.insertRecord(columnHandle, Columns_Descriptor, tuple, rid);
+            rbfm.insertRecord(*columnHandle, Columns_Descriptor, tuple, rid);
         }
 
-        tablesHandle.closeFile();
-        columnHandle.closeFile();
         delete [] tuple;
         this->addTableCount();
+        catalog[tableName] = {tableID, tableName, attrs, {}, (int)attrs.size() + 1};
         return 0;
     }
 
     RC RelationManager::deleteTable(const std::string &tableName) {
+        LogGuard guard;
         if(tableName=="Tables"||tableName=="Columns")return -1;
         RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
+        TableInfo* info = getTableInfo(tableName);
+        if(info == nullptr)return -1;
+        FileHandle* tablesHandle = fileHandles.get("Tables");
+        FileHandle* columnHandle = fileHandles.get("Columns");
+        if(tablesHandle == nullptr || columnHandle == nullptr)return -1;
+
+        // Remove the catalog records first so that a later table with the same name gets a clean schema
+        std::vector<RID> rids;
+        std::vector<std::string> records;
+        findCatalogRecords("Tables", Tables_Descriptor, "table-id", &info->id, {"table-id"}, rids, records);
+        for(auto& rid: rids){
+            rbfm.deleteRecord(*tablesHandle, Tables_Descriptor, rid);
+        }
+        rids.clear();
+        records.clear();
+        findCatalogRecords("Columns", Columns_Descriptor, "table-id", &info->id, {"table-id"}, rids, records);
+        for(auto& rid: rids){
+            rbfm.deleteRecord(*columnHandle, Columns_Descriptor, rid);
+        }
 
-        std::string indexTableName = getIndexTableName(tableName);
-        RBFM_ScanIterator iter;
-        FileHandle fileHandle;
-        auto id = getTableID(tableName);
-        if(rbfm.openFile(indexTableName, fileHandle)!=0)return -1;
-        rbfm.scan(fileHandle, Index_Descriptor, "table-id", EQ_OP, &id, {"attr-name"}, iter);
-        RID rid;
-        char* data = new char [INDEX_TUPLE_SIZE];
-        memset(data, 0, INDEX_TUPLE_SIZE);
-
-        while(iter.getNextRecord(rid, data)!=-1){
-            std::string attrName(data+sizeof(int)+1);
+        for(auto& attrName: info->indexes){
+            ixFileHandles.invalidate(getIndexName(tableName, attrName));
             rbfm.destroyFile(getIndexName(tableName, attrName));
         }
-        rbfm.destroyFile(tableName);
+        std::string indexTableName = getIndexTableName(tableName);
+        fileHandles.invalidate(info->fileName);
+        fileHandles.invalidate(indexTableName);
+        rbfm.destroyFile(info->fileName);
         rbfm.destroyFile(indexTableName);
-        iter.close();
-        delete [] data;
+        catalog.erase(tableName);
         return 0;
     }
 
     RC RelationManager::getAttributes(const std::string &tableName, std::vector<Attribute> &attrs) {
-        char* columnData = new char [COLUMNS_TUPLE_SIZE];
-        memset(columnData, 0, COLUMNS_TUPLE_SIZE);
-        RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
-
-        RID rid;
-        FileHandle columnFileHandle;
-
-        if (rbfm.openFile("Columns", columnFileHandle) != 0) {
-            return -1;
-        }
-        auto tableID = getTableID(tableName);
-
-        RBFM_ScanIterator columnsIterator;
-
-        rbfm.scan(columnFileHandle, Columns_Descriptor, "table-id", EQ_OP, &tableID, {"column-name","column-type","column-length"}, columnsIterator);
-
-        while(columnsIterator.getNextRecord(rid, columnData)!=-1){
-            char* column = columnData;
-            column+=1;
-            unsigned nameSize;
-            memcpy(&nameSize, column, sizeof(int));
-            column+=sizeof(int);
-            char* attrName = new char [nameSize];
-            memset(attrName, 0, nameSize);
-            memcpy(attrName, column, nameSize);
-            column+=nameSize;
-            unsigned attrType;
-            memcpy(&attrType, column, sizeof(int));
-            column+=sizeof(int);
-            unsigned attrSize;
-            memcpy(&attrSize, column, sizeof(int));
-            std::string name(attrName, nameSize);
-            attrs.push_back({name, (AttrType)attrType, (AttrLength)attrSize});
-            delete [] attrName;
-        }
-
-        delete [] columnData;
-        columnsIterator.close();
+        TableInfo* info = getTableInfo(tableName);
+        if(info == nullptr)return -1;
+        attrs.insert(attrs.end(), info->attrs.begin(), info->attrs.end());
         return 0;
     }
 
     RC RelationManager::insertTuple(const std::string &tableName, const void *data, RID &rid) {
+        // The tuple and its index entries commit together
+        LogGuard guard;
         RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
-        FileHandle fileHandle;
         if( tableName == "Tables" || tableName == "Columns") {
             return -1;
         }
 
-        std::vector<Attribute> attrs;
-        getAttributes(tableName,attrs);
-        if (rbfm.openFile(tableName, fileHandle) == 0) {
-            rbfm.insertRecord(fileHandle, attrs, data, rid);
-            insertIndex(tableName, rid);
-            rbfm.closeFile(fileHandle);
-            return 0;
+        TableInfo* info = getTableInfo(tableName);
+        if (info == nullptr) {
+            return -1;
         }
-        rbfm.closeFile(fileHandle);
-        return -1;
+        FileHandle* fileHandle = fileHandles.get(info->fileName);
+        if (fileHandle == nullptr) {
+            return -1;
+        }
+        if(rbfm.insertRecord(*fileHandle, info->attrs, data, rid) != 0)return -1;
+        insertIndex(tableName, rid);
+        return 0;
     }
 
     RC RelationManager::deleteTuple(const std::string &tableName, const RID &rid) {
+        LogGuard guard;
         RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
-        FileHandle fileHandle;
-        std::vector<Attribute> attrs;
-        getAttributes(tableName,attrs);
-        if (rbfm.openFile(tableName, fileHandle) == 0) {
-            deleteIndex(tableName, const_cast<RID &>(rid));
-            if(rbfm.deleteRecord(fileHandle, attrs, rid) != 0) {
-                fileHandle.closeFile();
-                return -1;
-            }
-            fileHandle.closeFile();
-            return 0;
+        TableInfo* info = getTableInfo(tableName);
+        if (info == nullptr) {
+            return -1;
         }
-        return -1;
+        FileHandle* fileHandle = fileHandles.get(info->fileName);
+        if (fileHandle == nullptr) {
+            return -1;
+        }
+        deleteIndex(tableName, const_cast<RID &>(rid));
+        return rbfm.deleteRecord(*fileHandle, info->attrs, rid) == 0 ? 0 : -1;
     }
 
     RC RelationManager::updateTuple(const std::string &tableName, const void *data, const RID &rid) {
+        LogGuard guard;
         RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
-        FileHandle fileHandle;
-        std::vector<Attribute> attrs;
-        getAttributes(tableName,attrs);
-
-        if (rbfm.openFile(tableName, fileHandle) == 0) {
-            deleteIndex(tableName, const_cast<RID &>(rid));
-            if(rbfm.updateRecord(fileHandle, attrs, data, rid) != 0) {
-                return -1;
-            }
+        TableInfo* info = getTableInfo(tableName);
+        if (info == nullptr) {
+            return -1;
+        }
+        FileHandle* fileHandle = fileHandles.get(info->fileName);
+        if (fileHandle == nullptr) {
+            return -1;
+        }
+        deleteIndex(tableName, const_cast<RID &>(rid));
+        if(rbfm.updateRecord(*fileHandle, info->attrs, data, rid) != 0) {
+            // The old tuple is still there, index it again
             insertIndex(tableName, const_cast<RID &>(rid));
-            fileHandle.closeFile();
-            return 0;
+            return -1;
         }
-        return -1;
+        insertIndex(tableName, const_cast<RID &>(rid));
+        return 0;
     }
 
     RC RelationManager::readTuple(const std::string &tableName, const RID &rid, void *data) {
         RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
-        FileHandle fileHandle;
-        std::vector<Attribute> attrs;
-        getAttributes(tableName,attrs);
-        if (rbfm.openFile(tableName, fileHandle) != 0) {
+        TableInfo* info = getTableInfo(tableName);
+        if (info == nullptr) {
+            return -1;
+        }
+        FileHandle* fileHandle = fileHandles.get(info->fileName);
+        if (fileHandle == nullptr) {
             return -1;
         }
-        if (rbfm.readRecord(fileHandle, attrs, rid, data) != 0 ) {
+        if (rbfm.readRecord(*fileHandle, info->attrs, rid, data) != 0 ) {
             return -1;
         }
-        rbfm.closeFile(fileHandle);
         return 0;
     }
 
+    RC RelationManager::readTuples(const std::string &tableName, const std::vector<RID> &rids, std::vector<char> &data,
+                                   std::vector<unsigned> &ends) {
+        RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
+        TableInfo* info = getTableInfo(tableName);
+        if (info == nullptr) {
+            return -1;
+        }
+        FileHandle* fileHandle = fileHandles.get(info->fileName);
+        if (fileHandle == nullptr) {
+            return -1;
+        }
+        return rbfm.readRecords(*fileHandle, info->attrs, rids, data, ends);
+    }
+
     RC RelationManager::printTuple(const std::vector<Attribute> &attrs, const void *data, std::ostream &out) {
         RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
         rbfm.printRecord(attrs, data, out);
@@ -280,12 +368,13 @@ namespace PeterDB {
     RC RelationManager::readAttribute(const std::string &tableName, const RID &rid, const std::string &attributeName,
                                       void *data) {
         RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
-        FileHandle fileHandle;
-        std::vector<Attribute> attrs;
-        getAttributes(tableName,attrs);
-        if (rbfm.openFile(tableName, fileHandle) == 0 &&
-            rbfm.readAttribute(fileHandle, attrs, rid, attributeName, data) == 0 ) {
-            fileHandle.closeFile();
+        TableInfo* info = getTableInfo(tableName);
+        if (info == nullptr) {
+            return -1;
+        }
+        FileHandle* fileHandle = fileHandles.get(info->fileName);
+        if (fileHandle != nullptr &&
+            rbfm.readAttribute(*fileHandle, info->attrs, rid, attributeName, data) == 0 ) {
             return 0;
         }
         return -1;
@@ -298,16 +387,37 @@ namespace PeterDB {
                              const std::vector<std::string> &attributeNames,
                              RM_ScanIterator &rm_ScanIterator) {
         RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
-        std::vector<Attribute> attrs;
-        this->getAttributes(tableName,attrs);
+        TableInfo* info = getTableInfo(tableName);
+        if (info == nullptr) {
+            return -1;
+        }
 
         RC rc;
-        rc = rbfm.openFile(tableName, rm_ScanIterator.fileHandle);
+        rc = rbfm.openFile(info->fileName, rm_ScanIterator.fileHandle);
         if( rc != 0) {
             return -1;
         }
 
-        rc = rbfm.scan(rm_ScanIterator.fileHandle, attrs, conditionAttribute, compOp, value, attributeNames, rm_ScanIterator.rbfmScanIterator);
+        rc = rbfm.scan(rm_ScanIterator.fileHandle, info->attrs, conditionAttribute, compOp, value, attributeNames, rm_ScanIterator.rbfmScanIterator);
+        rm_ScanIterator.init = true;
+        return rc;
+    }
+
+    RC RelationManager::scan(const std::string &tableName,
+                             const std::vector<ScanCondition> &conditions,
+                             const std::vector<std::string> &attributeNames,
+                             RM_ScanIterator &rm_ScanIterator) {
+        RecordBasedFileManager &rbfm = RecordBasedFileManager::instance();
+        TableInfo* info = getTableInfo(tableName);
+        if (info == nullptr) {
+            return -1;
+        }
+
+        if(rbfm.openFile(info->fileName, rm_ScanIterator.fileHandle) != 0) {
+            return -1;
+        }
+
+        RC rc = rbfm.scan(rm_ScanIterator.fileHandle, info->attrs, conditions, attributeNames, rm_ScanIterator.rbfmScanIterator);
         rm_ScanIterator.init = true;
         return rc;
     }
@@ -323,86 +433,117 @@ namespace PeterDB {
 
     // Extra credit work
     RC RelationManager::dropAttribute(const std::string &tableName, const std::string &attributeName) {
-        FileHandle columnHandle;
+        LogGuard guard;
         RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
-        RBFM_ScanIterator rbfmScanIterator;
-        rbfm.openFile("Columns", columnHandle);
-        int size = attributeName.size();
-        char* condition = new char [sizeof(int)+size];
-        memset(condition, 0, sizeof(int)+size);
-        memcpy(condition, &size, sizeof(int));
-        memcpy(condition+sizeof(int), attributeName.c_str(), size);
-        rbfm.scan(columnHandle, Columns_Descriptor, "column-name", EQ_OP, condition, {{"table-id"}}, rbfmScanIterator);
-        RID rid;
-        char* tuple = new char [COLUMNS_TUPLE_SIZE];
-        memset(tuple, 0, COLUMNS_TUPLE_SIZE);
-        rbfmScanIterator.getNextRecord(rid, tuple);
-
-        if(rbfm.deleteRecord(columnHandle, Columns_Descriptor, rid)){
-            std::cout <<"Error when deleting"<< std::endl;
+        TableInfo* info = getTableInfo(tableName);
+        if(info == nullptr)return -1;
+        FileHandle* columnHandle = fileHandles.get("Columns");
+        if(columnHandle == nullptr)return -1;
+
+        std::vector<RID> rids;
+        std::vector<std::string> records;
+        findCatalogRecords("Columns", Columns_Descriptor, "table-id", &info->id, {"column-name"}, rids, records);
+        for(size_t i = 0; i < rids.size(); i++){
+            unsigned nameSize;
+            memcpy(&nameSize, records[i].data()+1, sizeof(int));
+            if(records[i].compare(1+sizeof(int), nameSize, attributeName) != 0 || nameSize != attributeName.size())continue;
+            if(rbfm.deleteRecord(*columnHandle, Columns_Descriptor, rids[i])){
+                std::cout <<"Error when deleting"<< std::endl;
+                return -1;
+            }
+            for(auto it = info->attrs.begin(); it != info->attrs.end(); it++){
+                if(it->name == attributeName){
+                    info->attrs.erase(it);
+                    break;
+                }
+            }
+            return 0;
         }
-        rbfmScanIterator.close();
-        return 0;
+        std::cout<< "No such attribute in "<< tableName << std::endl;
+        return -1;
     }
 
     // Extra credit work
     RC RelationManager::addAttribute(const std::string &tableName, const Attribute &attr) {
-        auto id = getTableID(tableName);
-        FileHandle columnHandle;
+        LogGuard guard;
+        TableInfo* info = getTableInfo(tableName);
+        if(info == nullptr)return -1;
         RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
-        rbfm.openFile("Columns", columnHandle);
+        FileHandle* columnHandle = fileHandles.get("Columns");
+        if(columnHandle == nullptr)return -1;
         char* tuple = new char [COLUMNS_TUPLE_SIZE];
         memset(tuple, 0, COLUMNS_TUPLE_SIZE);
-        buildColumnsTuple(id, attr, 0, tuple);
+        buildColumnsTuple(info->id, attr, info->nextPosition, tuple);
         RID rid;
-        rbfm.insertRecord(columnHandle, Columns_Descriptor, tuple, rid);
-        columnHandle.closeFile();
-
+        RC rc = rbfm.insertRecord(*columnHandle, Columns_Descriptor, tuple, rid);
         delete [] tuple;
+        if(rc != 0)return -1;
+
+        info->attrs.push_back(attr);
+        info->nextPosition++;
         return 0;
     }
 
     // QE IX related
-    RC RelationManager::createIndex(const std::string &tableName, const std::string &attributeName){
+    RC RelationManager::createIndex(const std::string &tableName, const std::string &attributeName,
+                                    unsigned pageSize){
+        LogGuard guard;
         if(!containAttribute(tableName, attributeName)){
             std::cout<< "No such attribute in "<< tableName << std::endl;
             return -1;
         }
+        TableInfo* info = getTableInfo(tableName);
         std::string indexName = getIndexName(tableName, attributeName);
         IndexManager& indexManager = IndexManager::instance();
-        indexManager.createFile(indexName);
+        ixFileHandles.invalidate(indexName);
+        bool exists = std::find(info->indexes.begin(), info->indexes.end(), attributeName) != info->indexes.end();
+        if(exists)indexManager.destroyFile(indexName);
+        if(indexManager.createFile(indexName, pageSize) != 0)return -1;
 
-        IXFileHandle ixFileHandle;
-        indexManager.openFile(indexName, ixFileHandle);
+        IXFileHandle* ixFileHandle = ixFileHandles.get(indexName);
+        if(ixFileHandle == nullptr)return -1;
 
         RM_ScanIterator iter;
-        std::vector<Attribute> attrs;
-        getAttributes(tableName, attrs);
         Attribute attribute;
-        for(int i = 0; i < attrs.size(); i++){
-            if(attrs[i].name == attributeName){
-                attribute = attrs[i];
+        for(auto& attr: info->attrs){
+            if(attr.name == attributeName){
+                attribute = attr;
                 break;
             }
         }
 
-        FileHandle handle;
         std::string indexTableName = getIndexTableName(tableName);
         RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
-        if(rbfm.openFile(indexTableName, handle)!=0){
+        FileHandle* handle = fileHandles.get(indexTableName);
+        if(handle == nullptr){
             rbfm.createFile(indexTableName);
-            rbfm.openFile(indexTableName, handle);
+            handle = fileHandles.get(indexTableName);
+            if(handle == nullptr)return -1;
         }
-        RID rid;
+        RID rid, indexRid;
         char* indexTuple = new char [INDEX_TUPLE_SIZE];
         memset(indexTuple, 0, INDEX_TUPLE_SIZE);
-        buildIndexTuple(getTableID(tableName), tableName, attributeName, indexTuple);
-        rbfm.insertRecord(handle, Index_Descriptor, indexTuple, rid);
+        // Recreating an existing index only rebuilds its file
+        if(!exists){
+            buildIndexTuple(info->id, tableName, attributeName, indexTuple);
+            if(rbfm.insertRecord(*handle, Index_Descriptor, indexTuple, indexRid) != 0){
+                delete [] indexTuple;
+                return -1;
+            }
+        }
 
         std::vector<std::string> attrNames;
         attrNames.push_back(attribute.name);
         scan(tableName, "", NO_OP, NULL, attrNames, iter);
 
+        // The new index is empty, it is built bottom-up from the sorted entries
+        IX_BulkLoader loader;
+        if(indexManager.bulkLoad(*ixFileHandle, attribute, loader) != 0){
+            delete [] indexTuple;
+            iter.close();
+            if(!exists)dropNewIndex(tableName, attributeName, indexRid);
+            return -1;
+        }
         char* data = new char [PAGE_SIZE];
         memset(data, 0, PAGE_SIZE);
         char* key = new char [PAGE_SIZE];
@@ -410,28 +551,65 @@ namespace PeterDB {
             memset(key, 0, PAGE_SIZE);
             int keyLength = attribute.length + sizeof(int);
             memcpy(key, data + sizeof(char), keyLength);
-            indexManager.insertEntry(ixFileHandle, attribute, key, rid);
+            loader.insertEntry(key, rid);
         }
+        RC rc = loader.close();
 
         delete [] data;
         delete [] key;
         delete [] indexTuple;
-        indexManager.closeFile(ixFileHandle);
         iter.close();
+        if(exists)return rc;
+        // The cached entry only learns of the index once it is fully built
+        if(rc != 0){
+            dropNewIndex(tableName, attributeName, indexRid);
+            return -1;
+        }
+        info->indexes.push_back(attributeName);
         return 0;
     }
-    // Deletion remaining work to do
+
+    // Undo a failed createIndex of a new index: its catalog record and its file
+    void RelationManager::dropNewIndex(const std::string &tableName, const std::string &attributeName,
+                                       const RID &rid) {
+        std::string indexName = getIndexName(tableName, attributeName);
+        FileHandle* handle = fileHandles.get(getIndexTableName(tableName));
+        if(handle != nullptr)RecordBasedFileManager::instance().deleteRecord(*handle, Index_Descriptor, rid);
+        ixFileHandles.invalidate(indexName);
+        IndexManager::instance().destroyFile(indexName);
+    }
     RC RelationManager::destroyIndex(const std::string &tableName, const std::string &attributeName){
-        if(!containAttribute(tableName, attributeName)){
-            std::cout<< "No such attribute in "<< tableName << std::endl;
+        LogGuard guard;
+        TableInfo* info = getTableInfo(tableName);
+        if(info == nullptr)return -1;
+        auto pos = std::find(info->indexes.begin(), info->indexes.end(), attributeName);
+        if(pos == info->indexes.end()){
+            std::cout<< "No index on "<< attributeName << " in " << tableName << std::endl;
             return -1;
         }
-        std::string indexName = getIndexName(tableName, attributeName);
-        IndexManager& indexManager = IndexManager::instance();
-        indexManager.destroyFile(indexName);
-        
+        // Drop only this index's entry, the other indexes of the table stay registered
         std::string indexTableName = getIndexTableName(tableName);
-        indexManager.destroyFile(indexTableName);
+        RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
+        FileHandle* handle = fileHandles.get(indexTableName);
+        if(handle == nullptr)return -1;
+        std::vector<RID> rids;
+        std::vector<std::string> records;
+        if(findCatalogRecords(indexTableName, Index_Descriptor, "table-id", &info->id, {"attr-name"}, rids, records) != 0){
+            return -1;
+        }
+        for(size_t i = 0; i < rids.size(); i++){
+            unsigned nameSize;
+            memcpy(&nameSize, records[i].data()+1, sizeof(int));
+            if(nameSize == attributeName.size() && records[i].compare(1+sizeof(int), nameSize, attributeName) == 0){
+                if(rbfm.deleteRecord(*handle, Index_Descriptor, rids[i]) != 0)return -1;
+            }
+        }
+
+        // The file and the cached entry go only once the catalog no longer lists the index
+        std::string indexName = getIndexName(tableName, attributeName);
+        ixFileHandles.invalidate(indexName);
+        IndexManager::instance().destroyFile(indexName);
+        info->indexes.erase(pos);
         return 0;
     }
 
@@ -443,11 +621,11 @@ namespace PeterDB {
                  bool lowKeyInclusive,
                  bool highKeyInclusive,
                  RM_IndexScanIterator &rm_IndexScanIterator){
-        std::vector<Attribute> attrs;
-        getAttributes(tableName, attrs);
+        TableInfo* info = getTableInfo(tableName);
+        if(info == nullptr)return -1;
 
         Attribute targetAttr;
-        for(auto attr : attrs) {
+        for(auto& attr : info->attrs) {
             if(attr.name == attributeName) {
                 targetAttr = attr;
             }
@@ -520,28 +698,114 @@ namespace PeterDB {
     }
 
     int RelationManager::getTableID(const std::string &tableName){
+        TableInfo* info = getTableInfo(tableName);
+        return info == nullptr ? -1 : info->id;
+    }
+
+    RC RelationManager::loadCatalog() {
+        std::vector<RID> rids;
+        std::vector<std::string> records;
+        if(findCatalogRecords("Tables", Tables_Descriptor, "", NULL, {"table-id", "table-name", "file-name"}, rids, records) != 0){
+            return -1;
+        }
+        catalog.clear();
+        std::unordered_map<int, TableInfo*> tablesByID;
+        for(auto& record: records){
+            const char* ptr = record.data() + 1;
+            TableInfo info;
+            memcpy(&info.id, ptr, sizeof(int));
+            ptr += sizeof(int);
+            unsigned size;
+            memcpy(&size, ptr, sizeof(int));
+            ptr += sizeof(int);
+            std::string tableName(ptr, size);
+            ptr += size;
+            memcpy(&size, ptr, sizeof(int));
+            ptr += sizeof(int);
+            info.fileName = std::string(ptr, size);
+            info.nextPosition = 1;
+            tablesByID[info.id] = &(catalog[tableName] = info);
+        }
+
+        rids.clear();
+        records.clear();
+        findCatalogRecords("Columns", Columns_Descriptor, "", NULL,
+                           {"table-id", "column-name", "column-type", "column-length", "column-position"}, rids, records);
+        std::unordered_map<int, std::vector<std::pair<int, Attribute>>> columns;
+        for(auto& record: records){
+            const char* ptr = record.data() + 1;
+            int tableID;
+            memcpy(&tableID, ptr, sizeof(int));
+            ptr += sizeof(int);
+            unsigned nameSize;
+            memcpy(&nameSize, ptr, sizeof(int));
+            ptr += sizeof(int);
+            Attribute attr;
+            attr.name = std::string(ptr, nameSize);
+            ptr += nameSize;
+            memcpy(&attr.type, ptr, sizeof(int));
+            ptr += sizeof(int);
+            memcpy(&attr.length, ptr, sizeof(int));
+            ptr += sizeof(int);
+            int position;
+            memcpy(&position, ptr, sizeof(int));
+            columns[tableID].push_back({position, attr});
+        }
+        for(auto& entry: columns){
+            auto it = tablesByID.find(entry.first);
+            if(it == tablesByID.end())continue;
+            auto& cols = entry.second;
+            std::stable_sort(cols.begin(), cols.end(),
+                             [](const std::pair<int, Attribute>& a, const std::pair<int, Attribute>& b){return a.first < b.first;});
+            for(auto& col: cols){
+                it->second->attrs.push_back(col.second);
+                it->second->nextPosition = std::max(it->second->nextPosition, col.first + 1);
+            }
+        }
+
+        for(auto& entry: catalog){
+            rids.clear();
+            records.clear();
+            // The system tables have no index catalog
+            if(findCatalogRecords(getIndexTableName(entry.first), Index_Descriptor, "table-id", &entry.second.id,
+                                  {"attr-name"}, rids, records) != 0)continue;
+            for(auto& record: records){
+                unsigned nameSize;
+                memcpy(&nameSize, record.data()+1, sizeof(int));
+                entry.second.indexes.emplace_back(record.data()+1+sizeof(int), nameSize);
+            }
+        }
+        catalogLoaded = true;
+        return 0;
+    }
+
+    TableInfo* RelationManager::getTableInfo(const std::string &tableName) {
+        if(!catalogLoaded && loadCatalog() != 0)return nullptr;
+        auto it = catalog.find(tableName);
+        return it == catalog.end() ? nullptr : &it->second;
+    }
+
+    // Scan a catalog file with a private handle, collecting the rid and projected tuple of every match
+    RC RelationManager::findCatalogRecords(const std::string &fileName, const std::vector<Attribute> &descriptor,
+                                           const std::string &conditionAttr, const void *value,
+                                           const std::vector<std::string> &attrNames, std::vector<RID> &rids,
+                                           std::vector<std::string> &records) {
         RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
-        FileHandle tablesHandle;
-        rbfm.openFile("Tables", tablesHandle);
-        int tableID = 0;
-        RBFM_ScanIterator rbfmScanIterator;
-
-        int size = tableName.size();
-        char* condition = new char [sizeof(int)+size];
-        memset(condition, 0, sizeof(int)+size);
-        memcpy(condition, &size, sizeof(int));
-        memcpy(condition+sizeof(int), tableName.c_str(), size);
-        rbfm.scan(tablesHandle, Tables_Descriptor, "table-name", EQ_OP, condition, {{"table-id"}}, rbfmScanIterator);
+        FileHandle fileHandle;
+        if(rbfm.openFile(fileName, fileHandle) != 0)return -1;
+        RBFM_ScanIterator iter;
+        rbfm.scan(fileHandle, descriptor, conditionAttr, conditionAttr.empty() ? NO_OP : EQ_OP, value, attrNames, iter);
         RID rid;
-        char* data = new char [sizeof(int)+1];
-        memset(data, 0, sizeof(int)+1);
-        rbfmScanIterator.getNextRecord(rid, data);
-        tableID = *(int*)(data+1);
-
-        rbfmScanIterator.close();
-        delete [] condition;
+        char* data = new char [TABLES_TUPLE_SIZE];
+        memset(data, 0, TABLES_TUPLE_SIZE);
+        while(iter.getNextRecord(rid, data) != RBFM_EOF){
+            rids.push_back(rid);
+            records.emplace_back(data, TABLES_TUPLE_SIZE);
+            memset(data, 0, TABLES_TUPLE_SIZE);
+        }
+        iter.close();
         delete [] data;
-        return tableID;
+        return 0;
     }
 
     RM_IndexScanIterator::RM_IndexScanIterator() = default;
@@ -555,42 +819,44 @@ namespace PeterDB {
         return 0;
     }
 
+    RC RM_IndexScanIterator::seek(const void *key){
+        return iter.seek(key);
+    }
+
     RC RM_IndexScanIterator::close(){
         return iter.close();
     }
 
     void RelationManager::addTableCount() {
         RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
-        FileHandle varFile;
         int count = getTableCount() + 1;
+        FileHandle* varFile = fileHandles.get("Variables");
+        if(varFile == nullptr)return;
         char* countData = new char [sizeof(int)+1];
         memset(countData, 0, sizeof(int)+1);
         memcpy(countData+1, &count, sizeof(int));
-        rbfm.openFile("Variables",varFile);
-        rbfm.updateRecord(varFile, Variables_Descriptor, countData, {0,0});
-        varFile.closeFile();
+        rbfm.updateRecord(*varFile, Variables_Descriptor, countData, {0,0});
         delete [] countData;
     }
 
     int RelationManager::getTableCount() {
         RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
-        FileHandle fileHandle;
         int count = 0;
+        FileHandle* fileHandle = fileHandles.get("Variables");
+        if(fileHandle == nullptr)return count;
         char* countData = new char [sizeof(int)+1];
         memset(countData, 0, sizeof(int)+1);
-        rbfm.openFile("Variables",fileHandle);
-        rbfm.readRecord(fileHandle, Variables_Descriptor, {0,0}, countData);
-        fileHandle.closeFile();
+        rbfm.readRecord(*fileHandle, Variables_Descriptor, {0,0}, countData);
         memcpy(&count, countData+1, sizeof(int));
         delete[] countData;
         return count;
     }
 
     bool RelationManager::containAttribute(const std::string &tableName, const std::string &attrbuteName) {
-        std::vector<Attribute> attrs;
-        getAttributes(tableName, attrs);
-        for(int i=0;i<attrs.size();i++){
-            if(attrs.at(i).name==attrbuteName){
+        TableInfo* info = getTableInfo(tableName);
+        if(info == nullptr)return false;
+        for(auto& attr: info->attrs){
+            if(attr.name==attrbuteName){
                 return true;
             }
         }
@@ -606,30 +872,17 @@ namespace PeterDB {
     }
 
     void RelationManager::insertIndex(const std::string &tableName, RID &rid) {
-        RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
         IndexManager& indexManager = IndexManager::instance();
+        TableInfo* info = getTableInfo(tableName);
+        if(info == nullptr)return;
 
-        std::vector<Attribute> attrs;
-        getAttributes(tableName, attrs);
-        std::string indexTable = getIndexTableName(tableName);
-        RBFM_ScanIterator iter;
-        FileHandle fileHandle;
-        RC rc = rbfm.openFile(indexTable, fileHandle);
-        if(rc!=0)return;
-        auto id = getTableID(tableName);
-        rbfm.scan(fileHandle, Index_Descriptor, "table-id", EQ_OP, &id, {"attr-name"}, iter);
-        char* data = new char [INDEX_TUPLE_SIZE];
-        memset(data, 0, INDEX_TUPLE_SIZE);
-
-        RID scanRID;
-        while(iter.getNextRecord(scanRID, data)!=-1){
-            std::string attrName(data+sizeof(int)+1);
+        for(auto& attrName: info->indexes){
             std::string indexName = getIndexName(tableName, attrName);
-            IXFileHandle ixFileHandle;
-            indexManager.openFile(indexName, ixFileHandle);
+            IXFileHandle* ixFileHandle = ixFileHandles.get(indexName);
+            if(ixFileHandle == nullptr)continue;
 
             Attribute targetAttr;
-            for(auto attr : attrs) {
+            for(auto& attr : info->attrs) {
                 if(attr.name == attrName) {
                     targetAttr = attr;
                 }
@@ -639,40 +892,24 @@ namespace PeterDB {
             readAttribute(tableName, rid, attrName, keyData);
             char nullId = keyData[0];
             if(nullId!=-128){
-                indexManager.insertEntry(ixFileHandle, targetAttr, keyData+1, rid);
+                indexManager.insertEntry(*ixFileHandle, targetAttr, keyData+1, rid);
             }
-            indexManager.closeFile(ixFileHandle);
             delete [] keyData;
         }
-
-        delete [] data;
-        iter.close();
     }
 
     void RelationManager::deleteIndex(const std::string &tableName, RID &rid) {
-        RecordBasedFileManager& rbfm = RecordBasedFileManager::instance();
         IndexManager& indexManager = IndexManager::instance();
+        TableInfo* info = getTableInfo(tableName);
+        if(info == nullptr)return;
 
-        std::vector<Attribute> attrs;
-        getAttributes(tableName, attrs);
-        std::string indexTable = getIndexTableName(tableName);
-        RBFM_ScanIterator iter;
-        FileHandle fileHandle;
-        rbfm.openFile(indexTable, fileHandle);
-        auto id = getTableID(tableName);
-        rbfm.scan(fileHandle, Index_Descriptor, "table-id", EQ_OP, &id, {"attr-name"}, iter);
-        char* data = new char [INDEX_TUPLE_SIZE];
-        memset(data, 0, INDEX_TUPLE_SIZE);
-
-        RID scanRID;
-        while(iter.getNextRecord(scanRID, data)!=-1){
-            std::string attrName(data+sizeof(int)+1);
+        for(auto& attrName: info->indexes){
             std::string indexName = getIndexName(tableName, attrName);
-            IXFileHandle ixFileHandle;
-            indexManager.openFile(indexName, ixFileHandle);
+            IXFileHandle* ixFileHandle = ixFileHandles.get(indexName);
+            if(ixFileHandle == nullptr)continue;
 
             Attribute targetAttr;
-            for(auto attr : attrs) {
+            for(auto& attr : info->attrs) {
                 if(attr.name == attrName) {
                     targetAttr = attr;
                 }
@@ -682,13 +919,9 @@ namespace PeterDB {
             readAttribute(tableName, rid, attrName, keyData);
             char nullId = keyData[0];
             if(nullId!=-128){
-                indexManager.deleteEntry(ixFileHandle, targetAttr, keyData+1, rid);
+                indexManager.deleteEntry(*ixFileHandle, targetAttr, keyData+1, rid);
             }
-            indexManager.closeFile(ixFileHandle);
             delete [] keyData;
         }
-
-        delete [] data;
-        iter.close();
     }
 } // namespace PeterDB
\ No newline at end of file
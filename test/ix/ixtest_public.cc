@@ -1499,6 +1499,72 @@ namespace PeterDBTesting {
 
     }
 
+    TEST_F(IX_Test, bulk_load_then_insert) {
+        // Checks whether a bulk loaded tree is ordered and keeps working with insertEntry
+        // Functions tested
+        // 1. Bulk load entries in descending order, enough to spill sorted runs
+        // 2. Scan all entries in ascending order
+        // 3. Insert entries between the loaded ones
+        // 4. Scan again and look up one of the inserted entries
+
+        unsigned numOfEntries = 400000;
+        unsigned numOfInserts = 2000;
+        unsigned seed = 7, salt = 3;
+        unsigned key;
+
+        PeterDB::IX_BulkLoader loader;
+        ASSERT_EQ(ix.bulkLoad(ixFileHandle, ageAttr, loader, 0.7), success)
+                                    << "indexManager::bulkLoad() should succeed.";
+        for (unsigned i = numOfEntries; i > 0; i--) {
+            key = 2 * i + seed;
+            rid.pageNum = (unsigned) (key * salt + seed) % INT_MAX;
+            rid.slotNum = (unsigned) (key * salt * seed + seed) % SHRT_MAX;
+            ASSERT_EQ(loader.insertEntry(&key, rid), success) << "IX_BulkLoader::insertEntry() should succeed.";
+        }
+        ASSERT_EQ(loader.close(), success) << "IX_BulkLoader::close() should succeed.";
+
+        ASSERT_EQ(ix.scan(ixFileHandle, ageAttr, nullptr, nullptr, true, true, ix_ScanIterator), success)
+                                    << "indexManager::scan() should succeed.";
+        unsigned count = 0, last = 0;
+        while (ix_ScanIterator.getNextEntry(rid, &key) == success) {
+            count++;
+            ASSERT_GT(key, last) << "keys should be scanned in ascending order.";
+            last = key;
+            validateRID(key, seed, salt);
+        }
+        EXPECT_EQ(count, numOfEntries) << "scanned count should match loaded.";
+        ASSERT_EQ(ix_ScanIterator.close(), success) << "IX_ScanIterator::close() should succeed.";
+
+        for (unsigned i = 1; i <= numOfInserts; i++) {
+            key = 2 * i * 97 + 1 + seed;
+            rid.pageNum = (unsigned) (key * salt + seed) % INT_MAX;
+            rid.slotNum = (unsigned) (key * salt * seed + seed) % SHRT_MAX;
+            ASSERT_EQ(ix.insertEntry(ixFileHandle, ageAttr, &key, rid), success)
+                                        << "indexManager::insertEntry() should succeed.";
+        }
+
+        ASSERT_EQ(ix.scan(ixFileHandle, ageAttr, nullptr, nullptr, true, true, ix_ScanIterator), success)
+                                    << "indexManager::scan() should succeed.";
+        count = 0, last = 0;
+        while (ix_ScanIterator.getNextEntry(rid, &key) == success) {
+            count++;
+            ASSERT_GT(key, last) << "keys should be scanned in ascending order.";
+            last = key;
+            validateRID(key, seed, salt);
+        }
+        EXPECT_EQ(count, numOfEntries + numOfInserts) << "scanned count should match loaded and inserted.";
+        ASSERT_EQ(ix_ScanIterator.close(), success) << "IX_ScanIterator::close() should succeed.";
+
+        unsigned target = 2 * 500 * 97 + 1 + seed;
+        ASSERT_EQ(ix.scan(ixFileHandle, ageAttr, &target, &target, true, true, ix_ScanIterator), success)
+                                    << "indexManager::scan() should succeed.";
+        ASSERT_EQ(ix_ScanIterator.getNextEntry(rid, &key), success) << "the inserted entry should be found.";
+        EXPECT_EQ(key, target);
+        validateRID(key, seed, salt);
+        EXPECT_EQ(ix_ScanIterator.getNextEntry(rid, &key), IX_EOF) << "only one entry should match.";
+        ASSERT_EQ(ix_ScanIterator.close(), success) << "IX_ScanIterator::close() should succeed.";
+    }
+
     TEST_F(IX_Test, extra_merge_on_deletion) {
         // Checks whether the deletion is properly managed (non-lazy deletion)
         // Functions tested
@@ -1543,4 +1609,346 @@ namespace PeterDBTesting {
 
     }
 
+    TEST_F(IX_Test, seek_keys_in_increasing_order) {
+        // Checks point lookups through one scan that moves along the leaves
+        // Functions tested
+        // 1. Insert entries for even keys, enough for several leaves
+        // 2. Seek close keys, keys on the next leaf, far keys and missing keys in increasing order
+
+        unsigned numOfEntries = 20000;
+        unsigned seed = 5, salt = 11;
+        unsigned key;
+
+        for (unsigned i = 1; i <= numOfEntries; i++) {
+            key = 2 * i;
+            rid.pageNum = (unsigned) (key * salt + seed) % INT_MAX;
+            rid.slotNum = (unsigned) (key * salt * seed + seed) % SHRT_MAX;
+            ASSERT_EQ(ix.insertEntry(ixFileHandle, ageAttr, &key, rid), success)
+                                        << "indexManager::insertEntry() should succeed.";
+        }
+
+        ASSERT_EQ(ix.scan(ixFileHandle, ageAttr, nullptr, nullptr, true, true, ix_ScanIterator), success)
+                                    << "indexManager::scan() should succeed.";
+        std::vector<unsigned> targets = {2, 4, 5, 10, 400, 402, 1001, 1002, 2000, 9000, 9001, 39998, 40000, 40002};
+        for (unsigned target : targets) {
+            ASSERT_EQ(ix_ScanIterator.seek(&target), success) << "IX_ScanIterator::seek() should succeed.";
+            bool present = target % 2 == 0 && target <= 2 * numOfEntries;
+            if (present) {
+                ASSERT_EQ(ix_ScanIterator.getNextEntry(rid, &key), success) << "the key should be found: " << target;
+                EXPECT_EQ(key, target);
+                validateRID(key, seed, salt);
+            }
+            EXPECT_EQ(ix_ScanIterator.getNextEntry(rid, &key), IX_EOF) << "only the sought key should match.";
+        }
+        ASSERT_EQ(ix_ScanIterator.close(), success) << "IX_ScanIterator::close() should succeed.";
+    }
+
+    TEST_F(IX_Test, compact_leaves_for_int_and_varchar_keys) {
+        // Checks that a leaf holds more keys than an entry with a slot each would allow
+        // Functions tested
+        // 1. Insert int keys that fit one dense leaf, then varchar keys sharing a long prefix
+        // 2. Print BTree, the tree should still be a single leaf
+        // 3. Scan a range of the varchar keys
+
+        unsigned numOfEntries = 270;
+        for (unsigned i = 0; i < numOfEntries; i++) {
+            int key = 1000 + (int) i * 7 % numOfEntries;
+            rid.pageNum = i;
+            rid.slotNum = i;
+            ASSERT_EQ(ix.insertEntry(ixFileHandle, ageAttr, &key, rid), success)
+                                        << "indexManager::insertEntry() should succeed.";
+        }
+        std::stringstream stream;
+        ASSERT_EQ(ix.printBTree(ixFileHandle, ageAttr, stream), success)
+                                    << "indexManager::printBTree() should succeed.";
+        validateTree(stream, numOfEntries, numOfEntries, 0, numOfEntries, true);
+
+        ASSERT_EQ(ix.closeFile(ixFileHandle), success) << "indexManager::closeFile() should succeed.";
+        ASSERT_EQ(ix.destroyFile(indexFileName), success) << "indexManager::destroyFile() should succeed.";
+        ASSERT_EQ(ix.createFile(indexFileName), success) << "indexManager::createFile() should succeed.";
+        ASSERT_EQ(ix.openFile(indexFileName, ixFileHandle), success) << "indexManager::openFile() should succeed.";
+
+        // 120 bytes shared by every key, stored once per leaf
+        numOfEntries = 150;
+        std::string prefix(120, 'p');
+        char key[PAGE_SIZE];
+        std::vector<unsigned> order(numOfEntries);
+        std::iota(order.begin(), order.end(), 0);
+        std::shuffle(order.begin(), order.end(), std::mt19937(7));
+        for (unsigned i : order) {
+            std::string str = prefix + std::to_string(1000 + i);
+            *(unsigned *) key = str.size();
+            memcpy(key + 4, str.data(), str.size());
+            rid.pageNum = i;
+            rid.slotNum = i;
+            ASSERT_EQ(ix.insertEntry(ixFileHandle, empNameAttr, key, rid), success)
+                                        << "indexManager::insertEntry() should succeed.";
+        }
+        stream.str("");
+        stream.clear();
+        ASSERT_EQ(ix.printBTree(ixFileHandle, empNameAttr, stream), success)
+                                    << "indexManager::printBTree() should succeed.";
+        validateTree(stream, numOfEntries, numOfEntries, 0, numOfEntries, true);
+
+        char low[PAGE_SIZE], high[PAGE_SIZE];
+        std::string lowStr = prefix + "1020", highStr = prefix + "1100";
+        *(unsigned *) low = lowStr.size();
+        memcpy(low + 4, lowStr.data(), lowStr.size());
+        *(unsigned *) high = highStr.size();
+        memcpy(high + 4, highStr.data(), highStr.size());
+        ASSERT_EQ(ix.scan(ixFileHandle, empNameAttr, low, high, false, true, ix_ScanIterator), success)
+                                    << "indexManager::scan() should succeed.";
+        unsigned expected = 21;
+        while (ix_ScanIterator.getNextEntry(rid, key) == success) {
+            std::string str(key + 4, *(unsigned *) key);
+            EXPECT_EQ(str, prefix + std::to_string(1000 + expected)) << "keys should come back whole and in order.";
+            EXPECT_EQ(rid.pageNum, expected);
+            expected++;
+        }
+        EXPECT_EQ(expected, 101) << "scanned count should match the range.";
+        ASSERT_EQ(ix_ScanIterator.close(), success) << "IX_ScanIterator::close() should succeed.";
+    }
+
+    TEST_F(IX_Test, point_lookup_reads_only_its_leaf) {
+        // Checks that the root pointer and the inner nodes stay in memory
+        // Functions tested
+        // 1. Insert entries, enough for inner nodes
+        // 2. Look up keys once, then look them up again counting page reads of the file
+
+        unsigned numOfEntries = 60000;
+        unsigned seed = 3, salt = 17;
+        unsigned key;
+        for (unsigned i = 0; i < numOfEntries; i++) {
+            key = (i * 7919) % numOfEntries;
+            rid.pageNum = (unsigned) (key * salt + seed) % INT_MAX;
+            rid.slotNum = (unsigned) (key * salt * seed + seed) % SHRT_MAX;
+            ASSERT_EQ(ix.insertEntry(ixFileHandle, ageAttr, &key, rid), success)
+                                        << "indexManager::insertEntry() should succeed.";
+        }
+
+        for (int pass = 0; pass < 2; pass++) {
+            for (unsigned target = 0; target < numOfEntries; target += 97) {
+                ASSERT_EQ(ixFileHandle.fileHandle.collectCounterValues(rc, wc, ac), success)
+                                            << "FileHandle::collectCounterValues() should succeed.";
+                ASSERT_EQ(ix.scan(ixFileHandle, ageAttr, &target, &target, true, true, ix_ScanIterator), success)
+                                            << "indexManager::scan() should succeed.";
+                ASSERT_EQ(ix_ScanIterator.getNextEntry(rid, &key), success) << "the key should be found: " << target;
+                EXPECT_EQ(key, target);
+                validateRID(key, seed, salt);
+                ASSERT_EQ(ix_ScanIterator.close(), success) << "IX_ScanIterator::close() should succeed.";
+                ASSERT_EQ(ixFileHandle.fileHandle.collectCounterValues(rcAfter, wcAfter, acAfter), success)
+                                            << "FileHandle::collectCounterValues() should succeed.";
+                // The first pass brings in the nodes on the way. The scan moves on to the next leaf
+                // after the last key of a leaf.
+                if (pass == 1) EXPECT_IN_RANGE(rcAfter - rc, 1, 2);
+            }
+        }
+
+        // The reads served from memory still count for the index
+        ASSERT_EQ(ixFileHandle.collectCounterValues(rc, wc, ac), success)
+                                    << "indexManager::collectCounterValues() should succeed.";
+        ASSERT_EQ(ix.scan(ixFileHandle, ageAttr, &key, &key, true, true, ix_ScanIterator), success)
+                                    << "indexManager::scan() should succeed.";
+        ASSERT_EQ(ix_ScanIterator.close(), success) << "IX_ScanIterator::close() should succeed.";
+        ASSERT_EQ(ixFileHandle.collectCounterValues(rcAfter, wcAfter, acAfter), success)
+                                    << "indexManager::collectCounterValues() should succeed.";
+        EXPECT_GE(rcAfter - rc, 3) << "the root pointer, a node and a leaf should be read.";
+    }
+
+    TEST_F(IX_Test, scan_mapped_index_read_only) {
+        // Checks that a mapped index scans like an opened one and refuses changes
+        // Functions tested
+        // 1. Insert entries, then reopen the index mapped
+        // 2. Scan every entry and a range
+        // 3. Insert into the mapped index should fail
+
+        unsigned numOfEntries = 20000;
+        unsigned seed = 5, salt = 11;
+        unsigned key;
+        for (unsigned i = 0; i < numOfEntries; i++) {
+            key = (i * 7919) % numOfEntries;
+            rid.pageNum = (unsigned) (key * salt + seed) % INT_MAX;
+            rid.slotNum = (unsigned) (key * salt * seed + seed) % SHRT_MAX;
+            ASSERT_EQ(ix.insertEntry(ixFileHandle, ageAttr, &key, rid), success)
+                                        << "indexManager::insertEntry() should succeed.";
+        }
+        ASSERT_EQ(ix.closeFile(ixFileHandle), success) << "indexManager::closeFile() should succeed.";
+        ASSERT_EQ(ix.openFile(indexFileName, ixFileHandle, true), success)
+                                    << "indexManager::openFile() should succeed on a mapped index.";
+        ASSERT_TRUE(ixFileHandle.fileHandle.isMapped()) << "the index should be mapped.";
+
+        ASSERT_EQ(ix.scan(ixFileHandle, ageAttr, NULL, NULL, true, true, ix_ScanIterator), success)
+                                    << "indexManager::scan() should succeed.";
+        unsigned count = 0;
+        while (ix_ScanIterator.getNextEntry(rid, &key) == success) {
+            EXPECT_EQ(key, count);
+            validateRID(key, seed, salt);
+            count++;
+        }
+        EXPECT_EQ(count, numOfEntries) << "every entry should be scanned.";
+        ASSERT_EQ(ix_ScanIterator.close(), success) << "IX_ScanIterator::close() should succeed.";
+
+        unsigned low = 1000, high = 1999;
+        ASSERT_EQ(ix.scan(ixFileHandle, ageAttr, &low, &high, true, false, ix_ScanIterator), success)
+                                    << "indexManager::scan() should succeed.";
+        count = 0;
+        while (ix_ScanIterator.getNextEntry(rid, &key) == success) {
+            EXPECT_EQ(key, low + count);
+            count++;
+        }
+        EXPECT_EQ(count, high - low) << "the range should be scanned.";
+        ASSERT_EQ(ix_ScanIterator.close(), success) << "IX_ScanIterator::close() should succeed.";
+
+        key = numOfEntries;
+        ASSERT_NE(ix.insertEntry(ixFileHandle, ageAttr, &key, rid), success)
+                                    << "indexManager::insertEntry() should fail on a mapped index.";
+    }
+
+    TEST_F(IX_Test, duplicate_key_spread_over_leaves) {
+        // Checks that the entries of a key filling several leaves are all scanned and deleted
+        // Functions tested
+        // 1. Insert many entries of one key among a few of the keys around it
+        // 2. Scan entries - EQ_OP and GT_OP on the duplicated key
+        // 3. Delete every entry of the key and scan again
+
+        unsigned numOfDuplicates = 3000, numOfOthers = 300;
+        int dupKey = 50, key;
+        for (unsigned i = 0; i < numOfDuplicates; i++) {
+            rid.pageNum = i;
+            rid.slotNum = i;
+            ASSERT_EQ(ix.insertEntry(ixFileHandle, ageAttr, &dupKey, rid), success)
+                                        << "indexManager::insertEntry() should succeed.";
+            if (i % (numOfDuplicates / numOfOthers) == 0) {
+                // Half of them below the key, half above
+                key = (int) (i / 10 % 2 == 0 ? i / 100 : 100 + i / 100);
+                ASSERT_EQ(ix.insertEntry(ixFileHandle, ageAttr, &key, rid), success)
+                                            << "indexManager::insertEntry() should succeed.";
+            }
+        }
+
+        unsigned count = 0;
+        std::vector<bool> seen(numOfDuplicates, false);
+        ASSERT_EQ(ix.scan(ixFileHandle, ageAttr, &dupKey, &dupKey, true, true, ix_ScanIterator), success)
+                                    << "indexManager::scan() should succeed.";
+        while (ix_ScanIterator.getNextEntry(rid, &key) == success) {
+            ASSERT_EQ(key, dupKey) << "Scan outputs (value) should match.";
+            ASSERT_LT(rid.pageNum, numOfDuplicates) << "Scan outputs (PageNum) should match.";
+            ASSERT_FALSE(seen[rid.pageNum]) << "An entry should be scanned once.";
+            seen[rid.pageNum] = true;
+            count++;
+        }
+        ASSERT_EQ(ix_ScanIterator.close(), success) << "IX_ScanIterator::close() should succeed.";
+        ASSERT_EQ(count, numOfDuplicates) << "Every entry of the key should be scanned.";
+
+        count = 0;
+        ASSERT_EQ(ix.scan(ixFileHandle, ageAttr, &dupKey, nullptr, false, true, ix_ScanIterator), success)
+                                    << "indexManager::scan() should succeed.";
+        while (ix_ScanIterator.getNextEntry(rid, &key) == success) {
+            ASSERT_GT(key, dupKey) << "An excluded low key should not be scanned.";
+            count++;
+        }
+        ASSERT_EQ(ix_ScanIterator.close(), success) << "IX_ScanIterator::close() should succeed.";
+        ASSERT_EQ(count, numOfOthers / 2) << "Every entry above the key should be scanned.";
+
+        for (unsigned i = 0; i < numOfDuplicates; i++) {
+            rid.pageNum = i;
+            rid.slotNum = i;
+            ASSERT_EQ(ix.deleteEntry(ixFileHandle, ageAttr, &dupKey, rid), success)
+                                        << "indexManager::deleteEntry() should succeed.";
+        }
+        ASSERT_EQ(ix.scan(ixFileHandle, ageAttr, &dupKey, &dupKey, true, true, ix_ScanIterator), success)
+                                    << "indexManager::scan() should succeed.";
+        ASSERT_EQ(ix_ScanIterator.getNextEntry(rid, &key), IX_EOF) << "Every entry of the key should be deleted.";
+        ASSERT_EQ(ix_ScanIterator.close(), success) << "IX_ScanIterator::close() should succeed.";
+    }
+
+    TEST_F(IX_Test, large_pages_hold_more_entries) {
+        // Checks that an index created with 64 KB pages keeps its page size and fills whole pages
+        // Functions tested
+        // 1. Create the index with an unsupported and with a 64 KB page size
+        // 2. Insert varchar entries, fewer pages should be used than with 4 KB pages
+        // 3. Delete half of the entries, reopen the index and scan
+
+        ASSERT_EQ(ix.closeFile(ixFileHandle), success) << "indexManager::closeFile() should succeed.";
+        ASSERT_EQ(ix.destroyFile(indexFileName), success) << "indexManager::destroyFile() should succeed.";
+        ASSERT_NE(ix.createFile(indexFileName, 5000), success) << "a page size that is not a power of two should fail.";
+        ASSERT_NE(ix.createFile(indexFileName, 2 * PF_MAX_PAGE_SIZE), success) << "a page size too large should fail.";
+        ASSERT_EQ(ix.createFile(indexFileName, 64 * 1024), success) << "indexManager::createFile() should succeed.";
+        ASSERT_EQ(ix.openFile(indexFileName, ixFileHandle), success) << "indexManager::openFile() should succeed.";
+        ASSERT_EQ(ixFileHandle.fileHandle.getPageSize(), 64 * 1024) << "the page size should come from the header.";
+
+        unsigned numOfEntries = 20000;
+        char key[PAGE_SIZE];
+        auto makeKey = [&key](unsigned i) {
+            std::string str = std::to_string(100000 + i);
+            *(unsigned *) key = str.size();
+            memcpy(key + 4, str.data(), str.size());
+        };
+        for (unsigned i = 0; i < numOfEntries; i++) {
+            unsigned k = (i * 7919) % numOfEntries;
+            makeKey(k);
+            rid.pageNum = k;
+            rid.slotNum = k % SHRT_MAX;
+            ASSERT_EQ(ix.insertEntry(ixFileHandle, empNameAttr, key, rid), success)
+                                        << "indexManager::insertEntry() should succeed.";
+        }
+        // Around 20 bytes an entry, a 4 KB page holds about 200 of them
+        EXPECT_LT(ixFileHandle.getNumberOfPages(), numOfEntries / 1000) << "the leaves should fill the large pages.";
+
+        for (unsigned k = 1; k < numOfEntries; k += 2) {
+            makeKey(k);
+            rid.pageNum = k;
+            rid.slotNum = k % SHRT_MAX;
+            ASSERT_EQ(ix.deleteEntry(ixFileHandle, empNameAttr, key, rid), success)
+                                        << "indexManager::deleteEntry() should succeed.";
+        }
+
+        reopenIndexFile();
+        ASSERT_EQ(ixFileHandle.fileHandle.getPageSize(), 64 * 1024) << "the page size should be kept.";
+        ASSERT_EQ(ix.scan(ixFileHandle, empNameAttr, NULL, NULL, true, true, ix_ScanIterator), success)
+                                    << "indexManager::scan() should succeed.";
+        unsigned count = 0;
+        while (ix_ScanIterator.getNextEntry(rid, key) == success) {
+            std::string str(key + 4, *(unsigned *) key);
+            EXPECT_EQ(str, std::to_string(100000 + 2 * count)) << "keys should come back in order.";
+            EXPECT_EQ(rid.pageNum, 2 * count);
+            count++;
+        }
+        EXPECT_EQ(count, numOfEntries / 2) << "the entries left should be scanned.";
+        ASSERT_EQ(ix_ScanIterator.close(), success) << "IX_ScanIterator::close() should succeed.";
+    }
+
+    TEST_F(IX_Test, older_leaf_format_rejected) {
+        // Checks that an index written before the leaf format was recorded on page 0 is not misread
+        // Functions tested
+        // 1. Insert an entry, the index should reopen
+        // 2. Clear the format on page 0, as in an older file: opening should fail
+        // 3. An empty index has no format yet and opens
+
+        int key = 42;
+        rid.pageNum = 1;
+        rid.slotNum = 1;
+        ASSERT_EQ(ix.insertEntry(ixFileHandle, ageAttr, &key, rid), success)
+                                    << "indexManager::insertEntry() should succeed.";
+        reopenIndexFile();
+        ASSERT_EQ(ix.closeFile(ixFileHandle), success) << "indexManager::closeFile() should succeed.";
+
+        PeterDB::PagedFileManager &pfm = PeterDB::PagedFileManager::instance();
+        PeterDB::FileHandle fileHandle;
+        char page[PAGE_SIZE];
+        ASSERT_EQ(pfm.openFile(indexFileName, fileHandle), success) << "Opening the file should succeed.";
+        ASSERT_EQ(fileHandle.readPage(0, page), success) << "Reading page 0 should succeed.";
+        ASSERT_EQ(*(int *) (page + sizeof(int)), IX_LEAF_FORMAT) << "Page 0 should hold the leaf format.";
+        *(int *) (page + sizeof(int)) = 0;
+        ASSERT_EQ(fileHandle.writePage(0, page), success) << "Writing page 0 should succeed.";
+        ASSERT_EQ(pfm.closeFile(fileHandle), success) << "Closing the file should succeed.";
+
+        ASSERT_NE(ix.openFile(indexFileName, ixFileHandle), success) << "An older leaf format should not open.";
+        ASSERT_FALSE(ixFileHandle.fileHandle.handlingFile()) << "The failed open should leave the file closed.";
+
+        ASSERT_EQ(ix.destroyFile(indexFileName), success) << "indexManager::destroyFile() should succeed.";
+        ASSERT_EQ(ix.createFile(indexFileName), success) << "indexManager::createFile() should succeed.";
+        ASSERT_EQ(ix.openFile(indexFileName, ixFileHandle), success) << "An empty index should open.";
+    }
+
 } // namespace PeterDBTesting
\ No newline at end of file
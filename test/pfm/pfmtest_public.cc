@@ -1,3 +1,7 @@
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "src/include/pfm.h"
 #include "test/utils/pfm_test_utils.h"
 
@@ -360,4 +364,335 @@ namespace PeterDBTesting {
         }
     }
 
+    TEST_F (PFM_Page_Test, buffer_pool_hit_and_eviction) {
+        // Test case procedure:
+        // 1. Shrink the buffer pool to 4 frames
+        // 2. Append 10 pages and read the last one twice, both reads should hit
+        // 3. Overwrite every page so that dirty frames get evicted
+        // 4. Reopen the file and check the integrity of every page
+
+        PeterDB::BufferPool &pool = PeterDB::BufferPool::instance();
+        unsigned frameCount = pool.getFrameCount();
+        ASSERT_EQ(pool.setFrameCount(4), success) << "Resizing the buffer pool should succeed.";
+
+        inBuffer = malloc(PAGE_SIZE);
+        outBuffer = malloc(PAGE_SIZE);
+        int numPages = 10;
+        for (int i = 0; i < numPages; i++) {
+            generateData(inBuffer, PAGE_SIZE, i + 1);
+            ASSERT_EQ(fileHandle.appendPage(inBuffer), success) << "Appending a page should succeed.";
+        }
+
+        unsigned hitCount = 0, missCount = 0, updatedHitCount = 0, updatedMissCount = 0;
+        ASSERT_EQ(fileHandle.collectBufferCounterValues(hitCount, missCount), success)
+                                    << "Collecting buffer counters should succeed.";
+        ASSERT_EQ(fileHandle.readPage(numPages - 1, outBuffer), success) << "Reading a page should succeed.";
+        ASSERT_EQ(fileHandle.readPage(numPages - 1, outBuffer), success) << "Reading a page should succeed.";
+        ASSERT_EQ(fileHandle.collectBufferCounterValues(updatedHitCount, updatedMissCount), success)
+                                    << "Collecting buffer counters should succeed.";
+        ASSERT_EQ(updatedHitCount - hitCount, 2) << "A freshly appended page should be served by the pool.";
+        ASSERT_EQ(updatedMissCount, missCount) << "No page should have been read from the disk.";
+
+        for (int i = 0; i < numPages; i++) {
+            generateData(inBuffer, PAGE_SIZE, 30 + i, 20 - i);
+            ASSERT_EQ(fileHandle.writePage(i, inBuffer), success) << "Writing a page should succeed.";
+        }
+
+        reopenFile();
+        for (int i = 0; i < numPages; i++) {
+            generateData(inBuffer, PAGE_SIZE, 30 + i, 20 - i);
+            ASSERT_EQ(fileHandle.readPage(i, outBuffer), success) << "Reading a page should succeed.";
+            ASSERT_EQ(memcmp(inBuffer, outBuffer, PAGE_SIZE), 0)
+                                        << "Checking the integrity of the page should succeed.";
+        }
+
+        ASSERT_EQ(pool.setFrameCount(frameCount), success) << "Resizing the buffer pool should succeed.";
+    }
+
+    TEST_F (PFM_Page_Test, header_written_on_sync) {
+        // Test case procedure:
+        // 1. Append pages, the header on the disk should not change yet
+        // 2. sync() should persist the page count
+        // 3. Reopen the file and check the counters survived
+
+        auto readDiskPageCount = [this]() {
+            unsigned header[4] = {0};
+            std::ifstream in(fileName, std::ios::binary);
+            in.read((char *) header, sizeof(header));
+            return header[3];
+        };
+
+        inBuffer = malloc(PAGE_SIZE);
+        int numPages = 3;
+        for (int i = 0; i < numPages; i++) {
+            generateData(inBuffer, PAGE_SIZE, i + 1);
+            ASSERT_EQ(fileHandle.appendPage(inBuffer), success) << "Appending a page should succeed.";
+        }
+        ASSERT_EQ(fileHandle.getNumberOfPages(), numPages) << "The page count should not be persisted yet.";
+        ASSERT_EQ(readDiskPageCount(), 0) << "The header should only be written lazily.";
+
+        ASSERT_EQ(fileHandle.sync(), success) << "Syncing the file should succeed.";
+        ASSERT_EQ(readDiskPageCount(), numPages) << "The header should be persisted by sync().";
+
+        unsigned readCount = 0, writeCount = 0, appendCount = 0;
+        reopenFile();
+        ASSERT_EQ(fileHandle.collectCounterValues(readCount, writeCount, appendCount), success)
+                                    << "Collecting counters should succeed.";
+        ASSERT_EQ(appendCount, numPages) << "The append counter should be persisted.";
+        ASSERT_EQ(fileHandle.getNumberOfPages(), numPages) << "The page count should be persisted.";
+    }
+
+    TEST_F (PFM_Page_Test, log_truncated_on_last_close) {
+        // Test case procedure:
+        // 1. Append and overwrite a page in one atomic change
+        // 2. Without sync commit, the log writer should make the change durable within LOG_GROUP_COMMIT_US
+        // 3. Closing the file makes the change durable in the file, the log should be empty
+
+        PeterDB::LogManager &log = PeterDB::LogManager::instance();
+        inBuffer = malloc(PAGE_SIZE);
+        unsigned pageNum = fileHandle.getNumberOfPages();
+        log.beginAtomic();
+        generateData(inBuffer, PAGE_SIZE, 7);
+        ASSERT_EQ(fileHandle.appendPage(inBuffer), success) << "Appending a page should succeed.";
+        generateData(inBuffer, PAGE_SIZE, 9);
+        ASSERT_EQ(fileHandle.writePage(pageNum, inBuffer), success) << "Writing a page should succeed.";
+        ASSERT_EQ(log.endAtomic(), success) << "Committing should succeed.";
+        // Leave room for a slow fsync, the writer starts it after at most one window
+        for (int i = 0; i < 100 && getFileSize(log.getFileName()) == 0; i++) {
+            usleep(LOG_GROUP_COMMIT_US);
+        }
+        ASSERT_GT(getFileSize(log.getFileName()), 0) << "The committed change should be in the log.";
+
+        reopenFile();
+        ASSERT_EQ(getFileSize(log.getFileName()), 0) << "The log should be emptied on the last close.";
+        outBuffer = malloc(PAGE_SIZE);
+        ASSERT_EQ(fileHandle.readPage(pageNum, outBuffer), success) << "Reading a page should succeed.";
+        ASSERT_EQ(memcmp(inBuffer, outBuffer, PAGE_SIZE), 0) << "The page should hold the committed data.";
+    }
+
+    TEST_F (PFM_Page_Test, uncommitted_change_undone_after_crash) {
+        // Test case procedure:
+        // 1. Append a page and make it durable
+        // 2. In a child process, append a page and overwrite the first one in an atomic change,
+        //    force the pages and the log to the disk, then die without committing
+        // 3. Reopening replays the log: the append should be cut off and the page should hold its old data
+
+        const std::string &logName = PeterDB::LogManager::instance().getFileName();
+        inBuffer = malloc(PAGE_SIZE);
+        outBuffer = malloc(PAGE_SIZE);
+        unsigned pageNum = fileHandle.getNumberOfPages();
+        generateData(inBuffer, PAGE_SIZE, 3);
+        ASSERT_EQ(fileHandle.appendPage(inBuffer), success) << "Appending a page should succeed.";
+        ASSERT_EQ(pfm.closeFile(fileHandle), success) << "Closing the file should not fail.";
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            // The child never returns to the test, it dies like a crashed process
+            PeterDB::FileHandle handle;
+            generateData(outBuffer, PAGE_SIZE, 5);
+            bool forced = pfm.openFile(fileName, handle) == success;
+            PeterDB::LogManager::instance().beginAtomic();
+            forced = forced && handle.appendPage(outBuffer) == success &&
+                     handle.writePage(pageNum, outBuffer) == success &&
+                     PeterDB::BufferPool::instance().flushFile(handle) == success;
+            _exit(forced ? 0 : 1);
+        }
+        int status = 0;
+        ASSERT_EQ(waitpid(pid, &status, 0), pid) << "The child process should end.";
+        ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0) << "The change should be forced to the disk.";
+        ASSERT_GT(getFileSize(logName), 0) << "The crash should leave the log behind.";
+
+        ASSERT_EQ(pfm.openFile(fileName, fileHandle), success) << "Opening the file should not fail.";
+        ASSERT_EQ(getFileSize(logName), 0) << "The log should be emptied by the recovery.";
+        ASSERT_EQ(fileHandle.getNumberOfPages(), pageNum + 1) << "The uncommitted append should be undone.";
+        ASSERT_EQ(fileHandle.readPage(pageNum, outBuffer), success) << "Reading a page should succeed.";
+        ASSERT_EQ(memcmp(inBuffer, outBuffer, PAGE_SIZE), 0) << "The uncommitted write should be undone.";
+    }
+
+    TEST_F (PFM_Page_Test, committed_change_redone_after_crash) {
+        // Test case procedure:
+        // 1. Append a page and make it durable
+        // 2. In a child process, overwrite the page in an atomic change committed with sync commit,
+        //    then die while the new data is only in the buffer pool
+        // 3. Reopening replays the log: the page should hold the committed data
+
+        const std::string &logName = PeterDB::LogManager::instance().getFileName();
+        inBuffer = malloc(PAGE_SIZE);
+        outBuffer = malloc(PAGE_SIZE);
+        unsigned pageNum = fileHandle.getNumberOfPages();
+        generateData(outBuffer, PAGE_SIZE, 3);
+        ASSERT_EQ(fileHandle.appendPage(outBuffer), success) << "Appending a page should succeed.";
+        ASSERT_EQ(pfm.closeFile(fileHandle), success) << "Closing the file should not fail.";
+
+        generateData(inBuffer, PAGE_SIZE, 5);
+        pid_t pid = fork();
+        if (pid == 0) {
+            PeterDB::FileHandle handle;
+            bool committed = pfm.openFile(fileName, handle) == success;
+            PeterDB::LogManager::instance().setSyncCommit(true);
+            PeterDB::LogManager::instance().beginAtomic();
+            committed = committed && handle.writePage(pageNum, inBuffer) == success;
+            committed = PeterDB::LogManager::instance().endAtomic() == success && committed;
+            _exit(committed ? 0 : 1);
+        }
+        int status = 0;
+        ASSERT_EQ(waitpid(pid, &status, 0), pid) << "The child process should end.";
+        ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0) << "The change should commit.";
+        ASSERT_GT(getFileSize(logName), 0) << "The crash should leave the log behind.";
+
+        ASSERT_EQ(pfm.openFile(fileName, fileHandle), success) << "Opening the file should not fail.";
+        ASSERT_EQ(getFileSize(logName), 0) << "The log should be emptied by the recovery.";
+        ASSERT_EQ(fileHandle.getNumberOfPages(), pageNum + 1) << "The page count should not change.";
+        ASSERT_EQ(fileHandle.readPage(pageNum, outBuffer), success) << "Reading a page should succeed.";
+        ASSERT_EQ(memcmp(inBuffer, outBuffer, PAGE_SIZE), 0) << "The committed write should be redone.";
+    }
+
+    TEST_F (PFM_Page_Test, log_locked_by_its_process) {
+        // Test case procedure:
+        // 1. Commit a change, the log should hold it
+        // 2. The log should be locked, another process could not take it to replay or truncate it
+
+        PeterDB::LogManager &log = PeterDB::LogManager::instance();
+        log.setSyncCommit(true);
+        inBuffer = malloc(PAGE_SIZE);
+        generateData(inBuffer, PAGE_SIZE, 11);
+        log.beginAtomic();
+        ASSERT_EQ(fileHandle.appendPage(inBuffer), success) << "Appending a page should succeed.";
+        ASSERT_EQ(log.endAtomic(), success) << "Committing should succeed.";
+        log.setSyncCommit(false);
+        ASSERT_GT(getFileSize(log.getFileName()), 0) << "The committed change should be in the log.";
+
+        int fd = open(log.getFileName().c_str(), O_RDWR);
+        ASSERT_GE(fd, 0) << "The log should exist.";
+        ASSERT_NE(flock(fd, LOCK_EX | LOCK_NB), 0) << "The log should be locked.";
+        close(fd);
+
+    }
+
+    TEST_F (PFM_Page_Test, direct_io_with_two_handles) {
+        // Test case procedure:
+        // 1. Reopen the file with direct I/O (file systems without it fall back to buffered I/O)
+        // 2. Append pages from an unaligned buffer
+        // 3. Reopen, then read the pages from the disk through two handles in turn
+
+        pfm.setDirectIO(true);
+        reopenFile();
+        pfm.setDirectIO(false);
+
+        int numPages = 8;
+        char *unaligned = (char *) malloc(PAGE_SIZE + 1) + 1;
+        for (int i = 0; i < numPages; i++) {
+            generateData(unaligned, PAGE_SIZE, i + 1);
+            ASSERT_EQ(fileHandle.appendPage(unaligned), success) << "Appending a page should succeed.";
+        }
+        reopenFile();
+
+        PeterDB::FileHandle other;
+        ASSERT_EQ(pfm.openFile(fileName, other), success) << "Opening the file twice should succeed.";
+        inBuffer = malloc(PAGE_SIZE);
+        outBuffer = malloc(PAGE_SIZE);
+        for (int i = 0; i < numPages; i++) {
+            PeterDB::FileHandle &handle = i % 2 == 0 ? fileHandle : other;
+            generateData(inBuffer, PAGE_SIZE, i + 1);
+            // Physical page: skip the header and the space map page
+            ASSERT_EQ(handle.readFromDisk(i + 2, unaligned), success) << "Reading from the disk should succeed.";
+            ASSERT_EQ(memcmp(inBuffer, unaligned, PAGE_SIZE), 0) << "The page should hold the appended data.";
+            ASSERT_EQ(handle.readPage(i, outBuffer), success) << "Reading a page should succeed.";
+            ASSERT_EQ(memcmp(inBuffer, outBuffer, PAGE_SIZE), 0) << "The page should hold the appended data.";
+        }
+        ASSERT_EQ(pfm.closeFile(other), success) << "Closing the file should succeed.";
+        free(unaligned - 1);
+    }
+
+    TEST_F (PFM_Page_Test, prefetched_pages_hit_the_pool) {
+        // Test case procedure:
+        // 1. Append pages, then empty a buffer pool of 64 frames
+        // 2. Prefetch pages and read them, every read should hit and see the data on the disk
+        // 3. Overwrite a page while it may still be read ahead, the write should win
+
+        PeterDB::BufferPool &pool = PeterDB::BufferPool::instance();
+        unsigned frameCount = pool.getFrameCount();
+        inBuffer = malloc(PAGE_SIZE);
+        outBuffer = malloc(PAGE_SIZE);
+        int numPages = 40;
+        for (int i = 0; i < numPages; i++) {
+            generateData(inBuffer, PAGE_SIZE, i + 1);
+            ASSERT_EQ(fileHandle.appendPage(inBuffer), success) << "Appending a page should succeed.";
+        }
+        ASSERT_EQ(fileHandle.sync(), success) << "Syncing the file should succeed.";
+        ASSERT_EQ(pool.setFrameCount(64), success) << "Resizing the buffer pool should succeed.";
+
+        unsigned hitCount = 0, missCount = 0, updatedHitCount = 0, updatedMissCount = 0;
+        ASSERT_EQ(fileHandle.collectBufferCounterValues(hitCount, missCount), success)
+                                    << "Collecting buffer counters should succeed.";
+        fileHandle.prefetch(0, 16);
+        for (int i = 0; i < 16; i++) {
+            generateData(inBuffer, PAGE_SIZE, i + 1);
+            ASSERT_EQ(fileHandle.readPage(i, outBuffer), success) << "Reading a page should succeed.";
+            ASSERT_EQ(memcmp(inBuffer, outBuffer, PAGE_SIZE), 0) << "The prefetched page should be intact.";
+        }
+        ASSERT_EQ(fileHandle.collectBufferCounterValues(updatedHitCount, updatedMissCount), success)
+                                    << "Collecting buffer counters should succeed.";
+        ASSERT_EQ(updatedHitCount - hitCount, 16) << "Prefetched pages should be served by the pool.";
+        ASSERT_EQ(updatedMissCount, missCount) << "No page should have been read synchronously.";
+
+        fileHandle.prefetch(16, numPages - 16);
+        generateData(inBuffer, PAGE_SIZE, 77, 3);
+        ASSERT_EQ(fileHandle.writePage(20, inBuffer), success) << "Writing a page should succeed.";
+        for (int i = 16; i < numPages; i++) {
+            if (i == 20) generateData(inBuffer, PAGE_SIZE, 77, 3);
+            else generateData(inBuffer, PAGE_SIZE, i + 1);
+            ASSERT_EQ(fileHandle.readPage(i, outBuffer), success) << "Reading a page should succeed.";
+            ASSERT_EQ(memcmp(inBuffer, outBuffer, PAGE_SIZE), 0) << "The page should hold its latest data.";
+        }
+
+        ASSERT_EQ(pool.setFrameCount(frameCount), success) << "Resizing the buffer pool should succeed.";
+    }
+
+    TEST_F (PFM_Page_Test, batched_page_io) {
+        // Test case procedure:
+        // 1. Append pages and make them durable
+        // 2. Read them back in one batch (io_uring, or pread when it is unavailable)
+        // 3. Rewrite them in one batch, reopen the file and check every page
+
+        int numPages = 100;
+        inBuffer = malloc(PAGE_SIZE);
+        outBuffer = malloc(PAGE_SIZE);
+        for (int i = 0; i < numPages; i++) {
+            generateData(inBuffer, PAGE_SIZE, i + 1);
+            ASSERT_EQ(fileHandle.appendPage(inBuffer), success) << "Appending a page should succeed.";
+        }
+        ASSERT_EQ(fileHandle.sync(), success) << "Syncing the file should succeed.";
+
+        PeterDB::IORing ring;
+        std::vector<char> pages((size_t) numPages * PAGE_SIZE);
+        std::vector<PeterDB::PageRequest> requests;
+        for (int i = 0; i < numPages; i++) {
+            // Physical page: skip the header and the space map page
+            requests.push_back(PeterDB::PageRequest{&fileHandle.io, (unsigned) i + 2, &pages[(size_t) i * PAGE_SIZE],
+                                                    false, -1});
+        }
+        ASSERT_EQ(ring.run(requests), success) << "Reading a batch should succeed.";
+        for (int i = 0; i < numPages; i++) {
+            generateData(inBuffer, PAGE_SIZE, i + 1);
+            ASSERT_EQ(requests[i].rc, success) << "Every read of the batch should succeed.";
+            ASSERT_EQ(memcmp(inBuffer, &pages[(size_t) i * PAGE_SIZE], PAGE_SIZE), 0)
+                                        << "The page read in the batch should be intact.";
+        }
+
+        for (int i = 0; i < numPages; i++) {
+            generateData(&pages[(size_t) i * PAGE_SIZE], PAGE_SIZE, 50 + i, 7);
+            requests[i].write = true;
+        }
+        ASSERT_EQ(ring.run(requests), success) << "Writing a batch should succeed.";
+        // The pool still holds the old pages, drop them with the file's identity
+        ASSERT_EQ(pfm.closeFile(fileHandle), success) << "Closing the file should succeed.";
+        PeterDB::BufferPool::instance().dropFile(fileName);
+        ASSERT_EQ(pfm.openFile(fileName, fileHandle), success) << "Opening the file should succeed.";
+        for (int i = 0; i < numPages; i++) {
+            generateData(inBuffer, PAGE_SIZE, 50 + i, 7);
+            ASSERT_EQ(fileHandle.readPage(i, outBuffer), success) << "Reading a page should succeed.";
+            ASSERT_EQ(memcmp(inBuffer, outBuffer, PAGE_SIZE), 0) << "The page written in the batch should be intact.";
+        }
+    }
 } // namespace PeterDBTesting
\ No newline at end of file
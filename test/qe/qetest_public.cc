@@ -1,4 +1,7 @@
 #include "test/utils/qe_test_util.h"
+#include <map>
+#include <set>
+#include <tuple>
 
 namespace PeterDBTesting {
     TEST_F(QE_Test, cleanup){
@@ -1444,6 +1447,132 @@ namespace PeterDBTesting {
         ASSERT_EQ(glob("").size(), numFiles) << "GHJoin should clean after itself.";
     }
 
+    TEST_F(QE_Test, bnljoin_over_many_blocks) {
+        // BNLJoin with a one page block, so the right input is scanned once per block,
+        // on int, real and varchar keys with duplicates and nulls
+        // SELECT * FROM left, right WHERE left.K = right.K
+
+        auto keyText = [](PeterDB::AttrType type, int k) {
+            if (type == PeterDB::TypeInt) return std::to_string(k);
+            if (type == PeterDB::TypeReal) return std::to_string((float) k + 0.25f);
+            return "key" + std::to_string(k);
+        };
+        for (PeterDB::AttrType type : {PeterDB::TypeInt, PeterDB::TypeReal, PeterDB::TypeVarChar}) {
+            std::string leftName = "leftblocks" + std::to_string(type), rightName = "rightblocks" + std::to_string(type);
+            auto leftKey = [](unsigned i) { return i % 7 == 0 ? -1 : (int) (i % 150); };
+            auto rightKey = [](unsigned i) { return i % 5 == 0 ? -1 : (int) (i % 200); };
+            createJoinTable(leftName, type, 20, 2000, leftKey);
+            createJoinTable(rightName, type, 20, 500, rightKey);
+
+            // Key and payload letter of both sides
+            std::map<std::tuple<std::string, char, char>, int> expected, returned;
+            for (unsigned l = 0; l < 2000; l++) {
+                for (unsigned r = 0; r < 500; r++) {
+                    if (leftKey(l) >= 0 && leftKey(l) == rightKey(r))
+                        expected[std::make_tuple(keyText(type, leftKey(l)), 'a' + l % 26, 'a' + r % 26)]++;
+                }
+            }
+
+            PeterDB::TableScan leftIn(rm, leftName);
+            PeterDB::TableScan rightIn(rm, rightName);
+            PeterDB::Condition cond{leftName + ".K", PeterDB::EQ_OP, true, rightName + ".K"};
+            PeterDB::BNLJoin join(&leftIn, &rightIn, cond, 1);
+            ASSERT_EQ(join.getAttributes(attrs), success) << "BNLJoin.getAttributes() should succeed.";
+            std::vector<char> tuple(PAGE_SIZE);
+            while (join.getNextTuple(tuple.data()) != QE_EOF) {
+                PeterDB::TupleView view(attrs, tuple.data());
+                ASSERT_FALSE(view.isNull(0) || view.isNull(2)) << "Null keys should not join.";
+                std::string key = type == PeterDB::TypeInt ? std::to_string(view.getInt(0)) :
+                                  type == PeterDB::TypeReal ? std::to_string(view.getReal(0)) :
+                                  std::string(view.getField(0) + sizeof(unsigned), view.getFieldSize(0) - sizeof(unsigned));
+                ASSERT_EQ(memcmp(view.getField(0), view.getField(2), view.getFieldSize(0)), 0) << "The keys should match.";
+                returned[std::make_tuple(key, view.getField(1)[sizeof(unsigned)], view.getField(3)[sizeof(unsigned)])]++;
+            }
+            ASSERT_EQ(returned, expected) << "Every matching pair should be returned once.";
+        }
+    }
+
+    TEST_F(QE_Test, ghjoin_with_null_and_varchar_keys_matches_bnljoin) {
+        // GHJoin over many partitions, on int and varchar keys with nulls, against BNLJoin
+        // SELECT * FROM left, right WHERE left.K = right.K
+
+        for (PeterDB::AttrType type : {PeterDB::TypeInt, PeterDB::TypeVarChar}) {
+            std::string leftName = "leftkeys" + std::to_string(type), rightName = "rightkeys" + std::to_string(type);
+            auto leftKey = [](unsigned i) { return i % 7 == 0 ? -1 : (int) (i % 300); };
+            auto rightKey = [](unsigned i) { return i % 5 == 0 ? -1 : (int) (i % 400); };
+            createJoinTable(leftName, type, 20, 3000, leftKey);
+            createJoinTable(rightName, type, 20, 1000, rightKey);
+
+            unsigned expected = 0;
+            for (unsigned l = 0; l < 3000; l++) {
+                for (unsigned r = 0; r < 1000; r++) {
+                    if (leftKey(l) >= 0 && leftKey(l) == rightKey(r)) expected++;
+                }
+            }
+
+            PeterDB::Condition cond{leftName + ".K", PeterDB::EQ_OP, true, rightName + ".K"};
+            std::vector<std::string> hashed, nested;
+            int numFiles = (int) glob("").size();
+            {
+                PeterDB::TableScan leftIn(rm, leftName);
+                PeterDB::TableScan rightIn(rm, rightName);
+                PeterDB::GHJoin join(&leftIn, &rightIn, cond, 8);
+                collectTuples(join, hashed);
+            }
+            ASSERT_EQ(glob("").size(), numFiles) << "GHJoin should clean after itself.";
+            {
+                PeterDB::TableScan leftIn(rm, leftName);
+                PeterDB::TableScan rightIn(rm, rightName);
+                PeterDB::BNLJoin join(&leftIn, &rightIn, cond, 5);
+                collectTuples(join, nested);
+            }
+            ASSERT_EQ(hashed.size(), expected) << "Null keys should not join, the others should.";
+            ASSERT_EQ(hashed, nested) << "GHJoin and BNLJoin should return the same tuples.";
+        }
+    }
+
+    TEST_F(QE_Test, ghjoin_repartitions_large_partition) {
+        // GHJoin with two partitions of the left input larger than QE_HASH_MEMORY each,
+        // partitioned again before they are built, against BNLJoin
+        // SELECT * FROM left, right WHERE left.K = right.K
+
+        unsigned leftCount = 2600, payload = 1000;
+        ASSERT_GT((unsigned long long) leftCount * payload, 2ull * QE_HASH_MEMORY) << "The test needs a larger input.";
+        createJoinTable("leftwide", PeterDB::TypeInt, payload, leftCount, [](unsigned i) { return (int) (i % 500); });
+        createJoinTable("rightnarrow", PeterDB::TypeInt, 10, 600, [](unsigned i) { return (int) i; });
+
+        PeterDB::Condition cond{"leftwide.K", PeterDB::EQ_OP, true, "rightnarrow.K"};
+        std::vector<std::string> hashed, nested;
+        int numFiles = (int) glob("").size();
+        size_t mostFiles = 0;
+        {
+            PeterDB::TableScan leftIn(rm, "leftwide");
+            PeterDB::TableScan rightIn(rm, "rightnarrow");
+            PeterDB::GHJoin join(&leftIn, &rightIn, cond, 2);
+            std::vector<PeterDB::Attribute> joinAttrs;
+            ASSERT_EQ(join.getAttributes(joinAttrs), success) << "GHJoin.getAttributes() should succeed.";
+            std::vector<char> tuple(PAGE_SIZE);
+            while (join.getNextTuple(tuple.data()) != QE_EOF) {
+                mostFiles = std::max(mostFiles, glob("").size());
+                std::stringstream stream;
+                ASSERT_EQ(rm.printTuple(joinAttrs, tuple.data(), stream), success)
+                                            << "RelationManager.printTuple() should succeed.";
+                hashed.emplace_back(stream.str());
+            }
+            std::sort(hashed.begin(), hashed.end());
+        }
+        ASSERT_GT(mostFiles, numFiles + 4) << "A partition should be split into more spill files.";
+        ASSERT_EQ(glob("").size(), numFiles) << "GHJoin should clean after itself.";
+        {
+            PeterDB::TableScan leftIn(rm, "leftwide");
+            PeterDB::TableScan rightIn(rm, "rightnarrow");
+            PeterDB::BNLJoin join(&leftIn, &rightIn, cond, 10);
+            collectTuples(join, nested);
+        }
+        ASSERT_EQ(hashed.size(), leftCount) << "Every left tuple should join once.";
+        ASSERT_EQ(hashed, nested) << "GHJoin and BNLJoin should return the same tuples.";
+    }
+
     TEST_F(QE_Test, table_scan_with_group_min_aggregation) {
         // Extra credit
         // Aggregate -- MIN (with GroupBy)
@@ -1533,4 +1662,327 @@ namespace PeterDBTesting {
 
     }
 
+    TEST_F(QE_Test, table_scan_with_filter_and_project_in_batches) {
+        // Project -- Filter -- TableScan, read a batch at a time
+        // SELECT D,C FROM RIGHT WHERE D < 100
+
+        inBuffer = malloc(bufSize);
+
+        std::string tableName = "right";
+        createAndPopulateTable(tableName, {}, 3000);
+
+        PeterDB::TableScan ts(rm, tableName);
+
+        unsigned compVal = 100;
+        PeterDB::Condition cond{"right.D", PeterDB::LT_OP, false, "", {PeterDB::TypeInt, inBuffer}};
+        *(unsigned *) cond.rhsValue.data = compVal;
+        PeterDB::Filter filter(&ts, cond);
+        PeterDB::Project project(&filter, {"right.D", "right.C"});
+
+        // A batch smaller than the default one
+        ASSERT_EQ(project.getAttributes(attrs), success) << "Project.getAttributes() should succeed.";
+        PeterDB::TupleBatch batch;
+        batch.init(attrs, 100);
+
+        std::vector<std::string> printed;
+        while (project.getNextBatch(batch) != QE_EOF) {
+            ASSERT_GT(batch.size(), 0) << "A batch before QE_EOF should not be empty.";
+            ASSERT_LE(batch.size(), 100) << "A batch should not exceed its capacity.";
+            for (unsigned i = 0; i < batch.size(); i++) {
+                std::stringstream stream;
+                ASSERT_EQ(rm.printTuple(attrs, batch.getTuple(i), stream), success)
+                                            << "RelationManager.printTuple() should succeed.";
+                printed.emplace_back(stream.str());
+            }
+        }
+
+        std::vector<std::string> expected;
+        for (int i = 0; i < 3000; i++) {
+            float c = (float) (i % 261) + 25.5f;
+            unsigned d = i % 179;
+            if (d < 100)
+                expected.emplace_back("right.D: " + std::to_string(d) + ", right.C: " + std::to_string(c));
+        }
+        sort(expected.begin(), expected.end());
+        sort(printed.begin(), printed.end());
+
+        ASSERT_EQ(expected.size(), printed.size()) << "The number of returned tuple is not correct.";
+
+        for (int i = 0; i < expected.size(); ++i) {
+            checkPrintRecord(expected[i], printed[i], false, {});
+        }
+    }
+
+    TEST_F(QE_Test, table_scan_with_pushed_down_conditions_and_projection) {
+        // TableScan testing the conditions and projecting inside the record scan
+        // SELECT C,A FROM LEFT WHERE B <= 51 AND A >= 100
+
+        inBuffer = malloc(bufSize);
+        outBuffer = malloc(bufSize);
+        char data1[bufSize];
+
+        std::string tableName = "left";
+        createAndPopulateTable(tableName, {}, 1000);
+
+        PeterDB::TableScan ts(rm, tableName);
+
+        unsigned compVal = 51;
+        PeterDB::Condition cond1{"left.B", PeterDB::LE_OP, false, "", {PeterDB::TypeInt, inBuffer}};
+        *(unsigned *) cond1.rhsValue.data = compVal;
+        compVal = 100;
+        PeterDB::Condition cond2{"left.A", PeterDB::GE_OP, false, "", {PeterDB::TypeInt, data1}};
+        *(unsigned *) cond2.rhsValue.data = compVal;
+        ASSERT_EQ(ts.pushDownCondition(cond1), success) << "TableScan.pushDownCondition() should succeed.";
+        ASSERT_EQ(ts.pushDownCondition(cond2), success) << "TableScan.pushDownCondition() should succeed.";
+
+        // Conditions the record scan cannot test are refused
+        PeterDB::Condition mismatch{"left.C", PeterDB::LE_OP, false, "", {PeterDB::TypeInt, inBuffer}};
+        ASSERT_NE(ts.pushDownCondition(mismatch), success) << "A condition of the wrong type should be refused.";
+        PeterDB::Condition join{"left.B", PeterDB::EQ_OP, true, "right.B", {PeterDB::TypeInt, NULL}};
+        ASSERT_NE(ts.pushDownCondition(join), success) << "A join condition should be refused.";
+
+        ASSERT_EQ(ts.pushDownProjection({"left.C", "left.A"}), success)
+                                    << "TableScan.pushDownProjection() should succeed.";
+
+        std::vector<std::string> printed;
+        ASSERT_EQ(ts.getAttributes(attrs), success) << "TableScan.getAttributes() should succeed.";
+        ASSERT_EQ(attrs.size(), 2);
+        while (ts.getNextTuple(outBuffer) != QE_EOF) {
+            std::stringstream stream;
+            ASSERT_EQ(rm.printTuple(attrs, outBuffer, stream), success)
+                                        << "RelationManager.printTuple() should succeed.";
+            printed.emplace_back(stream.str());
+            memset(outBuffer, 0, bufSize);
+        }
+
+        std::vector<std::string> expected;
+        for (int i = 0; i < 1000; i++) {
+            unsigned a = i % 203;
+            unsigned b = (i + 10) % 197;
+            float c = (float) (i % 167) + 50.5f;
+            if (b <= 51 && a >= 100)
+                expected.emplace_back("left.C: " + std::to_string(c) + ", left.A: " + std::to_string(a));
+        }
+        sort(expected.begin(), expected.end());
+        sort(printed.begin(), printed.end());
+
+        ASSERT_EQ(expected.size(), printed.size()) << "The number of returned tuple is not correct.";
+
+        for (int i = 0; i < expected.size(); ++i) {
+            checkPrintRecord(expected[i], printed[i], false, {});
+        }
+    }
+
+    TEST_F(QE_Test, table_scan_with_filter_on_two_attributes) {
+        // Filter -- TableScan as input, comparing two attributes of the tuple
+        // SELECT * FROM LEFT WHERE A < B
+
+        inBuffer = malloc(bufSize);
+        outBuffer = malloc(bufSize);
+
+        std::string tableName = "left";
+        createAndPopulateTable(tableName, {}, 1000);
+
+        PeterDB::TableScan ts(rm, tableName);
+
+        PeterDB::Condition cond{"left.A", PeterDB::LT_OP, true, "left.B", {PeterDB::TypeInt, NULL}};
+        PeterDB::Filter filter(&ts, cond);
+
+        std::vector<std::string> printed;
+        ASSERT_EQ(filter.getAttributes(attrs), success) << "Filter.getAttributes() should succeed.";
+        while (filter.getNextTuple(outBuffer) != QE_EOF) {
+            std::stringstream stream;
+            ASSERT_EQ(rm.printTuple(attrs, outBuffer, stream), success)
+                                        << "RelationManager.printTuple() should succeed.";
+            printed.emplace_back(stream.str());
+            memset(outBuffer, 0, bufSize);
+        }
+
+        std::vector<std::string> expected;
+        for (int i = 0; i < 1000; i++) {
+            unsigned a = i % 203;
+            unsigned b = (i + 10) % 197;
+            float c = (float) (i % 167) + 50.5f;
+            if (a < b)
+                expected.emplace_back(
+                        "left.A: " + std::to_string(a) + ", left.B: " + std::to_string(b) + ", left.C: " +
+                        std::to_string(c));
+        }
+        sort(expected.begin(), expected.end());
+        sort(printed.begin(), printed.end());
+
+        ASSERT_EQ(expected.size(), printed.size()) << "The number of returned tuple is not correct.";
+
+        for (int i = 0; i < expected.size(); ++i) {
+            checkPrintRecord(expected[i], printed[i], false, {});
+        }
+    }
+
+    TEST_F(QE_Test, hash_aggregate_with_multiple_aggregates_and_spill) {
+        // HashAggregate -- several aggregates in one pass, with a memory budget small enough to spill
+        // SELECT left.A, COUNT(left.B), MIN(left.B), MAX(left.C), AVG(left.B), SUM(left.B) FROM left GROUP BY left.A
+
+        inBuffer = malloc(bufSize);
+        outBuffer = malloc(bufSize);
+
+        std::string tableName = "left";
+        int numTuples = 10000;
+        createAndPopulateTable(tableName, {}, numTuples);
+
+        PeterDB::TableScan ts(rm, tableName);
+        std::vector<PeterDB::AggregateSpec> aggregates = {{{"left.B", PeterDB::TypeInt, 4}, PeterDB::COUNT},
+                                                          {{"left.B", PeterDB::TypeInt, 4}, PeterDB::MIN},
+                                                          {{"left.C", PeterDB::TypeReal, 4}, PeterDB::MAX},
+                                                          {{"left.B", PeterDB::TypeInt, 4}, PeterDB::AVG},
+                                                          {{"left.B", PeterDB::TypeInt, 4}, PeterDB::SUM}};
+
+        int numFiles = (int) glob("").size();
+        auto *agg = new PeterDB::HashAggregate(&ts, {{"left.A", PeterDB::TypeInt, 4}}, aggregates, PAGE_SIZE);
+        ASSERT_EQ(agg->getAttributes(attrs), success) << "HashAggregate.getAttributes() should succeed.";
+        ASSERT_EQ(attrs.size(), 6);
+        ASSERT_EQ(attrs[1].name, "COUNT(left.B)");
+        ASSERT_EQ(attrs[4].type, PeterDB::TypeReal) << "AVG should be a REAL.";
+
+        // Expected count, min(B), max(C) and sum(B) of every group
+        std::map<int, std::vector<double>> expected;
+        for (int i = 0; i < numTuples; i++) {
+            int a = i % 203, b = (i + 10) % 197;
+            float c = (float) (i % 167) + 50.5f;
+            auto it = expected.find(a);
+            if (it == expected.end()) {
+                expected[a] = {1, (double) b, c, (double) b};
+                continue;
+            }
+            it->second[0]++;
+            it->second[1] = std::min(it->second[1], (double) b);
+            it->second[2] = std::max(it->second[2], (double) c);
+            it->second[3] += b;
+        }
+
+        std::set<int> seen;
+        bool spilled = false;
+        while (agg->getNextTuple(outBuffer) != QE_EOF) {
+            spilled = spilled || glob("").size() > numFiles;
+            char *tuple = (char *) outBuffer;
+            ASSERT_EQ(tuple[0], 0) << "No aggregate should be null.";
+            int a = *(int *) (tuple + 1);
+            ASSERT_TRUE(seen.insert(a).second) << "Every group should be returned once.";
+            auto &values = expected[a];
+            ASSERT_EQ(*(int *) (tuple + 5), (int) values[0]);
+            ASSERT_EQ(*(int *) (tuple + 9), (int) values[1]);
+            ASSERT_FLOAT_EQ(*(float *) (tuple + 13), (float) values[2]);
+            ASSERT_FLOAT_EQ(*(float *) (tuple + 17), (float) (values[3] / values[0]));
+            ASSERT_EQ(*(int *) (tuple + 21), (int) values[3]);
+        }
+        ASSERT_EQ(seen.size(), expected.size()) << "The number of returned groups is not correct.";
+        ASSERT_TRUE(spilled) << "The groups should not fit in one page.";
+
+        delete agg;
+        ASSERT_EQ(glob("").size(), numFiles) << "HashAggregate should clean after itself.";
+    }
+
+    TEST_F(QE_Test, external_sort_with_merge_passes) {
+        // Sort -- TableScan, with runs of 3 pages merged 2 at a time
+        // SELECT * FROM left ORDER BY left.B, left.A
+
+        inBuffer = malloc(bufSize);
+        outBuffer = malloc(bufSize);
+
+        std::string tableName = "left";
+        int numTuples = 5000;
+        createAndPopulateTable(tableName, {}, numTuples);
+
+        PeterDB::TableScan ts(rm, tableName);
+        int numFiles = (int) glob("").size();
+        auto *sort = new PeterDB::Sort(&ts, {"left.B", "left.A"}, 3);
+        ASSERT_EQ(sort->getAttributes(attrs), success) << "Sort.getAttributes() should succeed.";
+
+        int count = 0, lastA = -1, lastB = -1;
+        bool spilled = false;
+        while (sort->getNextTuple(outBuffer) != QE_EOF) {
+            spilled = spilled || glob("").size() > numFiles;
+            int a = *(int *) ((char *) outBuffer + 1);
+            int b = *(int *) ((char *) outBuffer + 5);
+            ASSERT_TRUE(b > lastB || (b == lastB && a >= lastA)) << "The tuples should come out sorted.";
+            lastA = a;
+            lastB = b;
+            count++;
+        }
+        ASSERT_EQ(count, numTuples) << "Every tuple should be returned once.";
+        ASSERT_TRUE(spilled) << "The runs should be written to disk.";
+
+        delete sort;
+        ASSERT_EQ(glob("").size(), numFiles) << "Sort should clean after itself.";
+    }
+
+    TEST_F(QE_Test, sort_merge_join_on_int) {
+        // SortMergeJoin -- equi join, then a band join
+        // SELECT * FROM left, right WHERE left.B = right.B
+        // SELECT * FROM left, right WHERE left.B < right.B
+
+        inBuffer = malloc(bufSize);
+        outBuffer = malloc(bufSize);
+
+        int numTuples = 1000;
+        createAndPopulateTable("left", {}, numTuples);
+        createAndPopulateTable("right", {}, numTuples);
+
+        std::vector<int> leftB, rightB;
+        for (int i = 0; i < numTuples; i++) {
+            leftB.push_back((i + 10) % 197);
+            rightB.push_back(i % 251 + 20);
+        }
+
+        for (PeterDB::CompOp op : {PeterDB::EQ_OP, PeterDB::LT_OP}) {
+            PeterDB::TableScan leftIn(rm, "left");
+            PeterDB::TableScan rightIn(rm, "right");
+            PeterDB::Condition cond{"left.B", op, true, "right.B"};
+            PeterDB::SortMergeJoin join(&leftIn, &rightIn, cond, 4);
+            ASSERT_EQ(join.getAttributes(attrs), success) << "SortMergeJoin.getAttributes() should succeed.";
+
+            std::map<std::pair<int, int>, int> expected, returned;
+            for (int l : leftB) {
+                for (int r : rightB) {
+                    if (op == PeterDB::EQ_OP ? l == r : l < r) expected[{l, r}]++;
+                }
+            }
+            while (join.getNextTuple(outBuffer) != QE_EOF) {
+                // left.A, left.B, left.C, right.B, right.C, right.D
+                int l = *(int *) ((char *) outBuffer + 1 + 4);
+                int r = *(int *) ((char *) outBuffer + 1 + 12);
+                returned[{l, r}]++;
+            }
+            ASSERT_EQ(returned, expected) << "The joined pairs are not correct.";
+        }
+    }
+
+    TEST_F(QE_Test, bitmap_index_scan_on_int) {
+        // BitmapIndexScan -- a range of the index, read in page order
+        // SELECT * FROM left WHERE 20 <= B < 70
+
+        inBuffer = malloc(bufSize);
+        outBuffer = malloc(bufSize);
+
+        int numTuples = 5000;
+        createAndPopulateTable("left", {"B"}, numTuples);
+
+        int low = 20, high = 70;
+        std::map<int, int> expected, returned;
+        for (int i = 0; i < numTuples; i++) {
+            int b = (i + 10) % 197;
+            if (b >= low && b < high) expected[b]++;
+        }
+
+        PeterDB::BitmapIndexScan scan(rm, "left", "B");
+        scan.setIterator(&low, &high, true, false);
+        ASSERT_EQ(scan.getAttributes(attrs), success) << "BitmapIndexScan.getAttributes() should succeed.";
+        ASSERT_EQ(attrs[1].name, "left.B") << "Attributes should be named rel.attr.";
+
+        while (scan.getNextTuple(outBuffer) != QE_EOF) {
+            int b = *(int *) ((char *) outBuffer + 1 + 4);
+            returned[b]++;
+        }
+        ASSERT_EQ(returned, expected) << "Every tuple of the range should be returned once.";
+    }
+
 } // namespace PeterDBTesting
\ No newline at end of file
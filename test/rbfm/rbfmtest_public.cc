@@ -1,3 +1,5 @@
+#include <cmath>
+#include <algorithm>
 #include "src/include/rbfm.h"
 #include "test/utils/rbfm_test_utils.h"
 
@@ -402,6 +404,287 @@ namespace PeterDBTesting {
                                     << "Read a deleted record should not success.";
     }
 
+    TEST_F(RBFM_Test, reuse_space_after_reopen) {
+        // Functions tested
+        // 1. Insert records - one per page
+        // 2. Delete Record
+        // 3. Close and reopen the file
+        // 4. Insert Record - should go to the page freed by the deletion, found through the free space map
+
+        PeterDB::RID rid;
+        size_t recordSize = 0;
+        inBuffer = malloc(3000);
+        outBuffer = malloc(3000);
+
+        std::vector<PeterDB::Attribute> recordDescriptor;
+        createLargeRecordDescriptor4(recordDescriptor);
+        nullsIndicator = initializeNullFieldsIndicator(recordDescriptor);
+
+        unsigned numRecords = 10;
+        std::vector<PeterDB::RID> rids;
+        for (unsigned i = 0; i < numRecords; i++) {
+            prepareLargeRecord4((int) recordDescriptor.size(), nullsIndicator, 2061, inBuffer, recordSize);
+            ASSERT_EQ(rbfm.insertRecord(fileHandle, recordDescriptor, inBuffer, rid), success)
+                                        << "Inserting a record should succeed.";
+            rids.push_back(rid);
+        }
+        ASSERT_EQ(fileHandle.getNumberOfPages(), numRecords) << "Page count does not match.";
+
+        ASSERT_EQ(rbfm.deleteRecord(fileHandle, recordDescriptor, rids[3]), success)
+                                    << "Deleting a record should succeed.";
+
+        ASSERT_EQ(rbfm.closeFile(fileHandle), success) << "Closing the file should not fail.";
+        ASSERT_EQ(rbfm.openFile(fileName, fileHandle), success) << "Opening the file should not fail.";
+
+        ASSERT_EQ(rbfm.insertRecord(fileHandle, recordDescriptor, inBuffer, rid), success)
+                                    << "Inserting a record should succeed.";
+        ASSERT_EQ(rid.pageNum, rids[3].pageNum) << "The freed page should be reused.";
+        ASSERT_EQ(fileHandle.getNumberOfPages(), numRecords) << "No page should be appended.";
+
+        ASSERT_EQ(rbfm.readRecord(fileHandle, recordDescriptor, rid, outBuffer), success)
+                                    << "Reading a record should succeed.";
+        ASSERT_EQ(memcmp(inBuffer, outBuffer, recordSize), 0) << "the read data should match the inserted data";
+    }
+
+    TEST_F(RBFM_Test, scan_reads_each_page_once) {
+        // Functions tested
+        // 1. Insert Multiple Records
+        // 2. Scan with a condition and a projection
+        // 3. Check every page was read exactly once
+
+        PeterDB::RID rid;
+        size_t recordSize = 0;
+        inBuffer = malloc(100);
+        outBuffer = malloc(100);
+
+        std::vector<PeterDB::Attribute> recordDescriptor;
+        createRecordDescriptor(recordDescriptor);
+        nullsIndicator = initializeNullFieldsIndicator(recordDescriptor);
+
+        int numRecords = 300;
+        for (int i = 0; i < numRecords; i++) {
+            prepareRecord((int) recordDescriptor.size(), nullsIndicator, 8, "Anteater", i % 100, 177.8, i, inBuffer,
+                          recordSize);
+            ASSERT_EQ(rbfm.insertRecord(fileHandle, recordDescriptor, inBuffer, rid), success)
+                                        << "Inserting a record should succeed.";
+        }
+
+        unsigned readCount = 0, writeCount = 0, appendCount = 0;
+        unsigned updatedReadCount = 0;
+        ASSERT_EQ(fileHandle.collectCounterValues(readCount, writeCount, appendCount), success)
+                                    << "Collecting counters should succeed.";
+        unsigned numPages = fileHandle.getNumberOfPages();
+
+        int age = 50;
+        PeterDB::RBFM_ScanIterator iter;
+        ASSERT_EQ(rbfm.scan(fileHandle, recordDescriptor, "Age", PeterDB::GE_OP, &age, {"Salary", "EmpName"}, iter),
+                  success) << "Scanning the file should succeed.";
+        int count = 0;
+        while (iter.getNextRecord(rid, outBuffer) != RBFM_EOF) {
+            int salary = *(int *) ((char *) outBuffer + 1);
+            ASSERT_GE(salary % 100, age) << "Only records matching the condition should be returned.";
+            ASSERT_EQ(*(int *) ((char *) outBuffer + 1 + sizeof(int)), 8) << "The projected name should be returned.";
+            count++;
+        }
+        ASSERT_EQ(fileHandle.collectCounterValues(updatedReadCount, writeCount, appendCount), success)
+                                    << "Collecting counters should succeed.";
+        ASSERT_EQ(count, numRecords / 2) << "The number of returned records does not match.";
+        ASSERT_EQ(updatedReadCount - readCount, numPages) << "Every page should be read exactly once.";
+
+        // The iterator closes the file
+        ASSERT_EQ(iter.close(), success) << "Closing the iterator should succeed.";
+        ASSERT_EQ(rbfm.openFile(fileName, fileHandle), success) << "Opening the file should not fail.";
+    }
+
+    TEST_F(RBFM_Test, tuple_view_and_builder) {
+        // Functions tested
+        // 1. Decode a record with nulls into a TupleView
+        // 2. Rebuild it field by field and at once with a TupleBuilder
+
+        size_t recordSize = 0;
+        inBuffer = malloc(100);
+        outBuffer = malloc(200);
+
+        std::vector<PeterDB::Attribute> recordDescriptor;
+        createRecordDescriptor(recordDescriptor);
+        int nullFieldsIndicatorActualSize = getActualByteForNullsIndicator((int) recordDescriptor.size());
+        unsigned char nullsIndicator[nullFieldsIndicatorActualSize];
+        memset(nullsIndicator, 0, nullFieldsIndicatorActualSize);
+        nullsIndicator[0] = 64; // 01000000, Age is null
+        prepareRecord((int) recordDescriptor.size(), nullsIndicator, 8, "Anteater", 25, 177.8, 6200, inBuffer,
+                      recordSize);
+
+        PeterDB::TupleView view(recordDescriptor, inBuffer);
+        ASSERT_EQ(view.getSize(), recordSize) << "The view should measure the whole record.";
+        ASSERT_EQ(view.getFieldSize(0), sizeof(int) + 8);
+        ASSERT_TRUE(view.isNull(1));
+        ASSERT_EQ(view.getField(1), nullptr) << "A null field has no value.";
+        ASSERT_FLOAT_EQ(view.getReal(2), 177.8);
+        ASSERT_EQ(view.getInt(3), 6200);
+
+        PeterDB::TupleBuilder builder;
+        builder.start(outBuffer, recordDescriptor.size());
+        for (unsigned i = 0; i < recordDescriptor.size(); i++) {
+            builder.addField(view, i);
+        }
+        ASSERT_EQ(builder.getSize(), recordSize);
+        ASSERT_EQ(memcmp(inBuffer, outBuffer, recordSize), 0) << "The rebuilt record should match.";
+
+        // Two copies side by side, the null bits of the second one are shifted by four fields
+        builder.start(outBuffer, recordDescriptor.size() * 2);
+        builder.addFields(view);
+        builder.addFields(view);
+        std::vector<PeterDB::Attribute> merged = recordDescriptor;
+        merged.insert(merged.end(), recordDescriptor.begin(), recordDescriptor.end());
+        PeterDB::TupleView mergedView(merged, outBuffer);
+        ASSERT_EQ(mergedView.getSize(), builder.getSize());
+        ASSERT_TRUE(mergedView.isNull(5));
+        ASSERT_FALSE(mergedView.isNull(4));
+        ASSERT_EQ(mergedView.getInt(7), 6200);
+    }
+
+    TEST_F(RBFM_Test, predicate_orders_reals_exactly) {
+        // Functions tested
+        // 1. compare() orders reals closer than FLOAT_DIFF, and NaNs after every number
+        // 2. Sorting with it puts the values in order
+        // 3. An EQ test still takes reals within FLOAT_DIFF as equal
+
+        float one = 1.0f, next = std::nextafter(1.0f, 2.0f), nan = std::nanf(""), zero = 0.0f, negativeZero = -0.0f;
+        ASSERT_LT(PeterDB::Predicate::compare(PeterDB::TypeReal, &one, &next), 0);
+        ASSERT_GT(PeterDB::Predicate::compare(PeterDB::TypeReal, &next, &one), 0);
+        ASSERT_EQ(PeterDB::Predicate::compare(PeterDB::TypeReal, &zero, &negativeZero), 0);
+        ASSERT_GT(PeterDB::Predicate::compare(PeterDB::TypeReal, &nan, &next), 0);
+        ASSERT_EQ(PeterDB::Predicate::compare(PeterDB::TypeReal, &nan, &nan), 0);
+
+        std::vector<float> values;
+        for (int i = 0; i < 1000; i++) {
+            values.push_back(i % 10 == 0 ? nan : 1.0f + (float) (i % 37) * 1e-8f);
+        }
+        std::sort(values.begin(), values.end(), [](float a, float b) {
+            return PeterDB::Predicate::compare(PeterDB::TypeReal, &a, &b) < 0;
+        });
+        for (size_t i = 1; i < values.size(); i++) {
+            ASSERT_LE(PeterDB::Predicate::compare(PeterDB::TypeReal, &values[i - 1], &values[i]), 0)
+                                        << "The values should come out sorted.";
+        }
+        ASSERT_TRUE(std::isnan(values.back())) << "NaNs should come last.";
+
+        float small = 0.1f, smallNext = std::nextafter(0.1f, 1.0f);
+        ASSERT_LT(PeterDB::Predicate::compare(PeterDB::TypeReal, &small, &smallNext), 0);
+        PeterDB::Predicate equal;
+        equal.compile(PeterDB::TypeReal, PeterDB::EQ_OP, &small);
+        ASSERT_TRUE(equal(&smallNext)) << "EQ should take reals within FLOAT_DIFF as equal.";
+    }
+
+    TEST_F(RBFM_Test, records_on_large_pages) {
+        // Functions tested
+        // 1. Create a file with 32 KB pages
+        // 2. Insert records, delete some of them
+        // 3. Close and reopen the file, read and scan the records left
+
+        ASSERT_EQ(rbfm.closeFile(fileHandle), success) << "Closing the file should not fail.";
+        ASSERT_EQ(rbfm.destroyFile(fileName), success) << "Destroying the file should not fail.";
+        ASSERT_EQ(rbfm.createFile(fileName, 32 * 1024), success) << "Creating the file should not fail.";
+        ASSERT_EQ(rbfm.openFile(fileName, fileHandle), success) << "Opening the file should not fail.";
+        ASSERT_EQ(fileHandle.getPageSize(), 32 * 1024) << "The page size should come from the header.";
+
+        PeterDB::RID rid;
+        size_t recordSize = 0;
+        inBuffer = malloc(100);
+        outBuffer = malloc(100);
+
+        std::vector<PeterDB::Attribute> recordDescriptor;
+        createRecordDescriptor(recordDescriptor);
+        nullsIndicator = initializeNullFieldsIndicator(recordDescriptor);
+
+        int numRecords = 2000;
+        std::vector<PeterDB::RID> rids;
+        for (int i = 0; i < numRecords; i++) {
+            prepareRecord((int) recordDescriptor.size(), nullsIndicator, 8, "Anteater", i, 177.8, i, inBuffer,
+                          recordSize);
+            ASSERT_EQ(rbfm.insertRecord(fileHandle, recordDescriptor, inBuffer, rid), success)
+                                        << "Inserting a record should succeed.";
+            rids.push_back(rid);
+        }
+        // Records lie past the first 4 KB of their page
+        ASSERT_LT(fileHandle.getNumberOfPages(), numRecords / 100) << "Pages should hold more records.";
+
+        for (int i = 0; i < numRecords; i += 3) {
+            ASSERT_EQ(rbfm.deleteRecord(fileHandle, recordDescriptor, rids[i]), success)
+                                        << "Deleting a record should succeed.";
+        }
+
+        ASSERT_EQ(rbfm.closeFile(fileHandle), success) << "Closing the file should not fail.";
+        ASSERT_EQ(rbfm.openFile(fileName, fileHandle), success) << "Opening the file should not fail.";
+        ASSERT_EQ(fileHandle.getPageSize(), 32 * 1024) << "The page size should be kept.";
+
+        for (int i = 0; i < numRecords; i++) {
+            if (i % 3 == 0) {
+                ASSERT_NE(rbfm.readRecord(fileHandle, recordDescriptor, rids[i], outBuffer), success)
+                                            << "Reading a deleted record should fail.";
+                continue;
+            }
+            prepareRecord((int) recordDescriptor.size(), nullsIndicator, 8, "Anteater", i, 177.8, i, inBuffer,
+                          recordSize);
+            ASSERT_EQ(rbfm.readRecord(fileHandle, recordDescriptor, rids[i], outBuffer), success)
+                                        << "Reading a record should succeed.";
+            ASSERT_EQ(memcmp(inBuffer, outBuffer, recordSize), 0) << "the read data should match the inserted data";
+        }
+
+        PeterDB::RBFM_ScanIterator iter;
+        ASSERT_EQ(rbfm.scan(fileHandle, recordDescriptor, "", PeterDB::NO_OP, NULL, {"Salary"}, iter), success)
+                                    << "Scanning the file should succeed.";
+        int count = 0;
+        while (iter.getNextRecord(rid, outBuffer) != RBFM_EOF) {
+            ASSERT_NE(*(int *) ((char *) outBuffer + 1) % 3, 0) << "Deleted records should not be returned.";
+            count++;
+        }
+        ASSERT_EQ(count, numRecords - (numRecords + 2) / 3) << "The number of returned records does not match.";
+        // The iterator closes the file
+        ASSERT_EQ(iter.close(), success) << "Closing the iterator should succeed.";
+        ASSERT_EQ(rbfm.openFile(fileName, fileHandle), success) << "Opening the file should not fail.";
+    }
+
+    TEST_F(RBFM_Test, records_over_page_size_rejected) {
+        // Functions tested
+        // 1. Create a file with 32 KB pages
+        // 2. Inserting a record of more than PAGE_SIZE bytes should fail, one of PAGE_SIZE bytes should not
+        // 3. Updating the record to more than PAGE_SIZE bytes should fail and leave it as it was
+
+        ASSERT_EQ(rbfm.closeFile(fileHandle), success) << "Closing the file should not fail.";
+        ASSERT_EQ(rbfm.destroyFile(fileName), success) << "Destroying the file should not fail.";
+        ASSERT_EQ(rbfm.createFile(fileName, 32 * 1024), success) << "Creating the file should not fail.";
+        ASSERT_EQ(rbfm.openFile(fileName, fileHandle), success) << "Opening the file should not fail.";
+
+        std::vector<PeterDB::Attribute> recordDescriptor = {{"Text", PeterDB::TypeVarChar, 16 * 1024}};
+        inBuffer = malloc(2 * PAGE_SIZE);
+        outBuffer = malloc(2 * PAGE_SIZE);
+        auto prepareText = [this](unsigned length) {
+            memset(inBuffer, 0, 2 * PAGE_SIZE);
+            memcpy((char *) inBuffer + 1, &length, sizeof(unsigned));
+            memset((char *) inBuffer + 1 + sizeof(unsigned), 'x', length);
+        };
+
+        PeterDB::RID rid;
+        prepareText(PAGE_SIZE + 100);
+        ASSERT_NE(rbfm.insertRecord(fileHandle, recordDescriptor, inBuffer, rid), success)
+                                    << "Inserting a record over PAGE_SIZE bytes should fail.";
+
+        unsigned length = PAGE_SIZE - 1 - sizeof(unsigned);
+        prepareText(length);
+        ASSERT_EQ(rbfm.insertRecord(fileHandle, recordDescriptor, inBuffer, rid), success)
+                                    << "Inserting a record of PAGE_SIZE bytes should succeed.";
+
+        prepareText(PAGE_SIZE);
+        ASSERT_NE(rbfm.updateRecord(fileHandle, recordDescriptor, inBuffer, rid), success)
+                                    << "Updating a record to over PAGE_SIZE bytes should fail.";
+
+        prepareText(length);
+        ASSERT_EQ(rbfm.readRecord(fileHandle, recordDescriptor, rid, outBuffer), success)
+                                    << "Reading a record should succeed.";
+        ASSERT_EQ(memcmp(inBuffer, outBuffer, PAGE_SIZE), 0) << "The record should be left as it was.";
+    }
+
     TEST_F(RBFM_Test_2, cleanup){
 
     }
@@ -318,6 +318,117 @@ namespace PeterDBTesting {
 
     }
 
+    TEST_F(RM_Tuple_Test, recreate_table_after_delete) {
+        // Functions Tested
+        // 0. Insert tuple
+        // 1. Delete Table
+        // 2. Create a table with the same name
+        // 3. Read Tuple - the old tuple should be gone
+        // 4. Insert and Read Tuple
+
+        size_t tupleSize = 0;
+        inBuffer = malloc(200);
+        outBuffer = malloc(200);
+
+        ASSERT_EQ(rm.getAttributes(tableName, attrs), success) << "RelationManager::getAttributes() should succeed.";
+        nullsIndicator = initializeNullFieldsIndicator(attrs);
+
+        std::string name = "Paul";
+        prepareTuple((int) attrs.size(), nullsIndicator, name.length(), name, 28, 165.5, 7000, inBuffer, tupleSize);
+        ASSERT_EQ(rm.insertTuple(tableName, inBuffer, rid), success)
+                                    << "RelationManager::insertTuple() should succeed.";
+        ASSERT_EQ(rm.readTuple(tableName, rid, outBuffer), success)
+                                    << "RelationManager::readTuple() should succeed.";
+
+        ASSERT_EQ(rm.deleteTable(tableName), success) << "RelationManager::deleteTable() should succeed.";
+        std::vector<PeterDB::Attribute> table_attrs = parseDDL(
+                "CREATE TABLE " + tableName + " (emp_name VARCHAR(50), age INT, height REAL, salary REAL)");
+        ASSERT_EQ(rm.createTable(tableName, table_attrs), success)
+                                    << "Create table " << tableName << " should succeed.";
+
+        ASSERT_NE(rm.readTuple(tableName, rid, outBuffer), success)
+                                    << "RelationManager::readTuple() should not see a tuple of the deleted table.";
+
+        name = "Peter";
+        prepareTuple((int) attrs.size(), nullsIndicator, name.length(), name, 30, 170.5, 8000, inBuffer, tupleSize);
+        ASSERT_EQ(rm.insertTuple(tableName, inBuffer, rid), success)
+                                    << "RelationManager::insertTuple() should succeed.";
+        memset(outBuffer, 0, 200);
+        ASSERT_EQ(rm.readTuple(tableName, rid, outBuffer), success)
+                                    << "RelationManager::readTuple() should succeed.";
+        ASSERT_EQ(memcmp(inBuffer, outBuffer, tupleSize), 0) << "The returned tuple should match the inserted.";
+    }
+
+    TEST_F(RM_Tuple_Test, recreate_table_with_new_schema) {
+        // Functions Tested
+        // 1. Delete Table
+        // 2. Create a table with the same name and a different schema
+        // 3. Get Attributes - only the new columns should be returned
+
+        ASSERT_EQ(rm.deleteTable(tableName), success) << "RelationManager::deleteTable() should succeed.";
+        std::vector<PeterDB::Attribute> table_attrs = parseDDL(
+                "CREATE TABLE " + tableName + " (emp_name VARCHAR(50), salary REAL)");
+        ASSERT_EQ(rm.createTable(tableName, table_attrs), success)
+                                    << "Create table " << tableName << " should succeed.";
+
+        ASSERT_EQ(rm.getAttributes(tableName, attrs), success) << "RelationManager::getAttributes() should succeed.";
+        ASSERT_EQ(attrs.size(), 2) << "Only the columns of the new table should be returned.";
+        ASSERT_EQ(attrs[0].name, "emp_name");
+        ASSERT_EQ(attrs[1].name, "salary");
+        ASSERT_EQ(attrs[1].type, PeterDB::TypeReal);
+
+        ASSERT_EQ(rm.deleteTable(tableName), success) << "RelationManager::deleteTable() should succeed.";
+        ASSERT_NE(rm.getAttributes(tableName, attrs), success)
+                                    << "RelationManager::getAttributes() on a deleted table should fail.";
+        destroyFile = false;
+    }
+
+    TEST_F(RM_Tuple_Test, table_and_index_on_large_pages) {
+        // Functions Tested
+        // 1. Create a table with 32KB pages
+        // 2. Insert Tuples
+        // 3. Create an index with 64KB pages on age
+        // 4. Index Scan - every tuple in the range should be found
+
+        size_t tupleSize = 0;
+        inBuffer = malloc(200);
+        outBuffer = malloc(200);
+        ASSERT_EQ(rm.getAttributes(tableName, attrs), success) << "RelationManager::getAttributes() should succeed.";
+        ASSERT_EQ(rm.deleteTable(tableName), success) << "RelationManager::deleteTable() should succeed.";
+        std::vector<PeterDB::Attribute> table_attrs = parseDDL(
+                "CREATE TABLE " + tableName + " (emp_name VARCHAR(50), age INT, height REAL, salary REAL)");
+        ASSERT_EQ(rm.createTable(tableName, table_attrs, 32 * 1024), success)
+                                    << "Create table " << tableName << " with 32KB pages should succeed.";
+        nullsIndicator = initializeNullFieldsIndicator(attrs);
+
+        unsigned numTuples = 1000;
+        for (unsigned i = 0; i < numTuples; i++) {
+            std::string name = "Employee" + std::to_string(i);
+            prepareTuple((int) attrs.size(), nullsIndicator, name.length(), name, i, 160.5, 5000 + i, inBuffer,
+                         tupleSize);
+            ASSERT_EQ(rm.insertTuple(tableName, inBuffer, rid), success)
+                                        << "RelationManager::insertTuple() should succeed.";
+        }
+        ASSERT_EQ((size_t) getFileSize(tableName) % (32 * 1024), 0) << "The table should be made of 32KB pages.";
+
+        ASSERT_EQ(rm.createIndex(tableName, "age", 64 * 1024), success)
+                                    << "RelationManager::createIndex() should succeed.";
+        ASSERT_EQ((size_t) getFileSize(tableName + "_age.idx") % (64 * 1024), 0)
+                                    << "The index should be made of 64KB pages.";
+
+        int low = 100, high = 199, key;
+        unsigned count = 0;
+        PeterDB::RM_IndexScanIterator rmIsi;
+        ASSERT_EQ(rm.indexScan(tableName, "age", &low, &high, true, true, rmIsi), success)
+                                    << "RelationManager::indexScan() should succeed.";
+        while (rmIsi.getNextEntry(rid, &key) == success) {
+            ASSERT_EQ(key, low + (int) count) << "The keys should come in order.";
+            count++;
+        }
+        ASSERT_EQ(rmIsi.close(), success) << "RM_IndexScanIterator::close() should succeed.";
+        ASSERT_EQ(count, 100) << "Every tuple in the range should be found.";
+    }
+
     TEST_F(RM_Scan_Test, simple_scan) {
         // Functions Tested
         // 1. Simple scan
@@ -7,6 +7,9 @@
 #include <cstdio>
 #include <cstring>
 #include <unordered_map>
+#include <functional>
+#include <algorithm>
+#include <sstream>
 
 #include "src/include/qe.h"
 #include "general_test_utils.h"
@@ -372,6 +375,53 @@ namespace PeterDBTesting {
                 rids.emplace_back(rid);
             }
         }
+
+        // A table of a join key K and a payload P of payloadSize bytes. The key of tuple i is key(i),
+        // null when negative, and spelled out as a string for a varchar key.
+        void createJoinTable(const std::string &tableName, PeterDB::AttrType keyType, unsigned payloadSize,
+                             unsigned tupleCount, const std::function<int(unsigned)> &key) {
+            std::vector<PeterDB::Attribute> tableAttrs = {{"K", keyType, keyType == PeterDB::TypeVarChar ? 30u : 4u},
+                                                          {"P", PeterDB::TypeVarChar, payloadSize}};
+            ASSERT_EQ(rm.createTable(tableName, tableAttrs), success)
+                                        << "Create table " << tableName << " should succeed.";
+            tableNames.emplace_back(tableName);
+
+            std::vector<char> tuple(PAGE_SIZE);
+            for (unsigned i = 0; i < tupleCount; i++) {
+                int k = key(i);
+                char *ptr = tuple.data();
+                *ptr++ = k < 0 ? (char) 0x80 : 0;
+                if (k >= 0 && keyType == PeterDB::TypeVarChar) {
+                    std::string value = "key" + std::to_string(k);
+                    unsigned length = value.size();
+                    memcpy(ptr, &length, sizeof(unsigned));
+                    memcpy(ptr + sizeof(unsigned), value.data(), length);
+                    ptr += sizeof(unsigned) + length;
+                } else if (k >= 0) {
+                    float real = (float) k + 0.25f;
+                    memcpy(ptr, keyType == PeterDB::TypeInt ? (void *) &k : (void *) &real, 4);
+                    ptr += 4;
+                }
+                memcpy(ptr, &payloadSize, sizeof(unsigned));
+                memset(ptr + sizeof(unsigned), 'a' + i % 26, payloadSize);
+                ASSERT_EQ(rm.insertTuple(tableName, tuple.data(), rid), success)
+                                            << "relationManager.insertTuple() should succeed.";
+            }
+        }
+
+        // Print every tuple of an iterator, sorted so that two plans of one query compare equal
+        void collectTuples(PeterDB::Iterator &iterator, std::vector<std::string> &tuples) {
+            std::vector<PeterDB::Attribute> tupleAttrs;
+            ASSERT_EQ(iterator.getAttributes(tupleAttrs), success) << "getAttributes() should succeed.";
+            std::vector<char> tuple(PAGE_SIZE);
+            while (iterator.getNextTuple(tuple.data()) != QE_EOF) {
+                std::stringstream stream;
+                ASSERT_EQ(rm.printTuple(tupleAttrs, tuple.data(), stream), success)
+                                            << "RelationManager.printTuple() should succeed.";
+                tuples.emplace_back(stream.str());
+            }
+            std::sort(tuples.begin(), tuples.end());
+        }
     };
 
 }; // PeterDBTesting